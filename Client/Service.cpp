@@ -4,22 +4,42 @@
 #include <protocol/MessageRequestDir.hpp>
 #include <protocol/MessageResponseDir.hpp>
 #include <protocol/MessageRequestFile.hpp>
+#include <protocol/MessageRequestManifest.hpp>
+#include <protocol/MessageRequestSignature.hpp>
 #include <protocol/MessageResponseFile.hpp>
+#include <protocol/MessageResponseManifest.hpp>
+#include <protocol/MessageResponseSignature.hpp>
 #include <protocol/MessageResponseSysInfo.hpp>
+#include <protocol/MessageRequestFiles.hpp>
+#include <protocol/MessageRequestTree.hpp>
+#include <protocol/MessageTreeAck.hpp>
+#include <protocol/MessageTreeData.hpp>
 #include <protocol/MessageUploadFile.hpp>
 #include <protocol/MessageUploadFileReply.hpp>
+#include <protocol/MessageOpenConnections.hpp>
 #include <protocol/SvcMsgFactory.hpp>
 
+#include <util/AsyncFileIo.hpp>
+
 #include "Logger.hpp"
 #include <Protocol/MessageGeneric.hpp>
 #include "SysInfoCollector.hpp"
 
 namespace {
-	// Size of transmitting block of file
-	const int kFileChunkSize = 1024*100;
-
 	// Reconnect interval, ms
 	const int kReconnectInterval = 1000;
+
+	// Limit of entries in a batch of a tree, so a tree of empty files is sent in several batches too
+	const size_t kMaxTreeBatchEntries = 4096;
+
+	// Estimated size of a serialized tree entry besides its path and data
+	const size_t kTreeEntryOverhead = 64;
+
+	// A piece of a file in a batch is not smaller than this, unless it is the rest of the file
+	const size_t kMinTreePiece = 64 * 1024;
+
+	// Limit of data connections the server may ask for
+	const size_t kMaxDataConnections = 7;
 }
 
 util::ThreadMutex Service::s_sync;
@@ -76,13 +96,20 @@ TDirItems getDirectoryContent(const std::wstring& dir)
 
 } // namespace
 
-Service::Service(const std::string& address)
+Service::Service(const std::string& address, bool zeroCopy)
 	: m_address(address)
 	, m_disconnected(false)
+	, m_zeroCopy(zeroCopy)
+	, m_identity(MessageIdentity::localName())
+	, m_connecting(0)
+	, m_primaryStream(0)
+	, m_wantedDataConnections(0)
+	, m_sender(1 + kMaxDataConnections)
 {
 	if (m_address.empty())
 		m_address = "127.0.0.1:7777";
 
+
 	// Check that there's always only 1 instance (not implemented as singleton, though should be)
 	{
 		util::ScopedLock lock(&s_sync);
@@ -113,11 +140,20 @@ void Service::neverStop()
 	while (true)
 	{
 		::Sleep(kReconnectInterval);
+
+		// Files of transfers which went quiet are closed
+		m_readers.evictIdle();
+		m_writers.evictIdle();
+
 		if (m_disconnected)
 		{
 			reset();
 			connect();
 		}
+		else
+		{
+			openDataConnections();
+		}
 	}
 }
 
@@ -133,6 +169,7 @@ void Service::connect()
 		messenger.setBindingDelegate(this); // Messanger will notify of new connections
 
 		m_binding = net::BindingFactory::createBinding(net::BindingFactory::BINDING_TCP_CLIENT);
+		m_connecting = 0;
 		m_binding->bind(m_address, &messenger); // Notifications of new streams are managed by Messanger
 		return;
 	}
@@ -148,8 +185,61 @@ void Service::connect()
 	m_disconnected = true;
 }
 
+void Service::openDataConnections()
+{
+	for (;;)
+	{
+		size_t open = 0;
+		{
+			util::ScopedLock lock(&m_sync);
+
+			open = m_dataStreams.size();
+			if (0 == m_primaryStream || !m_binding || open >= m_wantedDataConnections)
+				return;
+		}
+
+		// Data connections identify themselves by their numbers
+		m_connecting = static_cast<util::T_UI4>(open + 1);
+		try
+		{
+			m_binding->bind(m_address, &msg::Messenger::instance());
+		}
+		catch (const std::exception& x)
+		{
+			logger::out("Data connection error");
+			logger::out(x.what());
+		}
+		m_connecting = 0;
+
+		// Connecting is retried on the next round
+		util::ScopedLock lock(&m_sync);
+		if (m_dataStreams.size() <= open)
+			return;
+	}
+}
+
+const void* Service::readerStrand(net::IStream::TId streamId) const
+{
+	util::ScopedLock lock(&m_sync);
+
+	if (std::find(m_dataStreams.begin(), m_dataStreams.end(), streamId) != m_dataStreams.end())
+		return streamId;
+	return &m_readers;
+}
+
 void Service::reset()
 {
+	// Data connections go down with the first one
+	std::vector<net::IStream::TId> dataStreams;
+	{
+		util::ScopedLock lock(&m_sync);
+		dataStreams = m_dataStreams;
+		m_wantedDataConnections = 0;
+	}
+
+	for (std::vector<net::IStream::TId>::const_iterator ii = dataStreams.begin(); ii != dataStreams.end(); ++ii)
+		net::StreamListener::instance().closeStream(*ii, "Service reset");
+
 	net::StreamListener::instance().cancelRun();
 
 	// Don't need this binding any more
@@ -162,6 +252,25 @@ void Service::reset()
 	// otherwise Service will get callbacks after it is destroyed.
 	net::StreamListener::instance().joinRun();
 
+	// Queued disk I/O refers to the service too
+	util::AsyncFileIo& fileIo = util::AsyncFileIo::instance();
+	fileIo.drain(&m_readers);
+	fileIo.drain(&m_writers);
+
+	for (std::vector<net::IStream::TId>::const_iterator ii = dataStreams.begin(); ii != dataStreams.end(); ++ii)
+		fileIo.drain(*ii);
+
+	// Responses of the jobs are sent by now, or they fail since their streams are closed
+	m_sender.drain();
+
+	m_primaryStream = 0;
+
+	m_readers.clear();
+	m_writers.clear();
+	m_uploadSinks.clear();
+	m_deltaUploads.clear();
+	m_treeSenders.clear();
+
 	msg::Messenger& messenger = msg::Messenger::instance();
 	messenger.setMessageFactory(0);
 	messenger.setBindingDelegate(0);
@@ -170,19 +279,40 @@ void Service::reset()
 void
 Service::onStreamCreated(net::IStream::TId streamId)
 {
+	util::T_UI4 connection = m_connecting;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (0 == connection)
+			m_primaryStream = streamId;
+		else
+			m_dataStreams.push_back(streamId);
+	}
+
+	std::shared_ptr<MessageIdentity> identity = std::make_shared<MessageIdentity>(localIdentity());
+	identity->m_connection = connection;
+
 	msg::Messenger& messenger = msg::Messenger::instance();
 
 	messenger.addDelegate(streamId, this);
-	messenger.sendMessage(streamId, std::make_shared<MessageIdentity>());
+	messenger.sendMessage(streamId, identity);
 }
 
 void
 Service::onStreamDied(::net::IStream::TId streamId)
 {
 	std::string endpointId;
+	bool isDataStream = false;
 	{
 		util::ScopedLock lock(&m_sync);
 
+		std::vector<net::IStream::TId>::iterator dd = std::find(m_dataStreams.begin(), m_dataStreams.end(), streamId);
+		if (dd != m_dataStreams.end())
+		{
+			m_dataStreams.erase(dd);
+			isDataStream = true;
+		}
+
 		TEndpoints::iterator ii = m_endpoints.find(streamId);
 		if (ii == m_endpoints.end())
 		{
@@ -192,15 +322,39 @@ Service::onStreamDied(::net::IStream::TId streamId)
 		{
 			endpointId = ii->second;
 			assert(!endpointId.empty());
+
+			// Stream IDs are reused by later connections
+			m_endpoints.erase(ii);
+		}
+
+		m_sessions.erase(streamId);
+
+		for (TDeltaUploads::iterator ii = m_deltaUploads.begin(); ii != m_deltaUploads.end();)
+		{
+			if (ii->first == streamId)
+				m_deltaUploads.erase(ii++);
+			else
+				++ii;
 		}
 	}
 
-	if (!endpointId.empty())
+	// Data connection is opened again on the next round, if the server still wants it
+	if (!endpointId.empty() && !isDataStream)
 	{
 		logger::out("Disconnected!");
 		m_disconnected = true;
 	}
-	m_fileReader.close();
+
+	// Files of the stream are closed in order with its queued jobs, unfinished uploads are kept
+	util::AsyncFileIo& fileIo = util::AsyncFileIo::instance();
+	if (isDataStream)
+	{
+		fileIo.submit(streamId, [this, streamId]() { m_readers.removeTransfer(streamId); });
+		return;
+	}
+
+	fileIo.submit(&m_readers, [this, streamId]() { m_readers.removeTransfer(streamId); m_treeSenders.erase(streamId); });
+	fileIo.submit(&m_writers, [this, streamId]() { m_writers.removeTransfer(streamId); });
 }
 
 void
@@ -214,14 +368,23 @@ Service::onMessageReceived(
 	{
 		std::string endpointId = msgIdentity->m_identity;
 
-		assert(m_endpoints.find(streamId) == m_endpoints.end());
-		m_endpoints[streamId] = endpointId;
+		// Agree on the best mode the server supports
+		SessionParams session = MessageIdentity::negotiate(localIdentity(), *msgIdentity);
+		{
+			util::ScopedLock lock(&m_sync);
+
+			assert(m_endpoints.find(streamId) == m_endpoints.end());
+			m_endpoints[streamId] = endpointId;
+			m_sessions[streamId] = session;
+		}
+		msg::Messenger::instance().setStreamOptions(streamId, session.streamOptions());
 	}
 	else if (MessageRequestDir* msgRequestDir = dynamic_cast<MessageRequestDir*>(m))
 	{
 		std::shared_ptr<MessageResponseDir> msgResponse = std::make_shared<MessageResponseDir>();
 
 		msgResponse->m_content = getDirectoryContent(msgRequestDir->m_dir);
+		msgResponse->m_requestId = msgRequestDir->m_requestId;
 
 		msg::Messenger::instance().sendMessage(streamId, msgResponse);
 	}
@@ -233,6 +396,32 @@ Service::onMessageReceived(
 	{
 		uploadFile(streamId, *msgUploadFile);
 	}
+	else if (MessageRequestSignature* msgRequestSignature = dynamic_cast<MessageRequestSignature*>(m))
+	{
+		requestSignature(streamId, *msgRequestSignature);
+	}
+	else if (MessageRequestManifest* msgRequestManifest = dynamic_cast<MessageRequestManifest*>(m))
+	{
+		requestManifest(streamId, *msgRequestManifest);
+	}
+	else if (MessageRequestTree* msgRequestTree = dynamic_cast<MessageRequestTree*>(m))
+	{
+		requestTree(streamId, *msgRequestTree);
+	}
+	else if (MessageRequestFiles* msgRequestFiles = dynamic_cast<MessageRequestFiles*>(m))
+	{
+		requestFiles(streamId, *msgRequestFiles);
+	}
+	else if (MessageTreeAck* msgTreeAck = dynamic_cast<MessageTreeAck*>(m))
+	{
+		ackTree(streamId, msgTreeAck->m_sequence);
+	}
+	else if (MessageOpenConnections* msgOpenConnections = dynamic_cast<MessageOpenConnections*>(m))
+	{
+		// Connections are opened by the service loop, so that connecting does not stall the stream
+		util::ScopedLock lock(&m_sync);
+		m_wantedDataConnections = (std::min)(static_cast<size_t>(msgOpenConnections->m_count), kMaxDataConnections);
+	}
 	else if (MessageGeneric* genericMessage = dynamic_cast<MessageGeneric*>(m))
 	{
 		switch (genericMessage->m_commandType)
@@ -275,55 +464,599 @@ Service::onMessageReceived(
 	}
 }
 
+void
+Service::onMessageStarted(
+	net::IStream::TId streamId,
+	msg::TMessagePtr message)
+{
+	// Uploaded chunks are written to the file directly rather than collected in memory
+	if (MessageUploadFile* msgUploadFile = dynamic_cast<MessageUploadFile*>(message.get()))
+		msgUploadFile->m_chunk.m_sink = uploadSink(streamId);
+}
+
+IFileChunkSink* Service::uploadSink(net::IStream::TId streamId)
+{
+	util::ScopedLock lock(&m_sync);
+
+	std::shared_ptr<UploadSink>& sink = m_uploadSinks[streamId];
+	if (!sink)
+		sink = std::make_shared<UploadSink>(*this, streamId);
+
+	return sink.get();
+}
+
+bool Service::beginChunkData(net::IStream::TId streamId, const FileChunk& chunk)
+{
+	// Chunk of a delta upload is applied by writeChunk(), once its delta follows the literal data
+	{
+		util::ScopedLock lock(&m_sync);
+		if (0 != m_deltaUploads.count(std::make_pair(streamId, chunk.m_fileName)))
+			return false;
+	}
+
+	// File is opened in order with writes of the previous chunks, a failure fails the upload reply
+	std::wstring fileName = chunk.m_fileName;
+	__int64 positionFrom = chunk.m_positionFrom;
+	__int64 fileSize = chunk.m_fileSize;
+
+	util::AsyncFileIo::instance().submit(&m_writers, [this, streamId, fileName, positionFrom, fileSize]()
+	{
+		std::shared_ptr<OpenWriter> file = m_writers.get(fileName, streamId);
+
+		// Upload starts over from the beginning
+		if (0 == positionFrom)
+			file->writer.close();
+
+		// A file evicted from the cache amid the upload is reopened empty, the upload fails then
+		if (!file->writer.open(fileName) || positionFrom != file->writer.size())
+		{
+			file->failed = true;
+			return;
+		}
+
+		// Large uploads are received into a mapped preallocated file
+		if (0 == positionFrom)
+			file->writer.reserve(fileSize);
+	});
+
+	return true;
+}
+
+void Service::writeChunkData(net::IStream::TId streamId, const FileChunk& chunk, const util::BufferChain& data)
+{
+	// Received blocks are kept until they are written
+	std::wstring fileName = chunk.m_fileName;
+	util::AsyncFileIo::instance().submit(&m_writers, [this, streamId, fileName, data]()
+	{
+		std::shared_ptr<OpenWriter> file = m_writers.get(fileName, streamId);
+		if (!file->failed && !file->writer.write(data))
+			file->failed = true;
+	});
+}
+
+MessageIdentity Service::localIdentity() const
+{
+	MessageIdentity identity;
+	identity.m_identity = m_identity;
+
+	// Checksums and compression need file data in memory
+	if (m_zeroCopy)
+		identity.m_features &= ~(MessageIdentity::FEATURE_FRAME_CHECKSUMS | MessageIdentity::FEATURE_COMPRESSION);
+
+	return identity;
+}
+
 void Service::requestFile(net::IStream::TId streamId, const MessageRequestFile& msg)
+{
+	SessionParams session;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		TSessions::const_iterator ii = m_sessions.find(streamId);
+		if (ii != m_sessions.end())
+			session = ii->second;
+	}
+
+	// Chunks are read in order, so that the file is hashed as it is read.
+	//	Each data connection reads its own ranges, a striped file is read again for the hash the server asks for.
+	FileRequest request = msg.m_request;
+	util::AsyncFileIo::instance().submit(readerStrand(streamId), [this, streamId, request, session]()
+	{
+		readChunk(streamId, request, session);
+	});
+}
+
+void Service::readChunk(net::IStream::TId streamId, const FileRequest& request, const SessionParams& session)
 {
 	std::shared_ptr<MessageResponseFile> response = std::make_shared<MessageResponseFile>();
 	FileChunk& chunk = response->m_response;
-	chunk.m_fileName = msg.m_request.m_fileName;
+	chunk.m_fileName = request.m_fileName;
+	chunk.m_positionFrom = request.m_startFrom;
+
+	// Chunk size is agreed with the server, yet the server may ask for smaller chunks
+	__int64 maxChunkSize = session.m_chunkSize;
+
+	if (0 < request.m_size && request.m_size < maxChunkSize)
+		maxChunkSize = request.m_size;
+
+	// File stays open between chunks of the transfer
+	std::shared_ptr<OpenReader> file = m_readers.get(request.m_fileName, streamId);
+	util::FileReader& reader = file->reader;
+
+	// First request of a delta transfer carries the signature of the server's copy of the file
+	if (0 == request.m_startFrom)
+	{
+		bool delta = request.m_signature && 0 != (session.m_features & MessageIdentity::FEATURE_DELTA);
+		file->encoder.reset(delta ? new util::DeltaEncoder(request.m_signature) : 0);
+	}
+
+	// Literal data of a delta chunk and a block carried to the next chunk fit the chunk size
+	if (file->encoder.get())
+	{
+		__int64 windowSize = file->encoder->signature().windowSize(session.m_chunkSize);
+		if (windowSize < maxChunkSize)
+			maxChunkSize = windowSize;
+	}
 
 	// Try to open file
-	if (m_fileReader.open(msg.m_request.m_fileName))
+	if (reader.open(request.m_fileName))
 	{
-		chunk.m_fileSize = m_fileReader.size();
-		__int64 chunkSize = chunk.m_fileSize - msg.m_request.m_startFrom;
-		if (chunkSize > kFileChunkSize)
-			chunkSize = kFileChunkSize;
+		chunk.m_fileSize = reader.size();
+		__int64 chunkSize = chunk.m_fileSize - request.m_startFrom;
+		if (chunkSize > maxChunkSize)
+			chunkSize = maxChunkSize;
+
+		// Hole at the end of the requested range of a sparse file is described rather than sent.
+		// It is not extended beyond the range, since the server has requested the next ranges already.
+		__int64 dataSize = chunkSize;
+		if (0 != (session.m_features & MessageIdentity::FEATURE_SPARSE_FILES) && !file->encoder.get())
+			dataSize = reader.dataSize(request.m_startFrom, chunkSize);
+
+		// If frames don't touch the data, the chunk refers to the file and the stream sends it by TransmitFile()
+		msg::StreamOptions options = session.streamOptions();
+		if (file->encoder.get())
+		{
+			// Delta is found in file data, so they are read even if frames don't touch them.
+			// Requests cover the file without gaps, the chunk describes the file from where the previous one ended.
+			util::BufferChain data;
+			chunk.m_valid = file->prefetcher.take(data, request.m_startFrom, static_cast<int>(chunkSize));
+			if (chunk.m_valid)
+			{
+				bool last = request.m_startFrom + chunkSize == chunk.m_fileSize;
+				chunk.m_positionFrom = file->encoder->position();
+				file->encoder->encode(data, last, chunk.m_delta, chunk.m_fileData);
+
+				chunk.m_hasFileHash = file->prefetcher.hash(chunk.m_fileHash);
+			}
+		}
+		else if (!options.frameChecksums && !options.compression)
+		{
+			chunk.m_valid = reader.readRegion(chunk.m_fileData, request.m_startFrom, static_cast<int>(dataSize));
+		}
+		else
+		{
+			// Zeros of the hole are read from the file system cache for the hash, yet they are not sent
+			chunk.m_valid = file->prefetcher.take(chunk.m_fileData, request.m_startFrom, static_cast<int>(chunkSize));
+			if (chunk.m_valid && dataSize < chunkSize)
+				chunk.m_fileData = chunk.m_fileData.slice(0, static_cast<size_t>(dataSize));
+
+			// The last chunk carries hash of the whole file, if it was read from the beginning
+			if (chunk.m_valid)
+				chunk.m_hasFileHash = file->prefetcher.hash(chunk.m_fileHash);
+		}
+
+		if (chunk.m_valid)
+			chunk.m_holeSize = chunkSize - dataSize;
+
+		// Ranges read out of order or sent from the file system cache were not hashed
+		if (chunk.m_valid && request.m_wantFileHash && !chunk.m_hasFileHash)
+			chunk.m_hasFileHash = reader.readHash(chunk.m_fileHash);
 
-		chunk.m_valid = m_fileReader.read(chunk.m_fileData, msg.m_request.m_startFrom, static_cast<int>(chunkSize));
+		// File is closed after its last chunk, blocks of the chunk keep their own references
+		if (!chunk.m_valid || request.m_startFrom + chunkSize == chunk.m_fileSize)
+			m_readers.remove(request.m_fileName, streamId);
 	}
 	else
 	{
 		// File not found
 		chunk.m_valid = false;
+		m_readers.remove(request.m_fileName, streamId);
 	}
 
-	msg::Messenger::instance().sendMessage(streamId, response);
+	sendResponse(streamId, response);
 }
 
 void Service::uploadFile(net::IStream::TId streamId, const MessageUploadFile& msg)
 {
-	const FileChunk& chunk = msg.m_chunk;
+	// Reply follows writes of the chunk data
+	FileChunk chunk = msg.m_chunk;
+	util::AsyncFileIo::instance().submit(&m_writers, [this, streamId, chunk]()
+	{
+		writeChunk(streamId, chunk);
+	});
+}
+
+void Service::writeChunk(net::IStream::TId streamId, const FileChunk& chunk)
+{
 	if (!chunk.m_valid)
 	{
-		// This is the way to stop upload
-		m_fileWriter.close();
-		// TODO: delete partially uploaded file
+		// This is the way to stop upload, partially uploaded files are kept under their temporary names.
+		//	Other files may be uploaded by the stream meanwhile.
+		{
+			util::ScopedLock lock(&m_sync);
+			m_deltaUploads.erase(std::make_pair(streamId, chunk.m_fileName));
+		}
+		m_writers.remove(chunk.m_fileName, streamId);
 		return;
 	}
 
+	std::shared_ptr<OpenWriter> file = m_writers.get(chunk.m_fileName, streamId);
+	util::FileWriter& writer = file->writer;
+
+	bool writeFailed = file->failed;
+	file->failed = false;
+
 	bool ok = false;
 	// Try to open file
-	if (m_fileWriter.open(chunk.m_fileName))
+	if (writer.open(chunk.m_fileName))
 	{
-		// Write data to file
-		ok = m_fileWriter.write(chunk.m_fileData);
+		if (!chunk.m_delta.empty())
+		{
+			// Delta refers to the existing file, which is reopened if it was closed amid the upload
+			if (!file->basis.isOpen())
+				file->basis.openRead(chunk.m_fileName);
+
+			ok = chunk.m_positionFrom == writer.size()
+				&& util::DeltaEncoder::apply(chunk.m_delta, chunk.m_fileData, file->basis, writer);
+		}
+		else
+		{
+			// Write data to file, unless they were already written as they arrived
+			ok = !chunk.m_sinkFailed && !writeFailed && writer.write(chunk.m_fileData);
+
+			// Hole after the data is recreated rather than received
+			if (ok && 0 < chunk.m_holeSize)
+			{
+				__int64 holeFrom = chunk.m_positionFrom + chunk.m_sunkSize + chunk.m_fileData.size();
+				ok = writer.writeHole(holeFrom, chunk.m_holeSize);
+			}
+		}
+
+		bool complete = writer.isComplete(chunk.m_fileSize);
+		if (!ok || complete)
+			endDeltaUpload(streamId, chunk.m_fileName, *file);
+
+		if (complete)
+		{
+			// Verify the whole file
+			util::T_UI8 hash = 0;
+			if (chunk.m_hasFileHash && (!writer.hash(hash) || chunk.m_fileHash != hash))
+				ok = false;
 
-		if (chunk.m_fileSize <= m_fileWriter.size())
-			m_fileWriter.close();
+			// A corrupted file is left under its temporary name
+			if (ok)
+				ok = writer.finish();
+			else
+				writer.close();
+
+			m_writers.remove(chunk.m_fileName, streamId);
+		}
 	}
 	std::shared_ptr<MessageUploadFileReply> response = std::make_shared<MessageUploadFileReply>();
 	response->m_ok = ok;
+	response->m_fileName = chunk.m_fileName;
+
+	sendResponse(streamId, response);
+}
+
+void Service::requestSignature(net::IStream::TId streamId, const MessageRequestSignature& msg)
+{
+	// File is signed in order with writes, so a previous upload of it is complete
+	std::wstring fileName = msg.m_fileName;
+	util::AsyncFileIo::instance().submit(&m_writers, [this, streamId, fileName]()
+	{
+		signFile(streamId, fileName);
+	});
+}
+
+void Service::signFile(net::IStream::TId streamId, const std::wstring& fileName)
+{
+	std::shared_ptr<MessageResponseSignature> response = std::make_shared<MessageResponseSignature>();
+	response->m_fileName = fileName;
+
+	// Upload starts over, the existing file stays open until the upload ends, so it does not change meanwhile
+	std::shared_ptr<OpenWriter> file = m_writers.get(fileName, streamId);
+	file->writer.close();
+
+	std::shared_ptr<util::DeltaSignature> signature = std::make_shared<util::DeltaSignature>();
+	if (file->basis.openRead(fileName) && signature->compute(file->basis) && !signature->empty())
+	{
+		response->m_signature = signature;
+
+		util::ScopedLock lock(&m_sync);
+		m_deltaUploads.insert(std::make_pair(streamId, fileName));
+	}
+	else
+	{
+		// File is new or too large, the server sends it whole
+		endDeltaUpload(streamId, fileName, *file);
+	}
+
+	sendResponse(streamId, response);
+}
+
+void Service::requestManifest(net::IStream::TId streamId, const MessageRequestManifest& msg)
+{
+	// File is chunked in order with reads, the server requests chunks once the manifest arrives
+	std::wstring fileName = msg.m_fileName;
+	util::AsyncFileIo::instance().submit(&m_readers, [this, streamId, fileName]()
+	{
+		chunkFile(streamId, fileName);
+	});
+}
+
+void Service::chunkFile(net::IStream::TId streamId, const std::wstring& fileName)
+{
+	std::shared_ptr<MessageResponseManifest> response = std::make_shared<MessageResponseManifest>();
+	response->m_fileName = fileName;
+
+	// A file which is missing or too large is requested as usual
+	util::FileHandle file;
+	std::shared_ptr<util::ChunkManifest> manifest = std::make_shared<util::ChunkManifest>();
+	if (file.openRead(fileName) && manifest->compute(file))
+		response->m_manifest = manifest;
+
+	sendResponse(streamId, response);
+}
+
+void Service::requestTree(net::IStream::TId streamId, const MessageRequestTree& msg)
+{
+	SessionParams session;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		TSessions::const_iterator ii = m_sessions.find(streamId);
+		if (ii != m_sessions.end())
+			session = ii->second;
+	}
+
+	// A tree requested again replaces the previous one, its batches in flight are ignored by the server
+	std::wstring dir = msg.m_dir;
+	util::AsyncFileIo::instance().submit(&m_readers, [this, streamId, dir, session]()
+	{
+		std::shared_ptr<TreeSender> sender = std::make_shared<TreeSender>();
+		sender->session = session;
+		m_treeSenders[streamId] = sender;
+
+		if (!sender->walker.open(dir))
+		{
+			// Directory could not be listed
+			std::shared_ptr<MessageTreeData> response = std::make_shared<MessageTreeData>();
+			response->m_batch.m_done = true;
+			response->m_batch.m_valid = false;
+
+			sendResponse(streamId, response);
+			m_treeSenders.erase(streamId);
+			return;
+		}
+
+		sendTreeBatches(streamId, *sender);
+	});
+}
+
+void Service::requestFiles(net::IStream::TId streamId, const MessageRequestFiles& msg)
+{
+	SessionParams session;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		TSessions::const_iterator ii = m_sessions.find(streamId);
+		if (ii != m_sessions.end())
+			session = ii->second;
+	}
+
+	// Files are sent as a tree of the named files, acknowledged like batches of a tree
+	MessageRequestFiles request(msg);
+	util::AsyncFileIo::instance().submit(&m_readers, [this, streamId, request, session]()
+	{
+		std::shared_ptr<TreeSender> sender = std::make_shared<TreeSender>();
+		sender->session = session;
+		sender->root = request.m_dir;
+		m_treeSenders[streamId] = sender;
+
+		while (!sender->root.empty() && (L'\\' == *sender->root.rbegin() || L'/' == *sender->root.rbegin()))
+			sender->root.erase(sender->root.size() - 1);
 
-	msg::Messenger::instance().sendMessage(streamId, response);
+		sender->names = request.files(sender->root);
+
+		sendTreeBatches(streamId, *sender);
+	});
+}
+
+void Service::ackTree(net::IStream::TId streamId, util::T_UI4 sequence)
+{
+	// Every written batch makes room for the next one
+	util::AsyncFileIo::instance().submit(&m_readers, [this, streamId, sequence]()
+	{
+		TTreeSenders::iterator ii = m_treeSenders.find(streamId);
+		if (ii == m_treeSenders.end() || 0 == ii->second->inFlight)
+			return;
+
+		TreeSender& sender = *ii->second;
+		--sender.inFlight;
+
+		if (sender.done && 0 == sender.inFlight)
+			m_treeSenders.erase(ii);
+		else
+			sendTreeBatches(streamId, sender);
+	});
+}
+
+void Service::sendResponse(net::IStream::TId streamId, const msg::TMessagePtr& message)
+{
+	// Sending waits for the turn of the stream, which a slow peer or a rate limit may hold up.
+	//	Response to a stream which is closed meanwhile fails, the failure is suppressed by the sender.
+	m_sender.submit(streamId, [streamId, message]()
+	{
+		msg::Messenger::instance().sendMessage(streamId, message);
+	});
+}
+
+void Service::sendTreeBatches(net::IStream::TId streamId, TreeSender& sender)
+{
+	// Batches are sent back to back, the server writes them while the next ones arrive
+	while (!sender.done && sender.inFlight < sender.session.m_windowSize)
+	{
+		std::shared_ptr<MessageTreeData> response = std::make_shared<MessageTreeData>();
+		TreeBatch& batch = response->m_batch;
+		batch.m_sequence = sender.sequence++;
+
+		fillTreeBatch(sender, batch);
+		if (batch.m_done)
+			sender.done = true;
+
+		++sender.inFlight;
+		sendResponse(streamId, response);
+	}
 }
 
+void Service::fillTreeBatch(TreeSender& sender, TreeBatch& batch)
+{
+	// Batch fits a frame like a file chunk does, small files are packed into it whole
+	const size_t chunkSize = sender.session.m_chunkSize;
+	size_t batchSize = 0;
+
+	while (batch.m_entries.size() < kMaxTreeBatchEntries)
+	{
+		if (!sender.pending)
+		{
+			if (!nextTreeItem(sender, sender.item))
+			{
+				batch.m_done = true;
+				break;
+			}
+
+			sender.pending = true;
+
+			// File is opened as it is reached, its size is taken from the handle rather than from the listing
+			if (!sender.item.isDir)
+			{
+				sender.file.close();
+				sender.fileOffset = 0;
+				sender.fileHash.reset();
+
+				LARGE_INTEGER size;
+				const std::wstring& root = sender.root.empty() ? sender.walker.root() : sender.root;
+				bool opened = sender.file.openRead(root + L"\\" + sender.item.path)
+					&& ::GetFileSizeEx(sender.file.get(), &size);
+				sender.fileSize = opened ? size.QuadPart : -1;
+			}
+		}
+
+		// Entry which does not fit is left for the next batch
+		size_t entrySize = kTreeEntryOverhead + sender.item.path.size() * sizeof(wchar_t);
+		if (!batch.m_entries.empty() && batchSize + entrySize > chunkSize)
+			break;
+
+		size_t room = batchSize + entrySize < chunkSize ? chunkSize - batchSize - entrySize : 0;
+		if (batch.m_entries.empty() && room < kMinTreePiece)
+			room = kMinTreePiece;
+
+		TreeEntry entry;
+		entry.m_path = sender.item.path;
+		entry.m_isDir = sender.item.isDir;
+
+		size_t dataSize = 0;
+		if (!entry.m_isDir && 0 > sender.fileSize)
+		{
+			// File could not be opened, the server skips it
+			entry.m_valid = false;
+			entry.m_last = true;
+		}
+		else if (!entry.m_isDir)
+		{
+			__int64 left = sender.fileSize - sender.fileOffset;
+			dataSize = left < static_cast<__int64>(room) ? static_cast<size_t>(left) : room;
+
+			// A file is only split if it does not fit the rest of the batch nor a batch of its own
+			if (!batch.m_entries.empty() && dataSize < left && (dataSize < kMinTreePiece || left <= static_cast<__int64>(chunkSize - entrySize)))
+				break;
+
+			entry.m_fileSize = sender.fileSize;
+			entry.m_offset = sender.fileOffset;
+
+			if (0 < dataSize)
+			{
+				util::TBufferBlockPtr block = std::make_shared<util::BufferBlock>(dataSize);
+				entry.m_valid = sender.file.readAt(sender.fileOffset, block->tail(), dataSize);
+				if (entry.m_valid)
+				{
+					block->commit(dataSize);
+					sender.fileHash.update(block->data(), dataSize);
+					sender.fileOffset += dataSize;
+
+					entry.m_data.append(block, 0, dataSize);
+				}
+			}
+
+			// The last piece carries hash of the whole file, a file which fails to be read is dropped
+			entry.m_last = !entry.m_valid || sender.fileOffset == sender.fileSize;
+			if (entry.m_valid && entry.m_last)
+				entry.m_fileHash = sender.fileHash.digest();
+		}
+
+		if (entry.m_isDir || entry.m_last)
+		{
+			sender.pending = false;
+			sender.file.close();
+		}
+
+		batchSize += entrySize + dataSize;
+		batch.m_entries.push_back(entry);
+	}
+}
+
+bool Service::nextTreeItem(TreeSender& sender, util::TreeWalker::Entry& item)
+{
+	if (sender.root.empty())
+		return sender.walker.next(item);
+
+	if (sender.nextName == sender.names.size())
+		return false;
+
+	// Size is taken from the file once it is opened
+	item.path = sender.names[sender.nextName++];
+	item.isDir = false;
+	item.size = 0;
+	return true;
+}
+
+void Service::endDeltaUpload(net::IStream::TId streamId, const std::wstring& fileName, OpenWriter& file)
+{
+	file.basis.close();
+
+	util::ScopedLock lock(&m_sync);
+	m_deltaUploads.erase(std::make_pair(streamId, fileName));
+}
+
+Service::UploadSink::UploadSink(Service& service, net::IStream::TId streamId)
+	: m_service(service)
+	, m_streamId(streamId)
+{
+}
+
+bool Service::UploadSink::beginChunkData(const FileChunk& chunk)
+{
+	return m_service.beginChunkData(m_streamId, chunk);
+}
+
+bool Service::UploadSink::writeChunkData(const FileChunk& chunk, const char* buf, size_t bufSize)
+{
+	return writeChunkData(chunk, util::BufferChain::copy(buf, bufSize));
+}
+
+bool Service::UploadSink::writeChunkData(const FileChunk& chunk, const util::BufferChain& data)
+{
+	m_service.writeChunkData(m_streamId, chunk, data);
+	return true;
+}
@@ -1,19 +1,39 @@
 #pragma once
 
+#include <algorithm>
+#include <set>
+
 #include <msg/Messenger.hpp>
 #include <net/BindingFactory.hpp>
+#include <util/AsyncFileIo.hpp>
+#include <util/DeltaEncoder.hpp>
+#include <util/FileHandle.hpp>
+#include <util/FileHandleCache.hpp>
 #include <util/FileReader.hpp>
 #include <util/FileWriter.hpp>
+#include <util/ReadAheadPrefetcher.hpp>
+#include <util/TreeWalker.hpp>
+#include <util/XxHash64.hpp>
+#include <protocol/DataTypes.hpp>
+#include <protocol/MessageIdentity.hpp>
 
 class SvcMsgFactory;
 class MessageRequestFile;
+class MessageRequestManifest;
+class MessageRequestSignature;
+class MessageRequestFiles;
+class MessageRequestTree;
 class MessageUploadFile;
 
 /// Service sending/receiving messages
 class Service : public msg::IBindingDelegate, public msg::IMessengerDelegate
 {
 public:
-	Service(const std::string& address);
+	/**
+	 * If zeroCopy is set, frame checksums and compression are not offered to the server,
+	 *	so requested files are sent from the file system cache without being read by the service.
+	 */
+	Service(const std::string& address, bool zeroCopy = false);
 	~Service();
 
 	// Run client service in loop.
@@ -34,10 +54,147 @@ public:
 	virtual void onMessageReceived(
 		net::IStream::TId streamId,
 		msg::TMessagePtr message);
+	virtual void onMessageStarted(
+		net::IStream::TId streamId,
+		msg::TMessagePtr message);
 
 private:
+	/// Passes data uploaded by a stream to the service, so that they are written as they arrive
+	class UploadSink : public IFileChunkSink
+	{
+	public:
+		UploadSink(Service& service, net::IStream::TId streamId);
+
+		// IFileChunkSink
+		virtual bool beginChunkData(const FileChunk& chunk);
+		virtual bool writeChunkData(const FileChunk& chunk, const char* buf, size_t bufSize);
+		virtual bool writeChunkData(const FileChunk& chunk, const util::BufferChain& data);
+
+	private:
+		Service& m_service;
+		net::IStream::TId m_streamId;
+	};
+
+	/// File requested by a stream, chunks are read ahead while previous ones are sent
+	struct OpenReader
+	{
+		OpenReader()
+			: prefetcher(reader)
+		{
+		}
+
+		util::FileReader reader;
+		util::ReadAheadPrefetcher prefetcher;
+
+		/// Encodes chunks of a delta transfer as differences to the server's copy of the file
+		std::auto_ptr<util::DeltaEncoder> encoder;
+	};
+
+	/// File uploaded by a stream
+	struct OpenWriter
+	{
+		OpenWriter()
+			: failed(false)
+		{
+			// Uploaded file is on the disk before it is reported as uploaded
+			writer.setDurability(util::FileWriter::DURABILITY_AT_CLOSE);
+		}
+
+		util::FileWriter writer;
+
+		/// Existing file chunks of a delta upload refer to, is closed before the file is replaced
+		util::FileHandle basis;
+
+		/// Is set if writing of the current chunk failed, is only used by the writer jobs
+		bool failed;
+	};
+
+	/// Directory tree requested by a stream, is walked as batches are sent.
+	///	Files requested at once are sent the same way, the names replace the walk then.
+	struct TreeSender
+	{
+		TreeSender()
+			: nextName(0)
+			, pending(false)
+			, fileSize(0)
+			, fileOffset(0)
+			, sequence(0)
+			, inFlight(0)
+			, done(false)
+		{
+		}
+
+		util::TreeWalker walker;
+		SessionParams session;
+
+		/// Requested files, relative to the root, are sent instead of the walked tree if the root is set
+		std::wstring root;
+		std::vector<std::wstring> names;
+		size_t nextName;
+
+		/// Entry walked but not sent yet, a large file is split across batches
+		util::TreeWalker::Entry item;
+		bool pending;
+
+		/// File of the pending entry, its size is -1 if it could not be opened
+		util::FileHandle file;
+		__int64 fileSize;
+		__int64 fileOffset;
+		util::XxHash64 fileHash;
+
+		/// Sequence number of the next batch and number of batches not acknowledged yet
+		util::T_UI4 sequence;
+		util::T_UI4 inFlight;
+
+		/// Is set once the last batch is sent
+		bool done;
+	};
+
+	/// Returns the sink of data uploaded by a stream
+	IFileChunkSink* uploadSink(net::IStream::TId streamId);
+
+	/// Queue writes of uploaded data as they arrive, chunks of delta uploads are collected instead
+	bool beginChunkData(net::IStream::TId streamId, const FileChunk& chunk);
+	void writeChunkData(net::IStream::TId streamId, const FileChunk& chunk, const util::BufferChain& data);
+
+	/// Identity sent to the server, features depend on the mode of the service
+	MessageIdentity localIdentity() const;
+
+	/// Opens data connections the server asked for, ranges of large files are requested over them
+	void openDataConnections();
+
+	/// Returns the strand of reads requested by a stream, data connections read in parallel with the first one
+	const void* readerStrand(net::IStream::TId streamId) const;
+
+	/// Queue disk I/O (see util::AsyncFileIo), so that a slow disk does not stall the stream
 	void requestFile(net::IStream::TId streamId, const MessageRequestFile& msg);
 	void uploadFile(net::IStream::TId streamId, const MessageUploadFile& msg);
+	void requestSignature(net::IStream::TId streamId, const MessageRequestSignature& msg);
+	void requestManifest(net::IStream::TId streamId, const MessageRequestManifest& msg);
+	void requestTree(net::IStream::TId streamId, const MessageRequestTree& msg);
+	void requestFiles(net::IStream::TId streamId, const MessageRequestFiles& msg);
+	void ackTree(net::IStream::TId streamId, util::T_UI4 sequence);
+
+	/// Are run by the disk I/O threads, jobs of the readers and of the writers run in order
+	void readChunk(net::IStream::TId streamId, const FileRequest& request, const SessionParams& session);
+	void writeChunk(net::IStream::TId streamId, const FileChunk& chunk);
+	void signFile(net::IStream::TId streamId, const std::wstring& fileName);
+	void chunkFile(net::IStream::TId streamId, const std::wstring& fileName);
+
+	/// Queues a response of a disk job, responses of a stream are sent in order by the sender threads
+	void sendResponse(net::IStream::TId streamId, const msg::TMessagePtr& message);
+
+	/// Sends batches of a tree until the window is full or the tree is walked
+	void sendTreeBatches(net::IStream::TId streamId, TreeSender& sender);
+
+	/// Fills a batch with entries of the tree and the next pieces of files
+	void fillTreeBatch(TreeSender& sender, TreeBatch& batch);
+
+	/// Returns the next walked or requested entry, false once all were returned
+	bool nextTreeItem(TreeSender& sender, util::TreeWalker::Entry& item);
+
+	/// Closes the existing file of a delta upload once the upload is over
+	void endDeltaUpload(net::IStream::TId streamId, const std::wstring& fileName, OpenWriter& file);
 
 private:
 	typedef std::map<
@@ -45,6 +202,28 @@ private:
 		std::string			// endpoint ID
 	> TEndpoints;
 
+	typedef std::map<
+		net::IStream::TId,	// stream ID
+		SessionParams		// mode agreed with the server
+	> TSessions;
+
+	typedef std::map<
+		net::IStream::TId,				// stream ID
+		std::shared_ptr<UploadSink>		// sink referred to by chunks being received
+	> TUploadSinks;
+
+	typedef std::set<
+		std::pair<
+			net::IStream::TId,	// stream ID
+			std::wstring		// uploaded file
+		>
+	> TDeltaUploads;
+
+	typedef std::map<
+		net::IStream::TId,				// stream ID
+		std::shared_ptr<TreeSender>		// tree being sent
+	> TTreeSenders;
+
 private:
 	static util::ThreadMutex s_sync;
 	static Service* s_instance;
@@ -54,8 +233,37 @@ private:
 	net::TBindingPtr m_binding;
 	std::string m_address;
 	bool m_disconnected;
-	util::FileReader m_fileReader;
-	util::FileWriter m_fileWriter;
+	bool m_zeroCopy;
+
+	/// Identity of all connections of the service
+	std::string m_identity;
+
+	/// Connection being opened, onStreamCreated() is called by bind() on the same thread
+	util::T_UI4 m_connecting;
+
+	/// The first connection, the service reconnects once it dies
+	net::IStream::TId m_primaryStream;
+
+	/// Data connections the server asked for and the ones open
+	size_t m_wantedDataConnections;
+	std::vector<net::IStream::TId> m_dataStreams;
+
+	/// Sends responses of the disk jobs, a thread per connection, so a stream waiting for its turn to send does not stall disk I/O
+	util::AsyncFileIo m_sender;
+
+	/// Files of concurrent transfers stay open between chunks, keyed by name and stream
+	util::FileHandleCache<OpenReader> m_readers;
+	util::FileHandleCache<OpenWriter> m_writers;
 
 	TEndpoints m_endpoints;
+	TSessions m_sessions;
+
+	/// Sinks are kept until the service is reset, since received messages refer to them
+	TUploadSinks m_uploadSinks;
+
+	/// Uploads sent as differences to existing files, which were signed for the server
+	TDeltaUploads m_deltaUploads;
+
+	/// Trees being sent, are only used by the reader jobs
+	TTreeSenders m_treeSenders;
 };
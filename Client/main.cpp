@@ -111,6 +111,7 @@ _tWinMain(HINSTANCE hInstance,
 
 		typedef util::GetOpt::tstring tstring;
 		tstring address;
+		bool zeroCopy = false;
 
 		for (util::GetOpt::TArgs::const_iterator ii  = opt.argv.begin();
 			ii != opt.argv.end();
@@ -128,6 +129,11 @@ _tWinMain(HINSTANCE hInstance,
 			{
 				command = CMD_UNINSTALL;
 			}
+			else if (param == _T("/z") ||
+				param == _T("/Z"))
+			{
+				zeroCopy = true;
+			}
 			else
 			{
 				address = param;
@@ -144,7 +150,7 @@ _tWinMain(HINSTANCE hInstance,
 			break;
 		}
 
-		Service service(T2CA(address.c_str()));
+		Service service(T2CA(address.c_str()), zeroCopy);
 		service.neverStop();
 	}
 	catch (const std::exception& x)
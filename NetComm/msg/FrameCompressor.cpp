@@ -0,0 +1,203 @@
+#include "stdafx.h"
+#include "FrameCompressor.hpp"
+#include <util/Error.hpp>
+#include <util/Lz4.hpp>
+#include <util/ScopedLock.hpp>
+#include <util/Stopwatch.hpp>
+
+namespace msg {
+
+namespace {
+
+/// Smaller payloads are not worth compressing
+const size_t kMinCompressSize = 512;
+
+/// Size of the first block of a payload, which is compressed to detect incompressible data
+const size_t kSampleSize = 4096;
+
+/// Data are considered incompressible unless compression saves this fraction of them
+const double kMinSaving = 0.05;
+
+/// Larger payloads are neither compressed nor accepted, so that a peer can't make us allocate arbitrary memory
+const size_t kMaxRawSize = 64 * 1024 * 1024;
+
+/// Faster sends are limited by the send buffer rather than the link and tell nothing about the link speed
+const double kMinMeasurableSend = 0.001;
+
+/// Weight of a new sample in moving averages
+const double kSmoothing = 0.2;
+
+/// Compression must be this many times faster than sending the bytes it saves, otherwise it's made faster
+const double kMinMargin = 2.0;
+
+/// If compression is this many times faster than sending the bytes it saves, it's made stronger
+const double kMaxMargin = 8.0;
+
+/// Number of frames sent as is when compression does not pay off even at its fastest
+const unsigned kSkipInterval = 64;
+
+double
+smooth(double average, double sample)
+{
+	return 0 < average ? average + kSmoothing * (sample - average) : sample;
+}
+
+} // namespace
+
+FrameCompressor::FrameCompressor()
+: m_compressSpeed(0),
+  m_linkSpeed(0),
+  m_saving(0),
+  m_framesToSkip(0)
+{
+}
+
+bool
+FrameCompressor::compress(const unsigned char* buf, size_t bufSize, std::vector<unsigned char>& out)
+{
+	int acceleration = 1;
+
+	{
+		util::ScopedLock lock(&m_sync);
+
+		bool skip = kMinCompressSize > bufSize || kMaxRawSize < bufSize;
+		if (!skip && 0 < m_framesToSkip)
+		{
+			--m_framesToSkip;
+			skip = true;
+		}
+
+		if (skip)
+		{
+			++m_stats.framesSkipped;
+			m_stats.rawBytesSent += bufSize;
+			m_stats.wireBytesSent += bufSize;
+			return false;
+		}
+
+		acceleration = m_stats.acceleration;
+	}
+
+	util::Stopwatch stopwatch;
+	size_t inputSize = 0;
+	bool compressed = false;
+
+	// Sample the first block, incompressible data (e.g. archives or media) are sent as is
+	bool compressible = true;
+	if (kSampleSize < bufSize)
+	{
+		out.resize(util::Lz4::compressBound(kSampleSize));
+		size_t sampleSize = util::Lz4::compress(buf, kSampleSize, &out[0], out.size(), acceleration);
+
+		inputSize += kSampleSize;
+		compressible = sampleSize < kSampleSize * (1 - kMinSaving);
+	}
+
+	if (compressible)
+	{
+		util::T_UI4 rawSize = static_cast<util::T_UI4>(bufSize);
+
+		out.resize(sizeof(rawSize) + util::Lz4::compressBound(bufSize));
+		memcpy(&out[0], &rawSize, sizeof(rawSize));
+
+		size_t size = util::Lz4::compress(buf, bufSize, &out[sizeof(rawSize)], out.size() - sizeof(rawSize), acceleration);
+		out.resize(sizeof(rawSize) + size);
+
+		inputSize += bufSize;
+		compressed = out.size() < bufSize;
+	}
+
+	double seconds = stopwatch.seconds();
+
+	util::ScopedLock lock(&m_sync);
+
+	m_stats.rawBytesCompressed += inputSize;
+	m_stats.compressSeconds += seconds;
+	if (0 < seconds)
+		m_compressSpeed = smooth(m_compressSpeed, inputSize / seconds);
+
+	m_stats.rawBytesSent += bufSize;
+	if (compressed)
+	{
+		++m_stats.framesCompressed;
+		m_stats.wireBytesSent += out.size();
+		m_saving = smooth(m_saving, 1.0 - double(out.size()) / bufSize);
+	}
+	else
+	{
+		++m_stats.framesSkipped;
+		m_stats.wireBytesSent += bufSize;
+	}
+
+	adapt();
+
+	return compressed;
+}
+
+void
+FrameCompressor::decompress(const unsigned char* buf, size_t bufSize, std::vector<unsigned char>& out)
+{
+	util::T_UI4 rawSize = 0;
+	if (sizeof(rawSize) > bufSize)
+		throw util::Error("Malformed compressed frame");
+
+	memcpy(&rawSize, buf, sizeof(rawSize));
+	if (kMaxRawSize < rawSize)
+		throw util::Error("Compressed frame is too large");
+
+	util::Stopwatch stopwatch;
+
+	out.resize(rawSize);
+	util::Lz4::decompress(buf + sizeof(rawSize), bufSize - sizeof(rawSize), out.empty() ? 0 : &out[0], out.size());
+
+	double seconds = stopwatch.seconds();
+
+	util::ScopedLock lock(&m_sync);
+
+	m_stats.rawBytesReceived += rawSize;
+	m_stats.wireBytesReceived += bufSize;
+	m_stats.decompressSeconds += seconds;
+}
+
+void
+FrameCompressor::onFrameSent(size_t wireSize, double seconds)
+{
+	if (kMinMeasurableSend > seconds)
+		return;
+
+	util::ScopedLock lock(&m_sync);
+	m_linkSpeed = smooth(m_linkSpeed, wireSize / seconds);
+}
+
+CompressionStats
+FrameCompressor::stats() const
+{
+	util::ScopedLock lock(&m_sync);
+	return m_stats;
+}
+
+void
+FrameCompressor::adapt()
+{
+	// Until sends get slow the link is assumed to be slower than compression
+	if (0 >= m_linkSpeed || 0 >= m_compressSpeed)
+		return;
+
+	// Compression pays off while compressing a byte takes less time than sending the part of it which is saved,
+	//	i.e. while 1 / compressSpeed < saving / linkSpeed
+	double margin = m_compressSpeed * m_saving / m_linkSpeed;
+
+	if (kMinMargin > margin)
+	{
+		if (util::Lz4::kMaxAcceleration > m_stats.acceleration)
+			m_stats.acceleration *= 2;
+		else if (1 > margin)
+			m_framesToSkip = kSkipInterval;
+	}
+	else if (kMaxMargin < margin && 1 < m_stats.acceleration)
+	{
+		m_stats.acceleration /= 2;
+	}
+}
+
+} // namespace msg
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <vector>
+#include <util/utils.h>
+#include <util/ThreadMutex.hpp>
+
+namespace msg {
+
+/// Compression counters of a stream
+struct CompressionStats
+{
+	CompressionStats()
+	: rawBytesSent(0),
+	  wireBytesSent(0),
+	  framesCompressed(0),
+	  framesSkipped(0),
+	  rawBytesCompressed(0),
+	  compressSeconds(0),
+	  rawBytesReceived(0),
+	  wireBytesReceived(0),
+	  decompressSeconds(0),
+	  acceleration(1)
+	{}
+
+	/// Payload bytes of sent frames before and after compression
+	util::T_UI8 rawBytesSent;
+	util::T_UI8 wireBytesSent;
+
+	util::T_UI8 framesCompressed;
+
+	/// Frames sent as is, since they were incompressible or compression did not pay off
+	util::T_UI8 framesSkipped;
+
+	/// Payload bytes passed through the compressor, including samples of skipped frames, and time it took
+	util::T_UI8 rawBytesCompressed;
+	double compressSeconds;
+
+	/// Payload bytes of received compressed frames before and after decompression
+	util::T_UI8 rawBytesReceived;
+	util::T_UI8 wireBytesReceived;
+
+	double decompressSeconds;
+
+	/// Current LZ4 acceleration, 1 gives the best ratio
+	int acceleration;
+
+	/// Sent bytes per payload byte, less is better
+	double sendRatio() const
+	{
+		return rawBytesSent ? double(wireBytesSent) / rawBytesSent : 1.0;
+	}
+
+	/// Payload bytes compressed per second
+	double compressThroughput() const
+	{
+		return 0 < compressSeconds ? rawBytesCompressed / compressSeconds : 0;
+	}
+
+	/// Payload bytes decompressed per second
+	double decompressThroughput() const
+	{
+		return 0 < decompressSeconds ? rawBytesReceived / decompressSeconds : 0;
+	}
+};
+
+/**
+ * LZ4 compression of frame payloads for a single stream.
+ * Compression level is adapted to the ratio of compression speed and link speed,
+ *	so that compression is used only while it reduces the time a frame takes to be sent.
+ */
+class FrameCompressor
+{
+public:
+	FrameCompressor();
+
+	/**
+	 * Compresses a payload into out, which starts with the original payload size.
+	 * Returns false if the payload should be sent as is.
+	 */
+	bool compress(const unsigned char* buf, size_t bufSize, std::vector<unsigned char>& out);
+
+	/// Restores a payload compressed by compress(), throws util::Error if data are malformed
+	void decompress(const unsigned char* buf, size_t bufSize, std::vector<unsigned char>& out);
+
+	/// Is called once a frame is written to a stream, link speed is estimated from it
+	void onFrameSent(size_t wireSize, double seconds);
+
+	CompressionStats stats() const;
+
+private:
+	/// Must be executed under a lock. Selects acceleration for next frames.
+	void adapt();
+
+	mutable util::ThreadMutex m_sync;
+	CompressionStats m_stats;
+
+	/// Payload bytes compressed per second
+	double m_compressSpeed;
+
+	/// Bytes sent per second, 0 until a send is slow enough to be measured
+	double m_linkSpeed;
+
+	/// Fraction of bytes saved by compression
+	double m_saving;
+
+	/// Number of frames to send as is before compression is tried again
+	unsigned m_framesToSkip;
+};
+
+} // namespace msg
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <util/utils.h>
+#include <util/BufferChain.hpp>
+
+namespace msg {
+
+/**
+ * Optional interface for messages which can be deserialized incrementally.
+ * Messenger does not collect a payload of such a message in memory,
+ *	rather it feeds payload fragments to the message as they arrive.
+ * Thus a message size is not limited by memory available for a stream.
+ */
+struct IStreamingMessage
+{
+	virtual ~IStreamingMessage() {}
+
+	/// Is called once a message header is received, before any payload fragments
+	virtual void beginLoad(util::T_UI4 payloadSize) = 0;
+
+	/// Is called for every payload fragment, buf is only valid during the call
+	virtual void loadFragment(const unsigned char* buf, size_t bufSize) = 0;
+
+	/// Is called instead of the above with received data, the message may keep them rather than copy
+	virtual void loadFragment(const util::BufferChain& data)
+	{
+		for (size_t i = 0; i < data.segmentCount(); ++i)
+			loadFragment(data.segment(i).data(), data.segment(i).size);
+	}
+
+	/// Is called after the last payload fragment is loaded
+	virtual void endLoad() = 0;
+
+	/**
+	 * Serializes the message into a chain, so that bulk data are sent without being copied.
+	 * Returns false if the message is serialized by IMessage::save() only.
+	 */
+	virtual bool save(util::BufferChain& out)
+	{
+		return false;
+	}
+};
+
+} // namespace msg
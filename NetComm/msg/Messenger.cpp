@@ -5,7 +5,8 @@
 
 #pragma warning(disable: 4996)
 
-#define KMSG_INITIAL_DATA_BUF_SIZE (1024UL * 1024UL * 32UL)
+// Payloads of streaming messages are not collected, so the buffer only needs to fit regular messages
+#define KMSG_INITIAL_DATA_BUF_SIZE (1024UL * 256UL)
 
 #ifndef NDEBUG
 
@@ -67,6 +68,14 @@ struct MessageHeader
 	util::T_UI4 payloadSize;
 };
 
+/// Frame flags are carried in the high bits of a message type
+const util::T_UI4 kFrameChecksumFlag = 0x80000000;
+const util::T_UI4 kFrameCompressedFlag = 0x40000000;
+const util::T_UI4 kMessageTypeMask = 0x00FFFFFF;
+
+/// Size of a checksum following a frame payload
+const size_t kFrameChecksumSize = sizeof(util::T_UI4);
+
 } // namespace
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -138,166 +147,464 @@ Messenger::onDataReceived(
 	::net::IStream::TId streamId,
 	const unsigned char* buf,
 	size_t bufSize)
+{
+	onDataReceived(streamId, util::BufferChain::copy(buf, bufSize));
+}
+
+void
+Messenger::onDataReceived(
+	::net::IStream::TId streamId,
+	const util::BufferChain& data)
 {
 	util::ScopedLock lock(&s_sync);
 
 	try
 	{
-		// Append data to corresponding data buffer
+		StreamData& stream = m_streamData[streamId];
 
-		TStreamData::iterator dd = m_streamData.find(streamId);
-		if (dd == m_streamData.end())
+		size_t position = 0;
+		while (position < data.size())
 		{
-			dd = m_streamData.insert(std::make_pair(streamId, TData(0))).first;
-		}
+			size_t bufSize = data.size() - position;
 
-		TData& data = dd->second;
+			// Payload of a streaming message is not collected, rather it is fed to the message directly
+			if (stream.streaming)
+			{
+				position += loadFragment(streamId, stream, 0 == position ? data : data.slice(position, bufSize));
+				continue;
+			}
+
+			// Append data to corresponding data buffer,
+			//	only up to the end of a frame, since the next one may turn out to be streaming
+			size_t cb = collectSize(stream);
+			if (cb > bufSize)
+				cb = bufSize;
+
+			TData& collected = stream.data;
 
-		// Required data length
-		size_t dataSize = data.size();
-		size_t requiredLen = dataSize + bufSize;
-		size_t availableLen = data.capacity();
+			// Required data length
+			size_t dataSize = collected.size();
+			size_t requiredLen = dataSize + cb;
+			size_t availableLen = collected.capacity();
 
 #ifndef NDEBUG
-		{
-			char buf2[128];
-			memset(buf2, 0, sizeof(buf2));
-			sprintf(buf2, "%p data before: ", reinterpret_cast<void*>(streamId));
-			OutputDebugStringA(buf2);
-
-			if (0 < data.size())
-				dumpBinBuffer(&data[0], data.size());
-			else
-				OutputDebugStringA("<empty>\n");
-		}
+			{
+				char buf2[128];
+				memset(buf2, 0, sizeof(buf2));
+				sprintf(buf2, "%p data before: ", reinterpret_cast<void*>(streamId));
+				OutputDebugStringA(buf2);
+
+				if (0 < collected.size())
+					dumpBinBuffer(&collected[0], collected.size());
+				else
+					OutputDebugStringA("<empty>\n");
+			}
 #endif // !NDEBUG
 
-		// Resize data buffer if it is not large enough
-		if (availableLen < requiredLen)
-		{
-			// Reserve 20% more
-			size_t reserve = static_cast<size_t>(requiredLen * 1.2);
+			// Resize data buffer if it is not large enough
+			if (availableLen < requiredLen)
+			{
+				// Reserve 20% more
+				size_t reserve = static_cast<size_t>(requiredLen * 1.2);
+
+				if (reserve < KMSG_INITIAL_DATA_BUF_SIZE)
+					reserve = KMSG_INITIAL_DATA_BUF_SIZE;
+
+				collected.reserve(reserve);
+			}
+
+			collected.resize(requiredLen);
 
-			if (reserve < KMSG_INITIAL_DATA_BUF_SIZE)
-				reserve = KMSG_INITIAL_DATA_BUF_SIZE;
+			// Copy data to buffer
+			data.copyTo(&collected[dataSize], position, cb);
+			position += cb;
 
-			data.reserve(reserve);
+			// Try to extract messages from data,
+			//	once a streaming message is started the rest of its payload is not collected
+			extractMessages(streamId, stream);
 		}
+	}
+	catch (const std::exception& x)
+	{
+		// Some error (probably bad_alloc) occured while processing stream data.
+		// In this case stream is assumed to be in incosistent state and thus is not used any more.
+		net::StreamListener::instance().closeStream(streamId, x.what());
+	}
+	catch (...)
+	{
+		// Some unknown error occured while processing stream data.
+		// In this case stream is assumed to be in incosistent state and thus is not used any more.
+		net::StreamListener::instance().closeStream(streamId, "Unknown error");
+	}
+}
+
+size_t
+Messenger::collectSize(const StreamData& stream)
+{
+	const TData& data = stream.data;
+	if (sizeof(MessageHeader) > data.size())
+		return sizeof(MessageHeader) - data.size();
+
+	// Header is complete, so the message was created and the frame size was verified
+	MessageHeader header;
+	memcpy(&header, &data[0], sizeof(header));
+
+	size_t messageSize = header.payloadSize + sizeof(MessageHeader);
+	if (stream.checksummed)
+		messageSize += kFrameChecksumSize;
 
-		data.resize(requiredLen);
+	assert(messageSize > data.size());
+	return messageSize - data.size();
+}
+
+void
+Messenger::extractMessages(::net::IStream::TId streamId, StreamData& stream)
+{
+	TData& data = stream.data;
 
-		// Copy data to buffer
-		memcpy(&data[dataSize], buf, bufSize);
+	size_t dataSize = 0;
+	while (!stream.streaming &&
+		   sizeof(MessageHeader) <= (dataSize = data.size()))
+	{
+		MessageHeader header;
+		memset(&header, 0, sizeof(header));
+
+		unsigned char* pData = &data[0];
+		memcpy(&header, pData, sizeof(header));
 
-		// Try to extract message from data
-		while (sizeof(MessageHeader) <= (dataSize = data.size()))
+		// A message is created as soon as its header is received
+		if (!stream.message)
 		{
-			MessageHeader header;
-			memset(&header, 0, sizeof(header));
+			try
+			{
+				if (!m_messageFactory)
+				{
+					assert(!"Message factory must be set before receiving messages");
+					throw std::logic_error("Internal error");
+				}
+
+				chkptr(m_messageFactory);
+				stream.message = m_messageFactory->createMessage(header.messageType & kMessageTypeMask);
+			}
+			catch (const std::exception& x)
+			{
+				// Unknown messages are simply discarded
+				ignore_unused(x);
+				assert(!"Unknown message type");
+			}
+			catch (...)
+			{
+				assert(!"Unknown message type");
+			}
 
-			assert(data.size() == dataSize);
+			stream.payloadLeft = header.payloadSize;
+			stream.checksummed = 0 != (header.messageType & kFrameChecksumFlag);
+			stream.checksumLeft = stream.checksummed ? kFrameChecksumSize : 0;
+			stream.crc.reset();
+			stream.compressed = 0 != (header.messageType & kFrameCompressedFlag);
 
-			unsigned char* pData = &data[0];
-			memcpy(&header, pData, sizeof(header));
+			IStreamingMessage* streamingMessage = dynamic_cast<IStreamingMessage*>(stream.message.get());
 
-			util::T_UI4 messageSize = header.payloadSize + sizeof(MessageHeader); // two bytes at the beginning are message type and payload length
-			if (messageSize <= dataSize)
+			// Payloads of streaming and discarded messages are not collected,
+			//	unless a payload is compressed and thus has to be decompressed at once
+			if ((streamingMessage && !stream.compressed) || !stream.message)
 			{
-				TMessagePtr message;
+				stream.streaming = true;
 
-				try
+				if (streamingMessage)
 				{
-					if (!m_messageFactory)
+					try
 					{
-						assert(!"Message factory must be set before receiving messages");
-						throw std::logic_error("Internal error");
-					}
+						notifyMessageStarted(streamId, stream.message);
 
-					chkptr(m_messageFactory);
-					message = m_messageFactory->createMessage(header.messageType);
-
-					{
 						util::ScopedLock lock(&m_memStreamSync);
-						util::MemoryStream memstream(pData + sizeof(MessageHeader), pData + messageSize);
-						message->load(memstream);
+						streamingMessage->beginLoad(header.payloadSize);
 					}
-
-					// Remove message bytes from data
+					catch (const std::exception& x)
+					{
+						// Message handling errors are simply discarded along with the rest of the payload
+						ignore_unused(x);
+						assert(!"Message handling error");
+						stream.message.reset();
+					}
+					catch (...)
 					{
-						TData::iterator bb = data.begin();
-						std::advance(bb, messageSize);
+						assert(!"Message handling error");
+						stream.message.reset();
+					}
+				}
 
-#ifndef NDEBUG
-						size_t dataSizeBefore = data.size();
-						assert(dataSizeBefore >= messageSize);
-#endif // !NDEBUG
+				data.erase(data.begin(), data.begin() + sizeof(MessageHeader));
+
+				// Feed the part of frame that is already collected
+				size_t cb = loadFragment(streamId, stream, util::BufferChain::copy(data.empty() ? 0 : &data[0], data.size()));
+				data.erase(data.begin(), data.begin() + cb);
+
+				continue;
+			}
+		}
+
+		// Collected frames are limited, so that a peer can't make us allocate arbitrary memory
+		if (kMaxFrameSize < header.payloadSize)
+			throw util::Error("Frame is too large");
+
+		size_t messageSize = header.payloadSize + sizeof(MessageHeader); // two bytes at the beginning are message type and payload length
+		if (stream.checksummed)
+			messageSize += kFrameChecksumSize;
+
+		if (messageSize > dataSize)
+		{
+			// Not enough data
+			break;
+		}
+
+		if (stream.checksummed)
+		{
+			util::T_UI4 checksum = 0;
+			memcpy(&checksum, pData + sizeof(MessageHeader) + header.payloadSize, sizeof(checksum));
+
+			// Stream is closed, since a corrupted frame can't be told from a corrupted header of the next one
+			if (checksum != util::Crc32c::compute(pData + sizeof(MessageHeader), header.payloadSize))
+				throw util::Error("Frame checksum mismatch");
+		}
+
+		TMessagePtr message = stream.message;
+		stream.message.reset();
+
+		const unsigned char* payload = pData + sizeof(MessageHeader);
+		size_t payloadSize = header.payloadSize;
 
-						data.erase(data.begin(), bb);
+		// Stream is closed if a payload can't be decompressed, as it's the same as a checksum mismatch
+		TData raw;
+		if (stream.compressed)
+		{
+			frameCompressor(streamId)->decompress(payload, payloadSize, raw);
+
+			payload = raw.empty() ? 0 : &raw[0];
+			payloadSize = raw.size();
+		}
+
+		if (!loadMessage(streamId, message, payload, payloadSize))
+			message.reset();
+
+		// Remove message bytes from data
+		{
+			TData::iterator bb = data.begin();
+			std::advance(bb, messageSize);
 
 #ifndef NDEBUG
-						size_t dataSizeAfter = data.size();
-						assert(dataSizeAfter + messageSize == dataSizeBefore);
-						assert(dd->second.size() == dataSizeAfter);
-
-						{
-							char buf2[128];
-							memset(buf2, 0, sizeof(buf2));
-							sprintf(buf2, "%p data after: ", reinterpret_cast<void*>(streamId));
-							OutputDebugStringA(buf2);
-
-							if (0 < data.size())
-								dumpBinBuffer(&data[0], data.size());
-							else
-								OutputDebugStringA("<empty>\n");
-						}
+			size_t dataSizeBefore = data.size();
+			assert(dataSizeBefore >= messageSize);
 #endif // !NDEBUG
-					}
-
-					TMessengerDelegates::iterator ii = m_messengerDelegates.find(streamId);
-					if (ii == m_messengerDelegates.end())
-					{
-						assert(0);
-						throw util::Error("Stream not found");
-					}
 
-					IMessengerDelegate* delegate_ = ii->second;
-					chkptr(delegate_);
+			data.erase(data.begin(), bb);
 
-					delegate_->onMessageReceived(streamId, message);
-				}
-				catch (const std::exception& x)
-				{
 #ifndef NDEBUG
-					const char* szMsg = x.what();
-#endif
-					// Unknown messages and message handling errors are simple discarded
-					ignore_unused(x);
-					assert(!"Unknown message type or message handling error");
-				}
-				catch (...)
-				{
-					// Unknown messages and message handling errors are simple discarded
-					assert(!"Unknown message type or message handling error");
-				}
-			}
-			else
+			size_t dataSizeAfter = data.size();
+			assert(dataSizeAfter + messageSize == dataSizeBefore);
+
 			{
-				// Not enough data
-				break;
+				char buf2[128];
+				memset(buf2, 0, sizeof(buf2));
+				sprintf(buf2, "%p data after: ", reinterpret_cast<void*>(streamId));
+				OutputDebugStringA(buf2);
+
+				if (0 < data.size())
+					dumpBinBuffer(&data[0], data.size());
+				else
+					OutputDebugStringA("<empty>\n");
 			}
+#endif // !NDEBUG
+		}
+
+		if (message)
+			dispatchMessage(streamId, message);
+	}
+}
+
+size_t
+Messenger::loadFragment(
+	::net::IStream::TId streamId,
+	StreamData& stream,
+	const util::BufferChain& data)
+{
+	assert(stream.streaming);
+
+	size_t bufSize = data.size();
+	size_t cb = bufSize < stream.payloadLeft ? bufSize : stream.payloadLeft;
+	stream.payloadLeft -= cb;
+
+	util::BufferChain payload = cb == bufSize ? data : data.slice(0, cb);
+
+	if (stream.checksummed)
+	{
+		for (size_t i = 0; i < payload.segmentCount(); ++i)
+			stream.crc.update(payload.segment(i).data(), payload.segment(i).size);
+	}
+
+	// Message is NULL if it is being discarded
+	if (stream.message && 0 < cb)
+	{
+		IStreamingMessage* streamingMessage = dynamic_cast<IStreamingMessage*>(stream.message.get());
+		chkptr(streamingMessage);
+
+		try
+		{
+			util::ScopedLock lock(&m_memStreamSync);
+			streamingMessage->loadFragment(payload);
+		}
+		catch (const std::exception& x)
+		{
+			// Message handling errors are simply discarded along with the rest of the payload
+			ignore_unused(x);
+			assert(!"Message deserialization error");
+			stream.message.reset();
+		}
+		catch (...)
+		{
+			assert(!"Message deserialization error");
+			stream.message.reset();
 		}
 	}
+
+	// Checksum follows the payload
+	if (0 < stream.checksumLeft && cb < bufSize)
+	{
+		size_t n = bufSize - cb < stream.checksumLeft ? bufSize - cb : stream.checksumLeft;
+
+		unsigned char* checksum = reinterpret_cast<unsigned char*>(&stream.checksum);
+		data.copyTo(checksum + kFrameChecksumSize - stream.checksumLeft, cb, n);
+
+		cb += n;
+		stream.checksumLeft -= static_cast<util::T_UI4>(n);
+	}
+
+	if (0 < stream.payloadLeft || 0 < stream.checksumLeft)
+		return cb;
+
+	// Stream is closed, since the message could be already partially consumed by its handler
+	if (stream.checksummed && stream.checksum != stream.crc.value())
+		throw util::Error("Frame checksum mismatch");
+
+	TMessagePtr message = stream.message;
+
+	stream.message.reset();
+	stream.streaming = false;
+
+	if (message)
+	{
+		IStreamingMessage* streamingMessage = dynamic_cast<IStreamingMessage*>(message.get());
+		chkptr(streamingMessage);
+
+		try
+		{
+			util::ScopedLock lock(&m_memStreamSync);
+			streamingMessage->endLoad();
+		}
+		catch (const std::exception& x)
+		{
+			ignore_unused(x);
+			assert(!"Message deserialization error");
+			message.reset();
+		}
+		catch (...)
+		{
+			assert(!"Message deserialization error");
+			message.reset();
+		}
+	}
+
+	if (message)
+		dispatchMessage(streamId, message);
+
+	return cb;
+}
+
+void
+Messenger::notifyMessageStarted(::net::IStream::TId streamId, TMessagePtr message)
+{
+	TMessengerDelegates::iterator ii = m_messengerDelegates.find(streamId);
+	if (ii != m_messengerDelegates.end())
+	{
+		chkptr(ii->second);
+		ii->second->onMessageStarted(streamId, message);
+	}
+}
+
+bool
+Messenger::loadMessage(
+	::net::IStream::TId streamId,
+	TMessagePtr message,
+	const unsigned char* payload,
+	size_t payloadSize)
+{
+	try
+	{
+		// Streaming messages get here when their payload had to be collected, e.g. to be decompressed
+		if (IStreamingMessage* streamingMessage = dynamic_cast<IStreamingMessage*>(message.get()))
+		{
+			notifyMessageStarted(streamId, message);
+
+			util::ScopedLock lock(&m_memStreamSync);
+
+			streamingMessage->beginLoad(static_cast<util::T_UI4>(payloadSize));
+			if (0 < payloadSize)
+				streamingMessage->loadFragment(payload, payloadSize);
+			streamingMessage->endLoad();
+		}
+		else
+		{
+			util::ScopedLock lock(&m_memStreamSync);
+			util::MemoryStream memstream(payload, payload + payloadSize);
+			message->load(memstream);
+		}
+
+		return true;
+	}
 	catch (const std::exception& x)
 	{
-		// Some error (probably bad_alloc) occured while processing stream data.
-		// In this case stream is assumed to be in incosistent state and thus is not used any more.
-		net::StreamListener::instance().closeStream(streamId, x.what());
+		// Messages which failed to load are simply discarded
+		ignore_unused(x);
+		assert(!"Message deserialization error");
 	}
 	catch (...)
 	{
-		// Some unknown error occured while processing stream data.
-		// In this case stream is assumed to be in incosistent state and thus is not used any more.
-		net::StreamListener::instance().closeStream(streamId, "Unknown error");
+		assert(!"Message deserialization error");
+	}
+
+	return false;
+}
+
+void
+Messenger::dispatchMessage(::net::IStream::TId streamId, TMessagePtr message)
+{
+	try
+	{
+		TMessengerDelegates::iterator ii = m_messengerDelegates.find(streamId);
+		if (ii == m_messengerDelegates.end())
+		{
+			assert(0);
+			throw util::Error("Stream not found");
+		}
+
+		IMessengerDelegate* delegate_ = ii->second;
+		chkptr(delegate_);
+
+		delegate_->onMessageReceived(streamId, message);
+	}
+	catch (const std::exception& x)
+	{
+#ifndef NDEBUG
+		const char* szMsg = x.what();
+#endif
+		// Message handling errors are simple discarded
+		ignore_unused(x);
+		assert(!"Message handling error");
+	}
+	catch (...)
+	{
+		// Message handling errors are simple discarded
+		assert(!"Message handling error");
 	}
 }
 
@@ -327,6 +634,11 @@ Messenger::onStreamDied(::net::IStream::TId streamId)
 		m_streamData.erase(streamId);
 	}
 
+	{
+		util::ScopedLock lock(&m_settingsSync);
+		m_streamSettings.erase(streamId);
+	}
+
 	if (delegate_)
 	{
 		chkptr(delegate_);
@@ -353,36 +665,83 @@ Messenger::addDelegate(
 	}
 }
 
+void
+Messenger::setStreamOptions(
+	::net::IStream::TId streamId,
+	const StreamOptions& options)
+{
+	util::ScopedLock lock(&m_settingsSync);
+
+	StreamSettings& settings = m_streamSettings[streamId];
+	settings.options = options;
+
+	if (options.compression && !settings.compressor)
+		settings.compressor = std::make_shared<FrameCompressor>();
+}
+
+Messenger::TFrameCompressorPtr
+Messenger::frameCompressor(::net::IStream::TId streamId)
+{
+	util::ScopedLock lock(&m_settingsSync);
+
+	StreamSettings& settings = m_streamSettings[streamId];
+	if (!settings.compressor)
+		settings.compressor = std::make_shared<FrameCompressor>();
+
+	return settings.compressor;
+}
+
+CompressionStats
+Messenger::compressionStats(::net::IStream::TId streamId)
+{
+	TFrameCompressorPtr compressor;
+	{
+		util::ScopedLock lock(&m_settingsSync);
+
+		TStreamSettings::const_iterator ii = m_streamSettings.find(streamId);
+		if (ii != m_streamSettings.end())
+			compressor = ii->second.compressor;
+	}
+
+	return compressor ? compressor->stats() : CompressionStats();
+}
+
 void
 Messenger::sendMessage(
 	::net::IStream::TId streamId,
 	TMessagePtr message)
 {
-	util::ScopedArray<unsigned char> buf;
-	size_t bufSize = 0;
+	StreamSettings settings = streamSettings(streamId);
+	const StreamOptions& options = settings.options;
+	TFrameCompressorPtr compressor = settings.compressor;
 
-	const size_t headerSize = sizeof(MessageHeader);
+	util::BufferChain payload = savePayload(message);
 
+	// Compressed payload replaces the original one, compressor needs it to be contiguous
+	bool isCompressed = false;
+	if (options.compression && compressor && !payload.empty())
 	{
-		util::ScopedLock lock(&m_memStreamSync);
+		TData compressed;
+		const unsigned char* raw = payload.coalesce();
 
-		std::basic_string<unsigned char> membuf;
-		util::MemoryStream memstream;
-		memstream.exceptions(std::ios::badbit);
-		message->save(memstream);
+		isCompressed = compressor->compress(raw, payload.size(), compressed);
+		if (isCompressed)
+			payload = util::BufferChain::copy(&compressed[0], compressed.size());
+	}
 
-		membuf = memstream.str();
-		bufSize = membuf.size();
+	if (0 < options.maxFrameSize && options.maxFrameSize < payload.size())
+		throw util::Error("Message is larger than the peer accepts");
 
-		buf.reset(new unsigned char[bufSize + headerSize]);
-		memcpy(buf.get() + headerSize, membuf.data(), bufSize);
+	util::T_UI4 checksum = 0;
+	if (options.frameChecksums)
+	{
+		util::Crc32c crc;
+		for (size_t i = 0; i < payload.segmentCount(); ++i)
+			crc.update(payload.segment(i).data(), payload.segment(i).size);
+		checksum = crc.value();
 	}
 
-	MessageHeader* header = reinterpret_cast<MessageHeader*>(buf.get());
-	memset(header, 0, headerSize);
-
-	header->messageType = message->typeId();
-	header->payloadSize = bufSize;
+	util::BufferChain frame = buildFrame(message->typeId(), payload, isCompressed, options.frameChecksums, checksum);
 
 	net::StreamListener& streamListener = net::StreamListener::instance();
 
@@ -390,7 +749,103 @@ Messenger::sendMessage(
 	// Since Messenger::sendMessage() function can be called from different threads and
 	//	Messenger::sendMessage() does not sync while calling writeStream(),
 	//	it is important that all data are sent at once, otherwise data from different threads could interfere.
-	streamListener.writeStream(streamId, buf.get(), bufSize + headerSize);
+	double seconds = streamListener.writeStream(streamId, frame);
+
+	// Time a frame takes to be sent is used to choose compression level
+	if (compressor)
+		compressor->onFrameSent(frame.size(), seconds);
+}
+
+TSerializedMessagePtr
+Messenger::serializeMessage(TMessagePtr message)
+{
+	std::shared_ptr<SerializedMessage> serialized = std::make_shared<SerializedMessage>();
+	serialized->typeId = message->typeId();
+	serialized->payload = savePayload(message);
+
+	// Checksum is computed once as well, whether or not streams need it
+	util::Crc32c crc;
+	for (size_t i = 0; i < serialized->payload.segmentCount(); ++i)
+		crc.update(serialized->payload.segment(i).data(), serialized->payload.segment(i).size);
+	serialized->checksum = crc.value();
+
+	return serialized;
+}
+
+void
+Messenger::sendMessage(
+	::net::IStream::TId streamId,
+	const TSerializedMessagePtr& message)
+{
+	StreamOptions options = streamSettings(streamId).options;
+
+	if (0 < options.maxFrameSize && options.maxFrameSize < message->payload.size())
+		throw util::Error("Message is larger than the peer accepts");
+
+	// Only the header and the checksum are built for the stream
+	util::BufferChain frame = buildFrame(message->typeId, message->payload, false, options.frameChecksums, message->checksum);
+	net::StreamListener::instance().writeStream(streamId, frame);
+}
+
+Messenger::StreamSettings
+Messenger::streamSettings(::net::IStream::TId streamId)
+{
+	util::ScopedLock lock(&m_settingsSync);
+
+	TStreamSettings::const_iterator ii = m_streamSettings.find(streamId);
+	return ii != m_streamSettings.end() ? ii->second : StreamSettings();
+}
+
+util::BufferChain
+Messenger::savePayload(TMessagePtr message)
+{
+	util::ScopedLock lock(&m_memStreamSync);
+
+	// Streaming messages may share their bulk data with the frame rather than copy them
+	util::BufferChain payload;
+	IStreamingMessage* streamingMessage = dynamic_cast<IStreamingMessage*>(message.get());
+	if (!streamingMessage || !streamingMessage->save(payload))
+	{
+		util::MemoryStream memstream;
+		memstream.exceptions(std::ios::badbit);
+		message->save(memstream);
+
+		std::basic_string<unsigned char> membuf = memstream.str();
+		payload = util::BufferChain::copy(membuf.data(), membuf.size());
+	}
+
+	return payload;
+}
+
+util::BufferChain
+Messenger::buildFrame(
+	util::T_UI4 messageType,
+	const util::BufferChain& payload,
+	bool isCompressed,
+	bool isChecksummed,
+	util::T_UI4 checksum)
+{
+	MessageHeader header;
+	memset(&header, 0, sizeof(header));
+
+	assert(messageType == (messageType & kMessageTypeMask));
+	header.messageType = messageType;
+	header.payloadSize = payload.size();
+
+	if (isCompressed)
+		header.messageType |= kFrameCompressedFlag;
+
+	if (isChecksummed)
+		header.messageType |= kFrameChecksumFlag;
+
+	// Frame refers to the payload rather than copies it
+	util::BufferChain frame = util::BufferChain::copy(&header, sizeof(header));
+	frame.append(payload);
+
+	if (isChecksummed)
+		frame.append(util::BufferChain::copy(&checksum, kFrameChecksumSize));
+
+	return frame;
 }
 
 } // namespace msg
@@ -2,8 +2,11 @@
 
 #include <net/IBinding.hpp>
 #include <net/StreamListener.hpp>
+#include <util/Crc32c.hpp>
 #include "IMessage.hpp"
 #include "IMessageFactory.hpp"
+#include "IStreamingMessage.hpp"
+#include "FrameCompressor.hpp"
 
 
 namespace msg {
@@ -20,6 +23,15 @@ struct IMessengerDelegate
 		::net::IStream::TId streamId,
 		::msg::TMessagePtr message) = 0;
 
+	/**
+	 * Is called when a header of a streaming message (see IStreamingMessage) is received,
+	 *	before its payload is loaded. This is the place to attach a data sink to the message.
+	 * onMessageReceived() is called as usual once the whole payload is loaded.
+	 */
+	virtual void onMessageStarted(
+		::net::IStream::TId streamId,
+		::msg::TMessagePtr message) {}
+
 	/// Is propagated from StreamListener when net::IStreamListenerDelegate::onStreamDied() is called
 	virtual void onStreamDied(::net::IStream::TId streamId) = 0;
 };
@@ -37,6 +49,49 @@ struct IBindingDelegate
 	virtual void onStreamCreated(::net::IStream::TId streamId) = 0;
 };
 
+/**
+ * Options of frames sent over a stream.
+ * Receiving side recognizes them from frame headers, yet older endpoints do not,
+ *	so options must be enabled only after the peer reported their support.
+ */
+struct StreamOptions
+{
+	StreamOptions()
+	: frameChecksums(false),
+	  compression(false),
+	  maxFrameSize(0)
+	{}
+
+	/// CRC32C of the payload is appended to every frame
+	bool frameChecksums;
+
+	/// Payloads are compressed (LZ4) unless they are incompressible or the link is fast enough
+	bool compression;
+
+	/// The largest payload the peer accepts, 0 if unknown
+	util::T_UI4 maxFrameSize;
+};
+
+/**
+ * Message saved once, so that it is sent to many streams as the same payload.
+ * Payload is immutable and its blocks are shared by the frames of all the streams.
+ */
+struct SerializedMessage
+{
+	SerializedMessage()
+	: typeId(0),
+	  checksum(0)
+	{}
+
+	util::T_UI4 typeId;
+	util::BufferChain payload;
+
+	/// CRC32C of the payload, for streams which checksum frames
+	util::T_UI4 checksum;
+};
+
+typedef std::shared_ptr<const SerializedMessage> TSerializedMessagePtr;
+
 /**
  * Messenger built on top of net library.
  * Allows sending/receiving messages of fixed (yet arbitrary) size.
@@ -48,6 +103,9 @@ class Messenger : public net::IBindingDelegate, public net::IStreamListenerDeleg
 
 public:
 
+	/// The largest payload of a frame which is collected in memory, larger frames close a stream
+	static const util::T_UI4 kMaxFrameSize = 64 * 1024 * 1024;
+
 	/// Use this method to access global singleton instance
 	static Messenger& instance();
 
@@ -64,11 +122,34 @@ public:
 		::net::IStream::TId streamId,
 		IMessengerDelegate* delegate_);
 
-	/// Sends a message over the specified stream
+	/// Sets options of frames sent over the specified stream
+	void setStreamOptions(
+		::net::IStream::TId streamId,
+		const StreamOptions& options);
+
+	/// Returns compression counters of the specified stream
+	CompressionStats compressionStats(::net::IStream::TId streamId);
+
+	/**
+	 * Sends a message over the specified stream.
+	 * Throws util::Error if the message is larger than the peer accepts.
+	 */
 	void sendMessage(
 		::net::IStream::TId streamId,
 		TMessagePtr message);
 
+	/// Saves a message once, it may be sent to many streams then
+	TSerializedMessagePtr serializeMessage(TMessagePtr message);
+
+	/**
+	 * Sends a message saved by serializeMessage() over the specified stream.
+	 * Frame is not compressed, since compressors keep state of each stream.
+	 * Throws util::Error if the message is larger than the peer accepts.
+	 */
+	void sendMessage(
+		::net::IStream::TId streamId,
+		const TSerializedMessagePtr& message);
+
 	//
 	// net::IBindingDelegate
 	//
@@ -84,6 +165,10 @@ public:
 		const unsigned char* buf,
 		size_t bufSize);
 
+	virtual void onDataReceived(
+		::net::IStream::TId streamId,
+		const util::BufferChain& data);
+
 	virtual void onStreamDied(::net::IStream::TId streamId);
 
 private:
@@ -108,15 +193,127 @@ private:
 	/// A collection of delegates for each stream
 	TMessengerDelegates m_messengerDelegates;
 
+	typedef std::shared_ptr<FrameCompressor> TFrameCompressorPtr;
+
+	/// Sending state of a stream
+	struct StreamSettings
+	{
+		StreamOptions options;
+
+		/// Is created once the stream sends or receives compressed frames
+		TFrameCompressorPtr compressor;
+	};
+
+	typedef std::map<
+		::net::IStream::TId,	// Stream ID
+		StreamSettings
+	> TStreamSettings;
+
+	/// Settings are guarded separately, so that sending does not wait for receiving
+	util::ThreadMutex m_settingsSync;
+	TStreamSettings m_streamSettings;
+
+	/// Returns compressor of a stream, creates it if needed
+	TFrameCompressorPtr frameCompressor(::net::IStream::TId streamId);
+
+	/// Returns options and compressor of a stream
+	StreamSettings streamSettings(::net::IStream::TId streamId);
+
+	/// Returns payload of a message
+	util::BufferChain savePayload(TMessagePtr message);
+
+	/// Returns a frame of a payload, the frame refers to the payload rather than copies it
+	static util::BufferChain buildFrame(
+		util::T_UI4 messageType,
+		const util::BufferChain& payload,
+		bool isCompressed,
+		bool isChecksummed,
+		util::T_UI4 checksum);
+
 	typedef std::vector<unsigned char> TData;
 
+	/// Receiving state of a stream
+	struct StreamData
+	{
+		StreamData()
+		: streaming(false),
+		  payloadLeft(0),
+		  checksummed(false),
+		  checksum(0),
+		  checksumLeft(0),
+		  compressed(false)
+		{}
+
+		/// Data collected until a full message (or a header of a streaming message) is received
+		TData data;
+
+		/// Message whose header is received, but payload is not yet loaded
+		TMessagePtr message;
+
+		/// True if payload of the message is fed to it by fragments rather than collected in data
+		bool streaming;
+
+		/// Number of payload bytes of the message not yet received
+		util::T_UI4 payloadLeft;
+
+		/// True if the frame is followed by a checksum of its payload
+		bool checksummed;
+
+		/// Checksum of payload received so far
+		util::Crc32c crc;
+
+		/// Checksum sent by the peer and number of its bytes not yet received
+		util::T_UI4 checksum;
+		util::T_UI4 checksumLeft;
+
+		/// True if the payload is compressed, such payloads are always collected in data
+		bool compressed;
+	};
+
 	typedef std::map<
 		::net::IStream::TId,	// Stream ID
-		TData
+		StreamData
 	> TStreamData;
 
 	/// This is where data from each stream are collected until a full message is received
 	TStreamData m_streamData;
+
+	/**
+	 * Must be executed under a lock.
+	 * Extracts messages from data collected for a stream.
+	 */
+	void extractMessages(::net::IStream::TId streamId, StreamData& stream);
+
+	/**
+	 * Returns number of bytes to collect for a stream: the rest of a frame header or of a collected frame.
+	 * Bytes following a header of a streaming message are not collected.
+	 */
+	static size_t collectSize(const StreamData& stream);
+
+	/**
+	 * Must be executed under a lock.
+	 * Feeds a payload fragment to a streaming message, completes the message when its frame is over.
+	 * Returns number of bytes consumed, the rest belongs to next frames.
+	 */
+	size_t loadFragment(::net::IStream::TId streamId, StreamData& stream, const util::BufferChain& data);
+
+	/**
+	 * Must be executed under a lock.
+	 * Notifies a delegate of a stream that a streaming message is about to be loaded.
+	 */
+	void notifyMessageStarted(::net::IStream::TId streamId, TMessagePtr message);
+
+	/**
+	 * Must be executed under a lock.
+	 * Loads a message from a whole payload, returns false if the message failed to load.
+	 */
+	bool loadMessage(::net::IStream::TId streamId, TMessagePtr message, const unsigned char* payload, size_t payloadSize);
+
+	/**
+	 * Must be executed under a lock.
+	 * Notifies a delegate of a stream about a received message.
+	 */
+	void dispatchMessage(::net::IStream::TId streamId, TMessagePtr message);
 };
 
 } // namespace msg
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <util/ReadWriteMutex.hpp>
+#include <util/ScopedLock.hpp>
+#include "IStream.hpp"
+
+namespace net {
+
+/**
+ * Maps endpoint IDs to streams and streams to records of endpoints with a state of each stream.
+ * An endpoint has its main stream and may have extra connections, e.g. for striped downloads.
+ * Lookups take a shared lock of hash maps, so threads receiving messages don't wait for each other.
+ *	Records are replaced rather than changed, a record found stays valid after its stream is removed.
+ */
+template<class T>
+class EndpointRegistry
+{
+public:
+	struct Record
+	{
+		std::string endpointId;
+
+		/// Main stream of the endpoint rather than an extra connection
+		bool isMain;
+
+		T state;
+	};
+
+	typedef std::shared_ptr<const Record> TRecordPtr;
+
+	/// Registers the main stream of an endpoint, it replaces the previous one of an endpoint which reconnected
+	void add(IStream::TId streamId, const std::string& endpointId, const T& state)
+	{
+		TRecordPtr record = makeRecord(endpointId, true, state);
+		util::ScopedLock lock(&m_sync);
+
+		m_records[streamId] = record;
+		m_endpoints[endpointId].stream = streamId;
+	}
+
+	/// Registers an extra connection of an endpoint
+	void addConnection(IStream::TId streamId, const std::string& endpointId, const T& state)
+	{
+		TRecordPtr record = makeRecord(endpointId, false, state);
+		util::ScopedLock lock(&m_sync);
+
+		m_records[streamId] = record;
+		m_endpoints[endpointId].connections.push_back(streamId);
+	}
+
+	/// Replaces the state of a stream, returns false if the stream is not registered
+	bool update(IStream::TId streamId, const T& state)
+	{
+		util::ScopedLock lock(&m_sync);
+
+		typename TRecords::iterator ii = m_records.find(streamId);
+		if (ii == m_records.end())
+			return false;
+
+		ii->second = makeRecord(ii->second->endpointId, ii->second->isMain, state);
+		return true;
+	}
+
+	/**
+	 * Unregisters a stream, returns its record or NULL if it was not registered.
+	 * Endpoint is gone once its current main stream is removed, a replaced main stream leaves it be.
+	 */
+	TRecordPtr remove(IStream::TId streamId)
+	{
+		util::ScopedLock lock(&m_sync);
+
+		typename TRecords::iterator ii = m_records.find(streamId);
+		if (ii == m_records.end())
+			return TRecordPtr();
+
+		TRecordPtr record = ii->second;
+		m_records.erase(ii);
+
+		typename TEndpoints::iterator endpoint = m_endpoints.find(record->endpointId);
+		if (endpoint != m_endpoints.end())
+		{
+			std::vector<IStream::TId>& connections = endpoint->second.connections;
+			if (endpoint->second.stream == streamId)
+				endpoint->second.stream = 0;
+			else
+				connections.erase(std::remove(connections.begin(), connections.end(), streamId), connections.end());
+
+			if (!endpoint->second.stream && connections.empty())
+				m_endpoints.erase(endpoint);
+		}
+		return record;
+	}
+
+	/// Returns the record of a stream, NULL if it is not registered
+	TRecordPtr find(IStream::TId streamId) const
+	{
+		util::ScopedReadLock lock(&m_sync);
+
+		typename TRecords::const_iterator ii = m_records.find(streamId);
+		return ii != m_records.end() ? ii->second : TRecordPtr();
+	}
+
+	/// Returns the main stream of an endpoint, NULL if the endpoint is not connected
+	IStream::TId findStream(const std::string& endpointId) const
+	{
+		util::ScopedReadLock lock(&m_sync);
+
+		typename TEndpoints::const_iterator ii = m_endpoints.find(endpointId);
+		return ii != m_endpoints.end() ? ii->second.stream : 0;
+	}
+
+	/// Returns the extra connections of an endpoint
+	std::vector<IStream::TId> connections(const std::string& endpointId) const
+	{
+		util::ScopedReadLock lock(&m_sync);
+
+		typename TEndpoints::const_iterator ii = m_endpoints.find(endpointId);
+		return ii != m_endpoints.end() ? ii->second.connections : std::vector<IStream::TId>();
+	}
+
+	/// Returns IDs of the connected endpoints
+	std::vector<std::string> endpoints() const
+	{
+		util::ScopedReadLock lock(&m_sync);
+
+		std::vector<std::string> endpointIds;
+		endpointIds.reserve(m_endpoints.size());
+		for (typename TEndpoints::const_iterator ii = m_endpoints.begin(); ii != m_endpoints.end(); ++ii)
+		{
+			if (ii->second.stream)
+				endpointIds.push_back(ii->first);
+		}
+		return endpointIds;
+	}
+
+	/// Returns the number of registered streams
+	size_t size() const
+	{
+		util::ScopedReadLock lock(&m_sync);
+		return m_records.size();
+	}
+
+private:
+	struct Endpoint
+	{
+		Endpoint()
+		: stream(0)
+		{}
+
+		/// NULL while only extra connections of the endpoint are registered
+		IStream::TId stream;
+		std::vector<IStream::TId> connections;
+	};
+
+	typedef std::unordered_map<
+		IStream::TId,	// stream ID
+		TRecordPtr		// record of the stream
+	> TRecords;
+
+	typedef std::unordered_map<
+		std::string,	// endpoint ID
+		Endpoint		// streams of the endpoint
+	> TEndpoints;
+
+	static TRecordPtr makeRecord(const std::string& endpointId, bool isMain, const T& state)
+	{
+		std::shared_ptr<Record> record = std::make_shared<Record>();
+		record->endpointId = endpointId;
+		record->isMain = isMain;
+		record->state = state;
+		return record;
+	}
+
+	mutable util::ReadWriteMutex m_sync;
+
+	TRecords m_records;
+	TEndpoints m_endpoints;
+};
+
+} // namespace net
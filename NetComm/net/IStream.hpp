@@ -4,6 +4,7 @@
 #include "util/utils.h"
 #include "util/ThreadMutex.hpp"
 #include "util/ScopedLock.hpp"
+#include "util/BufferChain.hpp"
 
 namespace net {
 
@@ -27,6 +28,34 @@ struct IStream
 
 	/// Implementation is expected to write() to a stream synchroniosly, but this is not mandatory.
 	virtual void write(const unsigned char* buf, size_t count) = 0;
+
+	/**
+	 * Writes all segments of a chain at once.
+	 * Segments are merged by default, implementations may send them without copying.
+	 */
+	virtual void write(const util::BufferChain& data)
+	{
+		util::BufferChain merged(data);
+		const unsigned char* buf = merged.coalesce();
+		if (buf)
+			write(buf, merged.size());
+	}
+
+	/**
+	 * Reads available data into the free tail of block and appends them to chain,
+	 *	so that received data are shared rather than copied. Returns number of bytes read.
+	 */
+	size_t read(util::BufferChain& chain, const util::TBufferBlockPtr& block)
+	{
+		size_t offset = block->size();
+		size_t n = read(block->tail(), block->tailSize());
+		if (0 < n)
+		{
+			block->commit(n);
+			chain.append(block, offset, n);
+		}
+		return n;
+	}
 };
 
 typedef std::shared_ptr<IStream> TStreamPtr;
@@ -0,0 +1,331 @@
+#include "stdafx.h"
+#include "SendScheduler.hpp"
+#include <util/Error.hpp>
+#include <util/ScopedLock.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace net {
+
+SendScheduler::SendScheduler()
+: m_quantum(kDefaultQuantum),
+  m_maxSending(kDefaultMaxSending),
+  m_lastTicket(0),
+  m_sending(0)
+{
+}
+
+SendScheduler::~SendScheduler()
+{
+	assert(m_frames.empty());
+}
+
+void
+SendScheduler::setQuantum(size_t quantum)
+{
+	util::ScopedLock lock(&m_sync);
+	m_quantum = 0 < quantum ? quantum : 1;
+}
+
+void
+SendScheduler::setMaxSending(size_t maxSending)
+{
+	util::ScopedLock lock(&m_sync);
+	m_maxSending = maxSending;
+
+	if (0 <= dispatch(m_clock.seconds()))
+		wakeWriters();
+}
+
+void
+SendScheduler::setGlobalRate(double bytesPerSecond, double burst)
+{
+	util::ScopedLock lock(&m_sync);
+
+	double now = m_clock.seconds();
+	m_globalBucket.setRate(bytesPerSecond, burst, now);
+
+	if (0 <= dispatch(now))
+		wakeWriters();
+}
+
+void
+SendScheduler::setStreamRate(IStream::TId streamId, double bytesPerSecond, double burst)
+{
+	util::ScopedLock lock(&m_sync);
+
+	double now = m_clock.seconds();
+	m_streams[streamId].bucket.setRate(bytesPerSecond, burst, now);
+
+	if (0 <= dispatch(now))
+		wakeWriters();
+}
+
+SendStats
+SendScheduler::stats(IStream::TId streamId) const
+{
+	util::ScopedLock lock(&m_sync);
+
+	TStreams::const_iterator ii = m_streams.find(streamId);
+	return ii != m_streams.end() ? ii->second.stats : SendStats();
+}
+
+void
+SendScheduler::removeStream(IStream::TId streamId)
+{
+	util::ScopedLock lock(&m_sync);
+
+	TStreams::iterator ii = m_streams.find(streamId);
+	if (ii != m_streams.end())
+	{
+		ii->second.isRemoved = true;
+		dropIdleStream(streamId);
+	}
+}
+
+SendScheduler::TTicket
+SendScheduler::acquire(IStream::TId streamId, size_t size)
+{
+	HANDLE event = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (NULL == event)
+		throw util::Error("Failed to create an event");
+
+	TTicket ticket = 0;
+	double wait = -1;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		double now = m_clock.seconds();
+		ticket = enqueue(streamId, size, now);
+		m_frames[ticket].event = event;
+		wait = dispatch(now);
+	}
+
+	for (;;)
+	{
+		// Writer held by a rate limit wakes up to dispatch frames once it may be over
+		DWORD timeout = 0 > wait ? INFINITE : static_cast<DWORD>(ceil(wait * 1000));
+		::WaitForSingleObject(event, timeout);
+
+		util::ScopedLock lock(&m_sync);
+
+		Frame& frame = m_frames[ticket];
+		if (frame.isGranted)
+		{
+			frame.event = NULL;
+			break;
+		}
+
+		::ResetEvent(event);
+		wait = dispatch(m_clock.seconds());
+	}
+
+	::CloseHandle(event);
+	return ticket;
+}
+
+void
+SendScheduler::release(TTicket ticket)
+{
+	util::ScopedLock lock(&m_sync);
+
+	double now = m_clock.seconds();
+	complete(ticket, now);
+
+	// Writers which wait for their turns without a timeout are woken, so that the rate limit is waited for
+	if (0 <= dispatch(now))
+		wakeWriters();
+}
+
+SendScheduler::TTicket
+SendScheduler::enqueue(IStream::TId streamId, size_t size, double now)
+{
+	util::ScopedLock lock(&m_sync);
+
+	TTicket ticket = ++m_lastTicket;
+
+	Frame& frame = m_frames[ticket];
+	frame.streamId = streamId;
+	frame.size = size;
+	frame.queued = now;
+	frame.granted = 0;
+	frame.isGranted = false;
+	frame.event = NULL;
+
+	Stream& stream = m_streams[streamId];
+	stream.frames.push_back(ticket);
+
+	if (!stream.isInRound)
+	{
+		stream.isInRound = true;
+		m_round.push_back(streamId);
+	}
+
+	return ticket;
+}
+
+double
+SendScheduler::dispatch(double now)
+{
+	util::ScopedLock lock(&m_sync);
+
+	double wait = -1;
+
+	// Streams which may not send now are passed over, until all of them were passed in a row
+	size_t passed = 0;
+	while ((0 == m_maxSending || m_sending < m_maxSending) && passed < m_round.size())
+	{
+		IStream::TId streamId = m_round.front();
+		m_round.pop_front();
+
+		Stream& stream = m_streams[streamId];
+		assert(stream.isInRound && !stream.frames.empty());
+
+		if (stream.isSending)
+		{
+			m_round.push_back(streamId);
+			++passed;
+			continue;
+		}
+
+		double delay = stream.bucket.delay(now);
+		if (0 < delay)
+		{
+			wait = 0 > wait ? delay : std::min(wait, delay);
+			m_round.push_back(streamId);
+			++passed;
+			continue;
+		}
+
+		// Nothing is sent until the global limit is over, the stream keeps its turn
+		delay = m_globalBucket.delay(now);
+		if (0 < delay)
+		{
+			wait = 0 > wait ? delay : std::min(wait, delay);
+			m_round.push_front(streamId);
+			break;
+		}
+
+		passed = 0;
+		if (!stream.hasTurn)
+		{
+			stream.hasTurn = true;
+			stream.deficit += m_quantum;
+		}
+
+		TTicket ticket = stream.frames.front();
+		size_t size = m_frames[ticket].size;
+		if (size > stream.deficit)
+		{
+			// Frame larger than the quantum waits for the turns it needs
+			stream.hasTurn = false;
+			m_round.push_back(streamId);
+			continue;
+		}
+
+		stream.deficit -= size;
+		stream.frames.pop_front();
+		grant(ticket, now);
+
+		if (stream.frames.empty())
+		{
+			// Stream which runs out of frames leaves the round, it does not save turns while idle
+			stream.isInRound = false;
+			stream.hasTurn = false;
+			stream.deficit = 0;
+		}
+		else if (m_frames[stream.frames.front()].size <= stream.deficit)
+		{
+			// Turn goes on once the frame is sent, frames of a stream are sent one at a time
+			m_round.push_front(streamId);
+		}
+		else
+		{
+			stream.hasTurn = false;
+			m_round.push_back(streamId);
+		}
+	}
+
+	return wait;
+}
+
+bool
+SendScheduler::isGranted(TTicket ticket) const
+{
+	util::ScopedLock lock(&m_sync);
+
+	TFrames::const_iterator ii = m_frames.find(ticket);
+	return ii != m_frames.end() && ii->second.isGranted;
+}
+
+void
+SendScheduler::complete(TTicket ticket, double now)
+{
+	util::ScopedLock lock(&m_sync);
+
+	TFrames::iterator ii = m_frames.find(ticket);
+	assert(ii != m_frames.end() && ii->second.isGranted);
+	if (ii == m_frames.end() || !ii->second.isGranted)
+		return;
+
+	IStream::TId streamId = ii->second.streamId;
+	size_t size = ii->second.size;
+	m_frames.erase(ii);
+
+	Stream& stream = m_streams[streamId];
+	stream.isSending = false;
+	--m_sending;
+
+	++stream.stats.framesSent;
+	stream.stats.bytesSent += size;
+	stream.stats.activeSeconds = now - stream.firstSent;
+
+	dropIdleStream(streamId);
+}
+
+void
+SendScheduler::grant(TTicket ticket, double now)
+{
+	Frame& frame = m_frames[ticket];
+	frame.isGranted = true;
+	frame.granted = now;
+
+	Stream& stream = m_streams[frame.streamId];
+	stream.isSending = true;
+	++m_sending;
+
+	stream.bucket.consume(static_cast<double>(frame.size), now);
+	m_globalBucket.consume(static_cast<double>(frame.size), now);
+
+	if (0 > stream.firstSent)
+		stream.firstSent = now;
+
+	double queued = now - frame.queued;
+	stream.stats.queuedSeconds += queued;
+	if (queued > stream.stats.maxQueuedSeconds)
+		stream.stats.maxQueuedSeconds = queued;
+
+	if (frame.event)
+		::SetEvent(frame.event);
+}
+
+void
+SendScheduler::wakeWriters()
+{
+	for (TFrames::const_iterator ii = m_frames.begin(); ii != m_frames.end(); ++ii)
+	{
+		if (!ii->second.isGranted && ii->second.event)
+			::SetEvent(ii->second.event);
+	}
+}
+
+void
+SendScheduler::dropIdleStream(IStream::TId streamId)
+{
+	TStreams::iterator ii = m_streams.find(streamId);
+	if (ii != m_streams.end() && ii->second.isRemoved && !ii->second.isSending && ii->second.frames.empty())
+		m_streams.erase(ii);
+}
+
+} // namespace net
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <windows.h>
+
+#include <util/Stopwatch.hpp>
+#include <util/ThreadMutex.hpp>
+#include <util/TokenBucket.hpp>
+#include "IStream.hpp"
+
+namespace net {
+
+/// Counters of frames sent over a stream
+struct SendStats
+{
+	SendStats()
+	: framesSent(0),
+	  bytesSent(0),
+	  queuedSeconds(0),
+	  maxQueuedSeconds(0),
+	  activeSeconds(0)
+	{}
+
+	util::T_UI8 framesSent;
+	util::T_UI8 bytesSent;
+
+	/// Time frames waited for their turn, in total and at most
+	double queuedSeconds;
+	double maxQueuedSeconds;
+
+	/// Time from the first frame sent to the last one
+	double activeSeconds;
+
+	double averageQueuedSeconds() const
+	{
+		return 0 < framesSent ? queuedSeconds / framesSent : 0;
+	}
+
+	/// Bytes per second while the stream was sending
+	double throughput() const
+	{
+		return 0 < activeSeconds ? bytesSent / activeSeconds : 0;
+	}
+};
+
+/**
+ * Orders frames written to streams, so that a bulk transfer over one stream does not hold up others.
+ * Streams take turns by deficit round robin, each turn a stream may send up to the quantum of bytes
+ *	(a larger frame waits until the stream saves enough turns). Sending may be limited by token buckets
+ *	of each stream and of all of them. Frames of a stream are sent in order, one at a time.
+ * Streams send concurrently unless a limit of frames written at once is set, so a stream stalled
+ *	by its peer only holds up its own frames.
+ * Writers block in acquire() until their frame's turn comes, sending itself is done by the writers.
+ */
+class SendScheduler
+{
+public:
+	typedef unsigned int TTicket;
+
+	static const size_t kDefaultQuantum = 64 * 1024;
+	static const size_t kDefaultMaxSending = 0;
+	static const size_t kDefaultBurst = 256 * 1024;
+
+	SendScheduler();
+	~SendScheduler();
+
+	/// Bytes a stream may send per turn
+	void setQuantum(size_t quantum);
+
+	/**
+	 * Frames written at once by all streams, 0 removes the limit.
+	 * A stream stalled by its peer holds one of them until its write times out.
+	 */
+	void setMaxSending(size_t maxSending);
+
+	/// Limits all streams together or one stream, rate 0 removes the limit
+	void setGlobalRate(double bytesPerSecond, double burst = kDefaultBurst);
+	void setStreamRate(IStream::TId streamId, double bytesPerSecond, double burst = kDefaultBurst);
+
+	SendStats stats(IStream::TId streamId) const;
+
+	/// Forgets the rate and counters of a dead stream once its queued frames are gone
+	void removeStream(IStream::TId streamId);
+
+	/// Blocks until the frame may be written, release() must follow once it is written
+	TTicket acquire(IStream::TId streamId, size_t size);
+	void release(TTicket ticket);
+
+	/// Takes a turn for the lifetime of the object
+	class Turn
+	{
+	public:
+		Turn(SendScheduler& scheduler, IStream::TId streamId, size_t size)
+		: m_scheduler(scheduler),
+		  m_ticket(scheduler.acquire(streamId, size))
+		{}
+
+		~Turn()
+		{
+			m_scheduler.release(m_ticket);
+		}
+
+	private:
+		Turn(const Turn&);
+		Turn& operator =(const Turn&);
+
+		SendScheduler& m_scheduler;
+		TTicket m_ticket;
+	};
+
+	//
+	// Scheduling by time given in seconds, acquire() and release() are built on these.
+	// Must not be mixed with acquire() and release() on the same instance.
+	//
+
+	/// Queues a frame
+	TTicket enqueue(IStream::TId streamId, size_t size, double now);
+
+	/**
+	 * Grants queued frames whose turns came.
+	 * Returns seconds until a frame held by a rate limit may be granted, or a negative value if no frame is held by one.
+	 */
+	double dispatch(double now);
+
+	bool isGranted(TTicket ticket) const;
+
+	/// Ends sending of a granted frame
+	void complete(TTicket ticket, double now);
+
+private:
+	SendScheduler(const SendScheduler&);
+	SendScheduler& operator =(const SendScheduler&);
+
+	/// Must be executed under a lock. Marks a frame granted and wakes its writer.
+	void grant(TTicket ticket, double now);
+
+	/// Must be executed under a lock. Wakes writers so that one of them waits for a rate limit.
+	void wakeWriters();
+
+	/// Must be executed under a lock. Drops a removed stream once nothing is queued to it.
+	void dropIdleStream(IStream::TId streamId);
+
+private:
+	struct Frame
+	{
+		IStream::TId streamId;
+		size_t size;
+		double queued;
+		double granted;
+		bool isGranted;
+
+		/// Writer waiting in acquire(), NULL if the frame is scheduled by time
+		HANDLE event;
+	};
+
+	typedef std::map<
+		TTicket,
+		Frame
+	> TFrames;
+
+	struct Stream
+	{
+		Stream()
+		: deficit(0),
+		  hasTurn(false),
+		  isSending(false),
+		  isInRound(false),
+		  isRemoved(false),
+		  firstSent(-1)
+		{}
+
+		/// Queued frames in order, the front one is sent next
+		std::deque<TTicket> frames;
+
+		/// Bytes the stream may send, saved over turns it did not use
+		size_t deficit;
+
+		/// Stream got the quantum of its current turn
+		bool hasTurn;
+
+		bool isSending;
+		bool isInRound;
+		bool isRemoved;
+
+		util::TokenBucket bucket;
+		SendStats stats;
+
+		/// Time the first frame was sent, negative if none was
+		double firstSent;
+	};
+
+	typedef std::map<
+		IStream::TId,
+		Stream
+	> TStreams;
+
+	mutable util::ThreadMutex m_sync;
+	util::Stopwatch m_clock;
+
+	size_t m_quantum;
+	size_t m_maxSending;
+	util::TokenBucket m_globalBucket;
+
+	TTicket m_lastTicket;
+	TFrames m_frames;
+	TStreams m_streams;
+
+	/// Streams with queued frames in order of their turns
+	std::deque<IStream::TId> m_round;
+
+	size_t m_sending;
+};
+
+} // namespace net
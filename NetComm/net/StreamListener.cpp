@@ -1,9 +1,13 @@
 #include "stdafx.h"
 #include "StreamListener.hpp"
 #include <util/Error.hpp>
+#include <util/Stopwatch.hpp>
 
 #define K_DATA_CHUNK_SIZE (1024 * 1024)
 
+// Blocks with less free space are not read to
+#define K_DATA_MIN_TAIL_SIZE (1024 * 64)
+
 namespace net {
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -341,7 +345,8 @@ StreamListener::getStreamById(::net::IStream::TId streamId) const
 void
 StreamListener::listenStreams()
 {
-	std::vector<unsigned char> dataBuf(K_DATA_CHUNK_SIZE, 0);
+	// Data are read to a shared block, a new block is started once the rest of it is too small
+	util::TBufferBlockPtr block;
 
 	bool dataReceived = false;
 	while (true)
@@ -374,11 +379,15 @@ StreamListener::listenStreams()
 		do
 		{
 			cb = 0;
+			util::BufferChain data;
 
 			// Wrap reading operation with try/catch in order to handle stream errors
 			try
 			{
-				cb = stream->read(&dataBuf[0], K_DATA_CHUNK_SIZE);
+				if (!block || K_DATA_MIN_TAIL_SIZE > block->tailSize())
+					block = std::make_shared<util::BufferBlock>(K_DATA_CHUNK_SIZE);
+
+				cb = stream->read(data, block);
 			}
 			catch (const std::exception& x)
 			{
@@ -400,7 +409,7 @@ StreamListener::listenStreams()
 				for (TDelegates::iterator ii = delegates.begin(); ii != delegates.end(); ++ii)
 				{
 					IStreamListenerDelegate*& delegate_ = *ii;
-					delegate_->onDataReceived(stream->id(), &dataBuf[0], cb);
+					delegate_->onDataReceived(stream->id(), data);
 				}
 
 				dataReceived = true;
@@ -416,7 +425,7 @@ StreamListener::listenStreams()
 	}
 }
 
-void
+double
 StreamListener::writeStream(::net::IStream::TId streamId, const unsigned char* buf, size_t count)
 {
 	TStreamPtr stream;
@@ -425,18 +434,73 @@ StreamListener::writeStream(::net::IStream::TId streamId, const unsigned char* b
 		stream = getStreamById(streamId);
 	}
 
-	try
+	// Stream dies once its turn is over, so that its delegates do not hold up other streams
+	std::string error;
+	bool ok = false;
+	double seconds = 0;
 	{
-		stream->write(buf, count);
+		SendScheduler::Turn turn(m_sendScheduler, streamId, count);
+
+		try
+		{
+			util::Stopwatch stopwatch;
+			stream->write(buf, count);
+			seconds = stopwatch.seconds();
+			ok = true;
+		}
+		catch (const std::exception& x)
+		{
+			error = x.what();
+		}
+		catch (...)
+		{
+			error = "Unknown error";
+		}
 	}
-	catch (const std::exception& x)
+
+	if (!ok)
+		streamDied(stream->id(), error);
+
+	return seconds;
+}
+
+double
+StreamListener::writeStream(::net::IStream::TId streamId, const util::BufferChain& data)
+{
+	TStreamPtr stream;
 	{
-		streamDied(stream->id(), x.what());
+		util::ScopedLock lock(&s_sync);
+		stream = getStreamById(streamId);
 	}
-	catch (...)
+
+	// Stream dies once its turn is over, so that its delegates do not hold up other streams
+	std::string error;
+	bool ok = false;
+	double seconds = 0;
 	{
-		streamDied(stream->id(), "Unknown error");
+		SendScheduler::Turn turn(m_sendScheduler, streamId, data.size());
+
+		try
+		{
+			util::Stopwatch stopwatch;
+			stream->write(data);
+			seconds = stopwatch.seconds();
+			ok = true;
+		}
+		catch (const std::exception& x)
+		{
+			error = x.what();
+		}
+		catch (...)
+		{
+			error = "Unknown error";
+		}
 	}
+
+	if (!ok)
+		streamDied(stream->id(), error);
+
+	return seconds;
 }
 
 void
@@ -445,9 +509,17 @@ StreamListener::closeStream(::net::IStream::TId streamId, const std::string& err
 	streamDied(streamId, errorDescription);
 }
 
+SendScheduler&
+StreamListener::sendScheduler()
+{
+	return m_sendScheduler;
+}
+
 void
 StreamListener::streamDied(::net::IStream::TId streamId, const std::string& errorDescription)
 {
+	m_sendScheduler.removeStream(streamId);
+
 	util::ScopedLock lock(&s_sync);
 
 	TStreamDelegates::iterator ii = m_streamDelegates.find(streamId);
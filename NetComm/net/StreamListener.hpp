@@ -8,6 +8,7 @@
 #include <util/ThreadMutex.hpp>
 #include "util/ScopedLock.hpp"
 #include "IStream.hpp"
+#include "SendScheduler.hpp"
 
 namespace net {
 
@@ -25,6 +26,18 @@ namespace net {
 			const unsigned char* buf,
 			size_t bufSize) = 0;
 
+		/**
+		* Is called instead of the above with data shared by reference,
+		*	delegates may keep the chain (or its slices) rather than copy the data.
+		*/
+		virtual void onDataReceived(
+			::net::IStream::TId streamId,
+			const util::BufferChain& data)
+		{
+			for (size_t i = 0; i < data.segmentCount(); ++i)
+				onDataReceived(streamId, data.segment(i).data(), data.segment(i).size);
+		}
+
 		/// Is called when a stream has died
 		virtual void onStreamDied(::net::IStream::TId streamId) = 0;
 	};
@@ -71,15 +84,22 @@ namespace net {
 		/**
 		* This method should be used when writing to watched stream instead of IStream::write()
 		*	in order to let the StreamListener instance handle stream errors.
-		* This call is blocking.
+		* This call is blocking, it waits for the turn of the stream in the send scheduler as well.
+		* Returns seconds the write took once the turn came, e.g. to estimate speed of the link.
 		*/
-		void writeStream(::net::IStream::TId stream, const unsigned char* buf, size_t count);
+		double writeStream(::net::IStream::TId stream, const unsigned char* buf, size_t count);
+
+		/// The same as above, segments of a chain are written at once
+		double writeStream(::net::IStream::TId stream, const util::BufferChain& data);
 
 		/**
 		* Explicitly closes specified stream in case some higher level error occurs.
 		*/
 		void closeStream(::net::IStream::TId streamId, const std::string& errorDescription);
 
+		/// Orders writes to all streams, its limits may be changed at any time
+		SendScheduler& sendScheduler();
+
 	private:
 		static util::ThreadMutex s_sync;
 		static std::auto_ptr<StreamListener> s_instance;
@@ -133,6 +153,8 @@ namespace net {
 
 		TStreamDelegates m_streamDelegates;
 
+		SendScheduler m_sendScheduler;
+
 		/// Creates a worker thread. Must be executed under a sync.
 		void spawnWorkerThread();
 
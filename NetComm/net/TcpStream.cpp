@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include "TcpStream.hpp"
 #include "WSAError.hpp"
+#include <util/FileBlock.hpp>
 
 #ifndef NDEBUG
 
@@ -50,16 +51,33 @@ dumpBinBuffer(const unsigned char* buf, size_t bufSize)
 namespace net {
 
 TcpStream::TcpStream(int socket)
-	: m_socket(socket)
+	: m_socket(socket),
+	  m_transmitFile(NULL),
+	  m_transmitEvent(NULL)
 {
 	// Switch to non-blocking mode
 	u_long iMode = FIONBIO;
 	::ioctlsocket(m_socket, FIONBIO, &iMode);
+
+	// TransmitFile() is looked up rather than linked, files are sent from memory if it is missing
+	GUID guid = WSAID_TRANSMITFILE;
+	DWORD cb = 0;
+	if (SOCKET_ERROR == ::WSAIoctl(m_socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid),
+		&m_transmitFile, sizeof(m_transmitFile), &cb, NULL, NULL))
+	{
+		m_transmitFile = NULL;
+	}
+
+	if (m_transmitFile)
+		m_transmitEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
 }
 
 TcpStream::~TcpStream()
 {
 	::closesocket(m_socket);
+
+	if (m_transmitEvent)
+		::CloseHandle(m_transmitEvent);
 }
 
 size_t
@@ -118,6 +136,9 @@ TcpStream::write(const unsigned char* buf, size_t count)
 	}
 #endif // !NDEBUG
 
+	util::ScopedLock lock(&m_writeSync);
+
+	DWORD lastSent = ::GetTickCount();
 	size_t totalSent = 0;
 	while (totalSent < count)
 	{
@@ -127,7 +148,7 @@ TcpStream::write(const unsigned char* buf, size_t count)
 			int wsaError = ::WSAGetLastError();
 			if (WSAEWOULDBLOCK == wsaError) // Writing faster then WSA can send
 			{
-				::Sleep(50);
+				waitForSend(lastSent);
 				continue;
 			}
 
@@ -139,6 +160,137 @@ TcpStream::write(const unsigned char* buf, size_t count)
 		}
 
 		totalSent += n;
+		lastSent = ::GetTickCount();
+	}
+}
+
+void
+TcpStream::write(const util::BufferChain& data)
+{
+	util::ScopedLock lock(&m_writeSync);
+
+	// Buffers of the segments not yet sent
+	std::vector<WSABUF> buffers;
+	buffers.reserve(data.segmentCount());
+
+	for (size_t i = 0; i < data.segmentCount(); ++i)
+	{
+		const util::BufferChain::Segment& segment = data.segment(i);
+
+		// File ranges are not touched, unless something (e.g. a checksum) has already read them
+		const util::FileBlock* fileBlock = dynamic_cast<const util::FileBlock*>(segment.block.get());
+		if (m_transmitFile && fileBlock && !fileBlock->loaded())
+		{
+			sendBuffers(buffers);
+			transmitFile(*fileBlock, segment.offset, segment.size);
+			continue;
+		}
+
+		WSABUF wsaBuf;
+		wsaBuf.buf = const_cast<char*>(reinterpret_cast<const char*>(segment.data()));
+		wsaBuf.len = static_cast<u_long>(segment.size);
+		buffers.push_back(wsaBuf);
+	}
+
+	sendBuffers(buffers);
+}
+
+void
+TcpStream::sendBuffers(std::vector<WSABUF>& buffers)
+{
+	DWORD lastSent = ::GetTickCount();
+	size_t first = 0;
+	while (first < buffers.size())
+	{
+		DWORD sent = 0;
+		int res = ::WSASend(m_socket, &buffers[first], static_cast<DWORD>(buffers.size() - first), &sent, 0, NULL, NULL);
+		if (SOCKET_ERROR == res)
+		{
+			int wsaError = ::WSAGetLastError();
+			if (WSAEWOULDBLOCK == wsaError) // Writing faster then WSA can send
+			{
+				waitForSend(lastSent);
+				continue;
+			}
+
+			throw net::WSAError();
+		}
+		else if (0 == sent)
+		{
+			throw util::Error("TCP connection was closed");
+		}
+
+		lastSent = ::GetTickCount();
+
+		// Skip buffers sent completely, the rest of a partially sent one is sent next time
+		while (0 < sent)
+		{
+			WSABUF& wsaBuf = buffers[first];
+			if (sent < wsaBuf.len)
+			{
+				wsaBuf.buf += sent;
+				wsaBuf.len -= sent;
+				break;
+			}
+
+			sent -= wsaBuf.len;
+			++first;
+		}
+	}
+
+	buffers.clear();
+}
+
+void
+TcpStream::waitForSend(DWORD lastSent)
+{
+	if (::GetTickCount() - lastSent >= kSendTimeout)
+		throw util::Error("TCP connection timed out sending data");
+
+	::Sleep(50);
+}
+
+void
+TcpStream::transmitFile(const util::FileBlock& block, size_t offset, size_t size)
+{
+	// TransmitFile() can't send more than 2GB at once, a range is sent in parts so that the timeout applies to each of them
+	static const size_t kMaxTransmitSize = 4 * 1024 * 1024;
+
+	__int64 position = block.offset() + offset;
+	while (0 < size)
+	{
+		DWORD cb = static_cast<DWORD>(size < kMaxTransmitSize ? size : kMaxTransmitSize);
+
+		// Socket is non-blocking, so the transfer is overlapped and waited for
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = static_cast<DWORD>(position);
+		overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+		overlapped.hEvent = m_transmitEvent;
+		::ResetEvent(m_transmitEvent);
+
+		if (!m_transmitFile(m_socket, block.file()->get(), cb, 0, &overlapped, NULL, 0))
+		{
+			int wsaError = ::WSAGetLastError();
+			if (WSA_IO_PENDING != wsaError && ERROR_IO_PENDING != wsaError)
+				throw net::WSAError();
+
+			DWORD sent = 0;
+			DWORD flags = 0;
+			if (WAIT_OBJECT_0 != ::WaitForSingleObject(m_transmitEvent, kSendTimeout))
+			{
+				// Transfer refers to the overlapped structure until it is cancelled
+				::CancelIoEx(reinterpret_cast<HANDLE>(static_cast<INT_PTR>(m_socket)), &overlapped);
+				::WSAGetOverlappedResult(m_socket, &overlapped, &sent, TRUE, &flags);
+				throw util::Error("TCP connection timed out sending data");
+			}
+
+			if (!::WSAGetOverlappedResult(m_socket, &overlapped, &sent, TRUE, &flags))
+				throw net::WSAError();
+		}
+
+		position += cb;
+		size -= cb;
 	}
 }
 
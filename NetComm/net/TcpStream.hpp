@@ -2,6 +2,12 @@
 
 #include "IStream.hpp"
 
+#include <mswsock.h>
+
+namespace util {
+class FileBlock;
+}
+
 namespace net {
 
 class TcpServer;
@@ -15,13 +21,41 @@ public:
 	/// Must not be created by a client code
 	explicit TcpStream(int socket);
 
+	/// Write which sends nothing for this long fails, so that a peer which stopped reading is dropped
+	static const DWORD kSendTimeout = 60 * 1000;
+
 	~TcpStream();
 
 	virtual size_t read(unsigned char* buf, size_t bufSize);
 	virtual void write(const unsigned char* buf, size_t count);
 
+	/**
+	 * Segments are sent by a gathering WSASend() rather than merged.
+	 * Ranges of files which were not read yet (see util::FileBlock) are sent by TransmitFile(),
+	 *	so their data go from the file system cache to the socket without being copied.
+	 */
+	virtual void write(const util::BufferChain& data);
+
 private:
+	/// Sends buffers, skips buffers as they are sent
+	void sendBuffers(std::vector<WSABUF>& buffers);
+
+	/// Waits a while for the socket to take more data, throws once nothing was sent since lastSent for kSendTimeout
+	void waitForSend(DWORD lastSent);
+
+	/// Sends a range of a file block
+	void transmitFile(const util::FileBlock& block, size_t offset, size_t size);
+
 	int m_socket;
+
+	/// TransmitFile() extension, is NULL if the provider does not support it
+	LPFN_TRANSMITFILE m_transmitFile;
+
+	/// Signals completion of TransmitFile()
+	HANDLE m_transmitEvent;
+
+	/// Writes may be partial, so they are serialized to keep data of different threads apart
+	util::ThreadMutex m_writeSync;
 };
 
 } // namespace net
@@ -0,0 +1,264 @@
+#include "AsyncFileIo.hpp"
+#include "Error.hpp"
+#include "FileReader.hpp"
+#include "FileWriter.hpp"
+#include "ScopedLock.hpp"
+
+namespace util {
+
+namespace {
+
+/// Completion keys
+enum
+{
+	KEY_STOP = 0,
+	KEY_JOB,
+	KEY_STRAND
+};
+
+/// Engine whose job is running on the current thread, jobs queue more jobs without waiting for slots
+__declspec(thread) const AsyncFileIo* t_current = 0;
+
+} // namespace
+
+util::ThreadMutex AsyncFileIo::s_sync;
+std::auto_ptr<AsyncFileIo> AsyncFileIo::s_instance;
+
+AsyncFileIo&
+AsyncFileIo::instance()
+{
+	util::ScopedLock lock(&s_sync);
+	if (0 == s_instance.get())
+	{
+		s_instance.reset(new AsyncFileIo);
+		chkptr(s_instance.get());
+	}
+
+	return *s_instance;
+}
+
+AsyncFileIo::AsyncFileIo(size_t threadCount, size_t maxPending)
+	: m_pending(0)
+	, m_port(NULL)
+	, m_slots(NULL)
+	, m_idle(NULL)
+{
+	assert(0 < threadCount && 0 < maxPending);
+
+	m_port = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, static_cast<DWORD>(threadCount));
+	m_slots = ::CreateSemaphore(NULL, static_cast<LONG>(maxPending), static_cast<LONG>(maxPending), NULL);
+	m_idle = ::CreateEvent(NULL, TRUE, TRUE, NULL);
+	if (!m_port || !m_slots || !m_idle)
+		throw util::Error("Failed to create file I/O queue");
+
+	for (size_t i = 0; i < threadCount; ++i)
+	{
+		DWORD dwThread = 0;
+		HANDLE h = ::CreateThread(0, 0, workerThreadFunc, this, 0, &dwThread);
+		if (NULL == h)
+			throw util::Error("Failed to create a file I/O thread");
+
+		m_threads.push_back(h);
+	}
+}
+
+AsyncFileIo::~AsyncFileIo()
+{
+	::WaitForSingleObject(m_idle, INFINITE);
+
+	for (size_t i = 0; i < m_threads.size(); ++i)
+		::PostQueuedCompletionStatus(m_port, 0, KEY_STOP, NULL);
+
+	for (size_t i = 0; i < m_threads.size(); ++i)
+	{
+		::WaitForSingleObject(m_threads[i], INFINITE);
+		::CloseHandle(m_threads[i]);
+	}
+
+	::CloseHandle(m_idle);
+	::CloseHandle(m_slots);
+	::CloseHandle(m_port);
+}
+
+void
+AsyncFileIo::submit(const void* strand, const TJob& job)
+{
+	Job queued;
+	queued.run = job;
+	queued.hasSlot = this != t_current;
+
+	// Queue is bounded, so a slow disk slows down receivers rather than fills memory
+	if (queued.hasSlot)
+		::WaitForSingleObject(m_slots, INFINITE);
+
+	util::ScopedLock lock(&m_sync);
+
+	if (0 == m_pending++)
+		::ResetEvent(m_idle);
+
+	if (!strand)
+	{
+		::PostQueuedCompletionStatus(m_port, 0, KEY_JOB, reinterpret_cast<LPOVERLAPPED>(new Job(queued)));
+		return;
+	}
+
+	// A strand is scheduled once, its next job is scheduled when the previous one is done
+	TStrands::iterator ii = m_strands.find(strand);
+	if (ii == m_strands.end())
+	{
+		m_strands[strand].push_back(queued);
+		::PostQueuedCompletionStatus(m_port, 0, KEY_STRAND, reinterpret_cast<LPOVERLAPPED>(const_cast<void*>(strand)));
+	}
+	else
+	{
+		ii->second.push_back(queued);
+	}
+}
+
+void
+AsyncFileIo::drain(const void* strand)
+{
+	HANDLE event = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!event)
+		throw util::Error("Failed to create an event");
+
+	submit(strand, [event]() { ::SetEvent(event); });
+
+	::WaitForSingleObject(event, INFINITE);
+	::CloseHandle(event);
+}
+
+void
+AsyncFileIo::drain()
+{
+	assert(this != t_current);
+	::WaitForSingleObject(m_idle, INFINITE);
+}
+
+void
+AsyncFileIo::read(FileReader& reader, __int64 offset, int size, const TReadCompletion& done)
+{
+	FileReader* file = &reader;
+	submit(0, [file, offset, size, done]()
+	{
+		BufferChain data;
+		bool ok = file->readAt(data, offset, size);
+		done(ok, data);
+	});
+}
+
+void
+AsyncFileIo::write(FileWriter& writer, const BufferChain& data, __int64 offset, const TWriteCompletion& done)
+{
+	FileWriter* file = &writer;
+	submit(0, [file, data, offset, done]()
+	{
+		done(file->writeAt(data, offset));
+	});
+}
+
+size_t
+AsyncFileIo::pending() const
+{
+	util::ScopedLock lock(&m_sync);
+	return m_pending;
+}
+
+DWORD WINAPI
+AsyncFileIo::workerThreadFunc(LPVOID param)
+{
+	AsyncFileIo* self = static_cast<AsyncFileIo*>(param);
+	chkptr(self);
+
+	t_current = self;
+	self->work();
+
+	return 0;
+}
+
+void
+AsyncFileIo::work()
+{
+	for (;;)
+	{
+		DWORD cb = 0;
+		ULONG_PTR key = KEY_STOP;
+		LPOVERLAPPED overlapped = NULL;
+		if (!::GetQueuedCompletionStatus(m_port, &cb, &key, &overlapped, INFINITE) || KEY_STOP == key)
+			break;
+
+		if (KEY_JOB == key)
+		{
+			std::auto_ptr<Job> job(reinterpret_cast<Job*>(overlapped));
+			run(job->run);
+			done(job->hasSlot);
+			continue;
+		}
+
+		const void* strand = overlapped;
+
+		Job job;
+		{
+			util::ScopedLock lock(&m_sync);
+			job = m_strands[strand].front();
+		}
+
+		run(job.run);
+
+		{
+			util::ScopedLock lock(&m_sync);
+
+			TStrands::iterator ii = m_strands.find(strand);
+			assert(ii != m_strands.end());
+			ii->second.pop_front();
+
+			if (ii->second.empty())
+				m_strands.erase(ii);
+			else
+				::PostQueuedCompletionStatus(m_port, 0, KEY_STRAND, overlapped);
+		}
+
+		done(job.hasSlot);
+	}
+}
+
+void
+AsyncFileIo::run(const TJob& job)
+{
+	try
+	{
+		job();
+	}
+	catch (const std::exception& x)
+	{
+		ignore_unused(x);
+
+		// Suppress exception
+#ifndef NDEBUG
+		const char* szMsg = x.what();
+		ignore_unused(szMsg);
+#endif
+
+		assert(0);
+	}
+	catch (...)
+	{
+		// Suppress unknown exception
+		assert(0);
+	}
+}
+
+void
+AsyncFileIo::done(bool hasSlot)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+		if (0 == --m_pending)
+			::SetEvent(m_idle);
+	}
+
+	if (hasSlot)
+		::ReleaseSemaphore(m_slots, 1, NULL);
+}
+
+} // namespace util
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <windows.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+
+#include "BufferChain.hpp"
+#include "ThreadMutex.hpp"
+
+namespace util {
+
+class FileReader;
+class FileWriter;
+
+/**
+ * Runs disk I/O on a bounded pool of threads, so that a slow disk does not stall socket processing.
+ * Jobs of the same strand (e.g. all jobs writing one file) run in order, one at a time.
+ * Jobs of different strands and jobs without a strand run in parallel.
+ */
+class AsyncFileIo
+{
+public:
+	typedef std::function<void ()> TJob;
+	typedef std::function<void (bool ok, const BufferChain& data)> TReadCompletion;
+	typedef std::function<void (bool ok)> TWriteCompletion;
+
+	static const size_t kDefaultThreadCount = 4;
+	static const size_t kDefaultMaxPending = 256;
+
+	static AsyncFileIo& instance();
+
+	explicit AsyncFileIo(size_t threadCount = kDefaultThreadCount, size_t maxPending = kDefaultMaxPending);
+
+	/// Waits for queued jobs
+	~AsyncFileIo();
+
+	/**
+	 * Queues a job, strand may be NULL.
+	 * Blocks while maxPending jobs are queued, unless it is called by a job.
+	 */
+	void submit(const void* strand, const TJob& job);
+
+	/// Waits for jobs of the strand queued so far, must not be called by a job of the strand
+	void drain(const void* strand);
+
+	/// Waits until no jobs are pending, must not be called by a job
+	void drain();
+
+	/// Reads a range of a file at offset, completion is called by a pool thread
+	void read(FileReader& reader, __int64 offset, int size, const TReadCompletion& done);
+
+	/// Writes data at offset, completion is called by a pool thread
+	void write(FileWriter& writer, const BufferChain& data, __int64 offset, const TWriteCompletion& done);
+
+	/// Number of jobs queued or running
+	size_t pending() const;
+
+private:
+	AsyncFileIo(const AsyncFileIo&);
+	AsyncFileIo& operator =(const AsyncFileIo&);
+
+	static DWORD WINAPI workerThreadFunc(LPVOID param);
+
+	void work();
+
+	/// Runs a job, exceptions are suppressed
+	static void run(const TJob& job);
+
+	/// Releases the slot of a job once it is done, if it took one
+	void done(bool hasSlot);
+
+private:
+	struct Job
+	{
+		TJob run;
+
+		/// Jobs queued by jobs don't wait for slots, so they don't release them either
+		bool hasSlot;
+	};
+
+	typedef std::map<
+		const void*,		// strand
+		std::deque<Job>		// jobs of the strand, the front one is scheduled or running
+	> TStrands;
+
+	static util::ThreadMutex s_sync;
+	static std::auto_ptr<AsyncFileIo> s_instance;
+
+	mutable util::ThreadMutex m_sync;
+	TStrands m_strands;
+	size_t m_pending;
+
+	/// Jobs are queued to a completion port, which wakes the threads
+	HANDLE m_port;
+
+	/// Counts free slots of the queue
+	HANDLE m_slots;
+
+	/// Is set while no jobs are pending
+	HANDLE m_idle;
+
+	std::vector<HANDLE> m_threads;
+};
+
+} // namespace util
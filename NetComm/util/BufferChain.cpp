@@ -0,0 +1,307 @@
+#include "BufferChain.hpp"
+#include "Error.hpp"
+
+#include <cstring>
+
+namespace util {
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// BufferBlock
+
+BufferBlock::BufferBlock(size_t capacity)
+: m_data(0 < capacity ? new unsigned char[capacity] : 0),
+  m_size(0),
+  m_capacity(capacity),
+  m_owned(true)
+{
+}
+
+BufferBlock::BufferBlock(unsigned char* data, size_t size)
+: m_data(data),
+  m_size(size),
+  m_capacity(size),
+  m_owned(false)
+{
+}
+
+BufferBlock::BufferBlock(unsigned char* data, size_t size, size_t capacity)
+: m_data(data),
+  m_size(size),
+  m_capacity(capacity),
+  m_owned(false)
+{
+	assert(size <= capacity);
+}
+
+BufferBlock::~BufferBlock()
+{
+	if (m_owned)
+		delete [] m_data;
+}
+
+const unsigned char*
+BufferBlock::data() const
+{
+	return m_data;
+}
+
+size_t
+BufferBlock::size() const
+{
+	return m_size;
+}
+
+size_t
+BufferBlock::capacity() const
+{
+	return m_capacity;
+}
+
+unsigned char*
+BufferBlock::tail()
+{
+	return m_data + m_size;
+}
+
+size_t
+BufferBlock::tailSize() const
+{
+	return m_capacity - m_size;
+}
+
+void
+BufferBlock::commit(size_t size)
+{
+	if (size > tailSize())
+		throw util::Error("Buffer block overflow");
+
+	m_size += size;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// BufferChain
+
+BufferChain::BufferChain()
+: m_size(0)
+{
+}
+
+BufferChain::BufferChain(const TBufferBlockPtr& block)
+: m_size(0)
+{
+	chkptr(block.get());
+	append(block, 0, block->size());
+}
+
+BufferChain::BufferChain(const TBufferBlockPtr& block, size_t offset, size_t size)
+: m_size(0)
+{
+	append(block, offset, size);
+}
+
+BufferChain
+BufferChain::copy(const void* data, size_t size)
+{
+	BufferChain chain;
+	if (0 < size)
+	{
+		TBufferBlockPtr block = std::make_shared<BufferBlock>(size);
+		memcpy(block->tail(), data, size);
+		block->commit(size);
+
+		chain.append(block, 0, size);
+	}
+
+	return chain;
+}
+
+size_t
+BufferChain::size() const
+{
+	return m_size;
+}
+
+bool
+BufferChain::empty() const
+{
+	return 0 == m_size;
+}
+
+void
+BufferChain::clear()
+{
+	m_segments.clear();
+	m_size = 0;
+}
+
+size_t
+BufferChain::segmentCount() const
+{
+	return m_segments.size();
+}
+
+const BufferChain::Segment&
+BufferChain::segment(size_t index) const
+{
+	assert(index < m_segments.size());
+	return m_segments[index];
+}
+
+void
+BufferChain::append(const TBufferBlockPtr& block, size_t offset, size_t size)
+{
+	chkptr(block.get());
+
+	if (offset > block->size() || size > block->size() - offset)
+		throw util::Error("Buffer slice is out of range");
+
+	appendSegment(block, offset, size);
+}
+
+void
+BufferChain::appendSegment(const TBufferBlockPtr& block, size_t offset, size_t size)
+{
+	if (0 == size)
+		return;
+
+	// Adjacent slices of the same block are merged, e.g. when a socket fills a block by several reads
+	if (!m_segments.empty())
+	{
+		Segment& last = m_segments.back();
+		if (last.block == block && last.offset + last.size == offset)
+		{
+			last.size += size;
+			m_size += size;
+			return;
+		}
+	}
+
+	m_segments.push_back(Segment(block, offset, size));
+	m_size += size;
+}
+
+void
+BufferChain::append(const Segment& segment, size_t offset, size_t size)
+{
+	if (offset > segment.size || size > segment.size - offset)
+		throw util::Error("Buffer slice is out of range");
+
+	appendSegment(segment.block, segment.offset + offset, size);
+}
+
+void
+BufferChain::append(const BufferChain& chain)
+{
+	// Chain may be appended to itself
+	TSegments segments = chain.m_segments;
+	for (TSegments::const_iterator ii = segments.begin(); ii != segments.end(); ++ii)
+		appendSegment(ii->block, ii->offset, ii->size);
+}
+
+BufferChain
+BufferChain::slice(size_t offset, size_t size) const
+{
+	if (offset > m_size || size > m_size - offset)
+		throw util::Error("Buffer slice is out of range");
+
+	BufferChain chain;
+	for (TSegments::const_iterator ii = m_segments.begin(); ii != m_segments.end() && 0 < size; ++ii)
+	{
+		if (offset >= ii->size)
+		{
+			offset -= ii->size;
+			continue;
+		}
+
+		size_t cb = ii->size - offset;
+		if (cb > size)
+			cb = size;
+
+		chain.appendSegment(ii->block, ii->offset + offset, cb);
+
+		offset = 0;
+		size -= cb;
+	}
+
+	return chain;
+}
+
+void
+BufferChain::trimFront(size_t size)
+{
+	if (size > m_size)
+		throw util::Error("Buffer slice is out of range");
+
+	TSegments::iterator ii = m_segments.begin();
+	m_size -= size;
+
+	while (0 < size)
+	{
+		if (size < ii->size)
+		{
+			ii->offset += size;
+			ii->size -= size;
+			break;
+		}
+
+		size -= ii->size;
+		++ii;
+	}
+
+	m_segments.erase(m_segments.begin(), ii);
+}
+
+void
+BufferChain::copyTo(void* dst, size_t offset, size_t size) const
+{
+	if (offset > m_size || size > m_size - offset)
+		throw util::Error("Buffer slice is out of range");
+
+	unsigned char* p = static_cast<unsigned char*>(dst);
+	for (TSegments::const_iterator ii = m_segments.begin(); ii != m_segments.end() && 0 < size; ++ii)
+	{
+		if (offset >= ii->size)
+		{
+			offset -= ii->size;
+			continue;
+		}
+
+		size_t cb = ii->size - offset;
+		if (cb > size)
+			cb = size;
+
+		memcpy(p, ii->data() + offset, cb);
+
+		p += cb;
+		offset = 0;
+		size -= cb;
+	}
+}
+
+void
+BufferChain::copyTo(std::vector<unsigned char>& dst) const
+{
+	for (TSegments::const_iterator ii = m_segments.begin(); ii != m_segments.end(); ++ii)
+		dst.insert(dst.end(), ii->data(), ii->data() + ii->size);
+}
+
+const unsigned char*
+BufferChain::coalesce()
+{
+	if (m_segments.empty())
+		return 0;
+
+	if (1 < m_segments.size())
+	{
+		TBufferBlockPtr block = std::make_shared<BufferBlock>(m_size);
+		copyTo(block->tail(), 0, m_size);
+		block->commit(m_size);
+
+		m_segments.clear();
+		m_segments.push_back(Segment(block, 0, m_size));
+	}
+
+	return m_segments.front().data();
+}
+
+} // namespace util
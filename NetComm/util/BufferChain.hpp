@@ -0,0 +1,135 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace util {
+
+/**
+ * Reference counted block of memory shared by buffer chains.
+ * Bytes before size() are committed and never change, since chains may refer to them.
+ * The tail after size() may be filled by the owner of the block and then committed.
+ */
+class BufferBlock
+{
+public:
+	explicit BufferBlock(size_t capacity);
+	virtual ~BufferBlock();
+
+	/// Committed bytes, subclasses may provide them on demand
+	virtual const unsigned char* data() const;
+	size_t size() const;
+
+	size_t capacity() const;
+
+	/// Free tail of the block, must not be written once the block is shared by other threads
+	unsigned char* tail();
+	size_t tailSize() const;
+
+	/// Appends size bytes written to the tail to the committed bytes
+	void commit(size_t size);
+
+protected:
+	/// Lets subclasses provide memory they own (e.g. a mapped file view), all of it is committed
+	BufferBlock(unsigned char* data, size_t size);
+
+	/// Lets subclasses provide memory to be filled (e.g. a pooled buffer), size bytes are committed
+	BufferBlock(unsigned char* data, size_t size, size_t capacity);
+
+private:
+	BufferBlock(const BufferBlock&);
+	BufferBlock& operator =(const BufferBlock&);
+
+	unsigned char* m_data;
+	size_t m_size;
+	size_t m_capacity;
+	bool m_owned;
+};
+
+typedef std::shared_ptr<BufferBlock> TBufferBlockPtr;
+
+/**
+ * Immutable sequence of bytes made of slices of shared blocks.
+ * Copying, slicing and appending chains share blocks rather than copy bytes,
+ *	so data may pass from a file through messages to a socket and back without being copied.
+ */
+class BufferChain
+{
+public:
+	/// Slice of a block
+	struct Segment
+	{
+		Segment(const TBufferBlockPtr& block_, size_t offset_, size_t size_)
+		: block(block_),
+		  offset(offset_),
+		  size(size_)
+		{}
+
+		const unsigned char* data() const
+		{
+			return block->data() + offset;
+		}
+
+		TBufferBlockPtr block;
+		size_t offset;
+		size_t size;
+	};
+
+	BufferChain();
+
+	/// Refers to committed bytes of a block
+	explicit BufferChain(const TBufferBlockPtr& block);
+
+	/// Refers to a part of committed bytes of a block
+	BufferChain(const TBufferBlockPtr& block, size_t offset, size_t size);
+
+	/// Copies bytes to a new block
+	static BufferChain copy(const void* data, size_t size);
+
+	size_t size() const;
+	bool empty() const;
+	void clear();
+
+	size_t segmentCount() const;
+	const Segment& segment(size_t index) const;
+
+	/// Appends a slice of a block
+	void append(const TBufferBlockPtr& block, size_t offset, size_t size);
+
+	/// Appends a part of a segment of another chain
+	void append(const Segment& segment, size_t offset, size_t size);
+
+	/// Appends segments of another chain, bytes are shared
+	void append(const BufferChain& chain);
+
+	/// Returns a chain referring to size bytes starting at offset
+	BufferChain slice(size_t offset, size_t size) const;
+
+	/// Drops size bytes from the beginning of the chain
+	void trimFront(size_t size);
+
+	/// Copies size bytes starting at offset to dst
+	void copyTo(void* dst, size_t offset, size_t size) const;
+
+	/// Appends all bytes to a vector
+	void copyTo(std::vector<unsigned char>& dst) const;
+
+	/**
+	 * Returns bytes as a contiguous buffer.
+	 * Segments are merged into a new block if there are several of them, NULL is returned for an empty chain.
+	 */
+	const unsigned char* coalesce();
+
+private:
+	/// Bounds are not checked against the block, since its owner may be committing to it meanwhile
+	void appendSegment(const TBufferBlockPtr& block, size_t offset, size_t size);
+
+	typedef std::vector<Segment> TSegments;
+	TSegments m_segments;
+	size_t m_size;
+};
+
+} // namespace util
@@ -0,0 +1,117 @@
+#include "BufferPool.hpp"
+#include "ScopedLock.hpp"
+#include "ThreadMutex.hpp"
+
+namespace util {
+
+struct BufferPool::State
+{
+	State(size_t blockSize_, size_t maxBlocks_)
+	: blockSize(blockSize_),
+	  maxBlocks(maxBlocks_),
+	  inUse(0)
+	{}
+
+	~State()
+	{
+		for (size_t i = 0; i < free.size(); ++i)
+			delete [] free[i];
+	}
+
+	ThreadMutex sync;
+	size_t blockSize;
+	size_t maxBlocks;
+	size_t inUse;
+
+	/// Memory of released blocks
+	std::vector<unsigned char*> free;
+};
+
+namespace {
+
+/// Returns its memory to the pool rather than frees it
+class PooledBlock : public BufferBlock
+{
+public:
+	PooledBlock(const std::shared_ptr<BufferPool::State>& state, unsigned char* data)
+	: BufferBlock(data, 0, state->blockSize),
+	  m_state(state),
+	  m_memory(data)
+	{
+	}
+
+	~PooledBlock()
+	{
+		ScopedLock lock(&m_state->sync);
+		m_state->free.push_back(m_memory);
+		--m_state->inUse;
+	}
+
+private:
+	std::shared_ptr<BufferPool::State> m_state;
+	unsigned char* m_memory;
+};
+
+} // namespace
+
+BufferPool::BufferPool(size_t blockSize, size_t maxBlocks)
+: m_state(std::make_shared<State>(blockSize, maxBlocks))
+{
+	assert(0 < blockSize);
+}
+
+TBufferBlockPtr
+BufferPool::acquire()
+{
+	unsigned char* data = 0;
+	{
+		ScopedLock lock(&m_state->sync);
+		if (m_state->inUse >= m_state->maxBlocks)
+			return TBufferBlockPtr();
+
+		if (!m_state->free.empty())
+		{
+			data = m_state->free.back();
+			m_state->free.pop_back();
+		}
+
+		++m_state->inUse;
+	}
+
+	if (!data)
+	{
+		try
+		{
+			data = new unsigned char[m_state->blockSize];
+		}
+		catch (...)
+		{
+			ScopedLock lock(&m_state->sync);
+			--m_state->inUse;
+			throw;
+		}
+	}
+
+	return std::make_shared<PooledBlock>(m_state, data);
+}
+
+size_t
+BufferPool::blockSize() const
+{
+	return m_state->blockSize;
+}
+
+size_t
+BufferPool::maxBlocks() const
+{
+	return m_state->maxBlocks;
+}
+
+size_t
+BufferPool::blocksInUse() const
+{
+	ScopedLock lock(&m_state->sync);
+	return m_state->inUse;
+}
+
+} // namespace util
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "BufferChain.hpp"
+
+namespace util {
+
+/**
+ * Pool of equally sized blocks with a cap on memory.
+ * A block returns to the pool once no chain refers to it, so it may outlive the pool.
+ */
+class BufferPool
+{
+public:
+	BufferPool(size_t blockSize, size_t maxBlocks);
+
+	/// Returns an empty block, NULL if maxBlocks blocks are in use
+	TBufferBlockPtr acquire();
+
+	size_t blockSize() const;
+	size_t maxBlocks() const;
+
+	/// Number of blocks referred to by chains
+	size_t blocksInUse() const;
+
+	/// Is shared by the pool and its blocks
+	struct State;
+
+private:
+	std::shared_ptr<State> m_state;
+};
+
+} // namespace util
@@ -0,0 +1,192 @@
+#include "ChunkManifest.hpp"
+#include "BufferChain.hpp"
+#include "ContentChunker.hpp"
+#include "FileHandle.hpp"
+#include "MemoryStream.hpp"
+#include "XxHash64.hpp"
+
+#include <cstring>
+
+namespace util {
+
+namespace {
+
+/// Seed of the second hash of a chunk
+const T_UI8 kCheckSeed = 0x9E3779B97F4A7C15ULL;
+
+/// File is read in pieces of about this size
+const size_t kReadSize = 4 * 1024 * 1024;
+
+} // namespace
+
+ChunkId
+ChunkId::compute(const void* buf, size_t size)
+{
+	ChunkId id;
+	id.hash = XxHash64::compute(buf, size);
+	id.check = XxHash64::compute(buf, size, kCheckSeed);
+	return id;
+}
+
+ChunkId
+ChunkId::compute(const BufferChain& data)
+{
+	XxHash64 hash;
+	XxHash64 check(kCheckSeed);
+	for (size_t i = 0; i < data.segmentCount(); ++i)
+	{
+		const BufferChain::Segment& segment = data.segment(i);
+		hash.update(segment.data(), segment.size);
+		check.update(segment.data(), segment.size);
+	}
+
+	ChunkId id;
+	id.hash = hash.digest();
+	id.check = check.digest();
+	return id;
+}
+
+ChunkManifest::ChunkManifest()
+: m_fileSize(0),
+  m_fileHash(XxHash64().digest())
+{
+}
+
+bool
+ChunkManifest::compute(const FileHandle& file)
+{
+	LARGE_INTEGER fileSize;
+	if (!file.isOpen() || !::GetFileSizeEx(file.get(), &fileSize))
+		return false;
+
+	m_entries.clear();
+	m_fileSize = fileSize.QuadPart;
+
+	// Chunks are cut once the buffer holds the largest chunk, or at the end of the file
+	std::vector<unsigned char> buf(kReadSize + ContentChunker::kMaxSize);
+	size_t buffered = 0;
+	__int64 readOffset = 0;
+	XxHash64 fileHash;
+
+	for (;;)
+	{
+		size_t cb = buf.size() - buffered;
+		if (static_cast<__int64>(cb) > m_fileSize - readOffset)
+			cb = static_cast<size_t>(m_fileSize - readOffset);
+
+		if (0 < cb)
+		{
+			if (!file.readAt(readOffset, &buf[buffered], cb))
+				return false;
+
+			fileHash.update(&buf[buffered], cb);
+			buffered += cb;
+			readOffset += cb;
+		}
+
+		bool end = readOffset == m_fileSize;
+		size_t offset = 0;
+		while (offset < buffered && (end || buffered - offset >= ContentChunker::kMaxSize))
+		{
+			ManifestEntry entry;
+			entry.size = static_cast<T_UI4>(ContentChunker::cut(&buf[offset], buffered - offset));
+			entry.id = ChunkId::compute(&buf[offset], entry.size);
+
+			if (m_entries.size() == kMaxEntryCount)
+				return false;
+			m_entries.push_back(entry);
+
+			offset += entry.size;
+		}
+
+		if (end)
+			break;
+
+		memmove(&buf[0], &buf[offset], buffered - offset);
+		buffered -= offset;
+	}
+
+	m_fileHash = fileHash.digest();
+	return true;
+}
+
+size_t
+ChunkManifest::entryCount() const
+{
+	return m_entries.size();
+}
+
+const ManifestEntry&
+ChunkManifest::entry(size_t index) const
+{
+	assert(index < m_entries.size());
+	return m_entries[index];
+}
+
+__int64
+ChunkManifest::fileSize() const
+{
+	return m_fileSize;
+}
+
+T_UI8
+ChunkManifest::fileHash() const
+{
+	return m_fileHash;
+}
+
+void
+ChunkManifest::save(MemoryStream& out) const
+{
+	out << m_fileSize;
+	out << m_fileHash;
+	out << static_cast<T_UI4>(m_entries.size());
+
+	for (std::vector<ManifestEntry>::const_iterator ii = m_entries.begin(); ii != m_entries.end(); ++ii)
+	{
+		out << ii->id.hash;
+		out << ii->id.check;
+		out << ii->size;
+	}
+}
+
+bool
+ChunkManifest::load(MemoryStream& in)
+{
+	__int64 fileSize = 0;
+	T_UI8 fileHash = 0;
+	T_UI4 entryCount = 0;
+	in >> fileSize;
+	in >> fileHash;
+	in >> entryCount;
+
+	m_entries.clear();
+	if (in.fail() || fileSize < 0 || entryCount > kMaxEntryCount)
+		return false;
+
+	m_entries.resize(entryCount);
+
+	__int64 size = 0;
+	bool valid = true;
+	for (std::vector<ManifestEntry>::iterator ii = m_entries.begin(); ii != m_entries.end() && valid; ++ii)
+	{
+		in >> ii->id.hash;
+		in >> ii->id.check;
+		in >> ii->size;
+
+		valid = !in.fail() && 0 < ii->size && ii->size <= ContentChunker::kMaxSize;
+		size += ii->size;
+	}
+
+	if (!valid || size != fileSize)
+	{
+		m_entries.clear();
+		return false;
+	}
+
+	m_fileSize = fileSize;
+	m_fileHash = fileHash;
+	return true;
+}
+
+} // namespace util
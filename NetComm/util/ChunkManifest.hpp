@@ -0,0 +1,79 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace util {
+
+class BufferChain;
+class FileHandle;
+class MemoryStream;
+
+/// Identifies chunk content by two XXH64 hashes of different seeds, so that distinct chunks practically never collide
+struct ChunkId
+{
+	ChunkId()
+	: hash(0),
+	  check(0)
+	{}
+
+	static ChunkId compute(const void* buf, size_t size);
+	static ChunkId compute(const BufferChain& data);
+
+	bool operator ==(const ChunkId& other) const { return hash == other.hash && check == other.check; }
+	bool operator !=(const ChunkId& other) const { return !(*this == other); }
+	bool operator <(const ChunkId& other) const { return hash < other.hash || (hash == other.hash && check < other.check); }
+
+	T_UI8 hash;
+	T_UI8 check;
+};
+
+/// Chunk of a file, chunks follow each other from the beginning of the file
+struct ManifestEntry
+{
+	ManifestEntry()
+	: size(0)
+	{}
+
+	ChunkId id;
+	T_UI4 size;
+};
+
+/**
+ * List of chunks a file is cut into by content (see ContentChunker), the sender of a file offers it
+ *	and the receiver requests only the chunks it does not store (see ChunkStore).
+ * Also carries size and XXH64 of the whole file, which verify the file put together from the chunks.
+ */
+class ChunkManifest
+{
+public:
+	ChunkManifest();
+
+	/// Cuts a file into chunks, returns false if it could not be read or has too many chunks
+	bool compute(const FileHandle& file);
+
+	size_t entryCount() const;
+	const ManifestEntry& entry(size_t index) const;
+	__int64 fileSize() const;
+	T_UI8 fileHash() const;
+
+	void save(MemoryStream& out) const;
+
+	/// Returns false if the manifest is malformed, e.g. its chunks do not add up to the file size
+	bool load(MemoryStream& in);
+
+	/// Larger files are sent as they are, so that a manifest fits a frame
+	static const size_t kMaxEntryCount = 1024 * 1024;
+
+private:
+	std::vector<ManifestEntry> m_entries;
+	__int64 m_fileSize;
+	T_UI8 m_fileHash;
+};
+
+typedef std::shared_ptr<const ChunkManifest> TChunkManifestPtr;
+
+} // namespace util
@@ -0,0 +1,328 @@
+#include "ChunkStore.hpp"
+#include "BufferChain.hpp"
+#include "FileHandle.hpp"
+#include "ScopedLock.hpp"
+
+#include <algorithm>
+
+namespace util {
+
+namespace {
+
+/// Chunk files are named by 32 hex digits of their IDs
+const size_t kNameLength = 32;
+
+/// Chunk is written under this suffix and renamed once it is complete, leftovers of a crash are deleted
+const wchar_t* const kTempSuffix = L".part";
+
+const wchar_t* const kHexDigits = L"0123456789abcdef";
+
+void
+appendHex(std::wstring& out, T_UI8 value)
+{
+	for (int shift = 60; 0 <= shift; shift -= 4)
+		out += kHexDigits[(value >> shift) & 0xF];
+}
+
+bool
+parseHex(const wchar_t* p, T_UI8& value)
+{
+	value = 0;
+	for (size_t i = 0; i < 16; ++i)
+	{
+		const wchar_t* digit = wcschr(kHexDigits, p[i]);
+		if (0 == p[i] || 0 == digit)
+			return false;
+
+		value = (value << 4) | static_cast<T_UI8>(digit - kHexDigits);
+	}
+
+	return true;
+}
+
+} // namespace
+
+ChunkStore::ChunkStore()
+: m_capacity(kDefaultCapacity),
+  m_size(0)
+{
+}
+
+bool
+ChunkStore::open(const std::wstring& dir, __int64 capacity)
+{
+	close();
+
+	// Chunks are ordered by the time they were written, the oldest are evicted first
+	typedef std::pair<T_UI8, std::pair<ChunkId, __int64> > TFound;
+	std::vector<TFound> found;
+	std::vector<std::wstring> removed;
+
+	WIN32_FIND_DATAW fd;
+	memset(&fd, 0, sizeof(fd));
+
+	HANDLE h = ::FindFirstFileW((dir + L"\\*").c_str(), &fd);
+	if (INVALID_HANDLE_VALUE == h)
+		return false;
+
+	do {
+		if (0 != (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			continue;
+
+		ChunkId id;
+		if (!parseName(fd.cFileName, id))
+		{
+			std::wstring name = fd.cFileName;
+			if (name.size() > wcslen(kTempSuffix) && 0 == name.compare(name.size() - wcslen(kTempSuffix), std::wstring::npos, kTempSuffix))
+				removed.push_back(dir + L"\\" + name);
+			continue;
+		}
+
+		T_UI8 written = (static_cast<T_UI8>(fd.ftLastWriteTime.dwHighDateTime) << 32) | fd.ftLastWriteTime.dwLowDateTime;
+		__int64 size = (static_cast<__int64>(fd.nFileSizeHigh) << 32) | fd.nFileSizeLow;
+		found.push_back(TFound(written, std::make_pair(id, size)));
+	} while (::FindNextFileW(h, &fd));
+
+	::FindClose(h);
+	std::sort(found.begin(), found.end());
+
+	{
+		ScopedLock lock(&m_sync);
+
+		m_dir = dir;
+		m_capacity = capacity;
+
+		for (std::vector<TFound>::const_iterator ii = found.begin(); ii != found.end(); ++ii)
+		{
+			m_entries.push_front(ii->second);
+			m_index[ii->second.first] = m_entries.begin();
+			m_size += ii->second.second;
+		}
+
+		evict(removed);
+	}
+
+	removeFiles(removed);
+	return true;
+}
+
+void
+ChunkStore::close()
+{
+	ScopedLock lock(&m_sync);
+
+	m_dir.clear();
+	m_size = 0;
+	m_entries.clear();
+	m_index.clear();
+}
+
+bool
+ChunkStore::isOpen() const
+{
+	ScopedLock lock(&m_sync);
+	return !m_dir.empty();
+}
+
+void
+ChunkStore::setCapacity(__int64 capacity)
+{
+	std::vector<std::wstring> removed;
+	{
+		ScopedLock lock(&m_sync);
+
+		m_capacity = capacity;
+		evict(removed);
+	}
+
+	removeFiles(removed);
+}
+
+__int64
+ChunkStore::capacity() const
+{
+	ScopedLock lock(&m_sync);
+	return m_capacity;
+}
+
+__int64
+ChunkStore::size() const
+{
+	ScopedLock lock(&m_sync);
+	return m_size;
+}
+
+size_t
+ChunkStore::count() const
+{
+	ScopedLock lock(&m_sync);
+	return m_index.size();
+}
+
+bool
+ChunkStore::contains(const ChunkId& id)
+{
+	ScopedLock lock(&m_sync);
+
+	TIndex::iterator ii = m_index.find(id);
+	if (ii == m_index.end())
+		return false;
+
+	m_entries.splice(m_entries.begin(), m_entries, ii->second);
+	return true;
+}
+
+bool
+ChunkStore::get(const ChunkId& id, BufferChain& data)
+{
+	std::wstring path;
+	__int64 size = 0;
+	{
+		ScopedLock lock(&m_sync);
+
+		TIndex::iterator ii = m_index.find(id);
+		if (ii == m_index.end())
+			return false;
+
+		m_entries.splice(m_entries.begin(), m_entries, ii->second);
+		path = pathOf(id);
+		size = ii->second->second;
+	}
+
+	// Chunk evicted meanwhile fails to open or to read
+	TBufferBlockPtr block = std::make_shared<BufferBlock>(static_cast<size_t>(size));
+
+	FileHandle file;
+	bool ok = file.openRead(path) && file.readAt(0, block->tail(), block->tailSize());
+	file.close();
+
+	if (ok)
+	{
+		block->commit(block->tailSize());
+		ok = ChunkId::compute(block->data(), block->size()) == id;
+	}
+
+	if (!ok)
+	{
+		std::vector<std::wstring> removed;
+		{
+			ScopedLock lock(&m_sync);
+			drop(id, removed);
+		}
+
+		removeFiles(removed);
+		return false;
+	}
+
+	data.clear();
+	data.append(block, 0, block->size());
+	return true;
+}
+
+bool
+ChunkStore::put(const ChunkId& id, const BufferChain& data)
+{
+	std::wstring path;
+	{
+		ScopedLock lock(&m_sync);
+
+		if (m_dir.empty())
+			return false;
+		if (0 != m_index.count(id) || 0 != m_pending.count(id))
+			return true;
+
+		m_pending.insert(id);
+		path = pathOf(id);
+	}
+
+	// Chunk gets its name once it is complete, so a chunk file is never partial
+	std::wstring tempPath = path + kTempSuffix;
+
+	FileHandle file;
+	bool ok = file.openWrite(tempPath);
+
+	__int64 offset = 0;
+	for (size_t i = 0; ok && i < data.segmentCount(); ++i)
+	{
+		const BufferChain::Segment& segment = data.segment(i);
+		ok = file.writeAt(offset, segment.data(), segment.size);
+		offset += segment.size;
+	}
+
+	file.close();
+
+	if (ok)
+		ok = FALSE != ::MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+	else
+		::DeleteFileW(tempPath.c_str());
+
+	std::vector<std::wstring> removed;
+	{
+		ScopedLock lock(&m_sync);
+
+		m_pending.erase(id);
+
+		// Store may have been closed or reopened meanwhile
+		if (ok && path == pathOf(id) && 0 == m_index.count(id))
+		{
+			m_entries.push_front(std::make_pair(id, static_cast<__int64>(data.size())));
+			m_index[id] = m_entries.begin();
+			m_size += data.size();
+
+			evict(removed);
+		}
+	}
+
+	removeFiles(removed);
+	return ok;
+}
+
+std::wstring
+ChunkStore::pathOf(const ChunkId& id) const
+{
+	std::wstring path = m_dir;
+	path += L"\\";
+	appendHex(path, id.hash);
+	appendHex(path, id.check);
+	return path;
+}
+
+bool
+ChunkStore::parseName(const std::wstring& name, ChunkId& id)
+{
+	return kNameLength == name.size() && parseHex(name.c_str(), id.hash) && parseHex(name.c_str() + 16, id.check);
+}
+
+void
+ChunkStore::drop(const ChunkId& id, std::vector<std::wstring>& removed)
+{
+	TIndex::iterator ii = m_index.find(id);
+	if (ii == m_index.end())
+		return;
+
+	removed.push_back(pathOf(id));
+
+	m_size -= ii->second->second;
+	m_entries.erase(ii->second);
+	m_index.erase(ii);
+}
+
+void
+ChunkStore::evict(std::vector<std::wstring>& removed)
+{
+	while (m_size > m_capacity && !m_entries.empty())
+	{
+		// ID is copied, since the entry it is in is erased
+		ChunkId id = m_entries.back().first;
+		drop(id, removed);
+	}
+}
+
+void
+ChunkStore::removeFiles(const std::vector<std::wstring>& removed)
+{
+	for (std::vector<std::wstring>::const_iterator ii = removed.begin(); ii != removed.end(); ++ii)
+		::DeleteFileW(ii->c_str());
+}
+
+} // namespace util
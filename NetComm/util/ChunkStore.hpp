@@ -0,0 +1,93 @@
+#pragma once
+
+#include <windows.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ChunkManifest.hpp"
+#include "ThreadMutex.hpp"
+
+namespace util {
+
+class BufferChain;
+
+/**
+ * Content addressed store of file chunks (see ChunkManifest), which outlives transfers,
+ *	so a chunk received from one endpoint is not received again from any other.
+ * Every chunk is a file named by its ID in the store directory. The store is bounded by the total size
+ *	of its chunks, the least recently used ones are evicted. Chunks are verified by their IDs as they are read.
+ * May be used by several threads at once, disk I/O is done without the store locked.
+ */
+class ChunkStore
+{
+public:
+	static const __int64 kDefaultCapacity = 1024 * 1024 * 1024;
+
+	ChunkStore();
+
+	/**
+	 * Opens a store in an existing directory. Chunks stored before are kept,
+	 *	the ones written last are treated as the most recently used ones.
+	 */
+	bool open(const std::wstring& dir, __int64 capacity = kDefaultCapacity);
+	void close();
+	bool isOpen() const;
+
+	/// Evicts chunks at once if the store is larger than the new capacity
+	void setCapacity(__int64 capacity);
+	__int64 capacity() const;
+
+	/// Total size and number of stored chunks
+	__int64 size() const;
+	size_t count() const;
+
+	/// Returns true if a chunk is stored, it becomes the most recently used one, so it is not evicted soon
+	bool contains(const ChunkId& id);
+
+	/// Reads a chunk, a chunk which could not be read or does not match its ID is dropped
+	bool get(const ChunkId& id, BufferChain& data);
+
+	/// Stores a chunk unless it is stored already, returns false if it could not be written
+	bool put(const ChunkId& id, const BufferChain& data);
+
+private:
+	ChunkStore(const ChunkStore&);
+	ChunkStore& operator =(const ChunkStore&);
+
+	std::wstring pathOf(const ChunkId& id) const;
+
+	/// Returns true if name of a file is an ID of a chunk
+	static bool parseName(const std::wstring& name, ChunkId& id);
+
+	/// Drops a chunk from the index, its file is collected to be deleted without the store locked
+	void drop(const ChunkId& id, std::vector<std::wstring>& removed);
+
+	/// Drops the least recently used chunks over the capacity
+	void evict(std::vector<std::wstring>& removed);
+
+	static void removeFiles(const std::vector<std::wstring>& removed);
+
+private:
+	/// Chunks with sizes, the most recently used one in front
+	typedef std::list<std::pair<ChunkId, __int64> > TEntries;
+	typedef std::map<ChunkId, TEntries::iterator> TIndex;
+
+	mutable ThreadMutex m_sync;
+	std::wstring m_dir;
+	__int64 m_capacity;
+	__int64 m_size;
+	TEntries m_entries;
+	TIndex m_index;
+
+	/// Chunks being written, a chunk received by two transfers at once is written once
+	std::set<ChunkId> m_pending;
+};
+
+typedef std::shared_ptr<ChunkStore> TChunkStorePtr;
+
+} // namespace util
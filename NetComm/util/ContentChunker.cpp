@@ -0,0 +1,173 @@
+#include "ContentChunker.hpp"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#define KCHUNKER_SSE2
+#endif
+
+namespace util {
+
+namespace {
+
+/// Masks of the top hash bits, which depend on all 64 bytes. 2 bits more and less than the average size takes.
+const T_UI8 kMaskSmall = ~0ULL << (64 - 18);
+const T_UI8 kMaskLarge = ~0ULL << (64 - 14);
+
+/// Bytes of the window of the gear hash, a byte is shifted out of the hash after this many more bytes
+const size_t kWindowSize = 64;
+
+/// Random values of bytes, both endpoints cut the same data the same way, so the table never changes
+struct GearTable
+{
+	GearTable()
+	{
+		// SplitMix64 with a fixed seed
+		T_UI8 state = 0x6A09E667F3BCC908ULL;
+		for (size_t i = 0; i < 256; ++i)
+		{
+			state += 0x9E3779B97F4A7C15ULL;
+
+			T_UI8 z = state;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			table[i] = z ^ (z >> 31);
+		}
+	}
+
+	T_UI8 table[256];
+};
+
+const GearTable s_gear;
+
+/**
+ * Returns hash of the bytes before offset. Hashing starts at origin,
+ *	so bytes before it and the bytes shifted out of the window don't affect the hash.
+ */
+T_UI8
+hashBefore(const unsigned char* p, size_t origin, size_t offset)
+{
+	size_t from = offset - origin > kWindowSize ? offset - kWindowSize : origin;
+
+	T_UI8 hash = 0;
+	for (size_t i = from; i < offset; ++i)
+		hash = (hash << 1) + s_gear.table[p[i]];
+	return hash;
+}
+
+/// Returns offset of the first byte within [from, to) the hash of which has the masked bits clear, to if there is none
+size_t
+scanScalar(const unsigned char* p, size_t origin, size_t from, size_t to, T_UI8 mask)
+{
+	T_UI8 hash = hashBefore(p, origin, from);
+	for (size_t i = from; i < to; ++i)
+	{
+		hash = (hash << 1) + s_gear.table[p[i]];
+		if (0 == (hash & mask))
+			return i;
+	}
+
+	return to;
+}
+
+#ifdef KCHUNKER_SSE2
+
+/// Bytes hashed by each lane per step, the second lane is wasted once the first one finds a boundary
+const size_t kLaneSize = 4096;
+
+/**
+ * Scans two adjacent ranges of kLaneSize bytes at once, each in a 64-bit lane.
+ * The second lane starts with the hash of the window before its range, so its hashes are those of a sequential scan.
+ * Boundary found by the first lane precedes any found by the second one.
+ */
+size_t
+scan(const unsigned char* p, size_t origin, size_t from, size_t to, T_UI8 mask)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i vMask = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&mask));
+	const __m128i vMasks = _mm_unpacklo_epi64(vMask, vMask);
+
+	T_UI8 hash = hashBefore(p, origin, from);
+	size_t i = from;
+
+	for (; 2 * kLaneSize <= to - i; i += 2 * kLaneSize)
+	{
+		const unsigned char* first = p + i;
+		const unsigned char* second = p + i + kLaneSize;
+
+		T_UI8 secondHash = hashBefore(p, origin, i + kLaneSize);
+		__m128i vHash = _mm_unpacklo_epi64(
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&hash)),
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&secondHash)));
+
+		size_t found = to;
+		for (size_t k = 0; k < kLaneSize; ++k)
+		{
+			__m128i gear = _mm_unpacklo_epi64(
+				_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&s_gear.table[first[k]])),
+				_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&s_gear.table[second[k]])));
+			vHash = _mm_add_epi64(_mm_slli_epi64(vHash, 1), gear);
+
+			// Lane is a boundary if both of its 32-bit halves are clear
+			int clear = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(vHash, vMasks), zero));
+			if (0x00FF == (clear & 0x00FF))
+				return i + k;
+			if (0xFF00 == (clear & 0xFF00) && to == found)
+				found = i + kLaneSize + k;
+		}
+
+		if (to != found)
+			return found;
+
+		// Hash of the second lane continues in the first one
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(&hash), _mm_unpackhi_epi64(vHash, vHash));
+	}
+
+	return scanScalar(p, origin, i, to, mask);
+}
+
+#else
+
+size_t
+scan(const unsigned char* p, size_t origin, size_t from, size_t to, T_UI8 mask)
+{
+	return scanScalar(p, origin, from, to, mask);
+}
+
+#endif
+
+typedef size_t (*TScan)(const unsigned char* p, size_t origin, size_t from, size_t to, T_UI8 mask);
+
+/// Boundaries are not looked for within the minimal size, which is not hashed either
+size_t
+cutWith(TScan scanner, const void* data, size_t size)
+{
+	if (size <= ContentChunker::kMinSize)
+		return size;
+
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	size_t end = size < ContentChunker::kMaxSize ? size : ContentChunker::kMaxSize;
+	size_t normal = end < ContentChunker::kAverageSize ? end : ContentChunker::kAverageSize;
+
+	size_t i = scanner(p, ContentChunker::kMinSize, ContentChunker::kMinSize, normal, kMaskSmall);
+	if (i < normal)
+		return i + 1;
+
+	i = scanner(p, ContentChunker::kMinSize, normal, end, kMaskLarge);
+	return i < end ? i + 1 : end;
+}
+
+} // namespace
+
+size_t
+ContentChunker::cut(const void* data, size_t size)
+{
+	return cutWith(scan, data, size);
+}
+
+size_t
+ContentChunker::cutScalar(const void* data, size_t size)
+{
+	return cutWith(scanScalar, data, size);
+}
+
+} // namespace util
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstddef>
+
+namespace util {
+
+/**
+ * Cuts data into chunks by content (FastCDC), so that an insertion or a removal moves
+ *	only the boundaries of the chunks around it and the rest of the chunks stay the same.
+ * A boundary follows a byte where the gear hash of the last 64 bytes has its masked bits clear.
+ * The mask is stricter before the average size and looser after it, so chunk sizes gather around the average.
+ * Gear hashes of two distant ranges are computed by SSE2 at once, the cut points are the same as the scalar ones.
+ */
+class ContentChunker
+{
+public:
+	/**
+	 * Returns size of the chunk at the beginning of data.
+	 * Unless data end with the file, at least kMaxSize bytes are passed, so the chunk does not depend on the piece size.
+	 */
+	static size_t cut(const void* data, size_t size);
+
+	/// Scalar implementation of cut()
+	static size_t cutScalar(const void* data, size_t size);
+
+	static const size_t kMinSize = 16 * 1024;
+	static const size_t kAverageSize = 64 * 1024;
+	static const size_t kMaxSize = 256 * 1024;
+};
+
+} // namespace util
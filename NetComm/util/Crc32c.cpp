@@ -0,0 +1,177 @@
+#include "Crc32c.hpp"
+
+#include <cstring>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define KCRC32C_HARDWARE
+#endif
+
+namespace util {
+
+namespace {
+
+/// Reversed CRC32C polynomial
+const T_UI4 kPolynomial = 0x82F63B78;
+
+/// Lookup tables of the software implementation, processes 8 bytes per step
+struct Crc32cTables
+{
+	Crc32cTables()
+	{
+		for (T_UI4 i = 0; i < 256; ++i)
+		{
+			T_UI4 crc = i;
+			for (int j = 0; j < 8; ++j)
+				crc = (crc >> 1) ^ (kPolynomial & (0 - (crc & 1)));
+
+			table[0][i] = crc;
+		}
+
+		for (T_UI4 i = 0; i < 256; ++i)
+		{
+			for (int k = 1; k < 8; ++k)
+				table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+		}
+	}
+
+	T_UI4 table[8][256];
+};
+
+const Crc32cTables s_tables;
+
+T_UI4
+updateSoftware(T_UI4 crc, const unsigned char* p, size_t size)
+{
+	const T_UI4 (*t)[256] = s_tables.table;
+
+	while (0 < size && 0 != (reinterpret_cast<size_t>(p) & 7))
+	{
+		crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		--size;
+	}
+
+	while (8 <= size)
+	{
+		T_UI4 lo = 0;
+		T_UI4 hi = 0;
+		memcpy(&lo, p, sizeof(lo));
+		memcpy(&hi, p + sizeof(lo), sizeof(hi));
+
+		lo ^= crc;
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+			t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+
+		p += 8;
+		size -= 8;
+	}
+
+	while (0 < size--)
+		crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef KCRC32C_HARDWARE
+
+bool
+detectHardware()
+{
+	// SSE4.2 support is reported in bit 20 of ECX
+	int info[4] = { 0 };
+	__cpuid(info, 1);
+	return 0 != (info[2] & (1 << 20));
+}
+
+const bool s_hardware = detectHardware();
+
+T_UI4
+updateHardware(T_UI4 crc, const unsigned char* p, size_t size)
+{
+	while (0 < size && 0 != (reinterpret_cast<size_t>(p) & 7))
+	{
+		crc = _mm_crc32_u8(crc, *p++);
+		--size;
+	}
+
+#ifdef _M_X64
+	unsigned __int64 crc64 = crc;
+	while (8 <= size)
+	{
+		crc64 = _mm_crc32_u64(crc64, *reinterpret_cast<const unsigned __int64*>(p));
+		p += 8;
+		size -= 8;
+	}
+	crc = static_cast<T_UI4>(crc64);
+#endif // _M_X64
+
+	while (4 <= size)
+	{
+		crc = _mm_crc32_u32(crc, *reinterpret_cast<const T_UI4*>(p));
+		p += 4;
+		size -= 4;
+	}
+
+	while (0 < size--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+#endif // KCRC32C_HARDWARE
+
+} // namespace
+
+Crc32c::Crc32c()
+: m_crc(0xFFFFFFFF)
+{
+}
+
+void
+Crc32c::reset()
+{
+	m_crc = 0xFFFFFFFF;
+}
+
+void
+Crc32c::update(const void* buf, size_t size)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(buf);
+
+#ifdef KCRC32C_HARDWARE
+	if (s_hardware)
+	{
+		m_crc = updateHardware(m_crc, p, size);
+		return;
+	}
+#endif // KCRC32C_HARDWARE
+
+	m_crc = updateSoftware(m_crc, p, size);
+}
+
+T_UI4
+Crc32c::value() const
+{
+	return ~m_crc;
+}
+
+T_UI4
+Crc32c::compute(const void* buf, size_t size)
+{
+	Crc32c crc;
+	crc.update(buf, size);
+	return crc.value();
+}
+
+bool
+Crc32c::hardwareSupported()
+{
+#ifdef KCRC32C_HARDWARE
+	return s_hardware;
+#else
+	return false;
+#endif
+}
+
+} // namespace util
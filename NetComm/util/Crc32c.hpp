@@ -0,0 +1,37 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstddef>
+
+namespace util {
+
+/**
+ * CRC32C (Castagnoli) checksum.
+ * SSE4.2 crc32 instruction is used when CPU supports it, otherwise a table driven implementation is used.
+ */
+class Crc32c
+{
+public:
+	Crc32c();
+
+	/// Starts a new checksum
+	void reset();
+
+	/// Appends data to the checksum
+	void update(const void* buf, size_t size);
+
+	/// Returns checksum of data appended so far
+	T_UI4 value() const;
+
+	/// Returns checksum of a buffer
+	static T_UI4 compute(const void* buf, size_t size);
+
+	/// Returns true if the hardware implementation is used
+	static bool hardwareSupported();
+
+private:
+	T_UI4 m_crc;
+};
+
+} // namespace util
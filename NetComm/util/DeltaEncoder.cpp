@@ -0,0 +1,229 @@
+#include "DeltaEncoder.hpp"
+#include "FileHandle.hpp"
+#include "FileWriter.hpp"
+#include "RollingChecksum.hpp"
+#include "XxHash64.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace util {
+
+namespace {
+
+/// Copies are read from the basis in pieces of at most this size
+const size_t kCopyBufferSize = 1024 * 1024;
+
+size_t
+tagOf(T_UI4 weak)
+{
+	return (weak ^ (weak >> 16)) & 0xFFFF;
+}
+
+} // namespace
+
+DeltaEncoder::DeltaEncoder(const TDeltaSignaturePtr& basis)
+: m_basis(basis),
+  m_tags(0x10000, false),
+  m_position(0),
+  m_nextBlock(0)
+{
+	chkptr(basis.get());
+
+	m_index.reserve(basis->blockCount());
+	for (size_t i = 0; i < basis->blockCount(); ++i)
+	{
+		T_UI4 weak = basis->block(i).weak;
+		m_index.push_back(TIndexEntry(weak, static_cast<T_UI4>(i)));
+		m_tags[tagOf(weak)] = true;
+	}
+
+	std::sort(m_index.begin(), m_index.end());
+}
+
+void
+DeltaEncoder::encode(const BufferChain& data, bool last, TDeltaOps& ops, BufferChain& literals)
+{
+	// Carried tail and data are scanned as one buffer, literals refer to it
+	size_t size = m_carry.size() + data.size();
+	TBufferBlockPtr block = std::make_shared<BufferBlock>(size);
+	if (!m_carry.empty())
+		memcpy(block->tail(), &m_carry[0], m_carry.size());
+	data.copyTo(block->tail() + m_carry.size(), 0, data.size());
+	block->commit(size);
+
+	const unsigned char* p = block->data();
+	size_t blockSize = m_basis->blockSize();
+	size_t literalFrom = 0;
+	size_t offset = 0;
+
+	if (!m_basis->empty())
+	{
+		RollingChecksum checksum;
+		bool rolling = false;
+
+		while (offset + blockSize <= size)
+		{
+			if (!rolling)
+			{
+				checksum.reset(p + offset, blockSize);
+				rolling = true;
+			}
+
+			size_t index = 0;
+			if (findBlock(checksum.value(), p + offset, index))
+			{
+				addLiteral(block, literalFrom, offset - literalFrom, ops, literals);
+				addCopy(index, ops);
+
+				offset += blockSize;
+				literalFrom = offset;
+				rolling = false;
+				continue;
+			}
+
+			if (offset + blockSize < size)
+				checksum.roll(p[offset], p[offset + blockSize]);
+			++offset;
+		}
+	}
+
+	// Bytes which may still start a block are encoded with the next piece
+	size_t end = last || m_basis->empty() ? size : offset;
+	addLiteral(block, literalFrom, end - literalFrom, ops, literals);
+	m_carry.assign(p + end, p + size);
+}
+
+__int64
+DeltaEncoder::position() const
+{
+	return m_position;
+}
+
+const DeltaSignature&
+DeltaEncoder::signature() const
+{
+	return *m_basis;
+}
+
+__int64
+DeltaEncoder::targetSize(const TDeltaOps& ops)
+{
+	__int64 size = 0;
+	for (TDeltaOps::const_iterator ii = ops.begin(); ii != ops.end(); ++ii)
+		size += ii->size;
+	return size;
+}
+
+bool
+DeltaEncoder::apply(const TDeltaOps& ops, const BufferChain& literals, const FileHandle& basis, FileWriter& writer)
+{
+	std::vector<char> buf;
+	size_t literalFrom = 0;
+
+	for (TDeltaOps::const_iterator ii = ops.begin(); ii != ops.end(); ++ii)
+	{
+		if (DeltaOp::kLiteral == ii->offset)
+		{
+			if (ii->size > literals.size() - literalFrom)
+				return false;
+			if (!writer.write(literals.slice(literalFrom, ii->size)))
+				return false;
+
+			literalFrom += ii->size;
+			continue;
+		}
+
+		if (0 > ii->offset)
+			return false;
+
+		// Reads beyond the end of the basis fail
+		if (buf.empty())
+			buf.resize(kCopyBufferSize);
+
+		for (T_UI4 done = 0; done < ii->size;)
+		{
+			size_t cb = (std::min)(static_cast<size_t>(ii->size - done), buf.size());
+			if (!basis.readAt(ii->offset + done, &buf[0], cb) || !writer.write(&buf[0], cb))
+				return false;
+
+			done += static_cast<T_UI4>(cb);
+		}
+	}
+
+	return literalFrom == literals.size();
+}
+
+bool
+DeltaEncoder::findBlock(T_UI4 weak, const unsigned char* data, size_t& index) const
+{
+	if (!m_tags[tagOf(weak)])
+		return false;
+
+	size_t blockSize = m_basis->blockSize();
+	T_UI8 strong = 0;
+	bool hashed = false;
+
+	// Unchanged files are encoded as runs of consecutive blocks, which merge into a single copy
+	if (m_nextBlock < m_basis->blockCount() && m_basis->block(m_nextBlock).weak == weak)
+	{
+		strong = XxHash64::compute(data, blockSize);
+		hashed = true;
+
+		if (m_basis->block(m_nextBlock).strong == strong)
+		{
+			index = m_nextBlock;
+			return true;
+		}
+	}
+
+	std::vector<TIndexEntry>::const_iterator ii = std::lower_bound(m_index.begin(), m_index.end(), TIndexEntry(weak, 0));
+	for (; ii != m_index.end() && ii->first == weak; ++ii)
+	{
+		if (!hashed)
+		{
+			strong = XxHash64::compute(data, blockSize);
+			hashed = true;
+		}
+
+		if (m_basis->block(ii->second).strong == strong)
+		{
+			index = ii->second;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void
+DeltaEncoder::addLiteral(const TBufferBlockPtr& block, size_t offset, size_t size, TDeltaOps& ops, BufferChain& literals)
+{
+	if (0 == size)
+		return;
+
+	literals.append(block, offset, size);
+	m_position += size;
+
+	if (!ops.empty() && DeltaOp::kLiteral == ops.back().offset)
+		ops.back().size += static_cast<T_UI4>(size);
+	else
+		ops.push_back(DeltaOp(DeltaOp::kLiteral, static_cast<T_UI4>(size)));
+}
+
+void
+DeltaEncoder::addCopy(size_t index, TDeltaOps& ops)
+{
+	size_t blockSize = m_basis->blockSize();
+	__int64 offset = static_cast<__int64>(index) * blockSize;
+
+	m_position += blockSize;
+	m_nextBlock = index + 1;
+
+	if (!ops.empty() && DeltaOp::kLiteral != ops.back().offset && ops.back().offset + ops.back().size == offset)
+		ops.back().size += static_cast<T_UI4>(blockSize);
+	else
+		ops.push_back(DeltaOp(offset, static_cast<T_UI4>(blockSize)));
+}
+
+} // namespace util
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "BufferChain.hpp"
+#include "DeltaSignature.hpp"
+
+namespace util {
+
+class FileHandle;
+class FileWriter;
+
+/// Part of a new file, either a copy of a range of the basis or the next literal data
+struct DeltaOp
+{
+	DeltaOp()
+	: offset(kLiteral),
+	  size(0)
+	{}
+
+	DeltaOp(__int64 offset_, T_UI4 size_)
+	: offset(offset_),
+	  size(size_)
+	{}
+
+	/// Offset within the basis, kLiteral if data follow the previous literal data
+	__int64 offset;
+	T_UI4 size;
+
+	static const __int64 kLiteral = -1;
+};
+
+typedef std::vector<DeltaOp> TDeltaOps;
+
+/**
+ * Encodes a new file as blocks of the basis described by a signature and literal data, rsync style.
+ * The file is fed in order, a piece at a time. Checksums are rolled over every offset,
+ *	the tail which may still start a block is carried to the next piece, so blocks are found across pieces.
+ * Is used by one thread at a time.
+ */
+class DeltaEncoder
+{
+public:
+	explicit DeltaEncoder(const TDeltaSignaturePtr& basis);
+
+	/**
+	 * Encodes the next piece of the file, ops and literals describe the file starting at position().
+	 * The last piece encodes the carried tail as well. Literals share blocks with data rather than copy them.
+	 */
+	void encode(const BufferChain& data, bool last, TDeltaOps& ops, BufferChain& literals);
+
+	/// Offset of the file described by the next ops
+	__int64 position() const;
+
+	const DeltaSignature& signature() const;
+
+	/// Size of the file range described by ops
+	static __int64 targetSize(const TDeltaOps& ops);
+
+	/**
+	 * Appends the file range described by ops to a writer, copies are read from the basis.
+	 * Returns false if ops do not match literals or refer beyond the basis.
+	 */
+	static bool apply(const TDeltaOps& ops, const BufferChain& literals, const FileHandle& basis, FileWriter& writer);
+
+private:
+	/// Returns index of a block with the checksums of data, block following the previous copy is tried first
+	bool findBlock(T_UI4 weak, const unsigned char* data, size_t& index) const;
+
+	void addLiteral(const TBufferBlockPtr& block, size_t offset, size_t size, TDeltaOps& ops, BufferChain& literals);
+	void addCopy(size_t index, TDeltaOps& ops);
+
+	TDeltaSignaturePtr m_basis;
+
+	/// Blocks ordered by weak checksums, so candidates of a checksum are adjacent
+	typedef std::pair<T_UI4, T_UI4> TIndexEntry;
+	std::vector<TIndexEntry> m_index;
+
+	/// Bit per 16-bit tag of weak checksums, most offsets are rejected by it without a search
+	std::vector<bool> m_tags;
+
+	std::vector<unsigned char> m_carry;
+	__int64 m_position;
+	size_t m_nextBlock;
+};
+
+} // namespace util
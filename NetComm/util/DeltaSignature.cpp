@@ -0,0 +1,172 @@
+#include "DeltaSignature.hpp"
+#include "FileHandle.hpp"
+#include "MemoryStream.hpp"
+#include "RollingChecksum.hpp"
+#include "XxHash64.hpp"
+
+#include <cmath>
+
+namespace util {
+
+namespace {
+
+/// Basis is read in pieces of about this size
+const size_t kReadSize = 4 * 1024 * 1024;
+
+/// Block sizes are multiples of this
+const size_t kBlockAlignment = 1024;
+
+} // namespace
+
+DeltaSignature::DeltaSignature()
+: m_blockSize(kMinBlockSize)
+{
+}
+
+bool
+DeltaSignature::compute(const FileHandle& file)
+{
+	LARGE_INTEGER fileSize;
+	if (!file.isOpen() || !::GetFileSizeEx(file.get(), &fileSize))
+		return false;
+
+	reset(blockSizeFor(fileSize.QuadPart));
+
+	__int64 blockCount = fileSize.QuadPart / m_blockSize;
+	if (blockCount > static_cast<__int64>(kMaxBlockCount))
+		return false;
+
+	m_blocks.reserve(static_cast<size_t>(blockCount));
+
+	size_t blocksPerRead = kReadSize / m_blockSize;
+	std::vector<unsigned char> buf(blocksPerRead * m_blockSize);
+
+	for (__int64 block = 0; block < blockCount; block += blocksPerRead)
+	{
+		__int64 count = blockCount - block;
+		if (count > static_cast<__int64>(blocksPerRead))
+			count = blocksPerRead;
+
+		size_t size = static_cast<size_t>(count) * m_blockSize;
+		if (!file.readAt(block * m_blockSize, &buf[0], size))
+			return false;
+
+		addBlocks(&buf[0], size);
+	}
+
+	return true;
+}
+
+void
+DeltaSignature::reset(size_t blockSize)
+{
+	assert(0 < blockSize);
+
+	m_blockSize = blockSize;
+	m_blocks.clear();
+}
+
+void
+DeltaSignature::addBlocks(const void* buf, size_t size)
+{
+	assert(0 == size % m_blockSize);
+
+	const unsigned char* p = static_cast<const unsigned char*>(buf);
+	for (size_t offset = 0; offset + m_blockSize <= size; offset += m_blockSize)
+	{
+		BlockSignature block;
+		block.weak = RollingChecksum::compute(p + offset, m_blockSize);
+		block.strong = XxHash64::compute(p + offset, m_blockSize);
+		m_blocks.push_back(block);
+	}
+}
+
+size_t
+DeltaSignature::blockSize() const
+{
+	return m_blockSize;
+}
+
+size_t
+DeltaSignature::blockCount() const
+{
+	return m_blocks.size();
+}
+
+const BlockSignature&
+DeltaSignature::block(size_t index) const
+{
+	assert(index < m_blocks.size());
+	return m_blocks[index];
+}
+
+bool
+DeltaSignature::empty() const
+{
+	return m_blocks.empty();
+}
+
+size_t
+DeltaSignature::windowSize(size_t chunkSize) const
+{
+	return chunkSize > 2 * m_blockSize ? chunkSize - m_blockSize : chunkSize / 2;
+}
+
+size_t
+DeltaSignature::blockSizeFor(__int64 fileSize)
+{
+	// Square root of the file size is what rsync uses
+	size_t blockSize = static_cast<size_t>(std::sqrt(static_cast<double>(fileSize)));
+	blockSize = (blockSize + kBlockAlignment - 1) / kBlockAlignment * kBlockAlignment;
+
+	if (blockSize < kMinBlockSize)
+		blockSize = kMinBlockSize;
+	if (blockSize > kMaxBlockSize)
+		blockSize = kMaxBlockSize;
+	return blockSize;
+}
+
+void
+DeltaSignature::save(MemoryStream& out) const
+{
+	out << static_cast<T_UI4>(m_blockSize);
+	out << static_cast<T_UI4>(m_blocks.size());
+
+	for (std::vector<BlockSignature>::const_iterator ii = m_blocks.begin(); ii != m_blocks.end(); ++ii)
+	{
+		out << ii->weak;
+		out << ii->strong;
+	}
+}
+
+bool
+DeltaSignature::load(MemoryStream& in)
+{
+	T_UI4 blockSize = 0;
+	T_UI4 blockCount = 0;
+	in >> blockSize;
+	in >> blockCount;
+
+	m_blocks.clear();
+	if (in.fail() || blockSize < kMinBlockSize || blockSize > kMaxBlockSize || blockCount > kMaxBlockCount)
+		return false;
+
+	m_blockSize = blockSize;
+	m_blocks.resize(blockCount);
+
+	for (std::vector<BlockSignature>::iterator ii = m_blocks.begin(); ii != m_blocks.end() && !in.fail(); ++ii)
+	{
+		in >> ii->weak;
+		in >> ii->strong;
+	}
+
+	if (in.fail())
+	{
+		m_blocks.clear();
+		return false;
+	}
+
+	return true;
+}
+
+} // namespace util
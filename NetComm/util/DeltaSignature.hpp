@@ -0,0 +1,80 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace util {
+
+class FileHandle;
+class MemoryStream;
+
+/// Checksums of a block of the basis file
+struct BlockSignature
+{
+	BlockSignature()
+	: weak(0),
+	  strong(0)
+	{}
+
+	/// See RollingChecksum
+	T_UI4 weak;
+
+	/// XXH64 of the block, confirms a block found by the weak checksum
+	T_UI8 strong;
+};
+
+/**
+ * Signature of a file the receiver of a transfer already has (the basis),
+ *	the sender looks its blocks up in the new file and sends only data which are not in the basis (see DeltaEncoder).
+ * Only full blocks are signed, a shorter tail of the basis is always sent.
+ */
+class DeltaSignature
+{
+public:
+	DeltaSignature();
+
+	/// Signs a file, returns false if it could not be read or is too large to be signed
+	bool compute(const FileHandle& file);
+
+	/// Starts a signature of blocks of the size
+	void reset(size_t blockSize);
+
+	/// Appends signatures of full blocks of a buffer, the size is a multiple of the block size
+	void addBlocks(const void* buf, size_t size);
+
+	size_t blockSize() const;
+	size_t blockCount() const;
+	const BlockSignature& block(size_t index) const;
+	bool empty() const;
+
+	/**
+	 * Size of the new file to be encoded for a chunk. A block the encoder could not match yet
+	 *	is carried to the next chunk, so the window leaves room for it within the chunk size.
+	 */
+	size_t windowSize(size_t chunkSize) const;
+
+	/// Block size which balances the signature size against data sent for a changed block
+	static size_t blockSizeFor(__int64 fileSize);
+
+	void save(MemoryStream& out) const;
+
+	/// Returns false if the signature is malformed
+	bool load(MemoryStream& in);
+
+	static const size_t kMinBlockSize = 2 * 1024;
+	static const size_t kMaxBlockSize = 64 * 1024;
+
+	/// Larger files are sent whole, so that a signature fits a frame
+	static const size_t kMaxBlockCount = 1024 * 1024;
+
+private:
+	size_t m_blockSize;
+	std::vector<BlockSignature> m_blocks;
+};
+
+typedef std::shared_ptr<const DeltaSignature> TDeltaSignaturePtr;
+
+} // namespace util
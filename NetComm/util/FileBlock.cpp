@@ -0,0 +1,49 @@
+#include "FileBlock.hpp"
+#include "ScopedLock.hpp"
+#include "Error.hpp"
+
+namespace util
+{
+
+FileBlock::FileBlock(const TFileHandlePtr& file, __int64 offset, size_t size)
+	: BufferBlock(0, size)
+	, m_file(file)
+	, m_offset(offset)
+	, m_loaded(false)
+{
+	chkptr(m_file.get());
+}
+
+const unsigned char* FileBlock::data() const
+{
+	ScopedLock lock(&m_sync);
+
+	if (!m_loaded && 0 < size())
+	{
+		m_bytes.resize(size());
+		if (!m_file->readAt(m_offset, &m_bytes[0], m_bytes.size()))
+			throw util::Error("Failed to read file");
+
+		m_loaded = true;
+	}
+
+	return m_bytes.empty() ? 0 : &m_bytes[0];
+}
+
+const TFileHandlePtr& FileBlock::file() const
+{
+	return m_file;
+}
+
+__int64 FileBlock::offset() const
+{
+	return m_offset;
+}
+
+bool FileBlock::loaded() const
+{
+	ScopedLock lock(&m_sync);
+	return m_loaded;
+}
+
+} // namespace util
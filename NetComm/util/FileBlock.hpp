@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+
+#include "BufferChain.hpp"
+#include "FileHandle.hpp"
+#include "ThreadMutex.hpp"
+
+namespace util
+{
+
+/**
+ * Block referring to a range of a file.
+ * Bytes are not read until they are touched, so that a stream may send the range
+ *	straight from the file system cache (see net::TcpStream).
+ */
+class FileBlock : public BufferBlock
+{
+public:
+	FileBlock(const TFileHandlePtr& file, __int64 offset, size_t size);
+
+	/// Reads the range on the first call, throws util::Error if it can't be read
+	virtual const unsigned char* data() const;
+
+	const TFileHandlePtr& file() const;
+	__int64 offset() const;
+
+	/// Returns true once the range was read to memory
+	bool loaded() const;
+
+private:
+	TFileHandlePtr m_file;
+	__int64 m_offset;
+
+	mutable ThreadMutex m_sync;
+	mutable std::vector<unsigned char> m_bytes;
+	mutable bool m_loaded;
+};
+
+} // namespace util
@@ -0,0 +1,211 @@
+#include "FileHandle.hpp"
+
+#include <winioctl.h>
+#include <vector>
+
+#include "XxHash64.hpp"
+
+namespace util
+{
+
+namespace
+{
+
+/// Size of reads of a file being hashed
+const size_t kHashReadSize = 1024 * 1024;
+
+} // namespace
+
+FileHandle::FileHandle()
+	: m_handle(INVALID_HANDLE_VALUE)
+{
+}
+
+FileHandle::~FileHandle()
+{
+	close();
+}
+
+bool FileHandle::openRead(const std::wstring& name)
+{
+	close();
+
+	m_handle = ::CreateFileW(name.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	return isOpen();
+}
+
+bool FileHandle::openWrite(const std::wstring& name)
+{
+	close();
+
+	m_handle = ::CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	return isOpen();
+}
+
+void FileHandle::close()
+{
+	if (isOpen())
+	{
+		::CloseHandle(m_handle);
+		m_handle = INVALID_HANDLE_VALUE;
+	}
+}
+
+bool FileHandle::isOpen() const
+{
+	return INVALID_HANDLE_VALUE != m_handle;
+}
+
+HANDLE FileHandle::get() const
+{
+	return m_handle;
+}
+
+bool FileHandle::readAt(__int64 offset, void* buf, size_t size) const
+{
+	unsigned char* p = static_cast<unsigned char*>(buf);
+	while (0 < size)
+	{
+		// Offset is passed with every read
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = static_cast<DWORD>(offset);
+		overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+		DWORD cb = size < 0x40000000 ? static_cast<DWORD>(size) : 0x40000000;
+		DWORD read = 0;
+		if (!::ReadFile(m_handle, p, cb, &read, &overlapped) || 0 == read)
+			return false;
+
+		p += read;
+		offset += read;
+		size -= read;
+	}
+
+	return true;
+}
+
+bool FileHandle::hash(__int64 size, T_UI8& value) const
+{
+	if (!isOpen() || size < 0)
+		return false;
+
+	std::vector<unsigned char> buf(kHashReadSize);
+	XxHash64 hash;
+	for (__int64 offset = 0; offset < size;)
+	{
+		size_t cb = size - offset < static_cast<__int64>(buf.size()) ? static_cast<size_t>(size - offset) : buf.size();
+		if (!readAt(offset, &buf[0], cb))
+			return false;
+
+		hash.update(&buf[0], cb);
+		offset += cb;
+	}
+
+	value = hash.digest();
+	return true;
+}
+
+bool FileHandle::writeAt(__int64 offset, const void* buf, size_t size) const
+{
+	const unsigned char* p = static_cast<const unsigned char*>(buf);
+	while (0 < size)
+	{
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = static_cast<DWORD>(offset);
+		overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+		DWORD cb = size < 0x40000000 ? static_cast<DWORD>(size) : 0x40000000;
+		DWORD written = 0;
+		if (!::WriteFile(m_handle, p, cb, &written, &overlapped) || 0 == written)
+			return false;
+
+		p += written;
+		offset += written;
+		size -= written;
+	}
+
+	return true;
+}
+
+bool FileHandle::resize(__int64 size) const
+{
+	FILE_END_OF_FILE_INFO info;
+	info.EndOfFile.QuadPart = size;
+
+	// File pointer is not used, since reads and writes pass their offsets
+	return FALSE != ::SetFileInformationByHandle(m_handle, FileEndOfFileInfo, &info, sizeof(info));
+}
+
+bool FileHandle::allocate(__int64 size) const
+{
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = size;
+
+	return FALSE != ::SetFileInformationByHandle(m_handle, FileAllocationInfo, &info, sizeof(info));
+}
+
+bool FileHandle::sync() const
+{
+	return FALSE != ::FlushFileBuffers(m_handle);
+}
+
+bool FileHandle::isSparse() const
+{
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!::GetFileInformationByHandle(m_handle, &info))
+		return false;
+
+	return 0 != (info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE);
+}
+
+bool FileHandle::setSparse() const
+{
+	DWORD bytes = 0;
+	return FALSE != ::DeviceIoControl(m_handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+}
+
+bool FileHandle::zeroData(__int64 offset, __int64 size) const
+{
+	FILE_ZERO_DATA_INFORMATION info;
+	info.FileOffset.QuadPart = offset;
+	info.BeyondFinalZero.QuadPart = offset + size;
+
+	DWORD bytes = 0;
+	return FALSE != ::DeviceIoControl(m_handle, FSCTL_SET_ZERO_DATA, &info, sizeof(info), NULL, 0, &bytes, NULL);
+}
+
+bool FileHandle::allocatedRanges(__int64 offset, __int64 size, size_t maxCount, std::vector<TRange>& ranges, bool& complete) const
+{
+	ranges.clear();
+	complete = true;
+	if (0 == maxCount)
+		return false;
+
+	FILE_ALLOCATED_RANGE_BUFFER query;
+	query.FileOffset.QuadPart = offset;
+	query.Length.QuadPart = size;
+
+	std::vector<FILE_ALLOCATED_RANGE_BUFFER> buf(maxCount);
+	DWORD bytes = 0;
+	if (!::DeviceIoControl(m_handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+		&buf[0], static_cast<DWORD>(buf.size() * sizeof(buf[0])), &bytes, NULL))
+	{
+		// Buffer is filled with as many ranges as fit
+		if (ERROR_MORE_DATA != ::GetLastError())
+			return false;
+		complete = false;
+	}
+
+	for (size_t i = 0; i < bytes / sizeof(buf[0]); ++i)
+		ranges.push_back(TRange(buf[i].FileOffset.QuadPart, buf[i].Length.QuadPart));
+
+	return true;
+}
+
+} // namespace util
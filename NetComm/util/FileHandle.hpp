@@ -0,0 +1,80 @@
+#pragma once
+
+#include <windows.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "utils.h"
+
+namespace util
+{
+
+/**
+ * Owns a Win32 file handle.
+ * Is shared by objects which refer to a file after its reader moved on, e.g. by FileBlock.
+ */
+class FileHandle
+{
+public:
+	FileHandle();
+	~FileHandle();
+
+	/// Opens an existing file for sequential reading
+	bool openRead(const std::wstring& name);
+
+	/// Creates or truncates a file for writing, the file may be mapped and read back
+	bool openWrite(const std::wstring& name);
+
+	void close();
+
+	bool isOpen() const;
+	HANDLE get() const;
+
+	/// Reads size bytes at offset, the file pointer is not used, so concurrent reads do not interfere
+	bool readAt(__int64 offset, void* buf, size_t size) const;
+
+	/// Hashes the first size bytes by reading them (see XxHash64), e.g. once they were written out of order
+	bool hash(__int64 size, T_UI8& value) const;
+
+	/// Writes size bytes at offset, may be called by several threads at once
+	bool writeAt(__int64 offset, const void* buf, size_t size) const;
+
+	/// Extends or cuts the file
+	bool resize(__int64 size) const;
+
+	/// Reserves disk space for size bytes without changing the file size, so the file is laid out contiguously
+	bool allocate(__int64 size) const;
+
+	/// Writes cached data and metadata of the file to the disk
+	bool sync() const;
+
+	/// Returns true if the file is sparse, so it may have holes which take no disk space
+	bool isSparse() const;
+
+	/// Makes the file sparse, so that zeroed ranges release their disk space
+	bool setSparse() const;
+
+	/// Zeroes a range, the range becomes a hole if the file is sparse
+	bool zeroData(__int64 offset, __int64 size) const;
+
+	/// Offset and size of an allocated range
+	typedef std::pair<__int64, __int64> TRange;
+
+	/**
+	 * Returns allocated ranges of a sparse file within [offset, offset + size), holes lie between them.
+	 * At most maxCount ranges are returned, complete is false if there are more of them.
+	 */
+	bool allocatedRanges(__int64 offset, __int64 size, size_t maxCount, std::vector<TRange>& ranges, bool& complete) const;
+
+private:
+	FileHandle(const FileHandle&);
+	FileHandle& operator =(const FileHandle&);
+
+	HANDLE m_handle;
+};
+
+typedef std::shared_ptr<FileHandle> TFileHandlePtr;
+
+} // namespace util
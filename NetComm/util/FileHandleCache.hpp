@@ -0,0 +1,178 @@
+#pragma once
+
+#include <windows.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ScopedLock.hpp"
+#include "ThreadMutex.hpp"
+
+namespace util {
+
+/**
+ * Keeps files of concurrent transfers open, so that interleaved chunks don't reopen them.
+ * Files (e.g. readers or writers with their transfer state) are keyed by a path and a transfer,
+ *	e.g. a stream. The least recently used file is dropped once there are too many of them,
+ *	files idle for too long are dropped by evictIdle() and on every access.
+ * A dropped file is closed by its destructor once jobs using it release it,
+ *	never while the cache is locked.
+ */
+template<class T>
+class FileHandleCache
+{
+public:
+	typedef std::shared_ptr<T> TFilePtr;
+	typedef const void* TTransfer;
+
+	/// Limits the number of open files and the time a file stays open without being used (ms)
+	explicit FileHandleCache(size_t maxOpen = 16, DWORD idleTimeout = 30000)
+	: m_maxOpen(maxOpen),
+	  m_idleTimeout(idleTimeout)
+	{
+	}
+
+	/// Returns a file of a transfer, a new one is default constructed if it is not cached
+	TFilePtr get(const std::wstring& name, TTransfer transfer)
+	{
+		TFiles dropped;
+		ScopedLock lock(&m_sync);
+
+		DWORD now = ::GetTickCount();
+		evictIdle(now, dropped);
+
+		TKey key(name, transfer);
+		typename TIndex::iterator ii = m_index.find(key);
+		if (ii != m_index.end())
+		{
+			// Most recently used file is kept in front
+			m_entries.splice(m_entries.begin(), m_entries, ii->second);
+			ii->second->lastUse = now;
+			return ii->second->file;
+		}
+
+		m_entries.push_front(Entry(key, std::make_shared<T>(), now));
+		m_index[key] = m_entries.begin();
+
+		while (m_entries.size() > m_maxOpen && 1 < m_entries.size())
+			drop(--m_entries.end(), dropped);
+
+		return m_entries.front().file;
+	}
+
+	/// Returns a cached file without creating one, NULL if there is none
+	TFilePtr find(const std::wstring& name, TTransfer transfer) const
+	{
+		ScopedLock lock(&m_sync);
+
+		typename TIndex::const_iterator ii = m_index.find(TKey(name, transfer));
+		return ii != m_index.end() ? ii->second->file : TFilePtr();
+	}
+
+	/// Drops a file, e.g. once its transfer is complete
+	void remove(const std::wstring& name, TTransfer transfer)
+	{
+		TFiles dropped;
+		ScopedLock lock(&m_sync);
+
+		typename TIndex::iterator ii = m_index.find(TKey(name, transfer));
+		if (ii != m_index.end())
+			drop(ii->second, dropped);
+	}
+
+	/// Drops all files of a transfer, e.g. once its stream died
+	void removeTransfer(TTransfer transfer)
+	{
+		TFiles dropped;
+		ScopedLock lock(&m_sync);
+
+		for (typename TEntries::iterator ii = m_entries.begin(); ii != m_entries.end();)
+		{
+			typename TEntries::iterator entry = ii++;
+			if (entry->key.second == transfer)
+				drop(entry, dropped);
+		}
+	}
+
+	/// Drops files which were not used for the idle timeout
+	void evictIdle()
+	{
+		TFiles dropped;
+		ScopedLock lock(&m_sync);
+
+		evictIdle(::GetTickCount(), dropped);
+	}
+
+	void clear()
+	{
+		TFiles dropped;
+		ScopedLock lock(&m_sync);
+
+		while (!m_entries.empty())
+			drop(m_entries.begin(), dropped);
+	}
+
+	size_t size() const
+	{
+		ScopedLock lock(&m_sync);
+		return m_entries.size();
+	}
+
+	void setLimits(size_t maxOpen, DWORD idleTimeout)
+	{
+		ScopedLock lock(&m_sync);
+
+		m_maxOpen = maxOpen;
+		m_idleTimeout = idleTimeout;
+	}
+
+private:
+	typedef std::pair<std::wstring, TTransfer> TKey;
+
+	struct Entry
+	{
+		Entry(const TKey& key_, const TFilePtr& file_, DWORD lastUse_)
+		: key(key_),
+		  file(file_),
+		  lastUse(lastUse_)
+		{}
+
+		TKey key;
+		TFilePtr file;
+		DWORD lastUse;
+	};
+
+	/// Most recently used first
+	typedef std::list<Entry> TEntries;
+	typedef std::map<TKey, typename TEntries::iterator> TIndex;
+
+	/// Dropped files are released after the lock, so that closing them does not block other transfers
+	typedef std::vector<TFilePtr> TFiles;
+
+	void evictIdle(DWORD now, TFiles& dropped)
+	{
+		// Idle files are at the back, tick count wraps around safely
+		while (!m_entries.empty() && now - m_entries.back().lastUse >= m_idleTimeout)
+			drop(--m_entries.end(), dropped);
+	}
+
+	void drop(typename TEntries::iterator entry, TFiles& dropped)
+	{
+		dropped.push_back(entry->file);
+		m_index.erase(entry->key);
+		m_entries.erase(entry);
+	}
+
+	mutable ThreadMutex m_sync;
+
+	size_t m_maxOpen;
+	DWORD m_idleTimeout;
+
+	TEntries m_entries;
+	TIndex m_index;
+};
+
+} // namespace util
@@ -0,0 +1,133 @@
+#include "FileMapping.hpp"
+#include "Error.hpp"
+
+namespace util
+{
+
+namespace
+{
+
+/// Mapped window of a file, is unmapped with the last chain referring to it
+class MappedBlock : public BufferBlock
+{
+public:
+	MappedBlock(unsigned char* view, size_t size)
+		: BufferBlock(view, size)
+		, m_view(view)
+	{
+	}
+
+	~MappedBlock()
+	{
+		::UnmapViewOfFile(m_view);
+	}
+
+private:
+	unsigned char* m_view;
+};
+
+/// PrefetchVirtualMemory() is looked up, since it is missing before Windows 8
+typedef struct
+{
+	PVOID VirtualAddress;
+	SIZE_T NumberOfBytes;
+} TMemoryRangeEntry;
+
+typedef BOOL (WINAPI *TPrefetchVirtualMemory)(HANDLE, ULONG_PTR, TMemoryRangeEntry*, ULONG);
+
+TPrefetchVirtualMemory prefetchVirtualMemory()
+{
+	static TPrefetchVirtualMemory s_prefetch = reinterpret_cast<TPrefetchVirtualMemory>(
+		::GetProcAddress(::GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory"));
+
+	return s_prefetch;
+}
+
+} // namespace
+
+FileMapping::FileMapping()
+	: m_mapping(NULL)
+	, m_size(0)
+{
+}
+
+FileMapping::~FileMapping()
+{
+	close();
+}
+
+bool FileMapping::open(const TFileHandlePtr& file, __int64 size)
+{
+	close();
+
+	// Empty files can't be mapped
+	if (!file || !file->isOpen() || 0 >= size)
+		return false;
+
+	m_mapping = ::CreateFileMappingW(file->get(), NULL, PAGE_READONLY,
+		static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), NULL);
+	if (!m_mapping)
+		return false;
+
+	m_file = file;
+	m_size = size;
+	return true;
+}
+
+void FileMapping::close()
+{
+	if (m_mapping)
+	{
+		::CloseHandle(m_mapping);
+		m_mapping = NULL;
+		m_file.reset();
+		m_size = 0;
+	}
+}
+
+bool FileMapping::isOpen() const
+{
+	return NULL != m_mapping;
+}
+
+TBufferBlockPtr FileMapping::map(__int64 offset, size_t size) const
+{
+	assert(0 == offset % granularity());
+
+	if (!m_mapping || offset < 0 || offset + static_cast<__int64>(size) > m_size)
+		throw util::Error("File window is out of range");
+
+	void* view = ::MapViewOfFile(m_mapping, FILE_MAP_READ,
+		static_cast<DWORD>(offset >> 32), static_cast<DWORD>(offset), size);
+	if (!view)
+		throw util::Error("Failed to map file");
+
+	return std::make_shared<MappedBlock>(static_cast<unsigned char*>(view), size);
+}
+
+void FileMapping::prefetch(const void* data, size_t size)
+{
+	TPrefetchVirtualMemory prefetch = prefetchVirtualMemory();
+	if (prefetch && 0 < size)
+	{
+		TMemoryRangeEntry range;
+		range.VirtualAddress = const_cast<void*>(data);
+		range.NumberOfBytes = size;
+		prefetch(::GetCurrentProcess(), 1, &range, 0);
+	}
+}
+
+size_t FileMapping::granularity()
+{
+	static size_t s_granularity = 0;
+	if (0 == s_granularity)
+	{
+		SYSTEM_INFO info;
+		::GetSystemInfo(&info);
+		s_granularity = info.dwAllocationGranularity;
+	}
+
+	return s_granularity;
+}
+
+} // namespace util
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "BufferChain.hpp"
+#include "FileHandle.hpp"
+
+namespace util
+{
+
+/**
+ * Read-only mapping of a file.
+ * Windows of the file are mapped as blocks, so that chains refer to the file system cache directly.
+ * A window stays mapped while any chain refers to it, even after the mapping is closed.
+ */
+class FileMapping
+{
+public:
+	FileMapping();
+	~FileMapping();
+
+	bool open(const TFileHandlePtr& file, __int64 size);
+	void close();
+
+	bool isOpen() const;
+
+	/// Maps size bytes at offset, which must be a multiple of the allocation granularity
+	TBufferBlockPtr map(__int64 offset, size_t size) const;
+
+	/// Asks the system to read mapped pages ahead of their use, does nothing before Windows 8
+	static void prefetch(const void* data, size_t size);
+
+	/// Offsets of windows are multiples of this
+	static size_t granularity();
+
+private:
+	FileMapping(const FileMapping&);
+	FileMapping& operator =(const FileMapping&);
+
+	TFileHandlePtr m_file;
+	HANDLE m_mapping;
+	__int64 m_size;
+};
+
+typedef std::shared_ptr<FileMapping> TFileMappingPtr;
+
+} // namespace util
@@ -1,11 +1,25 @@
 #include "FileReader.hpp"
+#include "FileBlock.hpp"
+#include "Error.hpp"
+#include "ScopedLock.hpp"
 
 namespace util
 {
 
+namespace
+{
+
+/// Range of a sparse file with more allocated ranges than this is sent densely
+const size_t kMaxQueriedRanges = 64;
+
+} // namespace
+
 FileReader::FileReader()
 	: m_file(NULL)
 	, m_size(0)
+	, m_hashedSize(0)
+	, m_mapped(false)
+	, m_windowOffset(0)
 {
 }
 
@@ -16,6 +30,7 @@ FileReader::~FileReader()
 
 bool FileReader::open(const std::wstring& name)
 {
+	ScopedLock lock(&m_sync);
 
 	if (!name.empty() && (m_name != name))
 	{
@@ -27,6 +42,9 @@ bool FileReader::open(const std::wstring& name)
 			_fseeki64(m_file, 0, SEEK_END);
 			m_size = _ftelli64(m_file);
 			rewind(m_file);
+
+			m_hash.reset();
+			m_hashedSize = 0;
 		}
 		else
 		{
@@ -38,46 +56,278 @@ bool FileReader::open(const std::wstring& name)
 
 void FileReader::close()
 {
+	ScopedLock lock(&m_sync);
+
 	if (m_file)
 	{
 		fclose(m_file);
 		m_file = NULL;
 		m_name.clear();
+
+		// Blocks keep their own references to the handle and mapped windows
+		m_region.reset();
+		m_mapping.close();
+		m_window.reset();
 	}
 }
 
-bool FileReader::read(std::vector<char>& buf, __int64 startFrom, int size)
+void FileReader::setMapped(bool mapped)
+{
+	m_mapped = mapped;
+}
+
+bool FileReader::isMapped() const
+{
+	return m_mapped;
+}
+
+bool FileReader::read(BufferChain& buf, __int64 startFrom, int size)
 {
 	if (!m_file || (startFrom + size) > m_size)
 		return false;
 
-	// Seek to position
-	if (startFrom != _ftelli64(m_file))
+	bool result = true;
+	buf.clear();
+
+	if (m_mapped)
 	{
-		_fseeki64(m_file, startFrom, SEEK_SET);
+		result = readMapped(buf, startFrom, size);
 	}
+	else
+	{
+		// Seek to position
+		if (startFrom != _ftelli64(m_file))
+		{
+			_fseeki64(m_file, startFrom, SEEK_SET);
+		}
 
-	// Read data
-	bool result = true;
-	buf.clear();
-	buf.resize(size);
-	if (size != 0)
+		// Read data
+		if (size != 0)
+		{
+			TBufferBlockPtr block = std::make_shared<BufferBlock>(size);
+			result = (fread_s(block->tail(), size, 1, size, m_file) == size);
+			if (result)
+			{
+				block->commit(size);
+				buf.append(block, 0, size);
+			}
+		}
+	}
+
+	// Hash is only valid if the file is read sequentially
+	if (result && startFrom == m_hashedSize)
 	{
-		result = (fread_s(&buf.front(), size, 1, size, m_file) == size);
-		if (!result)
-			buf.clear();
+		for (size_t i = 0; i < buf.segmentCount(); ++i)
+			m_hash.update(buf.segment(i).data(), buf.segment(i).size);
+		m_hashedSize += size;
+	}
+	else
+	{
+		m_hashedSize = -1;
 	}
 
 	// Close file if end was reached
-	if (_ftelli64(m_file) == m_size)
+	if (m_mapped ? (result && startFrom + size == m_size) : (_ftelli64(m_file) == m_size))
 		close();
 
 	return result;
 }
 
+TFileHandlePtr FileReader::region()
+{
+	ScopedLock lock(&m_sync);
+
+	if (!m_region && m_file)
+	{
+		TFileHandlePtr region = std::make_shared<FileHandle>();
+		if (region->openRead(m_name))
+			m_region = region;
+	}
+
+	return m_region;
+}
+
+bool FileReader::readMapped(BufferChain& buf, __int64 startFrom, int size)
+{
+	if (0 == size)
+		return true;
+
+	// Current window is shared by positional reads
+	ScopedLock lock(&m_sync);
+
+	if (!m_mapping.isOpen() && !m_mapping.open(region(), m_size))
+		return false;
+
+	try
+	{
+		__int64 position = startFrom;
+		size_t left = size;
+		while (0 < left)
+		{
+			// Windows are aligned, so that a sequential reader maps every part of the file once
+			if (!m_window || position < m_windowOffset || position >= m_windowOffset + static_cast<__int64>(m_window->size()))
+			{
+				m_windowOffset = position - position % kWindowSize;
+				__int64 windowSize = m_size - m_windowOffset;
+				if (windowSize > static_cast<__int64>(kWindowSize))
+					windowSize = kWindowSize;
+
+				m_window = m_mapping.map(m_windowOffset, static_cast<size_t>(windowSize));
+			}
+
+			size_t offset = static_cast<size_t>(position - m_windowOffset);
+			size_t cb = m_window->size() - offset;
+			if (cb > left)
+				cb = left;
+
+			buf.append(m_window, offset, cb);
+
+			position += cb;
+			left -= cb;
+		}
+
+		// Pages of the current window ahead of the read are about to be sent
+		size_t ahead = static_cast<size_t>(position - m_windowOffset);
+		size_t aheadSize = m_window->size() - ahead;
+		if (aheadSize > kReadAheadSize)
+			aheadSize = kReadAheadSize;
+		FileMapping::prefetch(m_window->data() + ahead, aheadSize);
+	}
+	catch (const util::Error&)
+	{
+		buf.clear();
+		return false;
+	}
+
+	return true;
+}
+
+bool FileReader::readRegion(BufferChain& buf, __int64 startFrom, int size)
+{
+	if (!m_file || (startFrom + size) > m_size)
+		return false;
+
+	TFileHandlePtr file = region();
+	if (!file)
+		return false;
+
+	buf.clear();
+	if (size != 0)
+		buf.append(std::make_shared<FileBlock>(file, startFrom, size), 0, size);
+
+	// Data are not read, so the file can't be hashed
+	m_hashedSize = -1;
+
+	// Close file if end was reached
+	if (startFrom + size == m_size)
+		close();
+
+	return true;
+}
+
+bool FileReader::readAt(BufferChain& buf, __int64 offset, int size)
+{
+	if (!m_mapped)
+		return readAt(buf, offset, size, 0 < size ? std::make_shared<BufferBlock>(size) : TBufferBlockPtr());
+
+	if (offset < 0 || size < 0 || (offset + size) > m_size)
+		return false;
+
+	buf.clear();
+	return readMapped(buf, offset, size);
+}
+
+bool FileReader::readAt(BufferChain& buf, __int64 offset, int size, const TBufferBlockPtr& block)
+{
+	if (offset < 0 || size < 0 || (offset + size) > m_size)
+		return false;
+
+	// Handle is shared, so the reader may be closed meanwhile
+	TFileHandlePtr file = region();
+	if (!file)
+		return false;
+
+	buf.clear();
+	if (size != 0)
+	{
+		if (!block || block->tailSize() < static_cast<size_t>(size))
+			return false;
+
+		size_t from = block->size();
+		if (!file->readAt(offset, block->tail(), size))
+			return false;
+
+		block->commit(size);
+		buf.append(block, from, size);
+	}
+
+	return true;
+}
+
 __int64 FileReader::size() const
 {
 	return m_size;
 }
 
+__int64 FileReader::dataSize(__int64 offset, __int64 size)
+{
+	TFileHandlePtr file = region();
+	if (!file || 0 >= size || !file->isSparse())
+		return size;
+
+	std::vector<FileHandle::TRange> ranges;
+	bool complete = false;
+	if (!file->allocatedRanges(offset, size, kMaxQueriedRanges, ranges, complete) || !complete)
+		return size;
+
+	// Holes between allocated ranges are sent as zeros, only the trailing one is described
+	if (ranges.empty())
+		return 0;
+
+	__int64 end = ranges.back().first + ranges.back().second - offset;
+	return end < size ? end : size;
+}
+
+__int64 FileReader::holeSize(__int64 offset)
+{
+	TFileHandlePtr file = region();
+	if (!file || offset >= m_size || !file->isSparse())
+		return 0;
+
+	// Only the first allocated range matters
+	std::vector<FileHandle::TRange> ranges;
+	bool complete = false;
+	if (!file->allocatedRanges(offset, m_size - offset, 1, ranges, complete))
+		return 0;
+
+	if (ranges.empty())
+		return m_size - offset;
+	return ranges.front().first > offset ? ranges.front().first - offset : 0;
+}
+
+const std::wstring& FileReader::name() const
+{
+	return m_name;
+}
+
+bool FileReader::hash(T_UI8& value) const
+{
+	// Hash is kept after the file is closed at its end
+	if (m_hashedSize != m_size)
+		return false;
+
+	value = m_hash.digest();
+	return true;
+}
+
+bool FileReader::readHash(T_UI8& value)
+{
+	if (!m_file)
+		return false;
+
+	// Positional reads do not disturb the sequential position
+	TFileHandlePtr file = region();
+	return file && file->hash(m_size, value);
+}
+
 } //namespace util
\ No newline at end of file
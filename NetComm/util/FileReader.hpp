@@ -4,6 +4,12 @@
 #include <vector>
 #include <string>
 
+#include "XxHash64.hpp"
+#include "BufferChain.hpp"
+#include "FileHandle.hpp"
+#include "FileMapping.hpp"
+#include "ThreadMutex.hpp"
+
 namespace util
 {
 
@@ -15,13 +21,84 @@ public:
 
 	bool open(const std::wstring& name);
 	void close();
-	bool read(std::vector<char>& buf, __int64 startFrom, int size);
+
+	/**
+	 * In the mapped mode read() and readAt() refer to windows of a file mapping rather than copy data,
+	 *	pages ahead of a read are prefetched. Is off by default.
+	 */
+	void setMapped(bool mapped);
+	bool isMapped() const;
+
+	/// Reads data to a new block, so that they may be passed on without copying
+	bool read(BufferChain& buf, __int64 startFrom, int size);
+
+	/**
+	 * Refers to a range of the file rather than reads it (see FileBlock),
+	 *	so that the range may be sent from the file system cache. Such data are not hashed.
+	 */
+	bool readRegion(BufferChain& buf, __int64 startFrom, int size);
+
+	/**
+	 * Reads data at offset to a new block, or refers to the mapping in the mapped mode.
+	 * May be called by several threads at once.
+	 * Does not move the sequential position, data are not hashed and the file is not closed at its end.
+	 */
+	bool readAt(BufferChain& buf, __int64 offset, int size);
+
+	/// Reads data at offset to the tail of a block (e.g. a pooled one), the file is read in the mapped mode as well
+	bool readAt(BufferChain& buf, __int64 offset, int size, const TBufferBlockPtr& block);
+
+	/**
+	 * Returns size of data at offset which are followed by a hole up to offset + size,
+	 *	so that the hole may be described rather than sent. Is size unless the file is sparse.
+	 */
+	__int64 dataSize(__int64 offset, __int64 size);
+
+	/// Returns size of a hole of a sparse file at offset, it extends up to the next data or the end of the file
+	__int64 holeSize(__int64 offset);
+
 	__int64 size() const;
 
+	/// Name of the open file, empty if the file is closed
+	const std::wstring& name() const;
+
+	/// Returns hash of the whole file, false unless the file was read sequentially up to its end
+	bool hash(T_UI8& value) const;
+
+	/// Returns hash of the whole file read again, e.g. once its ranges were read out of order
+	bool readHash(T_UI8& value);
+
+	/// Size of a mapped window
+	static const size_t kWindowSize = 64 * 1024 * 1024;
+
+	/// Amount of data prefetched ahead of a mapped read
+	static const size_t kReadAheadSize = 16 * 1024 * 1024;
+
 private:
+	/// Opens the handle shared by file blocks, the mapping and positional reads, NULL if the file is closed
+	TFileHandlePtr region();
+
+	/// Appends slices of mapped windows, maps the next window once a read leaves the current one
+	bool readMapped(BufferChain& buf, __int64 startFrom, int size);
+
+	/// Guards the file state against positional reads
+	ThreadMutex m_sync;
+
 	FILE* m_file;
 	std::wstring m_name;
 	__int64 m_size;
+
+	/// File data are hashed as they are read, -1 if reads were not sequential
+	XxHash64 m_hash;
+	__int64 m_hashedSize;
+
+	/// Handle shared by file blocks and the mapping, is opened on the first use
+	TFileHandlePtr m_region;
+
+	bool m_mapped;
+	FileMapping m_mapping;
+	TBufferBlockPtr m_window;
+	__int64 m_windowOffset;
 };
 
 } //namespace util
@@ -1,10 +1,44 @@
 #include "FileWriter.hpp"
+#include "ScopedLock.hpp"
 
 namespace util
 {
 
+namespace
+{
+
+/// Copies data to a mapped view, returns false if the file system fails to provide a page
+bool copyToView(unsigned char* view, const char* buf, size_t size)
+{
+	__try
+	{
+		memcpy(view, buf, size);
+	}
+	__except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+} // namespace
+
+const wchar_t* const FileWriter::kTempSuffix = L".part";
+
 FileWriter::FileWriter()
-	: m_file(NULL)
+	: m_durability(DURABILITY_NONE)
+	, m_position(0)
+	, m_failed(false)
+	, m_sparse(false)
+	, m_unsynced(0)
+	, m_syncTime(0)
+	, m_hashedSize(0)
+	, m_mapping(NULL)
+	, m_reserved(0)
+	, m_view(NULL)
+	, m_viewOffset(0)
+	, m_viewSize(0)
 {
 }
 
@@ -13,55 +47,444 @@ FileWriter::~FileWriter()
 	close();
 }
 
+void FileWriter::setDurability(Durability durability)
+{
+	ScopedLock lock(&m_sync);
+	m_durability = durability;
+}
+
+FileWriter::Durability FileWriter::durability() const
+{
+	ScopedLock lock(&m_sync);
+	return m_durability;
+}
+
 bool FileWriter::open(const std::wstring& name)
 {
+	ScopedLock lock(&m_sync);
+
 	if (!name.empty() && (m_name != name))
 	{
 		close();
-		if (_wfopen_s(&m_file, name.c_str(), L"wb") == 0)
+
+		std::wstring tempName = name + kTempSuffix;
+		if (m_file.openWrite(tempName))
 		{
 			m_name = name;
-		}
-		else
-		{
-			m_file = NULL;
+			m_tempName = tempName;
+			m_position = 0;
+			m_buffer.clear();
+			m_buffer.reserve(kWriteBufferSize);
+			m_failed = false;
+			m_sparse = false;
+			m_unsynced = 0;
+			m_syncTime = ::GetTickCount();
+			m_written.clear();
+			m_hash.reset();
+			m_hashedSize = 0;
 		}
 	}
-	return (m_file != NULL);
+	return m_file.isOpen();
+}
+
+bool FileWriter::finish()
+{
+	ScopedLock lock(&m_sync);
+
+	if (!m_file.isOpen())
+		return false;
+
+	bool result = flushBuffer();
+	unmap();
+
+	if (result && DURABILITY_NONE != m_durability)
+		result = sync();
+
+	m_file.close();
+
+	// Rename is written through as well, otherwise a crash may leave the file under the temporary name
+	if (result)
+	{
+		DWORD flags = MOVEFILE_REPLACE_EXISTING;
+		if (DURABILITY_NONE != m_durability)
+			flags |= MOVEFILE_WRITE_THROUGH;
+		result = FALSE != ::MoveFileExW(m_tempName.c_str(), m_name.c_str(), flags);
+	}
+
+	m_name.clear();
+	m_tempName.clear();
+	return result;
 }
 
 void FileWriter::close()
 {
-	if (m_file)
+	ScopedLock lock(&m_sync);
+
+	if (m_file.isOpen())
 	{
-		fclose(m_file);
-		m_file = NULL;
+		flushBuffer();
+		unmap();
+
+		m_file.close();
 		m_name.clear();
+		m_tempName.clear();
 	}
 }
 
-bool FileWriter::write(const std::vector<char>& buf)
+bool FileWriter::reserve(__int64 fileSize)
 {
-	if (!m_file)
+	ScopedLock lock(&m_sync);
+
+	if (!m_file.isOpen() || m_mapping || 0 >= fileSize || !m_written.empty())
+		return false;
+
+	// Small files get their space in one piece as well, but are written through the buffer
+	if (fileSize < kMinMappedSize)
+	{
+		m_file.allocate(fileSize);
+		return false;
+	}
+
+	// Space is allocated at once, so a full disk is detected here rather than by a page fault
+	if (!m_file.resize(fileSize))
+		return false;
+
+	m_mapping = ::CreateFileMappingW(m_file.get(), NULL, PAGE_READWRITE,
+		static_cast<DWORD>(fileSize >> 32), static_cast<DWORD>(fileSize), NULL);
+
+	if (!m_mapping)
+	{
+		m_file.resize(0);
+		return false;
+	}
+
+	m_reserved = fileSize;
+	return true;
+}
+
+bool FileWriter::write(const BufferChain& buf)
+{
+	bool result = m_file.isOpen();
+	for (size_t i = 0; i < buf.segmentCount() && result; ++i)
+	{
+		const BufferChain::Segment& segment = buf.segment(i);
+		result = write(reinterpret_cast<const char*>(segment.data()), segment.size);
+	}
+
+	return result;
+}
+
+bool FileWriter::write(const char* buf, size_t size)
+{
+	ScopedLock lock(&m_sync);
+
+	if (!m_file.isOpen() || m_failed)
 		return false;
 
 	// Write data
 	bool result = true;
-	size_t sz = buf.size();
 
-	if (sz != 0)
+	if (size != 0)
 	{
-		result = (fwrite(&buf.front(), 1, sz, m_file) == sz);
+		// Data beyond the preallocated size are written as usual
+		if (m_mapping && m_position + static_cast<__int64>(size) > m_reserved)
+			unmap();
+
+		__int64 position = m_position;
+		if (m_mapping)
+		{
+			result = writeMapped(buf, size);
+			if (result)
+				groupCommit(size);
+		}
+		else
+		{
+			result = writeBuffered(buf, size);
+		}
+
+		if (result)
+			commit(buf, size, position);
+		else
+			m_failed = true;
 	}
 
 	return result;
 }
 
+bool FileWriter::writeBuffered(const char* buf, size_t size)
+{
+	while (0 < size)
+	{
+		// Large aligned writes bypass the buffer
+		if (m_buffer.empty() && 0 == m_position % kWriteBufferSize && size >= kWriteBufferSize)
+		{
+			size_t cb = size - size % kWriteBufferSize;
+			if (!m_file.writeAt(m_position, buf, cb))
+				return false;
+
+			buf += cb;
+			size -= cb;
+			m_position += cb;
+			groupCommit(cb);
+			continue;
+		}
+
+		// Buffer is filled up to the next aligned offset
+		size_t cb = kWriteBufferSize - static_cast<size_t>(m_position % kWriteBufferSize);
+		if (cb > size)
+			cb = size;
+		m_buffer.insert(m_buffer.end(), buf, buf + cb);
+
+		buf += cb;
+		size -= cb;
+		m_position += cb;
+
+		if (0 == m_position % kWriteBufferSize && !flushBuffer())
+			return false;
+	}
+
+	return true;
+}
+
+bool FileWriter::flushBuffer()
+{
+	if (m_failed)
+		return false;
+	if (m_buffer.empty())
+		return true;
+
+	size_t size = m_buffer.size();
+	if (!m_file.writeAt(m_position - size, &m_buffer[0], size))
+	{
+		m_failed = true;
+		return false;
+	}
+
+	m_buffer.clear();
+	groupCommit(size);
+	return true;
+}
+
+void FileWriter::groupCommit(size_t size)
+{
+	if (DURABILITY_GROUP_COMMIT != m_durability)
+		return;
+
+	m_unsynced += size;
+	if (m_unsynced >= kGroupCommitSize || ::GetTickCount() - m_syncTime >= kGroupCommitInterval)
+		sync();
+}
+
+bool FileWriter::sync()
+{
+	// Pages of the mapped window are not written by FlushFileBuffers()
+	bool result = !m_view || FALSE != ::FlushViewOfFile(m_view, 0);
+	result = m_file.sync() && result;
+
+	m_unsynced = 0;
+	m_syncTime = ::GetTickCount();
+	return result;
+}
+
+bool FileWriter::writeAt(const BufferChain& buf, __int64 offset)
+{
+	bool result = m_file.isOpen();
+	for (size_t i = 0; i < buf.segmentCount() && result; ++i)
+	{
+		const BufferChain::Segment& segment = buf.segment(i);
+		result = writeAt(reinterpret_cast<const char*>(segment.data()), segment.size, offset);
+		offset += segment.size;
+	}
+
+	return result;
+}
+
+bool FileWriter::writeAt(const char* buf, size_t size, __int64 offset)
+{
+	if (!m_file.isOpen())
+		return false;
+
+	// Positional writes don't share a file position, so they are not serialized.
+	// Writes through the handle are coherent with the mapped views.
+	if (size != 0 && !m_file.writeAt(offset, buf, size))
+		return false;
+
+	ScopedLock lock(&m_sync);
+	commit(buf, size, offset);
+	return true;
+}
+
+bool FileWriter::writeHole(__int64 offset, __int64 size)
+{
+	ScopedLock lock(&m_sync);
+
+	if (!m_file.isOpen() || m_failed)
+		return false;
+	if (0 >= size)
+		return true;
+
+	// Views would keep the hole allocated, the rest of the file is written by WriteFile()
+	if (!flushBuffer())
+		return false;
+	unmap();
+
+	if (!m_sparse)
+	{
+		if (!m_file.setSparse())
+			return false;
+		m_sparse = true;
+	}
+
+	// File is extended by the hole if it is the last one, its preallocated space is released either way
+	__int64 end = offset + size;
+	if (end > m_written.end() && !m_file.resize(end))
+		return false;
+	if (!m_file.zeroData(offset, size))
+		return false;
+
+	m_written.add(offset, size);
+
+	if (offset == m_hashedSize)
+	{
+		m_hash.updateZeros(size);
+		m_hashedSize += size;
+	}
+	else
+	{
+		m_hashedSize = -1;
+	}
+
+	if (offset == m_position)
+		m_position = end;
+
+	return true;
+}
+
+void FileWriter::commit(const char* buf, size_t size, __int64 offset)
+{
+	if (0 == size)
+		return;
+
+	m_written.add(offset, size);
+
+	// Hash is only valid if data are written in order
+	if (offset == m_hashedSize)
+	{
+		m_hash.update(buf, size);
+		m_hashedSize += size;
+	}
+	else
+	{
+		m_hashedSize = -1;
+	}
+}
+
+bool FileWriter::writeMapped(const char* buf, size_t size)
+{
+	while (0 < size)
+	{
+		// Move the window if the position left it
+		if (!m_view || m_position < m_viewOffset || m_position >= m_viewOffset + static_cast<__int64>(m_viewSize))
+		{
+			unmapView();
+
+			m_viewOffset = m_position - m_position % kViewSize;
+			__int64 viewSize = m_reserved - m_viewOffset;
+			m_viewSize = static_cast<size_t>(viewSize < kViewSize ? viewSize : kViewSize);
+			m_view = static_cast<unsigned char*>(::MapViewOfFile(m_mapping, FILE_MAP_WRITE,
+				static_cast<DWORD>(m_viewOffset >> 32), static_cast<DWORD>(m_viewOffset), m_viewSize));
+
+			if (!m_view)
+				return false;
+		}
+
+		size_t offset = static_cast<size_t>(m_position - m_viewOffset);
+		size_t cb = m_viewSize - offset;
+		if (cb > size)
+			cb = size;
+		if (!copyToView(m_view + offset, buf, cb))
+			return false;
+
+		buf += cb;
+		size -= cb;
+		m_position += cb;
+	}
+
+	return true;
+}
+
+void FileWriter::unmap()
+{
+	if (!m_mapping)
+		return;
+
+	unmapView();
+
+	::CloseHandle(m_mapping);
+	m_mapping = NULL;
+
+	// File can't be cut while it is mapped, data written at any offset are kept
+	m_file.resize(m_written.end());
+
+	m_reserved = 0;
+	m_viewOffset = 0;
+	m_viewSize = 0;
+}
+
+void FileWriter::unmapView()
+{
+	if (!m_view)
+		return;
+
+	// Dirty pages of an unmapped view are written back lazily, FlushFileBuffers() would not wait for them
+	if (DURABILITY_NONE != m_durability)
+		::FlushViewOfFile(m_view, 0);
+
+	::UnmapViewOfFile(m_view);
+	m_view = NULL;
+}
+
 __int64 FileWriter::size() const
 {
-	if (!m_file)
+	ScopedLock lock(&m_sync);
+
+	if (!m_file.isOpen())
 		return 0;
-	return _ftelli64(m_file);
+	return m_written.prefix();
+}
+
+bool FileWriter::isComplete(__int64 size) const
+{
+	ScopedLock lock(&m_sync);
+	return m_written.isComplete(size);
+}
+
+RangeSet FileWriter::written() const
+{
+	ScopedLock lock(&m_sync);
+	return m_written;
+}
+
+bool FileWriter::hash(T_UI8& value) const
+{
+	ScopedLock lock(&m_sync);
+
+	if (m_hashedSize != m_written.end())
+		return false;
+
+	value = m_hash.digest();
+	return true;
+}
+
+bool FileWriter::readHash(T_UI8& value)
+{
+	ScopedLock lock(&m_sync);
+
+	// Mapped views and reads of the file share the file system cache, buffered data are written first
+	if (!m_file.isOpen() || !flushBuffer())
+		return false;
+
+	return m_file.hash(m_written.end(), value);
 }
 
-} //namespace util
\ No newline at end of file
+} // namespace util
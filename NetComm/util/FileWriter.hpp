@@ -1,26 +1,178 @@
 #pragma once
 
-#include <stdio.h>
+#include <windows.h>
 #include <vector>
 #include <string>
 
+#include "XxHash64.hpp"
+#include "BufferChain.hpp"
+#include "FileHandle.hpp"
+#include "RangeSet.hpp"
+#include "ThreadMutex.hpp"
+
 namespace util
 {
 
+/**
+ * Writes a file either sequentially by write() or at arbitrary offsets by writeAt().
+ * Written ranges are tracked, so chunks may arrive out of order or be written by several threads.
+ * Data are written to a temporary file which gets the final name by finish(),
+ *	so a file under the final name is always complete.
+ */
 class FileWriter
 {
 public:
+	/// When written data are forced to the disk
+	enum Durability
+	{
+		/// Whenever the system writes them back
+		DURABILITY_NONE,
+		/// Once by finish(), before the file is renamed
+		DURABILITY_AT_CLOSE,
+		/// Also every kGroupCommitSize bytes or kGroupCommitInterval, so a crash loses a bounded amount
+		DURABILITY_GROUP_COMMIT
+	};
+
 	FileWriter();
 	~FileWriter();
 
+	/// Applies to files opened afterwards as well
+	void setDurability(Durability durability);
+	Durability durability() const;
+
+	/// Creates the temporary file for name
 	bool open(const std::wstring& name);
+
+	/**
+	 * Writes buffered data, forces them to the disk according to the durability mode
+	 *	and renames the temporary file to its final name, replacing an existing file.
+	 * The file is closed even if this fails.
+	 */
+	bool finish();
+
+	/// Closes the file, an unfinished file is kept under its temporary name
 	void close();
-	bool write(const std::vector<char>& buf);
+
+	/**
+	 * Preallocates a file which is about to be written from the beginning, so it is not fragmented.
+	 * Large files are also mapped, so that received data are copied straight to the file system cache
+	 *	rather than passed through WriteFile(). Returns false if the file is written as usual.
+	 * Unwritten tail of the preallocated file is cut when the file is closed.
+	 */
+	bool reserve(__int64 fileSize);
+
+	/**
+	 * Appends data after the previous write().
+	 * Small writes are coalesced into kWriteBufferSize aligned ones, so a failure may be reported by a later call.
+	 */
+	bool write(const BufferChain& buf);
+	bool write(const char* buf, size_t size);
+
+	/// Writes data at offset, may be called by several threads at once
+	bool writeAt(const BufferChain& buf, __int64 offset);
+	bool writeAt(const char* buf, size_t size, __int64 offset);
+
+	/**
+	 * Leaves a range as a hole of a sparse file rather than writes zeros, the range counts as written.
+	 * A hole at the position of write() moves the position past it.
+	 */
+	bool writeHole(__int64 offset, __int64 size);
+
+	/// Size of the part written without gaps from the beginning
 	__int64 size() const;
 
+	/// Returns true if the first size bytes were written
+	bool isComplete(__int64 size) const;
+
+	/// Ranges written since the file was opened
+	RangeSet written() const;
+
+	/// Returns hash of data written since the file was opened, false if they were not written in order
+	bool hash(T_UI8& value) const;
+
+	/// Returns hash of the written data read back from the file, so data written out of order are hashed too
+	bool readHash(T_UI8& value);
+
+	/// Files smaller than this are not worth mapping
+	static const __int64 kMinMappedSize = 4 * 1024 * 1024;
+
+	/// Size of a mapped window, a multiple of the allocation granularity
+	static const __int64 kViewSize = 64 * 1024 * 1024;
+
+	/// Size and alignment of coalesced writes
+	static const size_t kWriteBufferSize = 1024 * 1024;
+
+	/// Group commit is done once this much data or time passed since the previous one
+	static const __int64 kGroupCommitSize = 64 * 1024 * 1024;
+	static const DWORD kGroupCommitInterval = 1000;
+
+	/// Suffix of the temporary file
+	static const wchar_t* const kTempSuffix;
+
 private:
-	FILE* m_file;
+	/// Buffers data of write(), writes the buffer once it reaches an aligned offset
+	bool writeBuffered(const char* buf, size_t size);
+
+	/// Writes the buffered data, returns false if this or a previous deferred write failed
+	bool flushBuffer();
+
+	/// Forces data to the disk if a group commit is due
+	void groupCommit(size_t size);
+
+	/// Forces data written so far to the disk
+	bool sync();
+
+	/// Copies data to mapped views, moves views as the position advances
+	bool writeMapped(const char* buf, size_t size);
+
+	/// Unmaps the file and cuts it after the written data, further data are written by WriteFile()
+	void unmap();
+
+	/// Unmaps the current window, its pages are written back first if data must be durable
+	void unmapView();
+
+	/// Accounts written data, m_sync must be locked
+	void commit(const char* buf, size_t size, __int64 offset);
+
+	mutable ThreadMutex m_sync;
+
+	FileHandle m_file;
 	std::wstring m_name;
+	std::wstring m_tempName;
+
+	Durability m_durability;
+
+	/// Position of the next write(), data before it may still be buffered
+	__int64 m_position;
+
+	/// Data of write() which end at m_position and are not written yet
+	std::vector<char> m_buffer;
+
+	/// Set once a deferred write fails
+	bool m_failed;
+
+	/// Set once the file is made sparse by the first hole
+	bool m_sparse;
+
+	/// Data written since the previous group commit
+	__int64 m_unsynced;
+	DWORD m_syncTime;
+
+	/// Ranges written by both write() and writeAt()
+	RangeSet m_written;
+
+	/// File data are hashed as they are written in order, m_hashedSize is -1 once they are not
+	XxHash64 m_hash;
+	__int64 m_hashedSize;
+
+	/// Mapping of a preallocated file, NULL if the file is written by WriteFile()
+	HANDLE m_mapping;
+	__int64 m_reserved;
+
+	/// Current window
+	unsigned char* m_view;
+	__int64 m_viewOffset;
+	size_t m_viewSize;
 };
 
-} // namespace util
\ No newline at end of file
+} // namespace util
@@ -0,0 +1,274 @@
+#include "Lz4.hpp"
+#include "Error.hpp"
+
+#include <cstring>
+
+namespace util {
+
+namespace {
+
+const size_t kMinMatch = 4;
+
+/// The last match must start at least 12 bytes before the end of a block
+const size_t kMatchFindLimit = 12;
+
+/// The last 5 bytes of a block are always literals
+const size_t kLastLiterals = 5;
+
+const size_t kMaxOffset = 65535;
+
+const int kHashLog = 12;
+
+/// Search step grows each 2^kSkipTrigger failed attempts, so incompressible data are passed quickly
+const int kSkipTrigger = 6;
+
+inline T_UI4
+read32(const unsigned char* p)
+{
+	T_UI4 v = 0;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline T_UI4
+hash(T_UI4 sequence)
+{
+	return (sequence * 2654435761U) >> (32 - kHashLog);
+}
+
+inline unsigned char*
+writeLength(unsigned char* op, size_t len)
+{
+	while (255 <= len)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+
+	*op++ = static_cast<unsigned char>(len);
+	return op;
+}
+
+inline unsigned char*
+writeLiterals(unsigned char* op, const unsigned char* anchor, size_t literals, unsigned char*& token)
+{
+	token = op++;
+
+	if (15 <= literals)
+	{
+		*token = 15 << 4;
+		op = writeLength(op, literals - 15);
+	}
+	else
+	{
+		*token = static_cast<unsigned char>(literals << 4);
+	}
+
+	memcpy(op, anchor, literals);
+	return op + literals;
+}
+
+inline size_t
+readLength(const unsigned char*& ip, const unsigned char* iend)
+{
+	size_t len = 0;
+	unsigned char b = 0;
+
+	do
+	{
+		if (ip >= iend)
+			throw util::Error("Malformed LZ4 block");
+
+		b = *ip++;
+		len += b;
+	}
+	while (255 == b);
+
+	return len;
+}
+
+} // namespace
+
+size_t
+Lz4::compressBound(size_t srcSize)
+{
+	return srcSize + srcSize / 255 + 16;
+}
+
+size_t
+Lz4::compress(
+	const unsigned char* src,
+	size_t srcSize,
+	unsigned char* dst,
+	size_t dstCapacity,
+	int acceleration)
+{
+	if (dstCapacity < compressBound(srcSize))
+		throw util::Error("LZ4 output buffer is too small");
+
+	if (1 > acceleration)
+		acceleration = 1;
+	if (kMaxAcceleration < acceleration)
+		acceleration = kMaxAcceleration;
+
+	const unsigned char* ip = src;
+	const unsigned char* anchor = src;
+	const unsigned char* const iend = src + srcSize;
+	unsigned char* op = dst;
+	unsigned char* token = 0;
+
+	if (kMatchFindLimit + 1 <= srcSize)
+	{
+		const unsigned char* const mflimit = iend - kMatchFindLimit;
+		const unsigned char* const matchlimit = iend - kLastLiterals;
+
+		// Positions of recent sequences, relative to src
+		T_UI4 table[1 << kHashLog];
+		memset(table, 0, sizeof(table));
+
+		table[hash(read32(ip))] = 0;
+		++ip;
+
+		while (true)
+		{
+			// Find a match
+			const unsigned char* ref = 0;
+			{
+				const unsigned char* forward = ip;
+				unsigned searchMatchNb = acceleration << kSkipTrigger;
+
+				do
+				{
+					ip = forward;
+					forward = ip + (searchMatchNb++ >> kSkipTrigger);
+
+					if (forward > mflimit)
+						goto lastLiterals;
+
+					T_UI4 h = hash(read32(ip));
+					ref = src + table[h];
+					table[h] = static_cast<T_UI4>(ip - src);
+				}
+				while (ref + kMaxOffset < ip || read32(ref) != read32(ip));
+			}
+
+			// Extend the match backwards
+			while (ip > anchor && ref > src && ip[-1] == ref[-1])
+			{
+				--ip;
+				--ref;
+			}
+
+			op = writeLiterals(op, anchor, ip - anchor, token);
+
+			// Offset, little endian
+			size_t offset = ip - ref;
+			*op++ = static_cast<unsigned char>(offset);
+			*op++ = static_cast<unsigned char>(offset >> 8);
+
+			// Extend the match forwards
+			const unsigned char* matchStart = ip;
+			ip += kMinMatch;
+			ref += kMinMatch;
+			while (ip < matchlimit && *ip == *ref)
+			{
+				++ip;
+				++ref;
+			}
+
+			size_t matchLength = ip - matchStart - kMinMatch;
+			if (15 <= matchLength)
+			{
+				*token |= 15;
+				op = writeLength(op, matchLength - 15);
+			}
+			else
+			{
+				*token |= static_cast<unsigned char>(matchLength);
+			}
+
+			anchor = ip;
+
+			if (ip > mflimit)
+				break;
+
+			table[hash(read32(ip - 2))] = static_cast<T_UI4>(ip - 2 - src);
+		}
+	}
+
+lastLiterals:
+	op = writeLiterals(op, anchor, iend - anchor, token);
+
+	return op - dst;
+}
+
+void
+Lz4::decompress(
+	const unsigned char* src,
+	size_t srcSize,
+	unsigned char* dst,
+	size_t dstSize)
+{
+	const unsigned char* ip = src;
+	const unsigned char* const iend = src + srcSize;
+	unsigned char* op = dst;
+	unsigned char* const oend = dst + dstSize;
+
+	while (ip < iend)
+	{
+		unsigned char token = *ip++;
+
+		size_t literals = token >> 4;
+		if (15 == literals)
+			literals += readLength(ip, iend);
+
+		if (literals > static_cast<size_t>(iend - ip) ||
+			literals > static_cast<size_t>(oend - op))
+		{
+			throw util::Error("Malformed LZ4 block");
+		}
+
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+
+		// The last sequence has no match
+		if (ip == iend)
+			break;
+
+		if (2 > iend - ip)
+			throw util::Error("Malformed LZ4 block");
+
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (0 == offset || offset > static_cast<size_t>(op - dst))
+			throw util::Error("Malformed LZ4 block");
+
+		size_t matchLength = token & 15;
+		if (15 == matchLength)
+			matchLength += readLength(ip, iend);
+		matchLength += kMinMatch;
+
+		if (matchLength > static_cast<size_t>(oend - op))
+			throw util::Error("Malformed LZ4 block");
+
+		const unsigned char* ref = op - offset;
+		if (offset >= matchLength)
+		{
+			memcpy(op, ref, matchLength);
+			op += matchLength;
+		}
+		else
+		{
+			// Overlapping match repeats the last offset bytes
+			for (size_t i = 0; i < matchLength; ++i)
+				*op++ = *ref++;
+		}
+	}
+
+	if (op != oend)
+		throw util::Error("Malformed LZ4 block");
+}
+
+} // namespace util
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstddef>
+
+namespace util {
+
+/**
+ * LZ4 block format codec.
+ * Blocks are compatible with the reference implementation (LZ4_compress_fast()/LZ4_decompress_safe()).
+ */
+class Lz4
+{
+public:
+	/// Maximal acceleration, higher values trade compression ratio for speed
+	static const int kMaxAcceleration = 64;
+
+	/// Returns the output buffer size which is enough to compress srcSize bytes
+	static size_t compressBound(size_t srcSize);
+
+	/**
+	 * Compresses a block, dst must have at least compressBound(srcSize) bytes.
+	 * Acceleration 1 gives the best ratio. Returns the compressed size.
+	 */
+	static size_t compress(
+		const unsigned char* src,
+		size_t srcSize,
+		unsigned char* dst,
+		size_t dstCapacity,
+		int acceleration = 1);
+
+	/**
+	 * Decompresses a block into dst, which must have exactly the original size.
+	 * Throws util::Error if the block is malformed.
+	 */
+	static void decompress(
+		const unsigned char* src,
+		size_t srcSize,
+		unsigned char* dst,
+		size_t dstSize);
+};
+
+} // namespace util
@@ -0,0 +1,115 @@
+#include "RangeSet.hpp"
+
+namespace util
+{
+
+RangeSet::RangeSet()
+	: m_covered(0)
+{
+}
+
+__int64 RangeSet::add(__int64 offset, __int64 size)
+{
+	if (0 >= size)
+		return 0;
+
+	__int64 begin = offset;
+	__int64 end = offset + size;
+	__int64 before = m_covered;
+
+	// Range preceding the new one may touch it
+	TRanges::iterator ii = m_ranges.upper_bound(begin);
+	if (ii != m_ranges.begin())
+	{
+		TRanges::iterator prev = ii;
+		--prev;
+		if (prev->second >= begin)
+		{
+			begin = prev->first;
+			if (prev->second > end)
+				end = prev->second;
+
+			m_covered -= prev->second - prev->first;
+			ii = m_ranges.erase(prev);
+		}
+	}
+
+	// Ranges starting within the new one are absorbed
+	while (ii != m_ranges.end() && ii->first <= end)
+	{
+		if (ii->second > end)
+			end = ii->second;
+
+		m_covered -= ii->second - ii->first;
+		ii = m_ranges.erase(ii);
+	}
+
+	m_ranges[begin] = end;
+	m_covered += end - begin;
+
+	return m_covered - before;
+}
+
+bool RangeSet::contains(__int64 offset, __int64 size) const
+{
+	if (0 >= size)
+		return true;
+
+	TRanges::const_iterator ii = m_ranges.upper_bound(offset);
+	if (ii == m_ranges.begin())
+		return false;
+
+	--ii;
+	return ii->second >= offset + size;
+}
+
+__int64 RangeSet::prefix() const
+{
+	if (m_ranges.empty() || 0 != m_ranges.begin()->first)
+		return 0;
+
+	return m_ranges.begin()->second;
+}
+
+__int64 RangeSet::end() const
+{
+	return m_ranges.empty() ? 0 : m_ranges.rbegin()->second;
+}
+
+__int64 RangeSet::covered() const
+{
+	return m_covered;
+}
+
+bool RangeSet::isComplete(__int64 size) const
+{
+	return prefix() >= size;
+}
+
+__int64 RangeSet::nextGap(__int64 offset) const
+{
+	TRanges::const_iterator ii = m_ranges.upper_bound(offset);
+	if (ii == m_ranges.begin())
+		return offset;
+
+	--ii;
+	return ii->second > offset ? ii->second : offset;
+}
+
+size_t RangeSet::rangeCount() const
+{
+	return m_ranges.size();
+}
+
+bool RangeSet::empty() const
+{
+	return m_ranges.empty();
+}
+
+void RangeSet::clear()
+{
+	m_ranges.clear();
+	m_covered = 0;
+}
+
+} // namespace util
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <map>
+
+namespace util
+{
+
+/**
+ * Set of disjoint byte ranges.
+ * Tracks parts of a file which were transferred, when chunks arrive out of order or in parallel.
+ * Is not synchronized, owners lock it.
+ */
+class RangeSet
+{
+public:
+	RangeSet();
+
+	/// Adds [offset, offset + size), adjacent and overlapping ranges are merged. Returns number of bytes added.
+	__int64 add(__int64 offset, __int64 size);
+
+	/// Returns true if [offset, offset + size) is covered
+	bool contains(__int64 offset, __int64 size) const;
+
+	/// Size of the range starting at 0, e.g. the part of a file which may be read or hashed sequentially
+	__int64 prefix() const;
+
+	/// End of the last range
+	__int64 end() const;
+
+	/// Number of bytes covered
+	__int64 covered() const;
+
+	/// Returns true if [0, size) is covered
+	bool isComplete(__int64 size) const;
+
+	/// Returns the first offset at or after offset which is not covered
+	__int64 nextGap(__int64 offset) const;
+
+	size_t rangeCount() const;
+	bool empty() const;
+	void clear();
+
+private:
+	typedef std::map<
+		__int64,	// range begin
+		__int64		// range end
+	> TRanges;
+
+	TRanges m_ranges;
+	__int64 m_covered;
+};
+
+} // namespace util
@@ -0,0 +1,236 @@
+#include "ReadAheadPrefetcher.hpp"
+#include "AsyncFileIo.hpp"
+#include "Error.hpp"
+#include "FileReader.hpp"
+#include "ScopedLock.hpp"
+
+namespace util {
+
+ReadAheadPrefetcher::ReadAheadPrefetcher(FileReader& reader, size_t depth, size_t memoryCap)
+: m_reader(reader),
+  m_depth(depth),
+  m_memoryCap(memoryCap),
+  m_chunkSize(0),
+  m_next(0),
+  m_hashedSize(-1),
+  m_inFlight(0),
+  m_chunkRead(NULL)
+{
+	m_chunkRead = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (!m_chunkRead)
+		throw util::Error("Failed to create an event");
+}
+
+ReadAheadPrefetcher::~ReadAheadPrefetcher()
+{
+	// Reads in flight call back the prefetcher
+	for (;;)
+	{
+		{
+			ScopedLock lock(&m_sync);
+			if (0 == m_inFlight)
+				break;
+		}
+
+		::WaitForSingleObject(m_chunkRead, INFINITE);
+	}
+
+	::CloseHandle(m_chunkRead);
+}
+
+void
+ReadAheadPrefetcher::setDepth(size_t depth)
+{
+	m_depth = depth;
+}
+
+void
+ReadAheadPrefetcher::setMemoryCap(size_t memoryCap)
+{
+	m_memoryCap = memoryCap;
+	m_pool.reset();
+}
+
+bool
+ReadAheadPrefetcher::take(BufferChain& data, __int64 position, int size)
+{
+	if (size < 0)
+		return false;
+
+	// Another file is sent
+	if (m_name != m_reader.name())
+	{
+		reset();
+		m_name = m_reader.name();
+	}
+
+	bool ok = false;
+	if (!m_chunks.empty() && m_chunks.front()->position == position && m_chunks.front()->size == static_cast<size_t>(size))
+	{
+		TChunkPtr chunk = m_chunks.front();
+		m_chunks.pop_front();
+
+		wait(chunk);
+		ok = chunk->ok;
+		data = chunk->data;
+	}
+	else
+	{
+		// Position or chunk size changed, the read-ahead is restarted from this chunk
+		m_chunks.clear();
+		ok = m_reader.readAt(data, position, size);
+		m_next = position + size;
+
+		// The last chunk may be smaller than others
+		if (m_next < m_reader.size() && m_chunkSize != static_cast<size_t>(size))
+		{
+			m_chunkSize = size;
+			m_pool.reset();
+		}
+	}
+
+	// Hash is only valid if the file is taken sequentially
+	if (0 == position)
+	{
+		m_hash.reset();
+		m_hashedSize = 0;
+	}
+
+	if (ok && position == m_hashedSize)
+	{
+		for (size_t i = 0; i < data.segmentCount(); ++i)
+			m_hash.update(data.segment(i).data(), data.segment(i).size);
+		m_hashedSize += size;
+	}
+	else
+	{
+		m_hashedSize = -1;
+	}
+
+	if (ok)
+		readAhead();
+
+	return ok;
+}
+
+void
+ReadAheadPrefetcher::skip(__int64 position, __int64 size)
+{
+	if (0 >= size)
+		return;
+
+	if (position == m_hashedSize)
+	{
+		m_hash.updateZeros(size);
+		m_hashedSize += size;
+	}
+	else
+	{
+		m_hashedSize = -1;
+	}
+
+	// Chunks read ahead within the hole are not needed
+	__int64 end = position + size;
+	while (!m_chunks.empty() && m_chunks.front()->position < end)
+		m_chunks.pop_front();
+
+	if (m_chunks.empty() || m_chunks.front()->position != end)
+	{
+		m_chunks.clear();
+		m_next = end;
+	}
+
+	readAhead();
+}
+
+bool
+ReadAheadPrefetcher::hash(T_UI8& value) const
+{
+	if (m_hashedSize != m_reader.size())
+		return false;
+
+	value = m_hash.digest();
+	return true;
+}
+
+void
+ReadAheadPrefetcher::reset()
+{
+	// Reads in flight complete into chunks nobody refers to
+	m_chunks.clear();
+	m_next = 0;
+	m_hashedSize = -1;
+	m_name.clear();
+}
+
+void
+ReadAheadPrefetcher::readAhead()
+{
+	// Mapped file is read ahead by the system
+	if (0 == m_chunkSize || m_chunkSize > m_memoryCap || m_reader.isMapped())
+		return;
+
+	if (!m_pool.get())
+		m_pool.reset(new BufferPool(m_chunkSize, m_memoryCap / m_chunkSize));
+
+	FileReader* reader = &m_reader;
+	while (m_chunks.size() < m_depth && m_next < m_reader.size())
+	{
+		__int64 left = m_reader.size() - m_next;
+		size_t size = left < static_cast<__int64>(m_chunkSize) ? static_cast<size_t>(left) : m_chunkSize;
+
+		// Memory cap is reached, chunks taken by the sender free blocks
+		TBufferBlockPtr block = m_pool->acquire();
+		if (!block)
+			break;
+
+		TChunkPtr chunk = std::make_shared<Chunk>(m_next, size);
+		m_chunks.push_back(chunk);
+		m_next += size;
+
+		{
+			ScopedLock lock(&m_sync);
+			++m_inFlight;
+		}
+
+		AsyncFileIo::instance().submit(0, [this, reader, chunk, block]()
+		{
+			BufferChain data;
+			bool ok = reader->readAt(data, chunk->position, static_cast<int>(chunk->size), block);
+			{
+				ScopedLock lock(&m_sync);
+				chunk->data = data;
+				chunk->ok = ok;
+			}
+			onChunkRead(chunk);
+		});
+	}
+}
+
+void
+ReadAheadPrefetcher::onChunkRead(const TChunkPtr& chunk)
+{
+	// Event is signaled under the lock, so the destructor can't close it meanwhile
+	ScopedLock lock(&m_sync);
+	chunk->done = true;
+	--m_inFlight;
+
+	::SetEvent(m_chunkRead);
+}
+
+void
+ReadAheadPrefetcher::wait(const TChunkPtr& chunk)
+{
+	for (;;)
+	{
+		{
+			ScopedLock lock(&m_sync);
+			if (chunk->done)
+				return;
+		}
+
+		::WaitForSingleObject(m_chunkRead, INFINITE);
+	}
+}
+
+} // namespace util
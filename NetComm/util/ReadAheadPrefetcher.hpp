@@ -0,0 +1,115 @@
+#pragma once
+
+#include <windows.h>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "BufferChain.hpp"
+#include "BufferPool.hpp"
+#include "ThreadMutex.hpp"
+#include "XxHash64.hpp"
+
+namespace util {
+
+class FileReader;
+
+/**
+ * Keeps the next chunks of a file being sent read ahead, so that disk and network latencies overlap.
+ * Chunks are read by util::AsyncFileIo into pooled blocks, so the read-ahead is bounded by both
+ *	the number of chunks and the memory they take.
+ * Chunks of a reader in the mapped mode (see FileReader::setMapped()) refer to the mapping instead,
+ *	the reader prefetches pages ahead of them and no blocks are pooled.
+ * Chunks are expected to be taken in order, a chunk out of order drops the read-ahead and is read at once.
+ * Is used by one thread at a time.
+ */
+class ReadAheadPrefetcher
+{
+public:
+	static const size_t kDefaultDepth = 4;
+	static const size_t kDefaultMemoryCap = 64 * 1024 * 1024;
+
+	explicit ReadAheadPrefetcher(FileReader& reader, size_t depth = kDefaultDepth, size_t memoryCap = kDefaultMemoryCap);
+
+	/// Waits for reads in flight
+	~ReadAheadPrefetcher();
+
+	/// Number of chunks read ahead, 0 disables the read-ahead
+	void setDepth(size_t depth);
+
+	/// Memory taken by chunks read ahead, chunks larger than the cap are not read ahead
+	void setMemoryCap(size_t memoryCap);
+
+	/// Returns the chunk at position, waits for it if it is being read. Reads the following chunks ahead.
+	bool take(BufferChain& data, __int64 position, int size);
+
+	/**
+	 * Accounts a hole of a sparse file which is described rather than taken, the hash covers its zeros.
+	 * The read-ahead continues after the hole.
+	 */
+	void skip(__int64 position, __int64 size);
+
+	/// Returns hash of the whole file, false unless the file was taken sequentially up to its end
+	bool hash(T_UI8& value) const;
+
+	/// Drops chunks read ahead, e.g. once the transfer is stopped
+	void reset();
+
+private:
+	ReadAheadPrefetcher(const ReadAheadPrefetcher&);
+	ReadAheadPrefetcher& operator =(const ReadAheadPrefetcher&);
+
+	struct Chunk
+	{
+		Chunk(__int64 position_, size_t size_)
+		: position(position_),
+		  size(size_),
+		  done(false),
+		  ok(false)
+		{}
+
+		__int64 position;
+		size_t size;
+		bool done;
+		bool ok;
+		BufferChain data;
+	};
+
+	typedef std::shared_ptr<Chunk> TChunkPtr;
+
+	/// Queues reads of the chunks following m_next
+	void readAhead();
+
+	/// Is called by a pool thread once a chunk is read
+	void onChunkRead(const TChunkPtr& chunk);
+
+	/// Waits until a chunk is read
+	void wait(const TChunkPtr& chunk);
+
+private:
+	FileReader& m_reader;
+	size_t m_depth;
+	size_t m_memoryCap;
+
+	/// File and chunk size the read-ahead is done for
+	std::wstring m_name;
+	size_t m_chunkSize;
+	std::auto_ptr<BufferPool> m_pool;
+
+	/// Chunks read ahead in order of positions and position of the chunk to be read next
+	std::deque<TChunkPtr> m_chunks;
+	__int64 m_next;
+
+	/// Chunks are hashed as they are taken, m_hashedSize is -1 if they were not taken in order
+	XxHash64 m_hash;
+	__int64 m_hashedSize;
+
+	/// Guards chunk states and the number of reads in flight
+	mutable ThreadMutex m_sync;
+	size_t m_inFlight;
+
+	/// Is signaled every time a chunk is read
+	HANDLE m_chunkRead;
+};
+
+} // namespace util
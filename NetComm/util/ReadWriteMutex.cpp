@@ -0,0 +1,58 @@
+#include "ReadWriteMutex.hpp"
+#include "utils.h"
+#include <windows.h>
+
+namespace util {
+
+ReadWriteMutex::ReadWriteMutex()
+: m_srw(0)
+{
+	m_srw = new SRWLOCK;
+	::InitializeSRWLock(static_cast<PSRWLOCK>(m_srw));
+}
+
+ReadWriteMutex::~ReadWriteMutex()
+{
+	// Slim locks need not be released
+	delete static_cast<PSRWLOCK>(m_srw);
+	m_srw = 0;
+}
+
+void
+ReadWriteMutex::lock()
+{
+	::AcquireSRWLockExclusive(static_cast<PSRWLOCK>(m_srw));
+}
+
+void
+ReadWriteMutex::unlock()
+{
+	::ReleaseSRWLockExclusive(static_cast<PSRWLOCK>(m_srw));
+}
+
+void
+ReadWriteMutex::lockShared()
+{
+	::AcquireSRWLockShared(static_cast<PSRWLOCK>(m_srw));
+}
+
+void
+ReadWriteMutex::unlockShared()
+{
+	::ReleaseSRWLockShared(static_cast<PSRWLOCK>(m_srw));
+}
+
+ScopedReadLock::ScopedReadLock(util::ReadWriteMutex* sync)
+: m_sync(sync)
+{
+	chkptr(m_sync);
+	m_sync->lockShared();
+}
+
+ScopedReadLock::~ScopedReadLock()
+{
+	chkptr(m_sync);
+	m_sync->unlockShared();
+}
+
+} // namespace util
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "ISyncObject.hpp"
+
+namespace util {
+
+/**
+ * Reader-writer lock implemented by means of a slim reader-writer lock.
+ * lock() and unlock() take it exclusively, so ScopedLock works for writers.
+ * Is not recursive, a thread must not lock it again while it holds it.
+ */
+class ReadWriteMutex : public ISyncObject
+{
+public:
+	ReadWriteMutex();
+	~ReadWriteMutex();
+
+	virtual void lock();
+	virtual void unlock();
+
+	/// Many readers may hold the lock at once
+	void lockShared();
+	void unlockShared();
+
+private:
+	ReadWriteMutex(const ReadWriteMutex&);
+	ReadWriteMutex& operator =(const ReadWriteMutex&);
+
+	void* m_srw;
+};
+
+/// Provides scoped shared locking of a reader-writer lock.
+class ScopedReadLock
+{
+public:
+	ScopedReadLock(util::ReadWriteMutex* sync);
+	~ScopedReadLock();
+
+private:
+	util::ReadWriteMutex* m_sync;
+};
+
+} // namespace util
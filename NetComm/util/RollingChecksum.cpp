@@ -0,0 +1,118 @@
+#include "RollingChecksum.hpp"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#define KROLLING_SSE2
+#endif
+
+namespace util {
+
+namespace {
+
+#ifdef KROLLING_SSE2
+
+/// Adds 32-bit lanes of a vector
+T_UI4
+horizontalSum(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return static_cast<T_UI4>(_mm_cvtsi128_si32(v));
+}
+
+/**
+ * Sums 16-byte groups of a block.
+ * A group adds its bytes to a, and 16 * a before the group plus its bytes weighted by 16..1 to b,
+ *	which is the same as 16 scalar steps. Sums of a before every group are collected in a vector
+ *	and multiplied by 16 at the end, so the loop does no horizontal additions.
+ */
+size_t
+sumGroups(const unsigned char* p, size_t size, T_UI4& a, T_UI4& b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weightsLo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+	const __m128i weightsHi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+
+	__m128i va = zero;
+	__m128i vPrefix = zero;
+	__m128i vWeighted = zero;
+
+	size_t groups = size / 16;
+	for (size_t i = 0; i < groups; ++i, p += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+
+		vPrefix = _mm_add_epi32(vPrefix, va);
+
+		// Sums of absolute differences from zero are sums of bytes of both halves
+		va = _mm_add_epi32(va, _mm_sad_epu8(v, zero));
+
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		vWeighted = _mm_add_epi32(vWeighted, _mm_madd_epi16(lo, weightsLo));
+		vWeighted = _mm_add_epi32(vWeighted, _mm_madd_epi16(hi, weightsHi));
+	}
+
+	a = horizontalSum(va);
+	b = 16 * horizontalSum(vPrefix) + horizontalSum(vWeighted);
+	return groups * 16;
+}
+
+#else
+
+size_t
+sumGroups(const unsigned char* p, size_t size, T_UI4& a, T_UI4& b)
+{
+	a = 0;
+	b = 0;
+	return 0;
+}
+
+#endif
+
+} // namespace
+
+RollingChecksum::RollingChecksum()
+: m_a(0),
+  m_b(0),
+  m_size(0)
+{
+}
+
+void
+RollingChecksum::reset(const void* buf, size_t size)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(buf);
+
+	size_t done = sumGroups(p, size, m_a, m_b);
+	for (size_t i = done; i < size; ++i)
+	{
+		m_a += p[i];
+		m_b += m_a;
+	}
+
+	m_size = static_cast<T_UI4>(size);
+}
+
+void
+RollingChecksum::roll(unsigned char out, unsigned char in)
+{
+	m_a += static_cast<T_UI4>(in) - out;
+	m_b += m_a - m_size * out;
+}
+
+T_UI4
+RollingChecksum::value() const
+{
+	return (m_a & 0xFFFF) | (m_b << 16);
+}
+
+T_UI4
+RollingChecksum::compute(const void* buf, size_t size)
+{
+	RollingChecksum checksum;
+	checksum.reset(buf, size);
+	return checksum.value();
+}
+
+} // namespace util
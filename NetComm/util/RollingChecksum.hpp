@@ -0,0 +1,38 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstddef>
+
+namespace util {
+
+/**
+ * Weak checksum of a block (rsync's variant of Adler-32), which may be rolled over a buffer byte by byte.
+ * A block is summed by SSE2 16 bytes at a time, rolling takes a few scalar operations per byte,
+ *	so every offset of a file may be looked up in a signature of another file.
+ */
+class RollingChecksum
+{
+public:
+	RollingChecksum();
+
+	/// Starts over with a block, the block size stays the same while the checksum is rolled
+	void reset(const void* buf, size_t size);
+
+	/// Moves the block by one byte: out leaves it at the front, in enters it at the back
+	void roll(unsigned char out, unsigned char in);
+
+	/// Returns checksum of the current block
+	T_UI4 value() const;
+
+	/// Returns checksum of a block
+	static T_UI4 compute(const void* buf, size_t size);
+
+private:
+	/// Sums of bytes and of bytes weighted by their distance from the end of the block, both wrap around
+	T_UI4 m_a;
+	T_UI4 m_b;
+	T_UI4 m_size;
+};
+
+} // namespace util
@@ -0,0 +1,45 @@
+#include "Stopwatch.hpp"
+#include <windows.h>
+
+namespace util {
+
+namespace {
+
+double
+counterFrequency()
+{
+	LARGE_INTEGER frequency;
+	::QueryPerformanceFrequency(&frequency);
+	return static_cast<double>(frequency.QuadPart);
+}
+
+const double s_frequency = counterFrequency();
+
+__int64
+counter()
+{
+	LARGE_INTEGER value;
+	::QueryPerformanceCounter(&value);
+	return value.QuadPart;
+}
+
+} // namespace
+
+Stopwatch::Stopwatch()
+: m_start(counter())
+{
+}
+
+void
+Stopwatch::restart()
+{
+	m_start = counter();
+}
+
+double
+Stopwatch::seconds() const
+{
+	return (counter() - m_start) / s_frequency;
+}
+
+} // namespace util
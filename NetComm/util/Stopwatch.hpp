@@ -0,0 +1,21 @@
+#pragma once
+
+namespace util {
+
+/// Measures elapsed time by means of the performance counter
+class Stopwatch
+{
+public:
+	/// Starts measuring
+	Stopwatch();
+
+	void restart();
+
+	/// Returns seconds elapsed since the stopwatch was started
+	double seconds() const;
+
+private:
+	__int64 m_start;
+};
+
+} // namespace util
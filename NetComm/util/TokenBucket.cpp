@@ -0,0 +1,85 @@
+#include "TokenBucket.hpp"
+
+namespace util {
+
+TokenBucket::TokenBucket(double rate, double burst)
+: m_rate(rate),
+  m_burst(burst),
+  m_tokens(burst),
+  m_refilled(0)
+{
+}
+
+void
+TokenBucket::setRate(double rate, double burst, double now)
+{
+	refill(now);
+
+	// Bucket which was not limited starts full
+	if (!isLimited())
+		m_tokens = burst;
+
+	m_rate = rate;
+	m_burst = burst;
+
+	if (m_tokens > m_burst)
+		m_tokens = m_burst;
+}
+
+double
+TokenBucket::rate() const
+{
+	return m_rate;
+}
+
+double
+TokenBucket::burst() const
+{
+	return m_burst;
+}
+
+bool
+TokenBucket::isLimited() const
+{
+	return 0 < m_rate;
+}
+
+double
+TokenBucket::delay(double now)
+{
+	if (!isLimited())
+		return 0;
+
+	refill(now);
+
+	// Debt of less than a byte is rounding of the refill, it is not waited for
+	return -1 < m_tokens ? 0 : -m_tokens / m_rate;
+}
+
+void
+TokenBucket::consume(double bytes, double now)
+{
+	if (!isLimited())
+		return;
+
+	refill(now);
+	m_tokens -= bytes;
+}
+
+void
+TokenBucket::refill(double now)
+{
+	if (now > m_refilled)
+	{
+		if (isLimited())
+		{
+			m_tokens += (now - m_refilled) * m_rate;
+			if (m_tokens > m_burst)
+				m_tokens = m_burst;
+		}
+
+		m_refilled = now;
+	}
+}
+
+} // namespace util
@@ -0,0 +1,41 @@
+#pragma once
+
+namespace util {
+
+/**
+ * Token bucket rate limiter, time is given by the caller in seconds.
+ * Tokens accrue at rate up to burst. A send is allowed while the bucket is not in debt, it may take more tokens
+ *	than the bucket holds, so that a frame larger than the burst is still sent, and the debt delays the next one.
+ * Is not synchronized, owners lock it.
+ */
+class TokenBucket
+{
+public:
+	/// Rate 0 means unlimited
+	TokenBucket(double rate = 0, double burst = 0);
+
+	/// Changes the limit keeping the tokens accrued so far (up to the new burst)
+	void setRate(double rate, double burst, double now);
+
+	double rate() const;
+	double burst() const;
+	bool isLimited() const;
+
+	/// Returns seconds to wait until a send is allowed, 0 if it is allowed now
+	double delay(double now);
+
+	/// Takes tokens of sent bytes
+	void consume(double bytes, double now);
+
+private:
+	/// Adds tokens accrued since the last refill
+	void refill(double now);
+
+private:
+	double m_rate;
+	double m_burst;
+	double m_tokens;
+	double m_refilled;
+};
+
+} // namespace util
@@ -0,0 +1,91 @@
+#include "TreeWalker.hpp"
+
+namespace util {
+
+TreeWalker::TreeWalker()
+{
+}
+
+TreeWalker::~TreeWalker()
+{
+	close();
+}
+
+bool
+TreeWalker::open(const std::wstring& root)
+{
+	close();
+
+	m_root = root;
+	while (!m_root.empty() && (L'\\' == m_root[m_root.size() - 1] || L'/' == m_root[m_root.size() - 1]))
+		m_root.erase(m_root.size() - 1);
+
+	return push(std::wstring());
+}
+
+void
+TreeWalker::close()
+{
+	for (std::vector<Level>::iterator ii = m_levels.begin(); ii != m_levels.end(); ++ii)
+		::FindClose(ii->find);
+
+	m_levels.clear();
+}
+
+bool
+TreeWalker::next(Entry& entry)
+{
+	while (!m_levels.empty())
+	{
+		Level& level = m_levels.back();
+		if (!level.pending && !::FindNextFileW(level.find, &level.item))
+		{
+			::FindClose(level.find);
+			m_levels.pop_back();
+			continue;
+		}
+
+		level.pending = false;
+
+		const WIN32_FIND_DATAW& item = level.item;
+		if (0 == wcscmp(item.cFileName, L".") || 0 == wcscmp(item.cFileName, L".."))
+			continue;
+
+		entry.path = level.dir.empty() ? item.cFileName : level.dir + L"\\" + item.cFileName;
+		entry.isDir = 0 != (item.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+		entry.size = entry.isDir ? 0 : (static_cast<__int64>(item.nFileSizeHigh) << 32) | item.nFileSizeLow;
+
+		// Directory which could not be listed is returned empty
+		if (entry.isDir && 0 == (item.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+			push(entry.path);
+
+		return true;
+	}
+
+	return false;
+}
+
+const std::wstring&
+TreeWalker::root() const
+{
+	return m_root;
+}
+
+bool
+TreeWalker::push(const std::wstring& dir)
+{
+	Level level;
+	level.dir = dir;
+	level.pending = true;
+	memset(&level.item, 0, sizeof(level.item));
+
+	std::wstring mask = dir.empty() ? m_root + L"\\*" : m_root + L"\\" + dir + L"\\*";
+	level.find = ::FindFirstFileW(mask.c_str(), &level.item);
+	if (INVALID_HANDLE_VALUE == level.find)
+		return false;
+
+	m_levels.push_back(level);
+	return true;
+}
+
+} // namespace util
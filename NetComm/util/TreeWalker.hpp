@@ -0,0 +1,64 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+namespace util {
+
+/**
+ * Walks a directory tree depth first, a directory is returned before its content.
+ * Only one directory per level is open at a time, so trees of any size are walked in constant memory per level.
+ * Links to directories (reparse points) are returned but not followed, so the walk never loops.
+ * Is used by one thread at a time.
+ */
+class TreeWalker
+{
+public:
+	struct Entry
+	{
+		Entry()
+		: isDir(false),
+		  size(0)
+		{}
+
+		/// Path relative to the root, components are separated by backslashes
+		std::wstring path;
+		bool isDir;
+		__int64 size;
+	};
+
+	TreeWalker();
+	~TreeWalker();
+
+	/// Starts walking a directory, returns false if it could not be listed
+	bool open(const std::wstring& root);
+	void close();
+
+	/// Returns the next entry, false once the tree is walked
+	bool next(Entry& entry);
+
+	const std::wstring& root() const;
+
+private:
+	TreeWalker(const TreeWalker&);
+	TreeWalker& operator =(const TreeWalker&);
+
+	/// Lists a directory relative to the root, its first item is returned by the next call of next()
+	bool push(const std::wstring& dir);
+
+	struct Level
+	{
+		HANDLE find;
+		std::wstring dir;
+		WIN32_FIND_DATAW item;
+
+		/// Item was found by FindFirstFileW() and is not returned yet
+		bool pending;
+	};
+
+	std::wstring m_root;
+	std::vector<Level> m_levels;
+};
+
+} // namespace util
@@ -0,0 +1,215 @@
+#include "XxHash64.hpp"
+
+#include <cstring>
+
+namespace util {
+
+namespace {
+
+const T_UI8 kPrime1 = 11400714785074694791ULL;
+const T_UI8 kPrime2 = 14029467366897019727ULL;
+const T_UI8 kPrime3 = 1609587929392839161ULL;
+const T_UI8 kPrime4 = 9650029242287828579ULL;
+const T_UI8 kPrime5 = 2870177450012600261ULL;
+
+inline T_UI8
+rotl(T_UI8 x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+inline T_UI8
+read64(const unsigned char* p)
+{
+	T_UI8 v = 0;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline T_UI4
+read32(const unsigned char* p)
+{
+	T_UI4 v = 0;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline T_UI8
+round64(T_UI8 acc, T_UI8 input)
+{
+	acc += input * kPrime2;
+	acc = rotl(acc, 31);
+	return acc * kPrime1;
+}
+
+inline T_UI8
+mergeRound(T_UI8 acc, T_UI8 val)
+{
+	acc ^= round64(0, val);
+	return acc * kPrime1 + kPrime4;
+}
+
+} // namespace
+
+XxHash64::XxHash64(T_UI8 seed)
+{
+	reset(seed);
+}
+
+void
+XxHash64::reset(T_UI8 seed)
+{
+	m_seed = seed;
+	m_totalSize = 0;
+	m_acc[0] = seed + kPrime1 + kPrime2;
+	m_acc[1] = seed + kPrime2;
+	m_acc[2] = seed;
+	m_acc[3] = seed - kPrime1;
+	m_bufSize = 0;
+}
+
+void
+XxHash64::update(const void* buf, size_t size)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(buf);
+	const unsigned char* end = p + size;
+
+	m_totalSize += size;
+
+	// Complete a stripe started by previous calls
+	if (0 < m_bufSize)
+	{
+		size_t cb = sizeof(m_buf) - m_bufSize;
+		if (cb > size)
+			cb = size;
+
+		memcpy(m_buf + m_bufSize, p, cb);
+		m_bufSize += cb;
+		p += cb;
+
+		if (sizeof(m_buf) > m_bufSize)
+			return;
+
+		for (int i = 0; i < 4; ++i)
+			m_acc[i] = round64(m_acc[i], read64(m_buf + i * 8));
+		m_bufSize = 0;
+	}
+
+	// Process whole stripes directly from the input
+	if (sizeof(m_buf) <= static_cast<size_t>(end - p))
+	{
+		T_UI8 v1 = m_acc[0];
+		T_UI8 v2 = m_acc[1];
+		T_UI8 v3 = m_acc[2];
+		T_UI8 v4 = m_acc[3];
+
+		const unsigned char* limit = end - sizeof(m_buf);
+		do
+		{
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+			p += 32;
+		}
+		while (p <= limit);
+
+		m_acc[0] = v1;
+		m_acc[1] = v2;
+		m_acc[2] = v3;
+		m_acc[3] = v4;
+	}
+
+	// Keep the tail for the next call
+	if (p < end)
+	{
+		m_bufSize = end - p;
+		memcpy(m_buf, p, m_bufSize);
+	}
+}
+
+void
+XxHash64::updateZeros(T_UI8 size)
+{
+	static const unsigned char kZeros[32] = { 0 };
+
+	// Complete a stripe started by previous calls
+	if (0 < m_bufSize)
+	{
+		size_t cb = sizeof(m_buf) - m_bufSize;
+		if (cb > size)
+			cb = static_cast<size_t>(size);
+
+		update(kZeros, cb);
+		size -= cb;
+	}
+
+	// Whole stripes of zeros just advance the accumulators
+	for (T_UI8 stripes = size / sizeof(m_buf); 0 < stripes; --stripes)
+	{
+		for (int i = 0; i < 4; ++i)
+			m_acc[i] = round64(m_acc[i], 0);
+	}
+	m_totalSize += size - size % sizeof(m_buf);
+
+	update(kZeros, static_cast<size_t>(size % sizeof(m_buf)));
+}
+
+T_UI8
+XxHash64::digest() const
+{
+	T_UI8 h = 0;
+
+	if (sizeof(m_buf) <= m_totalSize)
+	{
+		h = rotl(m_acc[0], 1) + rotl(m_acc[1], 7) + rotl(m_acc[2], 12) + rotl(m_acc[3], 18);
+		for (int i = 0; i < 4; ++i)
+			h = mergeRound(h, m_acc[i]);
+	}
+	else
+	{
+		h = m_seed + kPrime5;
+	}
+
+	h += m_totalSize;
+
+	const unsigned char* p = m_buf;
+	const unsigned char* end = m_buf + m_bufSize;
+
+	for (; p + 8 <= end; p += 8)
+	{
+		h ^= round64(0, read64(p));
+		h = rotl(h, 27) * kPrime1 + kPrime4;
+	}
+
+	if (p + 4 <= end)
+	{
+		h ^= static_cast<T_UI8>(read32(p)) * kPrime1;
+		h = rotl(h, 23) * kPrime2 + kPrime3;
+		p += 4;
+	}
+
+	for (; p < end; ++p)
+	{
+		h ^= (*p) * kPrime5;
+		h = rotl(h, 11) * kPrime1;
+	}
+
+	h ^= h >> 33;
+	h *= kPrime2;
+	h ^= h >> 29;
+	h *= kPrime3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+T_UI8
+XxHash64::compute(const void* buf, size_t size, T_UI8 seed)
+{
+	XxHash64 hash(seed);
+	hash.update(buf, size);
+	return hash.digest();
+}
+
+} // namespace util
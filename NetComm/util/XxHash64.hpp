@@ -0,0 +1,43 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstddef>
+
+namespace util {
+
+/**
+ * Streaming XXH64 hash.
+ * Is fast enough to hash file data while they are transferred.
+ */
+class XxHash64
+{
+public:
+	explicit XxHash64(T_UI8 seed = 0);
+
+	/// Starts a new hash
+	void reset(T_UI8 seed = 0);
+
+	/// Appends data to the hash
+	void update(const void* buf, size_t size);
+
+	/// Appends size zero bytes, e.g. a hole of a sparse file, without reading memory
+	void updateZeros(T_UI8 size);
+
+	/// Returns hash of data appended so far
+	T_UI8 digest() const;
+
+	/// Returns hash of a buffer
+	static T_UI8 compute(const void* buf, size_t size, T_UI8 seed = 0);
+
+private:
+	T_UI8 m_seed;
+	T_UI8 m_totalSize;
+	T_UI8 m_acc[4];
+
+	/// Input not yet consumed by the accumulators, which process 32-byte stripes
+	unsigned char m_buf[32];
+	size_t m_bufSize;
+};
+
+} // namespace util
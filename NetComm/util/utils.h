@@ -16,5 +16,6 @@ template<> struct StaticAssert<true> {};
 
 typedef unsigned char T_UI1;
 typedef unsigned int T_UI4;
+typedef unsigned __int64 T_UI8;
 
 } // namespace util
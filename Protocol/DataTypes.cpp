@@ -1,5 +1,7 @@
 #include "DataTypes.hpp"
 
+#include <util/utils.h>
+#include <util/Error.hpp>
 #include <util/MemoryStream.hpp>
 
 void DirItem::save(util::MemoryStream& out)
@@ -40,6 +42,18 @@ void FileRequest::save(util::MemoryStream& out)
 		out.write((const unsigned char*)m_fileName.c_str(), sz);
 
 	out << m_startFrom;
+
+	// Chunk size is appended to the original format, older endpoints ignore it
+	out << m_size;
+
+	// Signature is appended as well, it is only sent to endpoints which support delta transfers
+	bool hasSignature = m_signature && !m_signature->empty();
+	out << hasSignature;
+	if (hasSignature)
+		m_signature->save(out);
+
+	// Request of the file hash follows, older endpoints ignore it and the file is not checked as a whole
+	out << m_wantFileHash;
 }
 
 void FileRequest::load(util::MemoryStream& in)
@@ -54,10 +68,74 @@ void FileRequest::load(util::MemoryStream& in)
 		in.read((unsigned char*)&m_fileName.front(), sz);
 
 	in >> m_startFrom;
+
+	// Older endpoints do not send chunk size
+	__int64 size = 0;
+	in >> size;
+	m_size = in.fail() ? 0 : size;
+
+	// A malformed signature is dropped, the file is sent whole then
+	bool hasSignature = false;
+	in >> hasSignature;
+
+	m_signature.reset();
+	if (!in.fail() && hasSignature)
+	{
+		std::shared_ptr<util::DeltaSignature> signature = std::make_shared<util::DeltaSignature>();
+		if (signature->load(in))
+			m_signature = signature;
+	}
+
+	// Older endpoints do not ask for the file hash
+	bool wantFileHash = false;
+	in >> wantFileHash;
+	m_wantFileHash = !in.fail() && wantFileHash;
 }
 
 
 void FileChunk::save(util::MemoryStream& out)
+{
+	size_t sz = m_fileData.size();
+	savePrefix(out, sz);
+	for (size_t i = 0; i < m_fileData.segmentCount(); ++i)
+		out.write(m_fileData.segment(i).data(), m_fileData.segment(i).size);
+	saveSuffix(out);
+}
+
+void FileChunk::load(util::MemoryStream& in)
+{
+	size_t sz;
+	loadPrefix(in, sz);
+
+	m_fileData.clear();
+	if (sz)
+	{
+		util::TBufferBlockPtr block = std::make_shared<util::BufferBlock>(sz);
+		in.read(block->tail(), sz);
+		block->commit(static_cast<size_t>(in.gcount()));
+
+		m_fileData.append(block, 0, block->size());
+	}
+
+	loadSuffix(in);
+}
+
+void FileChunk::save(util::BufferChain& out)
+{
+	util::MemoryStream prefix;
+	savePrefix(prefix, m_fileData.size());
+	std::basic_string<unsigned char> buf = prefix.str();
+	out.append(util::BufferChain::copy(buf.data(), buf.size()));
+
+	out.append(m_fileData);
+
+	util::MemoryStream suffix;
+	saveSuffix(suffix);
+	buf = suffix.str();
+	out.append(util::BufferChain::copy(buf.data(), buf.size()));
+}
+
+void FileChunk::savePrefix(util::MemoryStream& out, size_t dataSize)
 {
 	size_t len = m_fileName.size();
 	out << len;
@@ -68,14 +146,10 @@ void FileChunk::save(util::MemoryStream& out)
 		out.write((const unsigned char*)m_fileName.c_str(), sz);
 	out << m_fileSize;
 	out << m_positionFrom;
-	sz = m_fileData.size();
-	out << sz;
-	if (sz)
-		out.write((const unsigned char*)&m_fileData.front(), sz);
-	out << m_valid;
+	out << dataSize;
 }
 
-void FileChunk::load(util::MemoryStream& in)
+void FileChunk::loadPrefix(util::MemoryStream& in, size_t& dataSize)
 {
 	size_t len;
 	in >> len;
@@ -89,11 +163,336 @@ void FileChunk::load(util::MemoryStream& in)
 
 	in >> m_fileSize;
 	in >> m_positionFrom;
+	in >> dataSize;
+}
+
+void FileChunk::saveSuffix(util::MemoryStream& out)
+{
+	out << m_valid;
+
+	// File hash is appended to the original format, older endpoints ignore it
+	out << m_hasFileHash;
+	if (m_hasFileHash)
+		out << m_fileHash;
+
+	// Hole is appended as well, it is only sent to endpoints which support sparse files
+	out << m_holeSize;
+
+	// Delta is appended as well, it is only sent to endpoints which support delta transfers
+	util::T_UI4 count = static_cast<util::T_UI4>(m_delta.size());
+	out << count;
+	for (util::TDeltaOps::const_iterator ii = m_delta.begin(); ii != m_delta.end(); ++ii)
+	{
+		out << ii->offset;
+		out << ii->size;
+	}
+}
+
+void FileChunk::loadSuffix(util::MemoryStream& in)
+{
+	in >> m_valid;
+
+	// Older endpoints do not send file hash
+	bool hasFileHash = false;
+	in >> hasFileHash;
+	if (!in.fail() && hasFileHash)
+		in >> m_fileHash;
+
+	m_hasFileHash = !in.fail() && hasFileHash;
+
+	// Older endpoints do not describe holes
+	__int64 holeSize = 0;
+	in >> holeSize;
+	m_holeSize = in.fail() || holeSize < 0 ? 0 : holeSize;
+
+	// Hole must not extend the file, it would be allocated by the receiver
+	__int64 end = m_positionFrom + m_sunkSize + static_cast<__int64>(m_fileData.size());
+	if (0 < m_holeSize && m_holeSize > m_fileSize - end)
+		throw util::Error("Malformed file chunk");
+
+	// Older endpoints do not send delta, ops are bounded by the suffix size
+	util::T_UI4 count = 0;
+	in >> count;
+
+	m_delta.clear();
+	for (util::T_UI4 i = 0; i < count && !in.fail(); ++i)
+	{
+		util::DeltaOp op;
+		in >> op.offset;
+		in >> op.size;
+
+		if (!in.fail())
+			m_delta.push_back(op);
+	}
+
+	if (in.fail())
+		m_delta.clear();
+}
+
+
+void TreeEntry::save(util::MemoryStream& out)
+{
+	size_t len = m_path.size();
+	out << len;
+
+	size_t sz = m_path.size() * sizeof(wchar_t);
+	out << sz;
+	if (sz)
+		out.write((const unsigned char*)m_path.c_str(), sz);
+
+	out << m_isDir;
+	out << m_fileSize;
+	out << m_offset;
+
+	size_t dataSize = m_data.size();
+	out << dataSize;
+	for (size_t i = 0; i < m_data.segmentCount(); ++i)
+		out.write(m_data.segment(i).data(), m_data.segment(i).size);
+
+	out << m_last;
+	out << m_valid;
+	out << m_fileHash;
+}
+
+void TreeEntry::load(util::MemoryStream& in)
+{
+	size_t len = 0;
+	in >> len;
 
+	size_t sz = 0;
 	in >> sz;
-	m_fileData.resize(sz);
+
+	// Batch carries thousands of entries, a malformed path fails the batch rather than allocates
+	if (in.fail() || len > kMaxPathLength || sz != len * sizeof(wchar_t))
+	{
+		in.setstate(std::ios::failbit);
+		return;
+	}
+
+	m_path.resize(len);
 	if (sz)
-		in.read((unsigned char*)&m_fileData.front(), sz);
+		in.read((unsigned char*)&m_path.front(), sz);
+
+	in >> m_isDir;
+	in >> m_fileSize;
+	in >> m_offset;
+
+	size_t dataSize = 0;
+	in >> dataSize;
+
+	// Data are within the message
+	if (!in.fail() && dataSize > static_cast<size_t>(in.rdbuf()->in_avail()))
+		in.setstate(std::ios::failbit);
+
+	m_data.clear();
+	if (!in.fail() && dataSize)
+	{
+		util::TBufferBlockPtr block = std::make_shared<util::BufferBlock>(dataSize);
+		in.read(block->tail(), dataSize);
+		block->commit(static_cast<size_t>(in.gcount()));
+
+		m_data.append(block, 0, block->size());
+	}
 
+	in >> m_last;
 	in >> m_valid;
-}
\ No newline at end of file
+	in >> m_fileHash;
+}
+
+void TreeBatch::save(util::MemoryStream& out)
+{
+	out << m_sequence;
+	out << m_done;
+	out << m_valid;
+
+	util::T_UI4 count = static_cast<util::T_UI4>(m_entries.size());
+	out << count;
+	for (TTreeEntries::iterator ii = m_entries.begin(); ii != m_entries.end(); ++ii)
+		ii->save(out);
+}
+
+void TreeBatch::load(util::MemoryStream& in)
+{
+	in >> m_sequence;
+	in >> m_done;
+	in >> m_valid;
+
+	util::T_UI4 count = 0;
+	in >> count;
+
+	m_entries.clear();
+	for (util::T_UI4 i = 0; i < count && !in.fail(); ++i)
+	{
+		TreeEntry entry;
+		entry.load(in);
+
+		if (!in.fail())
+			m_entries.push_back(entry);
+	}
+
+	if (in.fail())
+	{
+		m_entries.clear();
+		m_valid = false;
+	}
+}
+
+FileChunkLoader::FileChunkLoader(FileChunk& chunk)
+	: m_state(LOAD_PREFIX_HEADER)
+	, m_chunk(chunk)
+	, m_size(0)
+	, m_loaded(0)
+	, m_prefixSize(0)
+	, m_dataLeft(0)
+	, m_useSink(false)
+{
+}
+
+void FileChunkLoader::begin(size_t size)
+{
+	m_state = LOAD_PREFIX_HEADER;
+	m_buf.clear();
+	m_size = size;
+	m_loaded = 0;
+	m_prefixSize = 0;
+	m_dataLeft = 0;
+	m_useSink = false;
+
+	m_chunk.m_fileData.clear();
+	m_chunk.m_sunkSize = 0;
+	m_chunk.m_sinkFailed = false;
+}
+
+void FileChunkLoader::load(const unsigned char* buf, size_t bufSize)
+{
+	load(util::BufferChain::copy(buf, bufSize));
+}
+
+void FileChunkLoader::load(const util::BufferChain& data)
+{
+	m_loaded += data.size();
+	if (m_loaded > m_size)
+		throw util::Error("File chunk is larger than announced");
+
+	for (size_t i = 0; i < data.segmentCount(); ++i)
+	{
+		const util::BufferChain::Segment& segment = data.segment(i);
+		size_t offset = 0;
+
+		while (offset < segment.size)
+		{
+			const unsigned char* buf = segment.data() + offset;
+			size_t bufSize = segment.size - offset;
+			size_t cb = 0;
+
+			switch (m_state)
+			{
+			case LOAD_PREFIX_HEADER:
+				// File name length and size come first, they determine the prefix size
+				cb = collect(m_buf, 2 * sizeof(size_t), buf, bufSize);
+				if (2 * sizeof(size_t) == m_buf.size())
+				{
+					size_t nameSize = 0;
+					memcpy(&nameSize, &m_buf[sizeof(size_t)], sizeof(nameSize));
+
+					if (nameSize > m_size)
+						throw util::Error("Malformed file chunk");
+
+					m_prefixSize = 2 * sizeof(size_t) + nameSize + 2 * sizeof(__int64) + sizeof(size_t);
+					m_state = LOAD_PREFIX;
+				}
+				break;
+			case LOAD_PREFIX:
+				cb = collect(m_buf, m_prefixSize, buf, bufSize);
+				if (m_prefixSize == m_buf.size())
+					onPrefixLoaded();
+				break;
+			case LOAD_DATA:
+				{
+					// Data are not copied, the chunk refers to the received blocks
+					cb = bufSize < m_dataLeft ? bufSize : m_dataLeft;
+
+					util::BufferChain part;
+					part.append(segment, offset, cb);
+					loadData(part);
+
+					m_dataLeft -= cb;
+					if (0 == m_dataLeft)
+						m_state = LOAD_SUFFIX;
+				}
+				break;
+			case LOAD_SUFFIX:
+				cb = collect(m_buf, m_buf.size() + bufSize, buf, bufSize);
+				break;
+			default:
+				assert(!"Unknown state");
+			}
+
+			offset += cb;
+		}
+	}
+}
+
+void FileChunkLoader::end()
+{
+	if (LOAD_SUFFIX != m_state)
+		throw util::Error("File chunk is incomplete");
+
+	const unsigned char* suffix = m_buf.empty() ? 0 : &m_buf[0];
+	util::MemoryStream in(suffix, suffix + m_buf.size());
+	m_chunk.loadSuffix(in);
+}
+
+size_t FileChunkLoader::collect(std::vector<unsigned char>& buf, size_t size, const unsigned char* data, size_t dataSize)
+{
+	assert(buf.size() <= size);
+
+	size_t cb = size - buf.size();
+	if (cb > dataSize)
+		cb = dataSize;
+
+	buf.insert(buf.end(), data, data + cb);
+	return cb;
+}
+
+void FileChunkLoader::onPrefixLoaded()
+{
+	util::MemoryStream in(&m_buf[0], &m_buf[0] + m_buf.size());
+	m_chunk.loadPrefix(in, m_dataLeft);
+	m_buf.clear();
+
+	if (m_dataLeft > m_size - m_prefixSize)
+		throw util::Error("Malformed file chunk");
+
+	if (0 < m_dataLeft)
+	{
+		m_useSink = m_chunk.m_sink && m_chunk.m_sink->beginChunkData(m_chunk);
+
+		m_state = LOAD_DATA;
+	}
+	else
+	{
+		m_state = LOAD_SUFFIX;
+	}
+}
+
+void FileChunkLoader::loadData(const util::BufferChain& data)
+{
+	if (!m_useSink)
+	{
+		m_chunk.m_fileData.append(data);
+		return;
+	}
+
+	if (m_chunk.m_sinkFailed)
+		return;
+
+	chkptr(m_chunk.m_sink);
+	if (!m_chunk.m_sink->writeChunkData(m_chunk, data))
+	{
+		m_chunk.m_sinkFailed = true;
+		return;
+	}
+
+	m_chunk.m_sunkSize += data.size();
+}
@@ -3,6 +3,10 @@
 #include <string>
 #include <vector>
 
+#include <util/BufferChain.hpp>
+#include <util/DeltaEncoder.hpp>
+#include <util/DeltaSignature.hpp>
+
 namespace util
 {
 class MemoryStream;
@@ -27,6 +31,8 @@ struct FileRequest
 {
 	FileRequest()
 		: m_startFrom(0)
+		, m_size(0)
+		, m_wantFileHash(false)
 	{}
 
 	void save(util::MemoryStream& out);
@@ -34,6 +40,51 @@ struct FileRequest
 
 	std::wstring m_fileName;
 	__int64 m_startFrom;
+
+	/// Requested chunk size, 0 lets the sender choose it
+	__int64 m_size;
+
+	/**
+	 * Signature of the receiver's copy of the file, is sent with the first request of a delta transfer.
+	 * Chunks are sent as differences to the copy then and m_size is the size of the file they encode.
+	 */
+	util::TDeltaSignaturePtr m_signature;
+
+	/// Asks for hash of the whole file with the chunk, since ranges of a striped download are not read in order
+	bool m_wantFileHash;
+};
+
+struct FileChunk;
+
+/// Receives chunk data as they arrive, so that chunks are not collected in memory
+struct IFileChunkSink
+{
+	virtual ~IFileChunkSink() {}
+
+	/**
+	 * Is called once file name, size and position of a chunk are known.
+	 * Return false to collect chunk data in FileChunk::m_fileData instead.
+	 */
+	virtual bool beginChunkData(const FileChunk& chunk) = 0;
+
+	/// Is called for every fragment of chunk data, returns false if data could not be consumed
+	virtual bool writeChunkData(const FileChunk& chunk, const char* buf, size_t bufSize) = 0;
+
+	/**
+	 * Is called instead of the above with received data, the sink may keep them (e.g. to write them later).
+	 * FileChunk::m_sunkSize is the offset of data within the chunk.
+	 */
+	virtual bool writeChunkData(const FileChunk& chunk, const util::BufferChain& data)
+	{
+		for (size_t i = 0; i < data.segmentCount(); ++i)
+		{
+			const util::BufferChain::Segment& segment = data.segment(i);
+			if (!writeChunkData(chunk, reinterpret_cast<const char*>(segment.data()), segment.size))
+				return false;
+		}
+
+		return true;
+	}
 };
 
 struct FileChunk
@@ -42,14 +93,160 @@ struct FileChunk
 		: m_fileSize(0)
 		, m_positionFrom(0)
 		, m_valid(false)
+		, m_hasFileHash(false)
+		, m_fileHash(0)
+		, m_holeSize(0)
+		, m_sink(0)
+		, m_sunkSize(0)
+		, m_sinkFailed(false)
 	{}
 
 	void save(util::MemoryStream& out);
 	void load(util::MemoryStream& in);
 
+	/// Serializes the chunk into a chain which shares m_fileData rather than copies it
+	void save(util::BufferChain& out);
+
 	std::wstring m_fileName;
 	__int64 m_fileSize;
 	__int64 m_positionFrom;
-	std::vector<char> m_fileData;
+
+	/// Data are shared with buffers they were read to, either from a file or from a stream
+	util::BufferChain m_fileData;
+	bool m_valid;
+
+	/// Hash (XXH64) of the whole file, is sent with the last chunk to verify the transferred file
+	bool m_hasFileHash;
+	unsigned __int64 m_fileHash;
+
+	/**
+	 * Size of a hole of a sparse file which follows chunk data, the receiver recreates it rather than receives zeros.
+	 * The hole may extend beyond the requested range, it is only sent if both endpoints support sparse files.
+	 */
+	__int64 m_holeSize;
+
+	/**
+	 * Chunk of a delta transfer is a list of copies of the receiver's copy of the file and literal data,
+	 *	m_fileData are the literal data then. The chunk describes the file from m_positionFrom on,
+	 *	possibly not the range the chunk was requested for. Is empty for data sent as is.
+	 */
+	util::TDeltaOps m_delta;
+
+	/// Optional receiver of chunk data, is not serialized
+	IFileChunkSink* m_sink;
+	/// Number of data bytes consumed by m_sink rather than collected in m_fileData
+	__int64 m_sunkSize;
+	/// Is set if m_sink failed to consume data, the rest of data are dropped
+	bool m_sinkFailed;
+
+private:
+	friend class FileChunkLoader;
+
+	void savePrefix(util::MemoryStream& out, size_t dataSize);
+	void loadPrefix(util::MemoryStream& in, size_t& dataSize);
+	void saveSuffix(util::MemoryStream& out);
+	void loadSuffix(util::MemoryStream& in);
+};
+
+/**
+ * Loads FileChunk incrementally as its serialized data arrive (see msg::IStreamingMessage).
+ * Chunk data are passed to FileChunk::m_sink if it is set, otherwise they are collected in FileChunk::m_fileData.
+ */
+class FileChunkLoader
+{
+public:
+	explicit FileChunkLoader(FileChunk& chunk);
+
+	void begin(size_t size);
+	void load(const unsigned char* buf, size_t bufSize);
+
+	/// Chunk data are kept in the chain blocks rather than copied
+	void load(const util::BufferChain& data);
+
+	void end();
+
+private:
+	/// Collects bytes to buf until it contains size bytes, returns number of bytes consumed
+	static size_t collect(std::vector<unsigned char>& buf, size_t size, const unsigned char* data, size_t dataSize);
+
+	void onPrefixLoaded();
+	void loadData(const util::BufferChain& data);
+
+	enum
+	{
+		LOAD_PREFIX_HEADER = 0,
+		LOAD_PREFIX,
+		LOAD_DATA,
+		LOAD_SUFFIX
+	} m_state;
+
+	FileChunk& m_chunk;
+	std::vector<unsigned char> m_buf;
+	size_t m_size;
+	size_t m_loaded;
+	size_t m_prefixSize;
+	size_t m_dataLeft;
+	bool m_useSink;
+};
+
+/// Entry of a directory tree being transferred, either a directory or a piece of a file
+struct TreeEntry
+{
+	TreeEntry()
+		: m_isDir(false)
+		, m_fileSize(0)
+		, m_offset(0)
+		, m_last(false)
+		, m_valid(true)
+		, m_fileHash(0)
+	{}
+
+	void save(util::MemoryStream& out);
+	void load(util::MemoryStream& in);
+
+	/// The longest path Windows supports
+	static const size_t kMaxPathLength = 32767;
+
+	/// Path relative to the transferred directory, components are separated by backslashes
+	std::wstring m_path;
+	bool m_isDir;
+	__int64 m_fileSize;
+
+	/// Offset of m_data within the file, a large file is sent in pieces by consecutive batches
+	__int64 m_offset;
+	util::BufferChain m_data;
+
+	/// Is set for the last piece of a file, which carries hash (XXH64) of the whole file
+	bool m_last;
+
+	/// Is cleared if the file could not be read, the receiver drops what it received of the file
+	bool m_valid;
+	unsigned __int64 m_fileHash;
+};
+
+typedef std::vector<TreeEntry> TTreeEntries;
+
+/**
+ * Batch of entries of a directory tree in the order the sender walks the tree, small files are packed whole.
+ * Batches are acknowledged once they are written, the sender keeps a window of them in flight.
+ */
+struct TreeBatch
+{
+	TreeBatch()
+		: m_sequence(0)
+		, m_done(false)
+		, m_valid(true)
+	{}
+
+	void save(util::MemoryStream& out);
+	void load(util::MemoryStream& in);
+
+	util::T_UI4 m_sequence;
+	TTreeEntries m_entries;
+
+	/// Is set for the last batch of the tree
+	bool m_done;
+
+	/// Is cleared if the tree could not be walked
 	bool m_valid;
 };
@@ -1,15 +1,51 @@
 #include "MessageIdentity.hpp"
 
 #include <windows.h>
+#include <algorithm>
 #include <cstdlib>
 #include <ctime>
 #include <util/ScopedArray.hpp>
 
 #include "SvcMsgFactory.hpp"
 
+namespace {
+
+/// Chunk size used with older endpoints
+const size_t kLegacyChunkSize = 1024 * 100;
+
+/// Chunk size used if both endpoints know frame size limits of each other
+const size_t kChunkSize = 1024 * 1024;
+
+/// Room for a file name and other chunk fields in a frame
+const size_t kChunkOverhead = 1024 * 64;
+
+/// Number of chunks in flight this build handles
+const util::T_UI4 kWindowSize = 4;
+
+/// Reads a field appended to the original format, returns false if the endpoint did not send it
+bool
+readOptional(msg::IMessage::TIStream& in, util::T_UI4& value)
+{
+	util::T_UI4 v = 0;
+	in >> v;
+	if (in.fail())
+		return false;
+
+	value = v;
+	return true;
+}
+
+} // namespace
+
 
 MessageIdentity::MessageIdentity()
 	: Message(SvcMsgFactory::MSG_IDENTITY)
+	, m_version(PROTOCOL_VERSION)
+	, m_features(kSupportedFeatures)
+	, m_maxFrameSize(msg::Messenger::kMaxFrameSize)
+	, m_windowSize(kWindowSize)
+	, m_codecs(CODEC_LZ4)
+	, m_connection(0)
 {
 }
 
@@ -17,32 +53,20 @@ void
 MessageIdentity::save(TOStream& out)
 {
 	if (m_identity.empty())
-	{
-		std::stringstream sid;
-
-		// try to get computer name as identity
-		const char* szIdentity = getenv("COMPUTERNAME");
-		if (szIdentity && *szIdentity)
-		{
-			sid << szIdentity;
-		}
-		else
-		{
-			// Some random identity
-			srand(time(0) && 0xFFFF);
-			sid << rand();
-		}
-
-		// Append process ID
-		sid << "-" << (int)::GetCurrentProcessId();
-
-		m_identity = sid.str();
-	}
+		m_identity = localName();
 
 	const char* sz = m_identity.c_str();
 	unsigned int len = m_identity.length();
 	out << len;
 	out.write(reinterpret_cast<const unsigned char*>(sz), len);
+
+	// Fields are appended to the original format, older endpoints ignore them
+	out << m_features;
+	out << m_version;
+	out << m_maxFrameSize;
+	out << m_windowSize;
+	out << m_codecs;
+	out << m_connection;
 }
 
 void
@@ -57,4 +81,112 @@ MessageIdentity::load(TIStream& in)
 	in.read(reinterpret_cast<unsigned char*>(buf.get()), len);
 
 	m_identity = buf.get();
+
+	// Older endpoints send only a part of the fields
+	m_version = PROTOCOL_VERSION_LEGACY;
+	m_features = 0;
+	m_maxFrameSize = 0;
+	m_windowSize = 1;
+	m_codecs = 0;
+	m_connection = 0;
+
+	if (readOptional(in, m_features))
+	{
+		// Version 1 endpoints compress with LZ4 if they support compression at all
+		m_version = PROTOCOL_VERSION_FEATURES;
+		if (m_features & FEATURE_COMPRESSION)
+			m_codecs = CODEC_LZ4;
+
+		if (readOptional(in, m_version))
+		{
+			readOptional(in, m_maxFrameSize);
+			readOptional(in, m_windowSize);
+			readOptional(in, m_codecs);
+			readOptional(in, m_connection);
+		}
+	}
+}
+
+SessionParams
+MessageIdentity::negotiate(const MessageIdentity& local, const MessageIdentity& remote)
+{
+	SessionParams params;
+
+	params.m_version = (std::min)(local.m_version, remote.m_version);
+	params.m_features = local.m_features & remote.m_features;
+	params.m_codecs = local.m_codecs & remote.m_codecs;
+	params.m_maxFrameSize = remote.m_maxFrameSize;
+
+	if (0 == params.m_codecs)
+		params.m_features &= ~FEATURE_COMPRESSION;
+
+	// Pipelining and larger chunks are only used if the peer reports its limits
+	if (PROTOCOL_VERSION_LIMITS <= params.m_version)
+	{
+		params.m_windowSize = (std::max)(1U, (std::min)(local.m_windowSize, remote.m_windowSize));
+
+		// Chunks fit frames of both endpoints, so both derive the same chunk size
+		util::T_UI4 maxFrameSize = (std::min)(local.m_maxFrameSize, remote.m_maxFrameSize);
+		if (0 == maxFrameSize)
+			maxFrameSize = (std::max)(local.m_maxFrameSize, remote.m_maxFrameSize);
+
+		params.m_chunkSize = kChunkSize;
+		if (0 < maxFrameSize && params.m_chunkSize + kChunkOverhead > maxFrameSize)
+		{
+			params.m_chunkSize = maxFrameSize > kLegacyChunkSize + kChunkOverhead ?
+				maxFrameSize - kChunkOverhead :
+				kLegacyChunkSize;
+		}
+	}
+
+	return params;
+}
+
+
+std::string
+MessageIdentity::localName()
+{
+	std::stringstream sid;
+
+	// try to get computer name as identity
+	const char* szIdentity = getenv("COMPUTERNAME");
+	if (szIdentity && *szIdentity)
+	{
+		sid << szIdentity;
+	}
+	else
+	{
+		// Some random identity
+		srand(time(0) && 0xFFFF);
+		sid << rand();
+	}
+
+	// Append process ID
+	sid << "-" << (int)::GetCurrentProcessId();
+
+	return sid.str();
+}
+
+
+SessionParams::SessionParams()
+	: m_version(MessageIdentity::PROTOCOL_VERSION_LEGACY)
+	, m_features(0)
+	, m_codecs(0)
+	, m_maxFrameSize(0)
+	, m_windowSize(1)
+	, m_chunkSize(kLegacyChunkSize)
+{
+}
+
+msg::StreamOptions
+SessionParams::streamOptions() const
+{
+	msg::StreamOptions options;
+
+	options.frameChecksums = 0 != (m_features & MessageIdentity::FEATURE_FRAME_CHECKSUMS);
+	options.compression = 0 != (m_features & MessageIdentity::FEATURE_COMPRESSION) &&
+		0 != (m_codecs & MessageIdentity::CODEC_LZ4);
+	options.maxFrameSize = m_maxFrameSize;
+
+	return options;
 }
@@ -1,16 +1,112 @@
 #pragma once
 
 #include <msg/IMessage.hpp>
+#include <msg/Messenger.hpp>
 
-/// Message 'endpoint identity'
+struct SessionParams;
+
+/**
+ * Message 'endpoint identity'.
+ * Is the first message sent over a stream, besides the identity it describes protocol version,
+ *	features and limits of the endpoint. Both endpoints agree on a common mode by means of negotiate().
+ */
 class MessageIdentity : public msg::Message
 {
 public:
+	/// Describes this build
 	MessageIdentity();
 
 	virtual void save(TOStream& out);
 
 	virtual void load(TIStream& in);
 
+	/// Returns the best mode supported by both endpoints
+	static SessionParams negotiate(const MessageIdentity& local, const MessageIdentity& remote);
+
+	/// Identity of this process, is sent unless another one is set
+	static std::string localName();
+
+	/**
+	 * Protocol versions.
+	 * Version 0 endpoints send just the identity, version 1 endpoints add features.
+	 */
+	enum
+	{
+		PROTOCOL_VERSION_LEGACY = 0,
+		PROTOCOL_VERSION_FEATURES = 1,
+		PROTOCOL_VERSION_LIMITS = 2,
+		PROTOCOL_VERSION = PROTOCOL_VERSION_LIMITS
+	};
+
+	/// Optional protocol features, which are enabled if both endpoints support them
+	enum
+	{
+		FEATURE_FRAME_CHECKSUMS = 0x1,
+		FEATURE_COMPRESSION = 0x2,
+		/// Holes of sparse files are described by FileChunk::m_holeSize rather than sent
+		FEATURE_SPARSE_FILES = 0x4,
+		/// Files the receiver already has are sent as differences to its copy (see util::DeltaEncoder)
+		FEATURE_DELTA = 0x8,
+		/// Files are offered as chunks cut by content, only chunks the receiver does not store are sent (see util::ChunkStore)
+		FEATURE_DEDUP = 0x10,
+		/// Directory trees are streamed as one operation (see MessageRequestTree)
+		FEATURE_TREE = 0x20,
+		/// Several files are requested at once and streamed like a tree (see MessageRequestFiles)
+		FEATURE_BATCH_FETCH = 0x40,
+		/// Upload replies name their files, so several files are uploaded at once (see MessageUploadFileReply)
+		FEATURE_NAMED_REPLIES = 0x80,
+		/// Endpoint opens extra connections on request, ranges of large files are striped across them (see MessageOpenConnections)
+		FEATURE_DATA_CONNECTIONS = 0x100
+	};
+
+	/// Compression codecs
+	enum
+	{
+		CODEC_LZ4 = 0x1
+	};
+
+	/// Features supported by this build
+	static const util::T_UI4 kSupportedFeatures = FEATURE_FRAME_CHECKSUMS | FEATURE_COMPRESSION | FEATURE_SPARSE_FILES | FEATURE_DELTA | FEATURE_DEDUP | FEATURE_TREE | FEATURE_BATCH_FETCH | FEATURE_NAMED_REPLIES | FEATURE_DATA_CONNECTIONS;
+
 	std::string m_identity;
+
+	util::T_UI4 m_version;
+
+	/// Is 0 if the endpoint does not report features
+	util::T_UI4 m_features;
+
+	/// The largest frame payload the endpoint accepts, 0 if unknown
+	util::T_UI4 m_maxFrameSize;
+
+	/// Number of file chunks the endpoint is able to handle without waiting for each of them
+	util::T_UI4 m_windowSize;
+
+	/// Supported compression codecs
+	util::T_UI4 m_codecs;
+
+	/// Connection of the endpoint, 0 for the first one, extra data connections are numbered from 1
+	util::T_UI4 m_connection;
+};
+
+/// Mode of a stream agreed by both endpoints
+struct SessionParams
+{
+	SessionParams();
+
+	/// Frame options for msg::Messenger::setStreamOptions()
+	msg::StreamOptions streamOptions() const;
+
+	/// Common protocol version, features and codecs
+	util::T_UI4 m_version;
+	util::T_UI4 m_features;
+	util::T_UI4 m_codecs;
+
+	/// The largest frame payload the peer accepts, 0 if unknown
+	util::T_UI4 m_maxFrameSize;
+
+	/// Number of file chunks which may be requested or sent without waiting for each of them
+	util::T_UI4 m_windowSize;
+
+	/// Size of file chunks
+	size_t m_chunkSize;
 };
@@ -0,0 +1,20 @@
+#include "MessageOpenConnections.hpp"
+#include "SvcMsgFactory.hpp"
+
+MessageOpenConnections::MessageOpenConnections()
+	: Message(SvcMsgFactory::MSG_OPEN_CONNECTIONS)
+	, m_count(0)
+{
+}
+
+void
+MessageOpenConnections::save(TOStream& out)
+{
+	out << m_count;
+}
+
+void
+MessageOpenConnections::load(TIStream& in)
+{
+	in >> m_count;
+}
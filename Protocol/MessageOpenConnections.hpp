@@ -0,0 +1,20 @@
+#pragma once
+
+#include <msg/IMessage.hpp>
+
+/**
+ * Message 'open connections', asks an endpoint to keep extra data connections to the server.
+ * Data connections identify themselves by MessageIdentity::m_connection, the server stripes ranges
+ *	of large downloads across them. Is only sent to endpoints supporting FEATURE_DATA_CONNECTIONS.
+ */
+class MessageOpenConnections : public msg::Message
+{
+public:
+	MessageOpenConnections();
+
+	virtual void save(TOStream& out);
+	virtual void load(TIStream& in);
+
+	/// Number of data connections besides the first one
+	util::T_UI4 m_count;
+};
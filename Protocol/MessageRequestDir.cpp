@@ -6,6 +6,7 @@
 
 MessageRequestDir::MessageRequestDir()
 	: Message(SvcMsgFactory::MSG_REQUEST_DIR)
+	, m_requestId(0)
 {
 }
 
@@ -24,6 +25,9 @@ MessageRequestDir::save(TOStream& out)
 	unsigned int lenDir = m_dir.length();
 	out << lenDir;
 	out.write(reinterpret_cast<const unsigned char*>(szDir), lenDir);*/
+
+	// Request ID is appended to the original format, older endpoints ignore it
+	out << m_requestId;
 }
 
 void
@@ -38,4 +42,9 @@ MessageRequestDir::load(TIStream& in)
 
 	if (sz)
 		in.read((unsigned char*)&m_dir.front(), sz);
+
+	// Older endpoints do not send request ID
+	util::T_UI4 requestId = 0;
+	in >> requestId;
+	m_requestId = in.fail() ? 0 : requestId;
 }
@@ -12,4 +12,7 @@ public:
 	virtual void load(TIStream& in);
 
 	std::wstring m_dir;
+
+	/// Is echoed by the response, so responses are matched to requests sent at once. 0 if the sender does not match them.
+	util::T_UI4 m_requestId;
 };
@@ -0,0 +1,114 @@
+#include "MessageRequestFiles.hpp"
+#include "SvcMsgFactory.hpp"
+
+#include <windows.h>
+
+namespace {
+
+/// The longest path Windows supports
+const size_t kMaxPathLength = 32767;
+
+void saveString(msg::Message::TOStream& out, const std::wstring& s)
+{
+	size_t len = s.size();
+	out << len;
+
+	size_t sz = s.size() * sizeof(wchar_t);
+	out << sz;
+	if (sz)
+		out.write((const unsigned char*)s.c_str(), sz);
+}
+
+bool loadString(msg::Message::TIStream& in, std::wstring& s, size_t maxLength)
+{
+	size_t len = 0;
+	in >> len;
+
+	size_t sz = 0;
+	in >> sz;
+
+	// A string longer than a path means the message is malformed
+	if (in.fail() || len > maxLength || sz != len * sizeof(wchar_t))
+		return false;
+
+	s.resize(len);
+	if (sz)
+		in.read((unsigned char*)&s.front(), sz);
+	return !in.fail();
+}
+
+} // namespace
+
+MessageRequestFiles::MessageRequestFiles()
+	: Message(SvcMsgFactory::MSG_REQUEST_FILES)
+{
+}
+
+void
+MessageRequestFiles::save(TOStream& out)
+{
+	saveString(out, m_dir);
+	saveString(out, m_pattern);
+
+	size_t count = m_names.size();
+	out << count;
+	for (std::vector<std::wstring>::const_iterator ii = m_names.begin(); ii != m_names.end(); ++ii)
+		saveString(out, *ii);
+}
+
+void
+MessageRequestFiles::load(TIStream& in)
+{
+	m_names.clear();
+
+	// A malformed request names no files, so none are sent
+	if (!loadString(in, m_dir, kMaxPathLength) || !loadString(in, m_pattern, kMaxPathLength))
+	{
+		m_pattern.clear();
+		return;
+	}
+
+	size_t count = 0;
+	in >> count;
+	if (in.fail() || count > kMaxFileCount)
+	{
+		m_pattern.clear();
+		return;
+	}
+
+	m_names.resize(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!loadString(in, m_names[i], kMaxPathLength))
+		{
+			m_names.clear();
+			m_pattern.clear();
+			return;
+		}
+	}
+}
+
+std::vector<std::wstring>
+MessageRequestFiles::files(const std::wstring& dir) const
+{
+	if (!m_names.empty() || m_pattern.empty())
+		return m_names;
+
+	// Files matching the pattern are listed by the file system
+	std::vector<std::wstring> names;
+
+	WIN32_FIND_DATAW fd;
+	memset(&fd, 0, sizeof(fd));
+
+	HANDLE h = ::FindFirstFileW((dir + L"\\" + m_pattern).c_str(), &fd);
+	if (INVALID_HANDLE_VALUE == h)
+		return names;
+
+	do {
+		if (0 == (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			names.push_back(fd.cFileName);
+	} while (names.size() < kMaxFileCount && ::FindNextFileW(h, &fd));
+
+	::FindClose(h);
+	return names;
+}
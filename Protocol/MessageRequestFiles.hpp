@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <msg/IMessage.hpp>
+
+/**
+ * Message 'request files'.
+ * Requests several files of a directory at once, either by names or by a wildcard pattern.
+ * The files are streamed like a directory tree (see MessageRequestTree), so small files are packed
+ *	into shared frames and none of them costs a round trip of its own.
+ */
+class MessageRequestFiles : public msg::Message
+{
+public:
+	MessageRequestFiles();
+
+	virtual void save(TOStream& out);
+	virtual void load(TIStream& in);
+
+	/**
+	 * Returns names of the requested files of the directory on disk: the names if there are any,
+	 *	otherwise files matching the pattern. Directories are skipped, at most kMaxFileCount files are listed.
+	 */
+	std::vector<std::wstring> files(const std::wstring& dir) const;
+
+	/// The most files one request names
+	static const size_t kMaxFileCount = 1024;
+
+	std::wstring m_dir;
+
+	/// Names relative to the directory, the pattern is used if there are none
+	std::vector<std::wstring> m_names;
+	std::wstring m_pattern;
+};
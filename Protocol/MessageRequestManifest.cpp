@@ -0,0 +1,32 @@
+#include "MessageRequestManifest.hpp"
+#include "SvcMsgFactory.hpp"
+
+MessageRequestManifest::MessageRequestManifest()
+	: Message(SvcMsgFactory::MSG_REQUEST_MANIFEST)
+{
+}
+
+void
+MessageRequestManifest::save(TOStream& out)
+{
+	size_t len = m_fileName.size();
+	out << len;
+
+	size_t sz = m_fileName.size() * sizeof(wchar_t);
+	out << sz;
+	if (sz)
+		out.write((const unsigned char*)m_fileName.c_str(), sz);
+}
+
+void
+MessageRequestManifest::load(TIStream& in)
+{
+	size_t len;
+	in >> len;
+	m_fileName.resize(len);
+
+	size_t sz;
+	in >> sz;
+	if (sz)
+		in.read((unsigned char*)&m_fileName.front(), sz);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <msg/IMessage.hpp>
+
+/**
+ * Message 'request manifest'.
+ * Is sent before a file is downloaded in dedup mode, the sender of the file replies by MessageResponseManifest
+ *	with the chunks of the file, then only the chunks the receiver does not store are requested.
+ */
+class MessageRequestManifest : public msg::Message
+{
+public:
+	MessageRequestManifest();
+
+	virtual void save(TOStream& out);
+	virtual void load(TIStream& in);
+
+	std::wstring m_fileName;
+};
@@ -0,0 +1,32 @@
+#include "MessageRequestSignature.hpp"
+#include "SvcMsgFactory.hpp"
+
+MessageRequestSignature::MessageRequestSignature()
+	: Message(SvcMsgFactory::MSG_REQUEST_SIGNATURE)
+{
+}
+
+void
+MessageRequestSignature::save(TOStream& out)
+{
+	size_t len = m_fileName.size();
+	out << len;
+
+	size_t sz = m_fileName.size() * sizeof(wchar_t);
+	out << sz;
+	if (sz)
+		out.write((const unsigned char*)m_fileName.c_str(), sz);
+}
+
+void
+MessageRequestSignature::load(TIStream& in)
+{
+	size_t len;
+	in >> len;
+	m_fileName.resize(len);
+
+	size_t sz;
+	in >> sz;
+	if (sz)
+		in.read((unsigned char*)&m_fileName.front(), sz);
+}
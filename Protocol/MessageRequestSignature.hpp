@@ -0,0 +1,19 @@
+#pragma once
+
+#include <msg/IMessage.hpp>
+
+/**
+ * Message 'request signature'.
+ * Is sent before a file is uploaded in delta mode, the receiver replies by MessageResponseSignature
+ *	with the signature of its copy of the file.
+ */
+class MessageRequestSignature : public msg::Message
+{
+public:
+	MessageRequestSignature();
+
+	virtual void save(TOStream& out);
+	virtual void load(TIStream& in);
+
+	std::wstring m_fileName;
+};
@@ -0,0 +1,32 @@
+#include "MessageRequestTree.hpp"
+#include "SvcMsgFactory.hpp"
+
+MessageRequestTree::MessageRequestTree()
+	: Message(SvcMsgFactory::MSG_REQUEST_TREE)
+{
+}
+
+void
+MessageRequestTree::save(TOStream& out)
+{
+	size_t len = m_dir.size();
+	out << len;
+
+	size_t sz = m_dir.size() * sizeof(wchar_t);
+	out << sz;
+	if (sz)
+		out.write((const unsigned char*)m_dir.c_str(), sz);
+}
+
+void
+MessageRequestTree::load(TIStream& in)
+{
+	size_t len;
+	in >> len;
+	m_dir.resize(len);
+
+	size_t sz;
+	in >> sz;
+	if (sz)
+		in.read((unsigned char*)&m_dir.front(), sz);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <msg/IMessage.hpp>
+
+/**
+ * Message 'request tree'.
+ * Requests a whole directory tree at once, the sender walks the tree and streams it by MessageTreeData
+ *	without waiting for requests of single files. Every batch is acknowledged by MessageTreeAck.
+ */
+class MessageRequestTree : public msg::Message
+{
+public:
+	MessageRequestTree();
+
+	virtual void save(TOStream& out);
+	virtual void load(TIStream& in);
+
+	std::wstring m_dir;
+};
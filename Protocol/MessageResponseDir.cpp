@@ -6,6 +6,7 @@
 
 MessageResponseDir::MessageResponseDir()
 	: Message(SvcMsgFactory::MSG_RESPONSE_DIR)
+	, m_requestId(0)
 {
 }
 
@@ -18,6 +19,9 @@ MessageResponseDir::save(TOStream& out)
 	for(auto item : m_content) {
 		item.save(out);
 	} 
+
+	// Request ID is appended to the original format, older endpoints ignore it
+	out << m_requestId;
 }
 
 void
@@ -33,4 +37,9 @@ MessageResponseDir::load(TIStream& in)
 		item.load(in);
 		m_content.push_back(item);
 	}
+
+	// Older endpoints do not echo request ID
+	util::T_UI4 requestId = 0;
+	in >> requestId;
+	m_requestId = in.fail() ? 0 : requestId;
 }
@@ -13,4 +13,7 @@ public:
 	virtual void load(TIStream& in);
 
 	TDirItems m_content;
+
+	/// ID of the request (see MessageRequestDir::m_requestId), 0 if older endpoints responded
+	util::T_UI4 m_requestId;
 };
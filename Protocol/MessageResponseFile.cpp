@@ -4,6 +4,7 @@
 
 MessageResponseFile::MessageResponseFile()
 	: Message(SvcMsgFactory::MSG_RESPONSE_FILE)
+	, m_loader(m_response)
 {
 }
 
@@ -16,3 +17,29 @@ void MessageResponseFile::load(TIStream& in)
 {
 	m_response.load(in);
 }
+
+void MessageResponseFile::beginLoad(util::T_UI4 payloadSize)
+{
+	m_loader.begin(payloadSize);
+}
+
+void MessageResponseFile::loadFragment(const unsigned char* buf, size_t bufSize)
+{
+	m_loader.load(buf, bufSize);
+}
+
+void MessageResponseFile::loadFragment(const util::BufferChain& data)
+{
+	m_loader.load(data);
+}
+
+void MessageResponseFile::endLoad()
+{
+	m_loader.end();
+}
+
+bool MessageResponseFile::save(util::BufferChain& out)
+{
+	m_response.save(out);
+	return true;
+}
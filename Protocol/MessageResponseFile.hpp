@@ -1,10 +1,11 @@
 #pragma once
 
 #include <msg/IMessage.hpp>
+#include <msg/IStreamingMessage.hpp>
 #include "DataTypes.hpp"
 
 /// Message 'Response file'
-class MessageResponseFile : public msg::Message
+class MessageResponseFile : public msg::Message, public msg::IStreamingMessage
 {
 public:
 	MessageResponseFile();
@@ -12,5 +13,17 @@ public:
 	virtual void save(TOStream& out);
 	virtual void load(TIStream& in);
 
+	//
+	// msg::IStreamingMessage
+	//
+	virtual void beginLoad(util::T_UI4 payloadSize);
+	virtual void loadFragment(const unsigned char* buf, size_t bufSize);
+	virtual void loadFragment(const util::BufferChain& data);
+	virtual void endLoad();
+	virtual bool save(util::BufferChain& out);
+
 	FileChunk m_response;
+
+private:
+	FileChunkLoader m_loader;
 };
@@ -0,0 +1,51 @@
+#include "MessageResponseManifest.hpp"
+#include "SvcMsgFactory.hpp"
+
+#include <util/MemoryStream.hpp>
+
+MessageResponseManifest::MessageResponseManifest()
+	: Message(SvcMsgFactory::MSG_RESPONSE_MANIFEST)
+{
+}
+
+void
+MessageResponseManifest::save(TOStream& out)
+{
+	size_t len = m_fileName.size();
+	out << len;
+
+	size_t sz = m_fileName.size() * sizeof(wchar_t);
+	out << sz;
+	if (sz)
+		out.write((const unsigned char*)m_fileName.c_str(), sz);
+
+	bool hasManifest = m_manifest.get() != 0;
+	out << hasManifest;
+	if (hasManifest)
+		m_manifest->save(out);
+}
+
+void
+MessageResponseManifest::load(TIStream& in)
+{
+	size_t len;
+	in >> len;
+	m_fileName.resize(len);
+
+	size_t sz;
+	in >> sz;
+	if (sz)
+		in.read((unsigned char*)&m_fileName.front(), sz);
+
+	// A malformed manifest is dropped, the file is requested as usual then
+	bool hasManifest = false;
+	in >> hasManifest;
+
+	m_manifest.reset();
+	if (!in.fail() && hasManifest)
+	{
+		std::shared_ptr<util::ChunkManifest> manifest = std::make_shared<util::ChunkManifest>();
+		if (manifest->load(in))
+			m_manifest = manifest;
+	}
+}
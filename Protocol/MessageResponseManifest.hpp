@@ -0,0 +1,19 @@
+#pragma once
+
+#include <msg/IMessage.hpp>
+#include <util/ChunkManifest.hpp>
+
+/// Message 'response manifest', see MessageRequestManifest
+class MessageResponseManifest : public msg::Message
+{
+public:
+	MessageResponseManifest();
+
+	virtual void save(TOStream& out);
+	virtual void load(TIStream& in);
+
+	std::wstring m_fileName;
+
+	/// Chunks of the file, NULL if the file could not be chunked and is sent as usual
+	util::TChunkManifestPtr m_manifest;
+};
@@ -0,0 +1,51 @@
+#include "MessageResponseSignature.hpp"
+#include "SvcMsgFactory.hpp"
+
+#include <util/MemoryStream.hpp>
+
+MessageResponseSignature::MessageResponseSignature()
+	: Message(SvcMsgFactory::MSG_RESPONSE_SIGNATURE)
+{
+}
+
+void
+MessageResponseSignature::save(TOStream& out)
+{
+	size_t len = m_fileName.size();
+	out << len;
+
+	size_t sz = m_fileName.size() * sizeof(wchar_t);
+	out << sz;
+	if (sz)
+		out.write((const unsigned char*)m_fileName.c_str(), sz);
+
+	bool hasSignature = m_signature && !m_signature->empty();
+	out << hasSignature;
+	if (hasSignature)
+		m_signature->save(out);
+}
+
+void
+MessageResponseSignature::load(TIStream& in)
+{
+	size_t len;
+	in >> len;
+	m_fileName.resize(len);
+
+	size_t sz;
+	in >> sz;
+	if (sz)
+		in.read((unsigned char*)&m_fileName.front(), sz);
+
+	// A malformed signature is dropped, the file is sent whole then
+	bool hasSignature = false;
+	in >> hasSignature;
+
+	m_signature.reset();
+	if (!in.fail() && hasSignature)
+	{
+		std::shared_ptr<util::DeltaSignature> signature = std::make_shared<util::DeltaSignature>();
+		if (signature->load(in))
+			m_signature = signature;
+	}
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <msg/IMessage.hpp>
+#include <util/DeltaSignature.hpp>
+
+/// Message 'response signature', see MessageRequestSignature
+class MessageResponseSignature : public msg::Message
+{
+public:
+	MessageResponseSignature();
+
+	virtual void save(TOStream& out);
+	virtual void load(TIStream& in);
+
+	std::wstring m_fileName;
+
+	/// Signature of the receiver's copy of the file, NULL if it has none and the file is sent whole
+	util::TDeltaSignaturePtr m_signature;
+};
@@ -0,0 +1,20 @@
+#include "MessageTreeAck.hpp"
+#include "SvcMsgFactory.hpp"
+
+MessageTreeAck::MessageTreeAck()
+	: Message(SvcMsgFactory::MSG_TREE_ACK)
+	, m_sequence(0)
+{
+}
+
+void
+MessageTreeAck::save(TOStream& out)
+{
+	out << m_sequence;
+}
+
+void
+MessageTreeAck::load(TIStream& in)
+{
+	in >> m_sequence;
+}
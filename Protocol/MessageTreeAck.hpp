@@ -0,0 +1,15 @@
+#pragma once
+
+#include <msg/IMessage.hpp>
+
+/// Message 'tree ack', is sent once a batch of a directory tree is written, see MessageRequestTree
+class MessageTreeAck : public msg::Message
+{
+public:
+	MessageTreeAck();
+
+	virtual void save(TOStream& out);
+	virtual void load(TIStream& in);
+
+	util::T_UI4 m_sequence;
+};
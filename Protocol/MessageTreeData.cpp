@@ -0,0 +1,19 @@
+#include "MessageTreeData.hpp"
+#include "SvcMsgFactory.hpp"
+
+MessageTreeData::MessageTreeData()
+	: Message(SvcMsgFactory::MSG_TREE_DATA)
+{
+}
+
+void
+MessageTreeData::save(TOStream& out)
+{
+	m_batch.save(out);
+}
+
+void
+MessageTreeData::load(TIStream& in)
+{
+	m_batch.load(in);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <msg/IMessage.hpp>
+
+#include "DataTypes.hpp"
+
+/// Message 'tree data', a batch of a directory tree, see MessageRequestTree
+class MessageTreeData : public msg::Message
+{
+public:
+	MessageTreeData();
+
+	virtual void save(TOStream& out);
+	virtual void load(TIStream& in);
+
+	TreeBatch m_batch;
+};
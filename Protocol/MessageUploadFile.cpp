@@ -4,6 +4,7 @@
 
 MessageUploadFile::MessageUploadFile()
 	: Message(SvcMsgFactory::MSG_UPLOAD_FILE)
+	, m_loader(m_chunk)
 {
 }
 
@@ -16,3 +17,29 @@ void MessageUploadFile::load(TIStream& in)
 {
 	m_chunk.load(in);
 }
+
+void MessageUploadFile::beginLoad(util::T_UI4 payloadSize)
+{
+	m_loader.begin(payloadSize);
+}
+
+void MessageUploadFile::loadFragment(const unsigned char* buf, size_t bufSize)
+{
+	m_loader.load(buf, bufSize);
+}
+
+void MessageUploadFile::loadFragment(const util::BufferChain& data)
+{
+	m_loader.load(data);
+}
+
+void MessageUploadFile::endLoad()
+{
+	m_loader.end();
+}
+
+bool MessageUploadFile::save(util::BufferChain& out)
+{
+	m_chunk.save(out);
+	return true;
+}
@@ -1,6 +1,11 @@
 #include "MessageUploadFileReply.hpp"
 #include "SvcMsgFactory.hpp"
 
+namespace {
+	/// Longest file name of a reply, a malformed one is dropped rather than allocated
+	const size_t kMaxFileNameLength = 32767;
+}
+
 MessageUploadFileReply::MessageUploadFileReply()
 	: Message(SvcMsgFactory::MSG_UPLOAD_FILE_REPLY)
 	, m_ok(false)
@@ -10,9 +15,36 @@ MessageUploadFileReply::MessageUploadFileReply()
 void MessageUploadFileReply::save(TOStream& out)
 {
 	out << m_ok;
+
+	// File name is appended to the original format, older endpoints ignore it
+	size_t len = m_fileName.size();
+	out << len;
+
+	size_t sz = m_fileName.size() * sizeof(wchar_t);
+	out << sz;
+	if (sz)
+		out.write((const unsigned char*)m_fileName.c_str(), sz);
 }
 
 void MessageUploadFileReply::load(TIStream& in)
 {
 	in >> m_ok;
+
+	// Older endpoints do not name the file
+	size_t len = 0;
+	in >> len;
+
+	size_t sz = 0;
+	in >> sz;
+
+	m_fileName.clear();
+	if (in.fail() || len > kMaxFileNameLength || sz != len * sizeof(wchar_t))
+		return;
+
+	m_fileName.resize(len);
+	if (sz)
+		in.read((unsigned char*)&m_fileName.front(), sz);
+
+	if (in.fail())
+		m_fileName.clear();
 }
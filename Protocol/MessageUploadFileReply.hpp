@@ -14,4 +14,7 @@ public:
 	virtual void load(TIStream& in);
 
 	bool m_ok;
+
+	/// Uploaded file the reply is for, is empty if the endpoint does not name it
+	std::wstring m_fileName;
 };
@@ -11,6 +11,15 @@
 #include "MessageUploadFile.hpp"
 #include "MessageUploadFileReply.hpp"
 #include "MessageGeneric.hpp"
+#include "MessageRequestSignature.hpp"
+#include "MessageResponseSignature.hpp"
+#include "MessageRequestManifest.hpp"
+#include "MessageResponseManifest.hpp"
+#include "MessageRequestTree.hpp"
+#include "MessageTreeData.hpp"
+#include "MessageTreeAck.hpp"
+#include "MessageRequestFiles.hpp"
+#include "MessageOpenConnections.hpp"
 
 ::msg::TMessagePtr
 SvcMsgFactory::createMessage(util::T_UI4 messageType)
@@ -46,6 +55,33 @@ SvcMsgFactory::createMessage(util::T_UI4 messageType)
 	case MSG_UPLOAD_FILE_REPLY:
 		message = std::make_shared<MessageUploadFileReply>();
 		break;
+	case MSG_REQUEST_SIGNATURE:
+		message = std::make_shared<MessageRequestSignature>();
+		break;
+	case MSG_RESPONSE_SIGNATURE:
+		message = std::make_shared<MessageResponseSignature>();
+		break;
+	case MSG_REQUEST_MANIFEST:
+		message = std::make_shared<MessageRequestManifest>();
+		break;
+	case MSG_RESPONSE_MANIFEST:
+		message = std::make_shared<MessageResponseManifest>();
+		break;
+	case MSG_REQUEST_TREE:
+		message = std::make_shared<MessageRequestTree>();
+		break;
+	case MSG_TREE_DATA:
+		message = std::make_shared<MessageTreeData>();
+		break;
+	case MSG_TREE_ACK:
+		message = std::make_shared<MessageTreeAck>();
+		break;
+	case MSG_REQUEST_FILES:
+		message = std::make_shared<MessageRequestFiles>();
+		break;
+	case MSG_OPEN_CONNECTIONS:
+		message = std::make_shared<MessageOpenConnections>();
+		break;
 	default:
 		assert(!"Unsupported message type");
 		throw util::Error("Unsupported mesage typ");
@@ -16,7 +16,16 @@ public:
 		MSG_RESPONSE_SYSINFO,
 		MSG_UPLOAD_FILE,
 		MSG_UPLOAD_FILE_REPLY,
-		MSG_GENERIC
+		MSG_GENERIC,
+		MSG_REQUEST_SIGNATURE,
+		MSG_RESPONSE_SIGNATURE,
+		MSG_REQUEST_MANIFEST,
+		MSG_RESPONSE_MANIFEST,
+		MSG_REQUEST_TREE,
+		MSG_TREE_DATA,
+		MSG_TREE_ACK,
+		MSG_REQUEST_FILES,
+		MSG_OPEN_CONNECTIONS
 	};
 
 	virtual ::msg::TMessagePtr createMessage(util::T_UI4 messageType);
@@ -0,0 +1,100 @@
+#include "FanOutQuery.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+double QueryResult::latencyPercentile(double fraction) const
+{
+	if (m_latencies.empty())
+		return 0;
+
+	// Nearest rank, so the result is one of the measured latencies
+	std::vector<double> sorted(m_latencies);
+	std::sort(sorted.begin(), sorted.end());
+
+	size_t rank = static_cast<size_t>(ceil(fraction * sorted.size()));
+	return sorted[0 < rank ? (std::min)(rank, sorted.size()) - 1 : 0];
+}
+
+FanOutQuery::FanOutQuery(unsigned int id, QueryResult::Kind kind, unsigned int timeoutMs)
+	: m_timeout(timeoutMs / 1000.0)
+	, m_expired(false)
+{
+	m_result.m_id = id;
+	m_result.m_kind = kind;
+}
+
+void FanOutQuery::addEndpoint(const std::string& endpointId, bool sent)
+{
+	++m_result.m_endpointCount;
+
+	if (sent)
+		m_pending.insert(endpointId);
+	else
+		m_lost.push_back(endpointId);
+}
+
+void FanOutQuery::onSysInfo(const std::string& endpointId, const std::vector<std::string>& sysinfo)
+{
+	if (answer(endpointId))
+		m_result.m_sysinfo[endpointId] = sysinfo;
+}
+
+void FanOutQuery::onDir(const std::string& endpointId, const TDirItems& content)
+{
+	if (answer(endpointId))
+		m_result.m_dirs[endpointId] = content;
+}
+
+void FanOutQuery::onEndpointGone(const std::string& endpointId)
+{
+	if (m_result.m_finished || 0 == m_pending.erase(endpointId))
+		return;
+
+	m_lost.push_back(endpointId);
+}
+
+bool FanOutQuery::isComplete() const
+{
+	return m_pending.empty();
+}
+
+bool FanOutQuery::isExpired() const
+{
+	return m_expired || m_clock.seconds() >= m_timeout;
+}
+
+void FanOutQuery::expire()
+{
+	m_expired = true;
+}
+
+void FanOutQuery::finish()
+{
+	if (m_result.m_finished)
+		return;
+
+	m_result.m_finished = true;
+	m_result.m_timedOut = !m_pending.empty();
+
+	// Answers which arrive late are not collected
+	m_lost.insert(m_lost.end(), m_pending.begin(), m_pending.end());
+	m_pending.clear();
+}
+
+QueryResult FanOutQuery::result() const
+{
+	QueryResult result = m_result;
+	result.m_unanswered = m_lost;
+	result.m_unanswered.insert(result.m_unanswered.end(), m_pending.begin(), m_pending.end());
+	return result;
+}
+
+bool FanOutQuery::answer(const std::string& endpointId)
+{
+	if (m_result.m_finished || 0 == m_pending.erase(endpointId))
+		return false;
+
+	m_result.m_latencies.push_back(m_clock.seconds());
+	return true;
+}
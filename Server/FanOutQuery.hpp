@@ -0,0 +1,103 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <util/Stopwatch.hpp>
+#include <protocol/DataTypes.hpp>
+
+/// Answers to a request sent to many endpoints at once, see Service::querySysInfo()
+struct QueryResult
+{
+	enum Kind
+	{
+		QUERY_SYSINFO,
+		QUERY_DIR
+	};
+
+	QueryResult()
+		: m_id(0)
+		, m_kind(QUERY_SYSINFO)
+		, m_endpointCount(0)
+		, m_finished(false)
+		, m_timedOut(false)
+	{}
+
+	unsigned int m_id;
+	Kind m_kind;
+
+	/// Endpoints the request was meant for
+	size_t m_endpointCount;
+
+	/// Answers of the endpoints which responded, the one of the kind of the query is filled
+	std::map<std::string, std::vector<std::string> > m_sysinfo;
+	std::map<std::string, TDirItems> m_dirs;
+
+	/// Seconds from sending the request to each response, in order of the responses
+	std::vector<double> m_latencies;
+
+	/// Endpoints which were not sent the request, disconnected or did not respond (yet)
+	std::vector<std::string> m_unanswered;
+
+	/// Query is finished once every endpoint answered or its deadline passed
+	bool m_finished;
+	bool m_timedOut;
+
+	/// Returns the latency which the fraction (0 to 1) of the responses did not exceed, 0 if none responded
+	double latencyPercentile(double fraction) const;
+};
+
+/**
+ * Collects responses of endpoints to a request sent to all of them at once.
+ * Service passes a response to the query of its request by the request ID the response echoes,
+ *	responses of older endpoints go to the oldest query waiting for the endpoint.
+ * Is not synchronized, Service locks it.
+ */
+class FanOutQuery
+{
+public:
+	FanOutQuery(unsigned int id, QueryResult::Kind kind, unsigned int timeoutMs);
+
+	/// Endpoint was sent the request, or failed to be sent it
+	void addEndpoint(const std::string& endpointId, bool sent);
+
+	/// Records a response of an endpoint, responses of endpoints the query does not wait for are ignored
+	void onSysInfo(const std::string& endpointId, const std::vector<std::string>& sysinfo);
+	void onDir(const std::string& endpointId, const TDirItems& content);
+
+	/// Endpoint disconnected, the query does not wait for it anymore
+	void onEndpointGone(const std::string& endpointId);
+
+	/// Returns true if every endpoint answered or is gone
+	bool isComplete() const;
+
+	/// Returns true once the deadline passed
+	bool isExpired() const;
+
+	/// Is called by the deadline timer, which may fire a bit early
+	void expire();
+
+	/// Marks the query finished, the endpoints it waits for are unanswered then
+	void finish();
+
+	/// Returns answers collected so far
+	QueryResult result() const;
+
+private:
+	/// Returns false unless the query waits for the endpoint, records latency of the response otherwise
+	bool answer(const std::string& endpointId);
+
+private:
+	QueryResult m_result;
+	util::Stopwatch m_clock;
+	double m_timeout;
+	bool m_expired;
+
+	/// Endpoints the query waits for
+	std::set<std::string> m_pending;
+
+	/// Endpoints which were not sent the request or are gone
+	std::vector<std::string> m_lost;
+};
@@ -0,0 +1,1218 @@
+#include "FileTransfer.hpp"
+
+#include <algorithm>
+
+#include <util/AsyncFileIo.hpp>
+#include <util/ContentChunker.hpp>
+#include <util/ScopedLock.hpp>
+
+namespace {
+
+/// Striped download starts with one data connection besides the first one, and never uses more connections than this
+const size_t kInitialStripes = 2;
+const size_t kMaxStripes = 8;
+
+/// Downloads with less chunks left are not worth the connections
+const __int64 kMinStripedChunks = 8;
+
+/// Number of stripes is measured this long, another connection is kept if it adds this much throughput
+const double kStripeProbeSeconds = 1.0;
+const double kStripeGain = 0.1;
+
+/// Returns a range of chunk data, data are followed by zeros of the hole
+util::BufferChain chunkRange(const FileChunk& chunk, size_t offset, size_t size)
+{
+	util::BufferChain range;
+	size_t dataSize = chunk.m_fileData.size();
+	if (offset < dataSize)
+		range = chunk.m_fileData.slice(offset, size < dataSize - offset ? size : dataSize - offset);
+
+	if (range.size() < size)
+	{
+		std::vector<char> zeros(size - range.size());
+		range.append(util::BufferChain::copy(&zeros[0], zeros.size()));
+	}
+
+	return range;
+}
+
+} // namespace
+
+FileTransfer::FileTransfer(Service& service, IListener& listener, const TransferInfo& info, const util::TChunkStorePtr& chunkStore)
+	: m_service(service)
+	, m_listener(listener)
+	, m_info(info)
+	, m_finished(false)
+	, m_flushing(false)
+	, m_transferringFileSize(0)
+	, m_transferringFilePosition(0)
+	, m_outstanding(0)
+	, m_requestedPosition(0)
+	, m_receivedPosition(0)
+	, m_writeFailed(false)
+	, m_prefetcher(m_fileReader)
+	, m_chunkStore(chunkStore)
+	, m_nextChunk(0)
+	, m_writtenChunk(0)
+	, m_striped(false)
+	, m_stripes(0)
+	, m_hasFileHash(false)
+	, m_fileHash(0)
+	, m_connectionsInUse(0)
+	, m_bestRate(0)
+	, m_bestStripes(0)
+	, m_stripesSettled(false)
+{
+	// Downloaded file is on the disk before it gets its name
+	m_fileWriter.setDurability(util::FileWriter::DURABILITY_AT_CLOSE);
+
+	// Uploaded chunks refer to the file mapping rather than copies of the file
+	m_fileReader.setMapped(true);
+}
+
+TransferInfo FileTransfer::info() const
+{
+	util::ScopedLock lock(&m_sync);
+	return m_info;
+}
+
+void FileTransfer::setBroadcast(const TUploadBroadcastPtr& broadcast)
+{
+	util::ScopedLock lock(&m_sync);
+	m_broadcast = broadcast;
+}
+
+void FileTransfer::start()
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (m_finished)
+			return;
+
+		m_info.m_state = TransferInfo::ACTIVE;
+		progress(m_info.m_position, m_info.m_fileSize);
+
+		// The endpoint may have disconnected while the transfer was queued
+		try
+		{
+			m_session = m_service.sessionParams(m_info.m_endpointId);
+
+			if (TransferInfo::DOWNLOAD == m_info.m_direction)
+				startDownload();
+			else
+				startUpload();
+		}
+		catch (const std::exception& x)
+		{
+			finish(false, x.what());
+		}
+	}
+
+	flush();
+}
+
+void FileTransfer::cancel(const std::string& error)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (m_finished)
+			return;
+
+		// Endpoint drops the partially uploaded file, unless it is gone
+		if (TransferInfo::UPLOAD == m_info.m_direction && TransferInfo::ACTIVE == m_info.m_state)
+		{
+			FileChunk chunk;
+			chunk.m_fileName = m_info.m_remoteFileName;
+			chunk.m_valid = false;
+
+			std::string endpointId = m_info.m_endpointId;
+			send([this, endpointId, chunk]()
+			{
+				m_service.uploadFile(endpointId, chunk);
+			}, true);
+		}
+
+		finish(false, error);
+	}
+
+	flush();
+}
+
+void FileTransfer::startDownload()
+{
+	// File size is unknown yet, the window is filled once the first chunk arrives
+	m_transferringFileSize = 0;
+	m_requestedPosition = 0;
+	m_outstanding = 0;
+
+	// Local copy of the file is signed by the disk I/O threads first, it may be large
+	if (0 != (m_session.m_features & MessageIdentity::FEATURE_DELTA))
+	{
+		std::shared_ptr<FileTransfer> self = shared_from_this();
+		m_outbox.push_back([self]()
+		{
+			util::AsyncFileIo::instance().submit(&self->m_fileWriter, [self]()
+			{
+				self->signLocalFile();
+			});
+		});
+		return;
+	}
+
+	startReceiving();
+}
+
+void FileTransfer::startUpload()
+{
+	// Chunks of a broadcast are the same for all the endpoints, so they are neither deltas nor sparse
+	if (m_broadcast)
+	{
+		m_transferringFilePosition = 0;
+		m_outstanding = 0;
+		m_broadcast->join(m_info.m_id);
+		startSending();
+		return;
+	}
+
+	if (!m_fileReader.open(m_info.m_localFileName))
+	{
+		finish(false, "Failed to open file");
+		return;
+	}
+
+	m_transferringFilePosition = 0;
+	m_outstanding = 0;
+
+	// The endpoint signs its copy of the file first, chunks are sent once the signature arrives
+	if (0 != (m_session.m_features & MessageIdentity::FEATURE_DELTA))
+	{
+		std::string endpointId = m_info.m_endpointId;
+		std::wstring fileName = m_info.m_remoteFileName;
+		send([this, endpointId, fileName]()
+		{
+			m_service.requestSignature(endpointId, fileName);
+		});
+		return;
+	}
+
+	startSending();
+}
+
+bool FileTransfer::beginChunkData(const FileChunk& chunk)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		// Literal data of delta chunks are collected, since the delta follows them.
+		// Data of deduplicated chunks are collected as well, they are stored once they are verified.
+		// Striped ranges arrive out of order, each of them is written at its position once it is whole.
+		if (m_finished || m_signature || m_manifest || m_striped)
+			return false;
+
+		// Chunks are written in order, a chunk out of order is rejected by onResponseFile()
+		if (chunk.m_positionFrom != m_receivedPosition)
+			return false;
+	}
+
+	// File is opened in order with writes of the previous chunks, chunks are received by one thread.
+	//	Jobs are queued without the lock, since queueing blocks while the disk I/O threads are busy.
+	std::shared_ptr<FileTransfer> self = shared_from_this();
+	__int64 positionFrom = chunk.m_positionFrom;
+	__int64 fileSize = chunk.m_fileSize;
+
+	util::AsyncFileIo::instance().submit(&m_fileWriter, [self, positionFrom, fileSize]()
+	{
+		// Download may have been stopped before the job was queued, its files are closed already then
+		{
+			util::ScopedLock lock(&self->m_sync);
+			if (self->m_finished)
+				return;
+		}
+
+		if (!self->m_fileWriter.open(self->m_info.m_localFileName))
+		{
+			self->onWriteFailed();
+			return;
+		}
+
+		// Large downloads are received into a mapped preallocated file
+		if (0 == positionFrom)
+			self->m_fileWriter.reserve(fileSize);
+	});
+
+	return true;
+}
+
+bool FileTransfer::writeChunkData(const FileChunk& chunk, const char* buf, size_t bufSize)
+{
+	return writeChunkData(chunk, util::BufferChain::copy(buf, bufSize));
+}
+
+bool FileTransfer::writeChunkData(const FileChunk& chunk, const util::BufferChain& data)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+		m_receivedPosition += data.size();
+	}
+
+	// Received blocks are kept until they are written, the stream goes on meanwhile
+	std::shared_ptr<FileTransfer> self = shared_from_this();
+	util::AsyncFileIo::instance().submit(&m_fileWriter, [self, data]()
+	{
+		{
+			util::ScopedLock lock(&self->m_sync);
+			if (self->m_finished || self->m_writeFailed)
+				return;
+		}
+
+		if (!self->m_fileWriter.write(data))
+			self->onWriteFailed();
+	});
+
+	return true;
+}
+
+void FileTransfer::onWriteFailed()
+{
+	util::ScopedLock lock(&m_sync);
+	m_writeFailed = true;
+}
+
+void FileTransfer::onResponseFile(const FileChunk& chunk)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		// Data which were not written as they arrived are written by the job as well, holes are not received.
+		// Delta chunk describes more of the file than its literal data.
+		if (chunk.m_delta.empty())
+			m_receivedPosition += chunk.m_fileData.size() + chunk.m_holeSize;
+		else
+			m_receivedPosition += util::DeltaEncoder::targetSize(chunk.m_delta);
+	}
+
+	std::shared_ptr<FileTransfer> self = shared_from_this();
+	util::AsyncFileIo::instance().submit(&m_fileWriter, [self, chunk]()
+	{
+		self->onChunkWritten(chunk);
+	});
+}
+
+void FileTransfer::onChunkWritten(const FileChunk& chunk)
+{
+	bool striped = false;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		// Responses to pipelined requests may arrive after the download was stopped
+		if (m_finished)
+			return;
+
+		striped = m_striped;
+	}
+
+	if (striped)
+		onStripeWritten(chunk);
+	else
+		writeChunk(chunk);
+
+	flush();
+}
+
+void FileTransfer::writeChunk(const FileChunk& chunk)
+{
+	util::TChunkManifestPtr manifest;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (0 < m_outstanding)
+			--m_outstanding;
+
+		// Older endpoints do not report position of a chunk
+		bool misplaced = (!chunk.m_fileData.empty() || !chunk.m_delta.empty())
+			&& MessageIdentity::PROTOCOL_VERSION_LIMITS <= m_session.m_version
+			&& chunk.m_positionFrom != m_fileWriter.size();
+
+		if (!chunk.m_valid
+			|| chunk.m_sinkFailed
+			|| m_writeFailed
+			|| misplaced
+			|| (chunk.m_fileName != m_info.m_remoteFileName))
+		{
+			finish(false, "Failed to download file");
+			return;
+		}
+		m_transferringFileSize = chunk.m_fileSize;
+
+		manifest = m_manifest;
+	}
+
+	// The writer and the local copy are only used by jobs of the strand, so the transfer is not locked meanwhile
+	bool written = m_fileWriter.open(m_info.m_localFileName);
+	if (written && !chunk.m_delta.empty())
+	{
+		// Copies are read from the local copy of the file
+		written = util::DeltaEncoder::apply(chunk.m_delta, chunk.m_fileData, m_basis, m_fileWriter);
+	}
+	else if (written)
+	{
+		// Write data to file, unless they were already written as they arrived
+		written = m_fileWriter.write(chunk.m_fileData);
+
+		// Hole after the data is recreated rather than received
+		__int64 holeFrom = chunk.m_positionFrom + chunk.m_sunkSize + chunk.m_fileData.size();
+		if (written && 0 < chunk.m_holeSize)
+			written = m_fileWriter.writeHole(holeFrom, chunk.m_holeSize);
+	}
+
+	// Received chunks are kept for later downloads, stored chunks which follow them are written
+	if (written && manifest)
+		written = storeReceivedChunks(chunk, *manifest) && writeStoredChunks(*manifest);
+
+	bool complete = false;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (m_finished)
+			return;
+
+		if (!written)
+		{
+			finish(false, "Failed to download file");
+			return;
+		}
+
+		complete = continueDownload();
+	}
+
+	// Hash of a deduplicated file comes with its manifest, since chunks are not read in order
+	if (complete && manifest)
+		completeDownload(true, manifest->fileHash());
+	else if (complete)
+		completeDownload(chunk.m_hasFileHash, chunk.m_fileHash);
+}
+
+void FileTransfer::beginStoredDownload()
+{
+	util::TChunkManifestPtr manifest;
+	__int64 fileSize = 0;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (m_finished || !m_manifest)
+			return;
+
+		manifest = m_manifest;
+		fileSize = m_transferringFileSize;
+	}
+
+	bool written = m_fileWriter.open(m_info.m_localFileName);
+	if (written)
+	{
+		m_fileWriter.reserve(fileSize);
+		written = writeStoredChunks(*manifest);
+	}
+
+	bool complete = false;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (m_finished)
+			return;
+
+		if (written)
+			complete = continueDownload();
+		else
+			finish(false, "Failed to download file");
+	}
+
+	if (complete)
+		completeDownload(true, manifest->fileHash());
+
+	flush();
+}
+
+bool FileTransfer::storeReceivedChunks(const FileChunk& chunk, const util::ChunkManifest& manifest)
+{
+	// Chunks are requested whole, a chunk which differs from the manifest means the file changed meanwhile
+	size_t size = chunk.m_fileData.size() + static_cast<size_t>(chunk.m_holeSize);
+	for (size_t offset = 0; offset < size; ++m_writtenChunk)
+	{
+		if (m_writtenChunk >= manifest.entryCount())
+			return false;
+
+		const util::ManifestEntry& entry = manifest.entry(m_writtenChunk);
+		if (entry.size > size - offset)
+			return false;
+
+		util::BufferChain data = chunkRange(chunk, offset, entry.size);
+		if (util::ChunkId::compute(data) != entry.id)
+			return false;
+
+		// A chunk which could not be stored is received again next time
+		m_chunkStore->put(entry.id, data);
+		offset += entry.size;
+	}
+
+	return true;
+}
+
+bool FileTransfer::writeStoredChunks(const util::ChunkManifest& manifest)
+{
+	// A chunk evicted since the manifest arrived fails the download, it is received by the next attempt
+	for (; m_writtenChunk < manifest.entryCount() && m_storedChunks[m_writtenChunk]; ++m_writtenChunk)
+	{
+		const util::ManifestEntry& entry = manifest.entry(m_writtenChunk);
+
+		util::BufferChain data;
+		if (!m_chunkStore->get(entry.id, data) || !m_fileWriter.write(data))
+			return false;
+	}
+
+	return true;
+}
+
+void FileTransfer::onStripeWritten(const FileChunk& chunk)
+{
+	StripeRequest request;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		// Range requested again after its connection closed may still arrive over that connection
+		TStripeRequests::iterator ii = m_stripeRequests.find(chunk.m_positionFrom);
+		if (ii == m_stripeRequests.end())
+			return;
+
+		request = ii->second;
+		m_stripeRequests.erase(ii);
+
+		StripeConnection& connection = m_stripeConnections[request.connection];
+		if (0 < connection.outstanding)
+			--connection.outstanding;
+
+		// File changed meanwhile, ranges of both versions must not be mixed
+		if (!chunk.m_valid
+			|| chunk.m_sinkFailed
+			|| m_writeFailed
+			|| (chunk.m_fileName != m_info.m_remoteFileName)
+			|| (chunk.m_fileSize != m_transferringFileSize))
+		{
+			finish(false, "Failed to download file");
+			return;
+		}
+
+		// Ranges complete in any order, the hash is kept until the last of them is written
+		if (chunk.m_hasFileHash)
+		{
+			m_hasFileHash = true;
+			m_fileHash = chunk.m_fileHash;
+		}
+	}
+
+	bool written = m_fileWriter.writeAt(chunk.m_fileData, chunk.m_positionFrom);
+	if (written && 0 < chunk.m_holeSize)
+		written = m_fileWriter.writeHole(chunk.m_positionFrom + chunk.m_fileData.size(), chunk.m_holeSize);
+
+	__int64 size = chunk.m_fileData.size() + chunk.m_holeSize;
+
+	bool complete = false;
+	bool hasFileHash = false;
+	util::T_UI8 fileHash = 0;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (m_finished)
+			return;
+
+		if (!written || 0 == size)
+		{
+			finish(false, "Failed to download file");
+			return;
+		}
+
+		// The endpoint may send less than requested, the rest is requested again
+		if (size < request.size)
+			m_retryRanges.push_back(std::make_pair(chunk.m_positionFrom + size, request.size - size));
+
+		m_stripeConnections[request.connection].received += size;
+		adaptStripes();
+
+		complete = continueDownload();
+		hasFileHash = m_hasFileHash;
+		fileHash = m_fileHash;
+	}
+
+	if (complete)
+		completeDownload(hasFileHash, fileHash);
+}
+
+bool FileTransfer::isStripeable() const
+{
+	// Delta and deduplicated chunks follow each other, ranges in flight are not tracked by their connections
+	return 0 != (m_session.m_features & MessageIdentity::FEATURE_DATA_CONNECTIONS)
+		&& !m_signature
+		&& !m_manifest
+		&& 0 == m_outstanding
+		&& m_transferringFileSize - m_fileWriter.size() >= kMinStripedChunks * m_session.m_chunkSize;
+}
+
+void FileTransfer::startStriping()
+{
+	m_striped = true;
+	m_stripes = kInitialStripes;
+	m_requestedPosition = m_fileWriter.size();
+
+	m_bestRate = 0;
+	m_bestStripes = 1;
+	m_stripesSettled = false;
+	m_probeClock.restart();
+
+	// Connections come up meanwhile, ranges are requested over the first one until they do.
+	//	Endpoint which is gone cancels the transfer.
+	std::string endpointId = m_info.m_endpointId;
+	size_t count = m_stripes - 1;
+	send([this, endpointId, count]()
+	{
+		m_service.openDataConnections(endpointId, count);
+	}, true);
+}
+
+void FileTransfer::fillStripes()
+{
+	std::vector<net::IStream::TId> connections = m_service.dataConnections(m_info.m_endpointId);
+	if (connections.size() > m_stripes - 1)
+		connections.resize(m_stripes - 1);
+	connections.insert(connections.begin(), 0);
+	m_connectionsInUse = connections.size();
+
+	// Requests are spread round robin, a faster connection empties its window sooner and gets more of them
+	for (bool requested = true; requested;)
+	{
+		requested = false;
+
+		for (std::vector<net::IStream::TId>::const_iterator ii = connections.begin(); ii != connections.end(); ++ii)
+		{
+			StripeConnection& connection = m_stripeConnections[*ii];
+			if (connection.outstanding >= m_session.m_windowSize)
+				continue;
+
+			std::pair<__int64, __int64> range;
+			if (!m_retryRanges.empty())
+			{
+				range = m_retryRanges.front();
+				m_retryRanges.pop_front();
+			}
+			else if (m_requestedPosition < m_transferringFileSize)
+			{
+				range.first = m_requestedPosition;
+				range.second = std::min<__int64>(m_session.m_chunkSize, m_transferringFileSize - m_requestedPosition);
+				m_requestedPosition += range.second;
+			}
+			else
+			{
+				return;
+			}
+
+			FileRequest request;
+			request.m_fileName = m_info.m_remoteFileName;
+			request.m_startFrom = range.first;
+			request.m_size = range.second;
+			request.m_wantFileHash = range.first + range.second == m_transferringFileSize;
+
+			// Data connection which closes meanwhile is reported by onConnectionClosed(), its ranges go over other ones then
+			std::string endpointId = m_info.m_endpointId;
+			net::IStream::TId connectionId = *ii;
+			send([this, endpointId, request, connectionId]()
+			{
+				m_service.requestFile(endpointId, request, connectionId);
+			}, 0 != connectionId);
+
+			StripeRequest& stripe = m_stripeRequests[range.first];
+			stripe.connection = *ii;
+			stripe.size = range.second;
+
+			++connection.outstanding;
+			requested = true;
+		}
+	}
+}
+
+void FileTransfer::adaptStripes()
+{
+	if (m_stripesSettled)
+		return;
+
+	// Throughput is only judged once all the connections are up
+	if (m_connectionsInUse != m_stripes)
+		return;
+
+	double seconds = m_probeClock.seconds();
+	if (seconds < kStripeProbeSeconds)
+		return;
+
+	double rate = 0;
+	for (TStripeConnections::iterator ii = m_stripeConnections.begin(); ii != m_stripeConnections.end(); ++ii)
+	{
+		rate += ii->second.received / seconds;
+		ii->second.received = 0;
+	}
+	m_probeClock.restart();
+
+	// Another connection is tried while the previous one paid off, otherwise the best number of them is kept
+	if (rate > m_bestRate * (1 + kStripeGain))
+	{
+		m_bestRate = rate;
+		m_bestStripes = m_stripes;
+
+		if (m_stripes < kMaxStripes)
+		{
+			++m_stripes;
+
+			// Endpoint which is gone cancels the transfer
+			std::string endpointId = m_info.m_endpointId;
+			size_t count = m_stripes - 1;
+			send([this, endpointId, count]()
+			{
+				m_service.openDataConnections(endpointId, count);
+			}, true);
+		}
+		else
+		{
+			m_stripesSettled = true;
+		}
+	}
+	else
+	{
+		m_stripes = m_bestStripes;
+		m_stripesSettled = true;
+	}
+}
+
+void FileTransfer::onConnectionClosed(net::IStream::TId connection)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (m_finished || !m_striped)
+			return;
+
+		for (TStripeRequests::iterator ii = m_stripeRequests.begin(); ii != m_stripeRequests.end();)
+		{
+			TStripeRequests::iterator request = ii++;
+			if (request->second.connection == connection)
+			{
+				m_retryRanges.push_back(std::make_pair(request->first, request->second.size));
+				m_stripeRequests.erase(request);
+			}
+		}
+		m_stripeConnections.erase(connection);
+
+		fillStripes();
+	}
+
+	flush();
+}
+
+bool FileTransfer::continueDownload()
+{
+	if (m_fileWriter.isComplete(m_transferringFileSize))
+		return true;
+
+	if (!m_striped && isStripeable())
+		startStriping();
+
+	if (m_striped)
+	{
+		fillStripes();
+		progress(m_fileWriter.written().covered(), m_transferringFileSize);
+		return false;
+	}
+
+	// The endpoint may send less than requested, continue from the end of the file then.
+	// Delta chunks are placed after each other rather than at the requested positions,
+	//	deduplicated chunks are requested at positions of the manifest.
+	if (0 == m_outstanding && !m_signature && !m_manifest)
+		m_requestedPosition = m_fileWriter.size();
+
+	// Keep the window full
+	while (m_outstanding < m_session.m_windowSize && m_requestedPosition < m_transferringFileSize)
+		requestNextChunk();
+
+	progress(m_fileWriter.size(), m_transferringFileSize);
+	return false;
+}
+
+void FileTransfer::completeDownload(bool hasFileHash, util::T_UI8 fileHash)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (m_finished)
+			return;
+	}
+
+	// Local copy is replaced by the downloaded file
+	m_basis.close();
+
+	// Verify the whole file, data which were not written in order (e.g. striped ranges) are read back for it.
+	//	A download cancelled while its file is saved is reported cancelled.
+	util::T_UI8 hash = 0;
+	bool hashed = hasFileHash && (m_fileWriter.hash(hash) || m_fileWriter.readHash(hash));
+	bool corrupted = hasFileHash && (!hashed || fileHash != hash);
+	bool saved = !corrupted && m_fileWriter.finish();
+
+	util::ScopedLock lock(&m_sync);
+
+	if (corrupted)
+		finish(false, "Downloaded file is corrupted");
+	else if (!saved)
+		finish(false, "Failed to save downloaded file");
+	else
+		finish(true, std::string());
+}
+
+void FileTransfer::onUploadFileReply(bool ok)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		// Replies to pipelined chunks may arrive after the upload was stopped
+		if (m_finished)
+			return;
+
+		if (0 < m_outstanding)
+			--m_outstanding;
+
+		__int64 fileSize = uploadSize();
+		if (!ok)
+		{
+			finish(false, "Failed to upload file");
+		}
+		else if (m_transferringFilePosition >= fileSize && 0 == m_outstanding)
+		{
+			// File transmited completely
+			finish(true, std::string());
+		}
+		else
+		{
+			// Keep the window full
+			bool sent = true;
+			while (sent && m_outstanding < m_session.m_windowSize && m_transferringFilePosition < fileSize)
+				sent = sendNextChunk();
+
+			if (sent)
+				progress(m_transferringFilePosition, fileSize);
+		}
+	}
+
+	flush();
+}
+
+void FileTransfer::onResponseSignature(const util::TDeltaSignaturePtr& signature)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		// Upload may have been stopped meanwhile
+		if (m_finished || 0 != m_outstanding)
+			return;
+
+		// File the endpoint does not have is sent whole
+		if (signature)
+			m_encoder.reset(new util::DeltaEncoder(signature));
+
+		startSending();
+	}
+
+	flush();
+}
+
+void FileTransfer::onResponseManifest(const util::TChunkManifestPtr& manifest)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		// Download may have been stopped meanwhile
+		if (m_finished || m_manifest || 0 != m_outstanding)
+			return;
+
+		// File the endpoint could not chunk is requested as usual
+		if (!manifest)
+		{
+			requestNextChunk();
+		}
+		else
+		{
+			m_manifest = manifest;
+			m_transferringFileSize = manifest->fileSize();
+
+			// Stored chunks are used recently, so they are not evicted by chunks received meanwhile
+			m_storedChunks.assign(manifest->entryCount(), false);
+			for (size_t i = 0; i < manifest->entryCount(); ++i)
+				m_storedChunks[i] = m_chunkStore->contains(manifest->entry(i).id);
+
+			m_nextChunk = 0;
+			m_writtenChunk = 0;
+
+			while (m_outstanding < m_session.m_windowSize && m_requestedPosition < m_transferringFileSize)
+				requestNextChunk();
+		}
+	}
+
+	// Stored chunks at the beginning are written before the requested ones arrive, responses are received by this thread
+	if (manifest)
+	{
+		std::shared_ptr<FileTransfer> self = shared_from_this();
+		util::AsyncFileIo::instance().submit(&m_fileWriter, [self]()
+		{
+			self->beginStoredDownload();
+		});
+	}
+
+	flush();
+}
+
+void FileTransfer::startReceiving()
+{
+	// Chunks are requested whole, so they are verified and stored as they arrive
+	if (m_chunkStore && m_chunkStore->isOpen()
+		&& 0 != (m_session.m_features & MessageIdentity::FEATURE_DEDUP)
+		&& util::ContentChunker::kMaxSize <= m_session.m_chunkSize
+		&& !m_signature)
+	{
+		std::string endpointId = m_info.m_endpointId;
+		std::wstring fileName = m_info.m_remoteFileName;
+		send([this, endpointId, fileName]()
+		{
+			m_service.requestManifest(endpointId, fileName);
+		});
+		return;
+	}
+
+	requestNextChunk();
+}
+
+void FileTransfer::signLocalFile()
+{
+	// A file which does not exist yet or is too large is downloaded whole
+	std::shared_ptr<util::DeltaSignature> signature = std::make_shared<util::DeltaSignature>();
+	if (!m_basis.openRead(m_info.m_localFileName) || !signature->compute(m_basis) || signature->empty())
+	{
+		m_basis.close();
+		signature.reset();
+	}
+
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (m_finished)
+			return;
+
+		m_signature = signature;
+		startReceiving();
+	}
+
+	flush();
+}
+
+void FileTransfer::requestNextChunk()
+{
+	FileRequest request;
+	request.m_fileName = m_info.m_remoteFileName;
+	request.m_startFrom = m_requestedPosition;
+	request.m_size = m_session.m_chunkSize;
+
+	// Delta chunks encode smaller ranges, the first request carries the signature
+	if (m_signature)
+	{
+		request.m_size = m_signature->windowSize(m_session.m_chunkSize);
+		if (0 == m_requestedPosition)
+			request.m_signature = m_signature;
+	}
+
+	// Chunks found in the store are skipped, adjacent chunks which are not are requested at once
+	if (m_manifest)
+	{
+		for (; m_nextChunk < m_manifest->entryCount() && m_storedChunks[m_nextChunk]; ++m_nextChunk)
+			m_requestedPosition += m_manifest->entry(m_nextChunk).size;
+
+		request.m_startFrom = m_requestedPosition;
+		request.m_size = 0;
+
+		for (; m_nextChunk < m_manifest->entryCount() && !m_storedChunks[m_nextChunk]; ++m_nextChunk)
+		{
+			__int64 size = m_manifest->entry(m_nextChunk).size;
+			if (request.m_size + size > static_cast<__int64>(m_session.m_chunkSize))
+				break;
+
+			request.m_size += size;
+		}
+
+		// The rest of the file is in the store
+		if (0 == request.m_size)
+			return;
+	}
+
+	std::string endpointId = m_info.m_endpointId;
+	send([this, endpointId, request]()
+	{
+		m_service.requestFile(endpointId, request);
+	});
+
+	m_requestedPosition += request.m_size;
+	++m_outstanding;
+}
+
+void FileTransfer::startSending()
+{
+	// The first chunk is sent even for an empty file, then the window is filled
+	if (!sendNextChunk())
+		return;
+
+	while (m_outstanding < m_session.m_windowSize && m_transferringFilePosition < uploadSize())
+	{
+		if (!sendNextChunk())
+			return;
+	}
+}
+
+bool FileTransfer::sendNextChunk()
+{
+	if (m_broadcast)
+		return sendBroadcastChunk();
+
+	FileChunk chunk;
+	chunk.m_fileName = m_info.m_remoteFileName;
+	chunk.m_fileSize = m_fileReader.size();
+	chunk.m_positionFrom = m_transferringFilePosition;
+	chunk.m_valid = true;
+
+	__int64 chunkSize = chunk.m_fileSize - chunk.m_positionFrom;
+	if (chunkSize > static_cast<__int64>(m_session.m_chunkSize))
+		chunkSize = m_session.m_chunkSize;
+
+	// Literal data of a delta chunk and a block carried to the next chunk fit the chunk size
+	if (m_encoder.get() && chunkSize > static_cast<__int64>(m_encoder->signature().windowSize(m_session.m_chunkSize)))
+		chunkSize = m_encoder->signature().windowSize(m_session.m_chunkSize);
+
+	// Hole at the end of the chunk is described up to the next data of a sparse file,
+	//	so a large hole takes one message. Chunks are only sent in order, the client follows holes.
+	__int64 dataSize = chunkSize;
+	__int64 holeSize = 0;
+	if (0 != (m_session.m_features & MessageIdentity::FEATURE_SPARSE_FILES) && !m_encoder.get())
+	{
+		dataSize = m_fileReader.dataSize(chunk.m_positionFrom, chunkSize);
+		if (dataSize < chunkSize)
+			holeSize = m_fileReader.holeSize(chunk.m_positionFrom + dataSize);
+
+		// File changed meanwhile, the chunk is sent as is
+		if (dataSize + holeSize < chunkSize)
+		{
+			dataSize = chunkSize;
+			holeSize = 0;
+		}
+	}
+
+	std::string endpointId = m_info.m_endpointId;
+	if (!m_prefetcher.take(chunk.m_fileData, chunk.m_positionFrom, static_cast<int>(chunkSize)))
+	{
+		// Failed to read, signal client to stop receiving file
+		chunk.m_valid = false;
+		send([this, endpointId, chunk]()
+		{
+			m_service.uploadFile(endpointId, chunk);
+		}, true);
+
+		finish(false, "Failed to read file");
+		return false;
+	}
+
+	// Zeros of the hole within the chunk are read from the file system cache for the hash, yet they are not sent.
+	// The rest of the hole is hashed without being read.
+	if (dataSize < chunkSize)
+		chunk.m_fileData = chunk.m_fileData.slice(0, static_cast<size_t>(dataSize));
+	m_prefetcher.skip(chunk.m_positionFrom + chunkSize, dataSize + holeSize - chunkSize);
+	chunk.m_holeSize = holeSize;
+
+	// Delta chunk describes the file from where the previous one ended, a block which may still match is carried
+	if (m_encoder.get())
+	{
+		bool last = chunk.m_positionFrom + chunkSize == chunk.m_fileSize;
+		util::BufferChain data = chunk.m_fileData;
+		chunk.m_fileData.clear();
+		chunk.m_positionFrom = m_encoder->position();
+		m_encoder->encode(data, last, chunk.m_delta, chunk.m_fileData);
+	}
+
+	m_transferringFilePosition += dataSize + holeSize;
+
+	// The last chunk carries hash of the whole file
+	chunk.m_hasFileHash = m_prefetcher.hash(chunk.m_fileHash);
+
+	send([this, endpointId, chunk]()
+	{
+		m_service.uploadFile(endpointId, chunk);
+	});
+	++m_outstanding;
+	return true;
+}
+
+bool FileTransfer::sendBroadcastChunk()
+{
+	__int64 size = 0;
+	msg::TSerializedMessagePtr chunk = m_broadcast->chunk(m_info.m_id, m_transferringFilePosition, size);
+
+	std::string endpointId = m_info.m_endpointId;
+	if (!chunk)
+	{
+		// Failed to read, signal client to stop receiving file
+		FileChunk failed;
+		failed.m_fileName = m_info.m_remoteFileName;
+		failed.m_valid = false;
+		send([this, endpointId, failed]()
+		{
+			m_service.uploadFile(endpointId, failed);
+		}, true);
+
+		finish(false, "Failed to read file");
+		return false;
+	}
+
+	send([this, endpointId, chunk]()
+	{
+		m_service.uploadFile(endpointId, chunk);
+	});
+
+	m_transferringFilePosition += size;
+	++m_outstanding;
+	return true;
+}
+
+__int64 FileTransfer::uploadSize() const
+{
+	return m_broadcast ? m_broadcast->fileSize() : m_fileReader.size();
+}
+
+void FileTransfer::progress(__int64 position, __int64 total)
+{
+	m_info.m_position = position;
+	m_info.m_fileSize = total;
+
+	TransferInfo info = m_info;
+	m_outbox.push_back([this, info]()
+	{
+		m_listener.onTransferProgress(info);
+	});
+}
+
+void FileTransfer::finish(bool ok, const std::string& error)
+{
+	if (m_finished)
+		return;
+
+	m_finished = true;
+	m_info.m_state = TransferInfo::FINISHED;
+	m_info.m_ok = ok;
+	m_info.m_error = error;
+
+	// Small files complete before any progress is reported
+	if (ok)
+	{
+		m_info.m_fileSize = TransferInfo::DOWNLOAD == m_info.m_direction ? m_transferringFileSize : uploadSize();
+		m_info.m_position = m_info.m_fileSize;
+	}
+
+	// Chunks are no longer kept for the transfer
+	if (m_broadcast)
+		m_broadcast->leave(m_info.m_id);
+
+	m_prefetcher.reset();
+	m_fileReader.close();
+	m_encoder.reset();
+	m_signature.reset();
+	m_manifest.reset();
+	m_stripeRequests.clear();
+	m_retryRanges.clear();
+	m_stripeConnections.clear();
+
+	// Files of a download and the chunks found in the store are dropped in order with the jobs using them
+	std::shared_ptr<FileTransfer> self = shared_from_this();
+	m_outbox.push_back([self]()
+	{
+		util::AsyncFileIo::instance().submit(&self->m_fileWriter, [self]()
+		{
+			self->m_fileWriter.close();
+			self->m_basis.close();
+			self->m_storedChunks.clear();
+		});
+	});
+
+	TransferInfo info = m_info;
+	m_outbox.push_back([this, info]()
+	{
+		m_listener.onTransferFinished(info);
+	});
+}
+
+void FileTransfer::send(const std::function<void ()>& message, bool mayFail)
+{
+	m_outbox.push_back([this, message, mayFail]()
+	{
+		try
+		{
+			message();
+		}
+		catch (const std::exception& x)
+		{
+			// Endpoint is gone or the message does not fit its limits
+			if (!mayFail)
+			{
+				util::ScopedLock lock(&m_sync);
+				finish(false, x.what());
+			}
+		}
+	});
+}
+
+void FileTransfer::flush()
+{
+	std::vector<std::function<void ()> > outbox;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		// Thread which is flushing already sends what was queued meanwhile as well
+		if (m_flushing)
+			return;
+
+		m_flushing = true;
+	}
+
+	for (;;)
+	{
+		{
+			util::ScopedLock lock(&m_sync);
+
+			outbox.clear();
+			outbox.swap(m_outbox);
+			if (outbox.empty())
+			{
+				m_flushing = false;
+				return;
+			}
+		}
+
+		// Messages handle their own failures, a delegate failing to take a report does not stop the rest
+		for (std::vector<std::function<void ()> >::const_iterator ii = outbox.begin(); ii != outbox.end(); ++ii)
+		{
+			try
+			{
+				(*ii)();
+			}
+			catch (const std::exception&)
+			{
+			}
+		}
+	}
+}
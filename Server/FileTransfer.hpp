@@ -0,0 +1,266 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <util/ChunkStore.hpp>
+#include <util/DeltaEncoder.hpp>
+#include <util/FileHandle.hpp>
+#include <util/FileReader.hpp>
+#include <util/FileWriter.hpp>
+#include <util/ReadAheadPrefetcher.hpp>
+#include <util/Stopwatch.hpp>
+#include <util/ThreadMutex.hpp>
+#include <protocol/DataTypes.hpp>
+#include <protocol/MessageIdentity.hpp>
+
+#include "Service.hpp"
+#include "UploadBroadcast.hpp"
+
+/**
+ * Download or upload of one file, it is scheduled by TransferManager.
+ * Chunks are pipelined up to the window size agreed with the endpoint. Downloaded data are written
+ *	by util::AsyncFileIo on a strand of the transfer, so files of concurrent transfers are written in parallel.
+ * Ranges of a large download are striped over data connections of the endpoint, each of them keeps its own window.
+ *	The number of connections grows while the total of their measured throughput does.
+ * Jobs keep the transfer alive, so it is always referred to by a shared pointer.
+ * Messages to the endpoint and reports to the listener are queued under the lock and sent in order once it is released,
+ *	since sending may block and the listener reaches delegates of the service, which call transfers themselves.
+ */
+class FileTransfer : public std::enable_shared_from_this<FileTransfer>, public IFileChunkSink
+{
+public:
+	/// Is called without the transfer locked, reports of a transfer come in order
+	struct IListener
+	{
+		virtual ~IListener() {}
+
+		/// Fires when the transfer starts and as its data are transferred
+		virtual void onTransferProgress(const TransferInfo& info) = 0;
+
+		/// Fires once the transfer is over, the transfer does not call the listener anymore
+		virtual void onTransferFinished(const TransferInfo& info) = 0;
+	};
+
+	FileTransfer(Service& service, IListener& listener, const TransferInfo& info, const util::TChunkStorePtr& chunkStore);
+
+	TransferInfo info() const;
+
+	/// Upload sends chunks of the broadcast rather than reads the file itself, is set before the transfer starts
+	void setBroadcast(const TUploadBroadcastPtr& broadcast);
+
+	/// Sends the first request of a download or the first chunk of an upload
+	void start();
+
+	/// Stops the transfer and reports it failed, a partially downloaded file is left under its temporary name
+	void cancel(const std::string& error);
+
+	//
+	// Responses of the endpoint, are routed by TransferManager
+	//
+	void onResponseFile(const FileChunk& chunk);
+	void onUploadFileReply(bool ok);
+	void onResponseSignature(const util::TDeltaSignaturePtr& signature);
+	void onResponseManifest(const util::TChunkManifestPtr& manifest);
+
+	/// Ranges requested over a closed data connection are requested over the other ones
+	void onConnectionClosed(net::IStream::TId connection);
+
+	//
+	// IFileChunkSink, downloaded data are written as they arrive
+	//
+	virtual bool beginChunkData(const FileChunk& chunk);
+	virtual bool writeChunkData(const FileChunk& chunk, const char* buf, size_t bufSize);
+	virtual bool writeChunkData(const FileChunk& chunk, const util::BufferChain& data);
+
+private:
+	FileTransfer(const FileTransfer&);
+	FileTransfer& operator =(const FileTransfer&);
+
+	void startDownload();
+	void startUpload();
+
+	/// Requests manifest of the downloaded file if its chunks may be in the store, otherwise its first chunk
+	void startReceiving();
+
+	/// Requests the next chunk of the downloaded file
+	void requestNextChunk();
+
+	/// Sends the first chunk of the uploaded file, then fills the window
+	void startSending();
+
+	/// Sends the next chunk of the uploaded file, returns false if the upload failed
+	bool sendNextChunk();
+
+	/// Sends the next chunk of a broadcast, returns false if the upload failed
+	bool sendBroadcastChunk();
+
+	/// Size of the uploaded file
+	__int64 uploadSize() const;
+
+	/// Is run by the disk I/O threads, signs the local copy of a downloaded file and sends the first request
+	void signLocalFile();
+
+	/// Is run by the disk I/O threads once data of a downloaded chunk are written
+	void onChunkWritten(const FileChunk& chunk);
+
+	/// Writes a chunk requested in order, data are written without the transfer locked
+	void writeChunk(const FileChunk& chunk);
+
+	/// Is run by the disk I/O threads once the manifest of a downloaded file arrives, writes the stored chunks it begins with
+	void beginStoredDownload();
+
+	/// Puts chunks of the manifest received by a chunk into the store, returns false if they do not match the manifest
+	bool storeReceivedChunks(const FileChunk& chunk, const util::ChunkManifest& manifest);
+
+	/// Writes stored chunks which follow the written data, up to the next chunk to be received
+	bool writeStoredChunks(const util::ChunkManifest& manifest);
+
+	/// Must be executed under the lock. Requests more of the downloaded file once data were written, returns true once it is complete.
+	bool continueDownload();
+
+	/// Is run by the disk I/O threads, verifies and saves the complete file, then finishes the download
+	void completeDownload(bool hasFileHash, util::T_UI8 fileHash);
+
+	/// Returns true if the rest of the download may be striped over data connections
+	bool isStripeable() const;
+
+	/// Starts requesting ranges over data connections of the endpoint
+	void startStriping();
+
+	/// Writes a range received over any of the connections at its position, data are written without the transfer locked
+	void onStripeWritten(const FileChunk& chunk);
+
+	/// Requests ranges over the connections in use, up to the window of each
+	void fillStripes();
+
+	/// Judges throughput of the connections in use, adds a connection while the throughput grows
+	void adaptStripes();
+
+	/// Marks the download failed, the next written chunk fails it
+	void onWriteFailed();
+
+	/// Reports progress of the transfer to the listener
+	void progress(__int64 position, __int64 total);
+
+	/// Ends the transfer and reports it to the listener, the first call wins
+	void finish(bool ok, const std::string& error);
+
+	/// Queues a message to the endpoint. The transfer fails if the message could not be sent, unless it may fail.
+	void send(const std::function<void ()>& message, bool mayFail = false);
+
+	/// Sends messages and reports queued under the lock, must be called without the lock
+	void flush();
+
+private:
+	mutable util::ThreadMutex m_sync;
+	Service& m_service;
+	IListener& m_listener;
+	TransferInfo m_info;
+	bool m_finished;
+
+	/// Messages and reports queued under the lock, one thread at a time sends them so they keep their order
+	std::vector<std::function<void ()> > m_outbox;
+	bool m_flushing;
+
+	__int64 m_transferringFileSize;
+	__int64 m_transferringFilePosition;
+
+	/// Mode agreed with the endpoint, chunks are pipelined up to its window size
+	SessionParams m_session;
+	unsigned int m_outstanding;
+	__int64 m_requestedPosition;
+
+	/// Downloaded data are written by util::AsyncFileIo in order, these track data queued for writing
+	__int64 m_receivedPosition;
+	bool m_writeFailed;
+
+	util::FileReader m_fileReader;
+
+	/// Reads chunks of the uploaded file ahead while previous ones are sent
+	util::ReadAheadPrefetcher m_prefetcher;
+
+	/// Is the strand of the disk I/O jobs of the transfer as well, only the jobs use it
+	util::FileWriter m_fileWriter;
+
+	/// Signature of the local copy of a downloaded file, chunks are differences to the copy if it is set
+	util::TDeltaSignaturePtr m_signature;
+
+	/// Local copy the differences are applied to, is only used by the disk I/O jobs
+	util::FileHandle m_basis;
+
+	/// Encodes chunks of the uploaded file as differences to the endpoint's copy of it
+	std::auto_ptr<util::DeltaEncoder> m_encoder;
+
+	/// Reads and saves chunks of a file uploaded to many endpoints, is NULL for other transfers
+	TUploadBroadcastPtr m_broadcast;
+
+	/// Chunks received by any download are stored, chunks of a downloaded file found in the store are not received again
+	util::TChunkStorePtr m_chunkStore;
+
+	/// Manifest of the downloaded file and which of its chunks were found in the store, is NULL unless chunks are deduplicated
+	util::TChunkManifestPtr m_manifest;
+	std::vector<bool> m_storedChunks;
+
+	/// Chunk of the manifest to be requested next and to be written next
+	size_t m_nextChunk;
+	size_t m_writtenChunk;
+
+	/// Ranges are requested over m_stripes connections at once, the first connection of the endpoint is one of them
+	bool m_striped;
+	size_t m_stripes;
+
+	struct StripeRequest
+	{
+		net::IStream::TId connection;
+		__int64 size;
+	};
+
+	typedef std::map<
+		__int64,		// position of the requested range
+		StripeRequest	// connection the range is requested over
+	> TStripeRequests;
+	TStripeRequests m_stripeRequests;
+
+	/// Ranges to be requested again, since their connection closed or the endpoint sent less of them
+	std::deque<std::pair<__int64, __int64> > m_retryRanges;
+
+	/// Hash of the whole file, it comes with the last range of a striped download
+	bool m_hasFileHash;
+	util::T_UI8 m_fileHash;
+
+	struct StripeConnection
+	{
+		StripeConnection()
+			: outstanding(0)
+			, received(0)
+		{
+		}
+
+		unsigned int outstanding;
+
+		/// Bytes received since the current probe began
+		__int64 received;
+	};
+
+	typedef std::map<
+		net::IStream::TId,	// data connection, 0 is the first connection
+		StripeConnection
+	> TStripeConnections;
+	TStripeConnections m_stripeConnections;
+
+	/// Connections the last requests were spread over
+	size_t m_connectionsInUse;
+
+	/// Throughput of each number of stripes is measured for a while, the best one is kept once more do not help
+	util::Stopwatch m_probeClock;
+	double m_bestRate;
+	size_t m_bestStripes;
+	bool m_stripesSettled;
+};
+
+typedef std::shared_ptr<FileTransfer> TFileTransferPtr;
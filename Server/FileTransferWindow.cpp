@@ -5,9 +5,9 @@
 #include <QFileSystemModel>
 #include "Server.h"
 
+#include <protocol/MessageRequestFiles.hpp>
+
 namespace {
-	// Size of transmitting block of file
-	const int kFileChunkSize = 1024*100;
 	const char* kDefaultRootPath = "C:\\";
 }
 
@@ -16,8 +16,10 @@ FileTransferWindow::FileTransferWindow(const ServicePtr& service, const std::str
 	: QWidget(parent)
 	, m_service(service)
 	, m_endpoint(endpoint)
+	, m_transferId(0)
 {
 	setAttribute(Qt::WA_DeleteOnClose);
+
 	this->setWindowTitle(QString::fromStdString("File Transfer [" + endpoint + "]"));
 	ui.setupUi(this);
 
@@ -42,9 +44,9 @@ FileTransferWindow::FileTransferWindow(const ServicePtr& service, const std::str
 
 FileTransferWindow::~FileTransferWindow()
 {
-	util::ScopedLock lock(&m_sync);
-
+	// Transfers go on without the window. Delegates being called are waited for, so the window is not locked meanwhile.
 	m_service->deleteDelegate(this);
+	m_treeReceiver.reset();
 }
 
 void FileTransferWindow::onEndpointDisconnected(const std::string& endpointId)
@@ -67,87 +69,45 @@ void FileTransferWindow::onResponseDir(const std::string& endpointId, const TDir
 	}
 }
 
-void FileTransferWindow::onResponseFile(const std::string& endpointId, const FileChunk& chunk)
+void FileTransferWindow::onTreeBatch(const std::string& endpointId, const TreeBatch& batch)
 {
 	util::ScopedLock lock(&m_sync);
 
-	if(m_endpoint == endpointId) {
-		if (!chunk.m_valid 
-			|| (chunk.m_fileName != m_remoteFileName)
-			|| !m_fileWriter.open(m_localFileName))
-		{
-			QMetaObject::invokeMethod(this, "stopFileTransmission", Qt::QueuedConnection);
-			::MessageBoxA(NULL, "Failed to download file", "Error", MB_ICONERROR);
-			return;
-		}
-		m_transferringFileSize = chunk.m_fileSize;
-
-		// Write data to file
-		m_fileWriter.write(chunk.m_fileData);
+	// Batches in flight may arrive after the download was stopped
+	if (m_endpoint == endpointId && m_treeReceiver.get())
+		m_treeReceiver->receive(batch);
+}
 
-		if (chunk.m_fileSize > m_fileWriter.size())
-		{
-			// Get another chunk
-			FileRequest request;
-			request.m_fileName = m_remoteFileName;
-			request.m_startFrom = m_fileWriter.size();
-
-			m_service->requestFile(m_endpoint, request);
-			// update ui
-			QMetaObject::invokeMethod(this, "updateFile", Qt::QueuedConnection, 
-				Q_ARG(qlonglong, m_fileWriter.size()), Q_ARG(qlonglong, chunk.m_fileSize));
-		}
-		else
-		{
-			QMetaObject::invokeMethod(this, "stopFileTransmission", Qt::QueuedConnection);
-		}
-	}
+void FileTransferWindow::onTransferQueued(const TransferInfo& info)
+{
+	onTransferProgress(info);
 }
 
-void FileTransferWindow::onUploadFileReply(const std::string& endpointId, bool ok)
+void FileTransferWindow::onTransferProgress(const TransferInfo& info)
 {
 	util::ScopedLock lock(&m_sync);
 
-	if(m_endpoint == endpointId) {
-		if (!ok) {
-			QMetaObject::invokeMethod(this, "stopFileTransmission", Qt::QueuedConnection);
-			::MessageBoxA(NULL, "Failed to upload file", "Error", MB_ICONERROR);
-			return;
-		}
+	if (m_endpoint == info.m_endpointId) {
+		m_transfers[info.m_id] = info;
 
-		FileChunk chunk;
-		chunk.m_fileName = m_remoteFileName;
-		chunk.m_fileSize = m_fileReader.size();
-		chunk.m_positionFrom = m_transferringFilePosition;
-		chunk.m_valid = true;
+		// main thread UI Update call
+		QMetaObject::invokeMethod(this, "updateTransfers", Qt::QueuedConnection);
+	}
+}
 
-		if (m_transferringFilePosition >= chunk.m_fileSize)
-		{
-			// File transmited completely, update UI
-			QMetaObject::invokeMethod(this, "stopFileTransmission", Qt::QueuedConnection);
-			return;
-		}
-	
-		__int64 chunkSize = chunk.m_fileSize - chunk.m_positionFrom;
-		if (chunkSize > kFileChunkSize) 
-			chunkSize = kFileChunkSize;
-		m_transferringFilePosition += chunkSize;
+void FileTransferWindow::onTransferFinished(const TransferInfo& info)
+{
+	util::ScopedLock lock(&m_sync);
 
-		if (!m_fileReader.read(chunk.m_fileData, chunk.m_positionFrom, static_cast<int>(chunkSize)))
-		{
-			// Failed to read, signal client to stop receiving file
-			chunk.m_valid = false;
-			m_service->uploadFile(m_endpoint, chunk);
+	if (m_endpoint == info.m_endpointId) {
+		m_transfers.erase(info.m_id);
 
-			// Stop uploading
-			QMetaObject::invokeMethod(this, "stopFileTransmission", Qt::QueuedConnection);
-			::MessageBoxA(NULL, "Failed to read file", "Error", MB_ICONERROR);
-			return;
-		}
-		m_service->uploadFile(m_endpoint, chunk);
-		// Update UI
-		QMetaObject::invokeMethod(this, "updateFile", Qt::QueuedConnection,
-			Q_ARG(qlonglong, chunk.m_positionFrom), Q_ARG(qlonglong, chunk.m_fileSize));
+		// Several transfers run at once, so the error names the file
+		if (!info.m_ok)
+			m_transferErrors.append(QString::fromStdString(info.m_error) + ": " + QString::fromStdWString(info.m_remoteFileName));
+
+		// main thread UI Update call
+		QMetaObject::invokeMethod(this, "updateTransfers", Qt::QueuedConnection);
 	}
 }
 
@@ -177,19 +137,48 @@ void FileTransferWindow::onDownloadFileClicked()
 {
 	// Get current selected file
 	QList<QListWidgetItem*> items = ui.lwDirRemote->selectedItems();
-	if (items.empty() || items.front()->data(Qt::UserRole).toBool())
+	if (items.empty())
+	{
+		// Nothing was selected
+		::MessageBoxA(NULL, "Select remote file", "Error", MB_ICONERROR);
+		return;
+	}
+
+	std::wstring rootPathUTF16 = std::wstring((wchar_t*)m_fileSystemModel->rootPath().unicode(), m_fileSystemModel->rootPath().length());
+
+	// Several files are requested at once, selected directories are skipped
+	if (1 < items.size() && 0 != (m_service->sessionParams(m_endpoint).m_features & MessageIdentity::FEATURE_BATCH_FETCH))
+	{
+		std::vector<std::wstring> names;
+		for (QList<QListWidgetItem*>::const_iterator ii = items.begin(); ii != items.end(); ++ii)
+		{
+			if (!(*ii)->data(Qt::UserRole).toBool())
+				names.push_back(std::wstring((wchar_t*)(*ii)->text().unicode(), (*ii)->text().length()));
+		}
+
+		if (!names.empty())
+		{
+			std::wstring remoteDirUTF16 = std::wstring((wchar_t*)m_currentRemoteDir.unicode(), m_currentRemoteDir.length());
+			startBatchDownload(remoteDirUTF16, names, rootPathUTF16);
+			return;
+		}
+	}
+
+	// Directory is downloaded as a whole tree if the endpoint streams trees
+	bool isDir = items.front()->data(Qt::UserRole).toBool();
+	if (isDir && 0 == (m_service->sessionParams(m_endpoint).m_features & MessageIdentity::FEATURE_TREE))
 	{
-		// Nothing or directory were selected
 		::MessageBoxA(NULL, "Select remote file", "Error", MB_ICONERROR);
 		return;
 	}
 
-	// File was selected
 	QString remoteFileName = m_currentRemoteDir + "/" + items.front()->text();
 	std::wstring remoteFileNameUTF16 = std::wstring((wchar_t*)remoteFileName.unicode(), remoteFileName.length());
-	std::wstring rootPathUTF16 = std::wstring((wchar_t*)m_fileSystemModel->rootPath().unicode(), m_fileSystemModel->rootPath().length());
 
-	startFileDownload(remoteFileNameUTF16, rootPathUTF16);
+	if (isDir)
+		startTreeDownload(remoteFileNameUTF16, rootPathUTF16);
+	else
+		startFileDownload(remoteFileNameUTF16, rootPathUTF16);
 }
 
 void FileTransferWindow::onUploadFileClicked()
@@ -301,76 +290,193 @@ void FileTransferWindow::updateDir()
 	}
 }
 
-void FileTransferWindow::updateFile(qlonglong position, qlonglong total)
+void FileTransferWindow::updateTransfers()
 {
 	static QDateTime lastUpdate = QDateTime::currentDateTime();
 
-	if (lastUpdate.msecsTo(QDateTime::currentDateTime()) < 200)
+	QStringList errors;
+	__int64 position = 0;
+	__int64 total = 0;
+	size_t count = 0;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		errors.swap(m_transferErrors);
+		for (std::map<unsigned int, TransferInfo>::const_iterator ii = m_transfers.begin(); ii != m_transfers.end(); ++ii)
+		{
+			// Downloads of unknown size do not count until their first chunk arrives
+			if (0 < ii->second.m_fileSize)
+			{
+				position += ii->second.m_position;
+				total += ii->second.m_fileSize;
+			}
+		}
+		count = m_transfers.size();
+	}
+
+	// Progress covers all transfers of the endpoint, the last update is always shown
+	if (errors.isEmpty() && 0 != count && lastUpdate.msecsTo(QDateTime::currentDateTime()) < 200)
 		return;
 	lastUpdate = QDateTime::currentDateTime();
 
-	double progress = (100.0 * position) / double(total);
+	double progress = total ? (100.0 * position) / double(total) : 0.0;
 	ui.progressBar->setValue(static_cast<int>(progress));
+	ui.progressBar->setFormat(1 < count ? QString("%p% of %1 files").arg(count) : QString("%p%"));
+
+	for (QStringList::const_iterator ii = errors.begin(); ii != errors.end(); ++ii)
+		::MessageBoxA(NULL, ii->toLocal8Bit().constData(), "Error", MB_ICONERROR);
 }
 
 void FileTransferWindow::startFileDownload(const std::wstring& remoteFileName, const std::wstring& localPath)
+{
+	QFileInfo info(QString::fromUtf16(remoteFileName.c_str()));
+	std::wstring fileNameUTF16 = std::wstring((wchar_t*)info.fileName().unicode(), info.fileName().length());
+
+	// Download is queued with transfers of all endpoints, the window shows its progress
+	try
+	{
+		m_service->transfers().download(m_endpoint, remoteFileName, localPath + L"/" + fileNameUTF16);
+	}
+	catch (const std::exception& x)
+	{
+		::MessageBoxA(NULL, x.what(), "Error", MB_ICONERROR);
+	}
+}
+
+void FileTransferWindow::startTreeDownload(const std::wstring& remoteDir, const std::wstring& localPath)
 {
 	ui.btnDownloadFile->setEnabled(false);
 	ui.btnUploadFile->setEnabled(false);
 	ui.btnRequestDir->setEnabled(false);
 
-	m_remoteFileName = remoteFileName;
-	QFileInfo info(QString::fromUtf16(remoteFileName.c_str()));
-	std::wstring fileNameUTF16 = std::wstring((wchar_t*)info.fileName().unicode(), info.fileName().length());
-	m_localFileName = localPath + L"/" + fileNameUTF16;
+	util::ScopedLock lock(&m_sync);
+
+	QFileInfo info(QString::fromUtf16(remoteDir.c_str()));
+	std::wstring dirNameUTF16 = std::wstring((wchar_t*)info.fileName().unicode(), info.fileName().length());
 
-	FileRequest request;
-	request.m_fileName = remoteFileName;
-	request.m_startFrom = 0;
+	receiveTree(localPath + L"/" + dirNameUTF16);
 
-	m_service->requestFile(m_endpoint, request);
+	try
+	{
+		m_service->requestTree(m_endpoint, remoteDir);
+	}
+	catch (const std::exception& x)
+	{
+		::MessageBoxA(NULL, x.what(), "Error", MB_ICONERROR);
+		stopFileTransmission();
+	}
 }
 
-void FileTransferWindow::startFileUpload(const std::wstring& localFileName)
+void FileTransferWindow::startBatchDownload(const std::wstring& remoteDir, const std::vector<std::wstring>& names, const std::wstring& localPath)
 {
 	ui.btnDownloadFile->setEnabled(false);
 	ui.btnUploadFile->setEnabled(false);
 	ui.btnRequestDir->setEnabled(false);
 
-	m_localFileName = localFileName;
-	QFileInfo info(QString::fromUtf16(localFileName.c_str()));
-	//std::string fileName = info.fileName().toStdString();
-	std::wstring fileNameUTF16 = std::wstring((wchar_t*)info.fileName().unicode(), info.fileName().length());
-	std::wstring currentRemoteDirUTF16 = std::wstring((wchar_t*)m_currentRemoteDir.unicode(), m_currentRemoteDir.length());
+	util::ScopedLock lock(&m_sync);
 
-	m_remoteFileName = currentRemoteDirUTF16 + L"/" + fileNameUTF16;
+	m_batchRemoteDir = remoteDir;
+	m_batchLocalDir = localPath;
+	m_batchNames.assign(names.begin(), names.end());
 
-	if (!m_fileReader.open(m_localFileName))
+	requestNextFiles();
+}
+
+void FileTransferWindow::receiveTree(const std::wstring& localDir)
+{
+	// Batches of the previous transfer are ignored
+	++m_transferId;
+	unsigned int transferId = m_transferId;
+
+	// Receiver reports from the disk I/O threads, the service is only called by the UI thread,
+	//	so that a job never waits for the service while the service waits for a free job slot
+	m_treeReceiver.reset(new TreeReceiver(localDir,
+		[this, transferId](util::T_UI4 sequence)
+		{
+			QMetaObject::invokeMethod(this, "ackTreeBatch", Qt::QueuedConnection,
+				Q_ARG(uint, transferId), Q_ARG(uint, sequence));
+		},
+		[this, transferId](bool ok, size_t fileCount, size_t failedCount)
+		{
+			QMetaObject::invokeMethod(this, "treeDownloaded", Qt::QueuedConnection,
+				Q_ARG(uint, transferId), Q_ARG(bool, ok), Q_ARG(uint, static_cast<uint>(failedCount)));
+		}));
+}
+
+void FileTransferWindow::requestNextFiles()
+{
+	// The endpoint sends files of one request at a time, so a large selection is requested in parts
+	std::vector<std::wstring> names;
+	while (!m_batchNames.empty() && names.size() < MessageRequestFiles::kMaxFileCount)
 	{
-		::MessageBoxA(NULL, "Failed to open file", "Error", MB_ICONERROR);
-		stopFileTransmission();
-		return;
+		names.push_back(m_batchNames.front());
+		m_batchNames.pop_front();
 	}
 
-	FileChunk chunk;
-	chunk.m_fileName = m_remoteFileName;
-	chunk.m_fileSize = m_fileReader.size();
-	chunk.m_positionFrom = 0;
-	chunk.m_valid = true;
-	
-	int chunkSize = chunk.m_fileSize < kFileChunkSize ? chunk.m_fileSize : kFileChunkSize;
-	if (!m_fileReader.read(chunk.m_fileData, 0, chunkSize))
+	receiveTree(m_batchLocalDir);
+
+	try
 	{
-		::MessageBoxA(NULL, "Failed to read file", "Error", MB_ICONERROR);
+		m_service->requestFiles(m_endpoint, m_batchRemoteDir, names, std::wstring());
+	}
+	catch (const std::exception& x)
+	{
+		::MessageBoxA(NULL, x.what(), "Error", MB_ICONERROR);
 		stopFileTransmission();
-		return;
 	}
+}
 
-	m_transferringFilePosition = chunkSize;
+void FileTransferWindow::ackTreeBatch(uint transferId, uint sequence)
+{
+	util::ScopedLock lock(&m_sync);
 
-	m_service->uploadFile(m_endpoint, chunk);
+	if (transferId == m_transferId && m_treeReceiver.get())
+		m_service->ackTreeBatch(m_endpoint, sequence);
 }
 
+void FileTransferWindow::treeDownloaded(uint transferId, bool ok, uint failedCount)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (transferId != m_transferId || !m_treeReceiver.get())
+			return;
+
+		// Files of a batch download are requested part by part
+		if (ok && !m_batchNames.empty())
+		{
+			requestNextFiles();
+			return;
+		}
+	}
+
+	stopFileTransmission();
+
+	if (!ok)
+	{
+		std::string message = failedCount ?
+			std::to_string(failedCount) + " files of the directory failed to download" :
+			std::string("Failed to read remote directory");
+		::MessageBoxA(NULL, message.c_str(), "Error", MB_ICONERROR);
+	}
+}
+
+void FileTransferWindow::startFileUpload(const std::wstring& localFileName)
+{
+	QFileInfo info(QString::fromUtf16(localFileName.c_str()));
+	std::wstring fileNameUTF16 = std::wstring((wchar_t*)info.fileName().unicode(), info.fileName().length());
+	std::wstring currentRemoteDirUTF16 = std::wstring((wchar_t*)m_currentRemoteDir.unicode(), m_currentRemoteDir.length());
+
+	// Upload is queued with transfers of all endpoints, the window shows its progress
+	try
+	{
+		m_service->transfers().upload(m_endpoint, localFileName, currentRemoteDirUTF16 + L"/" + fileNameUTF16);
+	}
+	catch (const std::exception& x)
+	{
+		::MessageBoxA(NULL, x.what(), "Error", MB_ICONERROR);
+	}
+}
 
 void FileTransferWindow::startFileExecution(const std::wstring& remoteFileName)
 {
@@ -384,11 +490,16 @@ void FileTransferWindow::startFileExecution(const std::wstring& remoteFileName)
 
 void FileTransferWindow::stopFileTransmission()
 {
-	m_fileReader.close();
-	m_fileWriter.close();
+	util::ScopedLock lock(&m_sync);
+
+	// Batches of the stopped tree are ignored
+	++m_transferId;
+
+	// Writes queued for the tree are waited for, they do not use the window
+	m_treeReceiver.reset();
+	m_batchNames.clear();
 
 	ui.btnDownloadFile->setEnabled(true);
 	ui.btnUploadFile->setEnabled(true);
 	ui.btnRequestDir->setEnabled(true);
-	ui.progressBar->setValue(0);
 }
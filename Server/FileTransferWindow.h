@@ -8,6 +8,8 @@
 #include <limits>
 #include <cassert>
 #include <ctime>
+#include <deque>
+#include <map>
 
 #include <windows.h>
 
@@ -18,8 +20,6 @@
 #include "util/ThreadMutex.hpp"
 #include "util/ScopedLock.hpp"
 #include <util/Error.hpp>
-#include <util/FileReader.hpp>
-#include <util/FileWriter.hpp>
 #include <util/GetOpt.hpp>
 #include <util/MemoryStream.hpp>
 #include <util/ScopedArray.hpp>
@@ -33,6 +33,8 @@
 
 #include "ui_filetransferwindow.h"
 #include "Service.hpp"
+#include "TransferManager.hpp"
+#include "TreeReceiver.hpp"
 
 class QFileSystemModel;
 
@@ -50,8 +52,10 @@ protected:
 	//
 	virtual void onEndpointDisconnected(const std::string& endpointId);
 	virtual void onResponseDir(const std::string& endpointId, const TDirItems& content);
-	virtual void onResponseFile(const std::string& endpointId, const FileChunk& chunk);
-	virtual void onUploadFileReply(const std::string& endpointId, bool ok);
+	virtual void onTreeBatch(const std::string& endpointId, const TreeBatch& batch);
+	virtual void onTransferQueued(const TransferInfo& info);
+	virtual void onTransferProgress(const TransferInfo& info);
+	virtual void onTransferFinished(const TransferInfo& info);
 
 public slots:
 	
@@ -65,12 +69,28 @@ private slots:
 
 
 	void updateDir();
-	void updateFile(qlonglong position, qlonglong total);
+
+	/// Shows progress of the transfers of the endpoint and errors of the finished ones
+	void updateTransfers();
 	void endpointDisconnect();
 	void stopFileTransmission();
 
+	/// Acknowledges a written batch of the downloaded tree, unless another transfer started meanwhile
+	void ackTreeBatch(uint transferId, uint sequence);
+
+	/// Reports the downloaded tree once all its files are written
+	void treeDownloaded(uint transferId, bool ok, uint failedCount);
+
 private:
 	void startFileDownload(const std::wstring& remoteFileName, const std::wstring& localPath);
+	void startTreeDownload(const std::wstring& remoteDir, const std::wstring& localPath);
+	void startBatchDownload(const std::wstring& remoteDir, const std::vector<std::wstring>& names, const std::wstring& localPath);
+
+	/// Starts a new transfer whose files are written under a local directory as batches arrive
+	void receiveTree(const std::wstring& localDir);
+
+	/// Requests the next files of the batch download, as many as one request names
+	void requestNextFiles();
 	void startFileExecution(const std::wstring& remoteFileName);
 	void startFileUpload(const std::wstring& localFileName);
 
@@ -81,13 +101,22 @@ private:
 	std::string m_endpoint;
 
 	TDirItems m_dirContent;
-	
-	std::wstring m_remoteFileName;
-	std::wstring m_localFileName;
-	__int64 m_transferringFileSize;
-	__int64 m_transferringFilePosition;
-	util::FileReader m_fileReader;
-	util::FileWriter m_fileWriter;
+
+	/// Transfers of the endpoint being run by the service, errors of the finished ones are shown by the UI thread
+	std::map<unsigned int, TransferInfo> m_transfers;
+	QStringList m_transferErrors;
+
+	/// Batches of a previous tree download are ignored
+	unsigned int m_transferId;
+
+	/// Writes the downloaded directory tree, is NULL unless a tree is downloaded
+	std::auto_ptr<TreeReceiver> m_treeReceiver;
+
+	/// Files of the batch download not requested yet, their remote and local directories
+	std::deque<std::wstring> m_batchNames;
+	std::wstring m_batchRemoteDir;
+	std::wstring m_batchLocalDir;
+
 	QFileSystemModel* m_fileSystemModel; 
 	QString m_currentRemoteDir;
 };
@@ -11,6 +11,7 @@
 #include <ctime>
 
 #include <util/SharedPtr.hpp>
+#include <util/ChunkStore.hpp>
 #include <util/Error.hpp>
 #include <util/GetOpt.hpp>
 #include <util/MemoryStream.hpp>
@@ -42,6 +43,7 @@ protected:
 	virtual void onEndpointConnected(const std::string& endpointId);
 	virtual void onEndpointDisconnected(const std::string& endpointId);
 	virtual void onResponseSysInfo(const std::string& endpointId, const std::vector<std::string>& sysinfo);
+	virtual void onQueryFinished(const QueryResult& result);
 
 private:
 	Ui::ServerClass ui;
@@ -49,6 +51,9 @@ private:
 	util::ThreadMutex m_sync;
 	ServicePtr m_service;
 
+	/// Chunks of downloaded files shared by file transfers of all endpoints, see TransferManager::setChunkStore()
+	util::TChunkStorePtr m_chunkStore;
+
 	typedef std::vector<std::string> TStrings;
 	typedef std::map<std::string, std::string> TStringMap;
 	typedef std::map<std::string,std::vector<std::string>> TStringVectorMap;
@@ -71,4 +76,5 @@ public slots:
 	void updateSysinfo();
 	void updateConnectedEndpoints();
 	void updateDisconnectedEndpoints();
+	void showQueryResult(const QString& summary);
 };
@@ -1,14 +1,24 @@
 #include "Service.hpp"
+#include "TransferManager.hpp"
 
 #include <net/BindingFactory.hpp>
 #include <protocol/MessageIdentity.hpp>
 #include <protocol/MessageRequestDir.hpp>
 #include <protocol/MessageResponseDir.hpp>
 #include <protocol/MessageRequestFile.hpp>
+#include <protocol/MessageRequestManifest.hpp>
+#include <protocol/MessageRequestSignature.hpp>
 #include <protocol/MessageResponseFile.hpp>
+#include <protocol/MessageResponseManifest.hpp>
+#include <protocol/MessageResponseSignature.hpp>
 #include <protocol/MessageResponseSysInfo.hpp>
+#include <protocol/MessageRequestFiles.hpp>
+#include <protocol/MessageRequestTree.hpp>
+#include <protocol/MessageTreeAck.hpp>
+#include <protocol/MessageTreeData.hpp>
 #include <protocol/MessageUploadFile.hpp>
 #include <protocol/MessageUploadFileReply.hpp>
+#include <protocol/MessageOpenConnections.hpp>
 #include <protocol/SvcMsgFactory.hpp>
 #include <util/Error.hpp>
 #include <Protocol/MessageGeneric.hpp>
@@ -18,8 +28,34 @@ Service* Service::s_instance = 0;
 
 static DWORD WINAPI listenerWorkerProc(LPVOID param);
 
-Service::Service(net::BindingFactory::BindingType bindingType, const std::string& address, IServiceDelegate* delegate_) : m_hWorker(NULL)
+namespace {
+
+/// Dispatches the calling thread is in and the epoch the outermost one is counted in
+__declspec(thread) int t_dispatchDepth = 0;
+__declspec(thread) LONG t_dispatchEpoch = 0;
+
+} // namespace
+
+Service::Service(net::BindingFactory::BindingType bindingType, const std::string& address, IServiceDelegate* delegate_)
+	: m_subscriptions(std::make_shared<Subscriptions>())
+	, m_epoch(0)
+	, m_hWorker(NULL)
+	, m_hQueryTimers(NULL)
+	, m_lastQueryId(0)
+	, m_lastRequestId(0)
 {
+	m_dispatches[0] = 0;
+	m_dispatches[1] = 0;
+
+	// Deadlines of queries are timed by the thread pool
+	m_hQueryTimers = ::CreateTimerQueue();
+	if (NULL == m_hQueryTimers)
+		throw util::Error("Failed to create timer queue");
+
+	// Transfers get responses as soon as the listener runs
+	m_transfers.reset(new TransferManager(*this));
+	subscribe(m_transfers.get(), std::string(), IServiceDelegate::EVENT_CONNECTION | IServiceDelegate::EVENT_FILE | IServiceDelegate::EVENT_UPLOAD | IServiceDelegate::EVENT_MANIFEST);
+
 	m_msgFactory.reset(new SvcMsgFactory);
 
 	msg::Messenger& messenger = msg::Messenger::instance();
@@ -29,7 +65,7 @@ Service::Service(net::BindingFactory::BindingType bindingType, const std::string
 	m_binding = net::BindingFactory::createBinding(bindingType);
 	m_binding->bind(address, &(msg::Messenger::instance())); // Notifications of new streams are managed by Messanger
 
-	this->m_delegate.push_back(delegate_);
+	addDelegate(delegate_);
 
 	DWORD dwThreadId = 0;
 	m_hWorker = ::CreateThread(0, 0, listenerWorkerProc, this, 0, &dwThreadId);
@@ -72,6 +108,14 @@ Service::~Service()
 	messenger.setMessageFactory(0);
 	messenger.setBindingDelegate(0);
 
+	// Waits for running deadlines, queries are not reported anymore
+	::DeleteTimerQueueEx(m_hQueryTimers, INVALID_HANDLE_VALUE);
+	m_hQueryTimers = NULL;
+
+	// No more responses arrive, transfers are stopped before the service they use is gone
+	deleteDelegate(m_transfers.get());
+	m_transfers.reset();
+
 	// Reset instance pointer
 	{
 		util::ScopedLock lock(&s_sync);
@@ -84,15 +128,155 @@ Service::~Service()
 
 void Service::addDelegate(IServiceDelegate* delegate_)
 {
-	if (std::find(m_delegate.begin(), m_delegate.end(), delegate_) == m_delegate.end())
-		m_delegate.push_back(delegate_);
+	subscribe(delegate_, std::string(), IServiceDelegate::EVENT_ALL);
 }
 
 void Service::deleteDelegate(IServiceDelegate* delegate_)
 {
-	std::vector<IServiceDelegate*>::iterator position = std::find(m_delegate.begin(), m_delegate.end(), delegate_);
-	if (position != m_delegate.end())
-		m_delegate.erase(position);
+	{
+		util::ScopedLock lock(&m_sync);
+
+		std::shared_ptr<Subscriptions> subscriptions = std::make_shared<Subscriptions>(*std::atomic_load(&m_subscriptions));
+		unsubscribe(subscriptions->all, delegate_);
+		for (TEndpointSubscriptions::iterator ii = subscriptions->endpoints.begin(); ii != subscriptions->endpoints.end();)
+		{
+			unsubscribe(ii->second, delegate_);
+			if (ii->second.empty())
+				ii = subscriptions->endpoints.erase(ii);
+			else
+				++ii;
+		}
+
+		std::atomic_store(&m_subscriptions, TSubscriptionsPtr(subscriptions));
+	}
+
+	// Dispatches starting from now do not see the delegate, the ones which started before are waited for.
+	//	A delegate removed while it is called by this thread is not waited for by its own dispatch.
+	util::ScopedLock lock(&m_removeSync);
+
+	LONG epoch = m_epoch;
+	::InterlockedExchange(&m_epoch, 1 - epoch);
+
+	LONG own = 0 < t_dispatchDepth && epoch == t_dispatchEpoch ? 1 : 0;
+	while (m_dispatches[epoch] > own)
+		::Sleep(1);
+}
+
+void Service::subscribe(IServiceDelegate* delegate_, const std::string& endpointId, unsigned int events)
+{
+	if (!delegate_)
+		return;
+
+	util::ScopedLock lock(&m_sync);
+
+	// Messages being dispatched keep the subscriptions they started with
+	std::shared_ptr<Subscriptions> subscriptions = std::make_shared<Subscriptions>(*std::atomic_load(&m_subscriptions));
+	TSubscriptionList& list = endpointId.empty() ? subscriptions->all : subscriptions->endpoints[endpointId];
+
+	unsubscribe(list, delegate_);
+	if (0 != events)
+	{
+		Subscription subscription;
+		subscription.delegate = delegate_;
+		subscription.events = events;
+		list.push_back(subscription);
+	}
+
+	if (list.empty() && !endpointId.empty())
+		subscriptions->endpoints.erase(endpointId);
+
+	std::atomic_store(&m_subscriptions, TSubscriptionsPtr(subscriptions));
+}
+
+template<class F>
+void Service::notify(const std::string& endpointId, unsigned int event, F call)
+{
+	// Delegates are called without the lock, since they may send messages, which blocks, and call the service themselves
+	Dispatch dispatch(*this);
+
+	TSubscriptionsPtr subscriptions = std::atomic_load(&m_subscriptions);
+
+	const TSubscriptionList* lists[2] = { &subscriptions->all, 0 };
+	if (!endpointId.empty())
+	{
+		TEndpointSubscriptions::const_iterator ii = subscriptions->endpoints.find(endpointId);
+		if (ii != subscriptions->endpoints.end())
+			lists[1] = &ii->second;
+	}
+
+	for (size_t i = 0; i < 2 && lists[i]; ++i)
+	{
+		for (TSubscriptionList::const_iterator ii = lists[i]->begin(); ii != lists[i]->end(); ++ii)
+		{
+			// Delegate subscribed to all endpoints and to this one gets the event once
+			if (0 == (ii->events & event) || (0 < i && hasEvent(subscriptions->all, ii->delegate, event)))
+				continue;
+
+			// Delegate which unsubscribed meanwhile may be gone already
+			TSubscriptionsPtr current = std::atomic_load(&m_subscriptions);
+			if (current != subscriptions && !isSubscribed(*current, ii->delegate, endpointId, event))
+				continue;
+
+			call(ii->delegate);
+		}
+	}
+}
+
+Service::Dispatch::Dispatch(Service& service)
+	: m_service(service)
+{
+	if (0 < t_dispatchDepth++)
+		return;
+
+	// Removal may flip the epoch meanwhile, the dispatch counts in the epoch which is current once it is counted
+	for (;;)
+	{
+		LONG epoch = m_service.m_epoch;
+		::InterlockedIncrement(&m_service.m_dispatches[epoch]);
+		if (epoch == m_service.m_epoch)
+		{
+			t_dispatchEpoch = epoch;
+			return;
+		}
+		::InterlockedDecrement(&m_service.m_dispatches[epoch]);
+	}
+}
+
+Service::Dispatch::~Dispatch()
+{
+	if (0 == --t_dispatchDepth)
+		::InterlockedDecrement(&m_service.m_dispatches[t_dispatchEpoch]);
+}
+
+bool Service::hasEvent(const TSubscriptionList& list, IServiceDelegate* delegate_, unsigned int event)
+{
+	for (TSubscriptionList::const_iterator ii = list.begin(); ii != list.end(); ++ii)
+	{
+		if (ii->delegate == delegate_)
+			return 0 != (ii->events & event);
+	}
+	return false;
+}
+
+bool Service::isSubscribed(const Subscriptions& subscriptions, IServiceDelegate* delegate_, const std::string& endpointId, unsigned int event)
+{
+	if (hasEvent(subscriptions.all, delegate_, event))
+		return true;
+
+	TEndpointSubscriptions::const_iterator ii = endpointId.empty() ? subscriptions.endpoints.end() : subscriptions.endpoints.find(endpointId);
+	return ii != subscriptions.endpoints.end() && hasEvent(ii->second, delegate_, event);
+}
+
+void Service::unsubscribe(TSubscriptionList& list, IServiceDelegate* delegate_)
+{
+	for (TSubscriptionList::iterator ii = list.begin(); ii != list.end(); ++ii)
+	{
+		if (ii->delegate == delegate_)
+		{
+			list.erase(ii);
+			return;
+		}
+	}
 }
 
 
@@ -107,32 +291,61 @@ void Service::onStreamCreated(net::IStream::TId streamId)
 void Service::onStreamDied(net::IStream::TId streamId)
 {
 	std::string endpointId;
-	IServiceDelegate* delegate_ = 0;
+	bool isDataConnection = false;
+	std::vector<net::IStream::TId> dataConnections;
 	{
 		util::ScopedLock lock(&m_sync);
 
-		TEndpoints::iterator ii = m_endpoints.find(streamId);
-		if (ii == m_endpoints.end())
+		TEndpointRegistry::TRecordPtr record = m_registry.remove(streamId);
+
+		if (record && !record->isMain)
+		{
+			endpointId = record->endpointId;
+			isDataConnection = true;
+		}
+		else if (!record)
 		{
 			assert(!"Stream either not found or died while processing MessageIdentity");
 		}
 		else
 		{
-			endpointId = ii->second;
+			endpointId = record->endpointId;
 			assert(!endpointId.empty());
+
+			// Endpoint which reconnected meanwhile keeps its new streams and the queries waiting for it
+			if (!m_registry.findStream(endpointId))
+			{
+				dataConnections = this->dataConnections(endpointId);
+				m_dataConnectionCounts.erase(endpointId);
+
+				m_pendingSysInfo.erase(endpointId);
+				m_pendingDirs.erase(endpointId);
+				for (TQueries::iterator qq = m_queries.begin(); qq != m_queries.end(); ++qq)
+					qq->second.query->onEndpointGone(endpointId);
+			}
 		}
 	}
 
-	for(IServiceDelegate* i: m_delegate){
-		if (i)
+	// Endpoint stays connected without a data connection
+	if (isDataConnection)
+	{
+		notify(endpointId, IServiceDelegate::EVENT_CONNECTION, [&](IServiceDelegate* delegate)
 		{
-			chkptr(i);
+			delegate->onDataConnectionClosed(endpointId, streamId);
+		});
+		return;
+	}
 
-			util::ScopedLock lock(&m_sync);
+	finishQueries();
 
-			i->onEndpointDisconnected(endpointId);
-		}
-	}
+	notify(endpointId, IServiceDelegate::EVENT_CONNECTION, [&](IServiceDelegate* delegate)
+	{
+		delegate->onEndpointDisconnected(endpointId);
+	});
+
+	// Data connections go down with the first one
+	for (std::vector<net::IStream::TId>::const_iterator ii = dataConnections.begin(); ii != dataConnections.end(); ++ii)
+		net::StreamListener::instance().closeStream(*ii, "Endpoint disconnected");
 }
 
 void Service::onMessageReceived(::net::IStream::TId streamId, ::msg::TMessagePtr message)
@@ -141,68 +354,92 @@ void Service::onMessageReceived(::net::IStream::TId streamId, ::msg::TMessagePtr
 
 	if (MessageIdentity* msgIdentity = dynamic_cast<MessageIdentity*>(m))
 	{
+		// Agree on the best mode the client supports
+		SessionParams session = MessageIdentity::negotiate(MessageIdentity(), *msgIdentity);
+		msg::Messenger::instance().setStreamOptions(streamId, session.streamOptions());
+
+		// Data connection belongs to an endpoint which is connected already
+		if (0 != msgIdentity->m_connection)
+		{
+			util::ScopedLock lock(&m_sync);
+			m_registry.addConnection(streamId, msgIdentity->m_identity, session);
+			return;
+		}
+
 		// First message after connect, remember client's endpoint
-		for(IServiceDelegate* delegate: m_delegate) {
-			if (delegate)
-			{
-				{
-					util::ScopedLock lock(&m_sync);
-					m_endpoints[streamId] = msgIdentity->m_identity;
-				}
-				delegate->onEndpointConnected(msgIdentity->m_identity);
-			}
+		{
+			util::ScopedLock lock(&m_sync);
+			m_registry.add(streamId, msgIdentity->m_identity, session);
 		}
+
+		notify(msgIdentity->m_identity, IServiceDelegate::EVENT_CONNECTION, [&](IServiceDelegate* delegate)
+		{
+			delegate->onEndpointConnected(msgIdentity->m_identity);
+		});
 		return;
 	}
 
-	// Find client's endpoint id
-	TEndpoints::const_iterator it = m_endpoints.find(streamId);
-	if (it == m_endpoints.end())
+	// Find client's endpoint id, responses over data connections are the endpoint's ones too
+	TEndpointRegistry::TRecordPtr record = m_registry.find(streamId);
+	if (!record)
 	{
 		assert(!"Stream not found");
 		return;
 	}
-	const std::string& endpointId = it->second;
+	const std::string& endpointId = record->endpointId;
 
 	if (MessageResponseDir* msgResponseDir = dynamic_cast<MessageResponseDir*>(m))
 	{
-		for(IServiceDelegate* delegate: m_delegate) {
-			if (delegate)
-			{
-				util::ScopedLock lock(&m_sync);
-				delegate->onResponseDir(endpointId, msgResponseDir->m_content);
-			}
-		}
+		answerQuery(endpointId, 0, &msgResponseDir->m_content, msgResponseDir->m_requestId);
+
+		notify(endpointId, IServiceDelegate::EVENT_DIR, [&](IServiceDelegate* delegate)
+		{
+			delegate->onResponseDir(endpointId, msgResponseDir->m_content);
+		});
 	}
 	else if (MessageResponseFile* msgResponseFile = dynamic_cast<MessageResponseFile*>(m))
 	{
-		for(IServiceDelegate* delegate: m_delegate) {
-			if (delegate)
-			{
-				util::ScopedLock lock(&m_sync);
-				delegate->onResponseFile(endpointId, msgResponseFile->m_response);
-			}
-		}
+		notify(endpointId, IServiceDelegate::EVENT_FILE, [&](IServiceDelegate* delegate)
+		{
+			delegate->onResponseFile(endpointId, msgResponseFile->m_response);
+		});
 	}
 	else if (MessageResponseSysInfo* msgResponseSysInfo = dynamic_cast<MessageResponseSysInfo*>(m))
 	{
-		for(IServiceDelegate* delegate: m_delegate) {
-			if (delegate)
-			{
-				util::ScopedLock lock(&m_sync);
-				delegate->onResponseSysInfo(endpointId, msgResponseSysInfo->m_sysinfo);
-			}
-		}
+		answerQuery(endpointId, &msgResponseSysInfo->m_sysinfo, 0, 0);
+
+		notify(endpointId, IServiceDelegate::EVENT_SYSINFO, [&](IServiceDelegate* delegate)
+		{
+			delegate->onResponseSysInfo(endpointId, msgResponseSysInfo->m_sysinfo);
+		});
 	}
 	else if (MessageUploadFileReply* msgUploadFileReply = dynamic_cast<MessageUploadFileReply*>(m))
 	{
-		for(IServiceDelegate* delegate: m_delegate) {
-			if (delegate)
-			{
-				util::ScopedLock lock(&m_sync);
-				delegate->onUploadFileReply(endpointId, msgUploadFileReply->m_ok);
-			}
-		}
+		notify(endpointId, IServiceDelegate::EVENT_UPLOAD, [&](IServiceDelegate* delegate)
+		{
+			delegate->onUploadFileReply(endpointId, msgUploadFileReply->m_fileName, msgUploadFileReply->m_ok);
+		});
+	}
+	else if (MessageResponseSignature* msgResponseSignature = dynamic_cast<MessageResponseSignature*>(m))
+	{
+		notify(endpointId, IServiceDelegate::EVENT_UPLOAD, [&](IServiceDelegate* delegate)
+		{
+			delegate->onResponseSignature(endpointId, msgResponseSignature->m_fileName, msgResponseSignature->m_signature);
+		});
+	}
+	else if (MessageResponseManifest* msgResponseManifest = dynamic_cast<MessageResponseManifest*>(m))
+	{
+		notify(endpointId, IServiceDelegate::EVENT_MANIFEST, [&](IServiceDelegate* delegate)
+		{
+			delegate->onResponseManifest(endpointId, msgResponseManifest->m_fileName, msgResponseManifest->m_manifest);
+		});
+	}
+	else if (MessageTreeData* msgTreeData = dynamic_cast<MessageTreeData*>(m))
+	{
+		notify(endpointId, IServiceDelegate::EVENT_TREE, [&](IServiceDelegate* delegate)
+		{
+			delegate->onTreeBatch(endpointId, msgTreeData->m_batch);
+		});
 	}
 	else
 	{
@@ -210,38 +447,143 @@ void Service::onMessageReceived(::net::IStream::TId streamId, ::msg::TMessagePtr
 	}
 }
 
+void Service::onMessageStarted(::net::IStream::TId streamId, ::msg::TMessagePtr message)
+{
+	MessageResponseFile* msgResponseFile = dynamic_cast<MessageResponseFile*>(message.get());
+	if (!msgResponseFile)
+		return;
+
+	TEndpointRegistry::TRecordPtr record = m_registry.find(streamId);
+	if (!record || !record->isMain)
+		return;
+
+	// Let a delegate receive file data as they arrive
+	IFileChunkSink* sink = 0;
+	notify(record->endpointId, IServiceDelegate::EVENT_FILE, [&](IServiceDelegate* delegate)
+	{
+		if (!sink)
+			sink = delegate->fileChunkSink(record->endpointId);
+	});
+
+	if (sink)
+		msgResponseFile->m_response.m_sink = sink;
+}
+
 void Service::requestDir(const std::string& endpointId, const std::wstring& dir)
 {
-	util::ScopedLock lock(&m_sync);
+	::net::IStream::TId streamId = findStream(endpointId);
 
+	// Response is not an answer to a query, the request carries ID of its own
 	std::shared_ptr<MessageRequestDir> msgRequest = std::make_shared<MessageRequestDir>();
 	msgRequest->m_dir = dir;
-	msg::Messenger::instance().sendMessage(findStream(endpointId), msgRequest);
+	msgRequest->m_requestId = expectResponse(m_pendingDirs, endpointId, 0);
+
+	try
+	{
+		msg::Messenger::instance().sendMessage(streamId, msgRequest);
+	}
+	catch (const std::exception&)
+	{
+		dropPending(m_pendingDirs, endpointId, msgRequest->m_requestId);
+		throw;
+	}
 }
 
 
 void Service::requestFile(const std::string& endpointId, const FileRequest &request)
 {
-	util::ScopedLock lock(&m_sync);
+	requestFile(endpointId, request, 0);
+}
+
+void Service::requestFile(const std::string& endpointId, const FileRequest& request, net::IStream::TId connection)
+{
+	::net::IStream::TId streamId = findStream(endpointId);
+	if (connection)
+	{
+		TEndpointRegistry::TRecordPtr record = m_registry.find(connection);
+		if (!record || record->isMain || record->endpointId != endpointId)
+			throw util::Error("Data connection is closed");
+		streamId = connection;
+	}
 
 	std::shared_ptr<MessageRequestFile> msgRequest = std::make_shared<MessageRequestFile>();
 	msgRequest->m_request = request;
-	msg::Messenger::instance().sendMessage(findStream(endpointId), msgRequest);
+	msg::Messenger::instance().sendMessage(streamId, msgRequest);
 }
 
-void Service::uploadFile(const std::string& endpointId, const FileChunk& chunk)
+void Service::openDataConnections(const std::string& endpointId, size_t count)
 {
-	util::ScopedLock lock(&m_sync);
+	::net::IStream::TId streamId = findStream(endpointId);
+	{
+		util::ScopedLock lock(&m_sync);
+
+		size_t& requested = m_dataConnectionCounts[endpointId];
+		if (count <= requested)
+			return;
+		requested = count;
+	}
+
+	std::shared_ptr<MessageOpenConnections> msgOpen = std::make_shared<MessageOpenConnections>();
+	msgOpen->m_count = static_cast<util::T_UI4>(count);
+	msg::Messenger::instance().sendMessage(streamId, msgOpen);
+}
 
+std::vector<net::IStream::TId> Service::dataConnections(const std::string& endpointId)
+{
+	return m_registry.connections(endpointId);
+}
+
+void Service::uploadFile(const std::string& endpointId, const FileChunk& chunk)
+{
 	std::shared_ptr<MessageUploadFile> msgUpload = std::make_shared<MessageUploadFile>();
 	msgUpload->m_chunk = chunk;
 	msg::Messenger::instance().sendMessage(findStream(endpointId), msgUpload);
 }
 
-void Service::executeFile(const std::string& endpointId, const std::wstring& remoteFile)
+void Service::uploadFile(const std::string& endpointId, const msg::TSerializedMessagePtr& chunk)
 {
-	util::ScopedLock lock(&m_sync);
+	msg::Messenger::instance().sendMessage(findStream(endpointId), chunk);
+}
+
+void Service::requestSignature(const std::string& endpointId, const std::wstring& fileName)
+{
+	std::shared_ptr<MessageRequestSignature> msgRequest = std::make_shared<MessageRequestSignature>();
+	msgRequest->m_fileName = fileName;
+	msg::Messenger::instance().sendMessage(findStream(endpointId), msgRequest);
+}
+
+void Service::requestManifest(const std::string& endpointId, const std::wstring& fileName)
+{
+	std::shared_ptr<MessageRequestManifest> msgRequest = std::make_shared<MessageRequestManifest>();
+	msgRequest->m_fileName = fileName;
+	msg::Messenger::instance().sendMessage(findStream(endpointId), msgRequest);
+}
+
+void Service::requestTree(const std::string& endpointId, const std::wstring& dir)
+{
+	std::shared_ptr<MessageRequestTree> msgRequest = std::make_shared<MessageRequestTree>();
+	msgRequest->m_dir = dir;
+	msg::Messenger::instance().sendMessage(findStream(endpointId), msgRequest);
+}
+
+void Service::ackTreeBatch(const std::string& endpointId, util::T_UI4 sequence)
+{
+	std::shared_ptr<MessageTreeAck> msgAck = std::make_shared<MessageTreeAck>();
+	msgAck->m_sequence = sequence;
+	msg::Messenger::instance().sendMessage(findStream(endpointId), msgAck);
+}
+
+void Service::requestFiles(const std::string& endpointId, const std::wstring& dir, const std::vector<std::wstring>& names, const std::wstring& pattern)
+{
+	std::shared_ptr<MessageRequestFiles> msgRequest = std::make_shared<MessageRequestFiles>();
+	msgRequest->m_dir = dir;
+	msgRequest->m_names = names;
+	msgRequest->m_pattern = pattern;
+	msg::Messenger::instance().sendMessage(findStream(endpointId), msgRequest);
+}
 
+void Service::executeFile(const std::string& endpointId, const std::wstring& remoteFile)
+{
 	std::shared_ptr<MessageGeneric> msgExec = std::make_shared<MessageGeneric>();
 
 	msgExec->m_commandType = MessageGeneric::cmdType::REQFILEEXEC;
@@ -252,11 +594,316 @@ void Service::executeFile(const std::string& endpointId, const std::wstring& rem
 
 void Service::requestSysInfo(const std::string& endpointId)
 {
-	util::ScopedLock lock(&m_sync);
+	::net::IStream::TId streamId = findStream(endpointId);
 
 	std::shared_ptr<MessageGeneric> msgRequest = std::make_shared<MessageGeneric>();
 	msgRequest->m_commandType = MessageGeneric::cmdType::REQSYSINFO;
-	msg::Messenger::instance().sendMessage(findStream(endpointId), msgRequest);
+
+	// Response is not an answer to a query. Responses carry no request ID, yet they are alike whichever request they answer.
+	unsigned int requestId = expectResponse(m_pendingSysInfo, endpointId, 0);
+
+	try
+	{
+		msg::Messenger::instance().sendMessage(streamId, msgRequest);
+	}
+	catch (const std::exception&)
+	{
+		dropPending(m_pendingSysInfo, endpointId, requestId);
+		throw;
+	}
+}
+
+unsigned int Service::querySysInfo(const std::vector<std::string>& endpointIds, unsigned int timeoutMs)
+{
+	return startQuery(QueryResult::QUERY_SYSINFO, endpointIds, std::wstring(), timeoutMs);
+}
+
+unsigned int Service::queryDir(const std::vector<std::string>& endpointIds, const std::wstring& dir, unsigned int timeoutMs)
+{
+	return startQuery(QueryResult::QUERY_DIR, endpointIds, dir, timeoutMs);
+}
+
+QueryResult Service::queryResult(unsigned int queryId)
+{
+	util::ScopedLock lock(&m_sync);
+
+	TQueries::const_iterator ii = m_queries.find(queryId);
+	return ii != m_queries.end() ? ii->second.query->result() : QueryResult();
+}
+
+std::vector<std::string> Service::endpoints()
+{
+	return m_registry.endpoints();
+}
+
+unsigned int Service::startQuery(QueryResult::Kind kind, std::vector<std::string> endpointIds, const std::wstring& dir, unsigned int timeoutMs)
+{
+	if (endpointIds.empty())
+		endpointIds = endpoints();
+
+	TPendingQueries& pending = QueryResult::QUERY_SYSINFO == kind ? m_pendingSysInfo : m_pendingDirs;
+
+	struct Recipient
+	{
+		std::string endpointId;
+		::net::IStream::TId streamId;
+		unsigned int requestId;
+	};
+
+	// Endpoints which are expected to answer, requests are sent once the query is set up
+	std::vector<Recipient> recipients;
+
+	unsigned int queryId = 0;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		queryId = ++m_lastQueryId;
+
+		RunningQuery& running = m_queries[queryId];
+		running.query = std::make_shared<FanOutQuery>(queryId, kind, timeoutMs);
+		running.timer = NULL;
+
+		PVOID param = reinterpret_cast<PVOID>(static_cast<UINT_PTR>(queryId));
+		if (!::CreateTimerQueueTimer(&running.timer, m_hQueryTimers, queryTimerProc, param, timeoutMs, 0, WT_EXECUTEONLYONCE))
+		{
+			m_queries.erase(queryId);
+			throw util::Error("Failed to create timer");
+		}
+
+		for (std::vector<std::string>::const_iterator ii = endpointIds.begin(); ii != endpointIds.end(); ++ii)
+		{
+			// Endpoint which is gone is reported unanswered
+			::net::IStream::TId streamId = m_registry.findStream(*ii);
+			if (streamId)
+			{
+				Recipient recipient;
+				recipient.endpointId = *ii;
+				recipient.streamId = streamId;
+				recipient.requestId = expectResponse(pending, *ii, queryId);
+				recipients.push_back(recipient);
+			}
+
+			running.query->addEndpoint(*ii, 0 != streamId);
+		}
+	}
+
+	// Endpoints answer in parallel, though sending to a stream which waits for its turn holds up the requests after it
+	std::shared_ptr<MessageGeneric> msgSysInfo = std::make_shared<MessageGeneric>();
+	msgSysInfo->m_commandType = MessageGeneric::cmdType::REQSYSINFO;
+
+	std::shared_ptr<MessageRequestDir> msgDir = std::make_shared<MessageRequestDir>();
+	msgDir->m_dir = dir;
+
+	for (std::vector<Recipient>::const_iterator ii = recipients.begin(); ii != recipients.end(); ++ii)
+	{
+		try
+		{
+			if (QueryResult::QUERY_SYSINFO == kind)
+			{
+				msg::Messenger::instance().sendMessage(ii->streamId, msgSysInfo);
+			}
+			else
+			{
+				msgDir->m_requestId = ii->requestId;
+				msg::Messenger::instance().sendMessage(ii->streamId, msgDir);
+			}
+		}
+		catch (const std::exception&)
+		{
+			// Endpoint disconnected meanwhile, the query does not wait for it
+			dropPending(pending, ii->endpointId, ii->requestId);
+
+			util::ScopedLock lock(&m_sync);
+
+			TQueries::iterator qq = m_queries.find(queryId);
+			if (qq != m_queries.end())
+				qq->second.query->onEndpointGone(ii->endpointId);
+		}
+	}
+
+	// Query to no endpoints, or to none which is connected, is over at once
+	finishQueries();
+	return queryId;
+}
+
+void Service::answerQuery(const std::string& endpointId, const std::vector<std::string>* sysinfo, const TDirItems* content, unsigned int requestId)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		TPendingQueries& pending = sysinfo ? m_pendingSysInfo : m_pendingDirs;
+		TPendingQueries::iterator ii = pending.find(endpointId);
+		if (ii == pending.end() || ii->second.empty())
+			return;
+
+		// Requests sent by several threads at once may arrive in any order, older endpoints answer them in order of arrival
+		std::deque<PendingRequest>::iterator rr = ii->second.begin();
+		if (0 != requestId)
+		{
+			while (rr != ii->second.end() && rr->requestId != requestId)
+				++rr;
+			if (rr == ii->second.end())
+				return;
+		}
+
+		unsigned int queryId = rr->queryId;
+		ii->second.erase(rr);
+		if (ii->second.empty())
+			pending.erase(ii);
+
+		// Query may be finished by its deadline already
+		TQueries::iterator qq = m_queries.find(queryId);
+		if (qq == m_queries.end())
+			return;
+
+		if (sysinfo)
+			qq->second.query->onSysInfo(endpointId, *sysinfo);
+		else
+			qq->second.query->onDir(endpointId, *content);
+
+		if (!qq->second.query->isComplete())
+			return;
+	}
+
+	finishQueries();
+}
+
+unsigned int Service::expectResponse(TPendingQueries& pending, const std::string& endpointId, unsigned int queryId)
+{
+	util::ScopedLock lock(&m_sync);
+
+	// IDs are never 0, which stands for responses of older endpoints
+	if (0 == ++m_lastRequestId)
+		++m_lastRequestId;
+
+	PendingRequest request;
+	request.requestId = m_lastRequestId;
+	request.queryId = queryId;
+	pending[endpointId].push_back(request);
+
+	return request.requestId;
+}
+
+void Service::dropPending(TPendingQueries& pending, const std::string& endpointId, unsigned int requestId)
+{
+	util::ScopedLock lock(&m_sync);
+
+	TPendingQueries::iterator ii = pending.find(endpointId);
+	if (ii == pending.end())
+		return;
+
+	for (std::deque<PendingRequest>::iterator rr = ii->second.begin(); rr != ii->second.end(); ++rr)
+	{
+		if (rr->requestId == requestId)
+		{
+			ii->second.erase(rr);
+			break;
+		}
+	}
+
+	if (ii->second.empty())
+		pending.erase(ii);
+}
+
+void Service::finishQueries()
+{
+	std::vector<QueryResult> finished;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		for (TQueries::iterator ii = m_queries.begin(); ii != m_queries.end();)
+		{
+			TQueries::iterator running = ii++;
+
+			FanOutQuery& query = *running->second.query;
+			if (!query.isComplete() && !query.isExpired())
+				continue;
+
+			query.finish();
+			finished.push_back(query.result());
+
+			// Timer may be running this, so it is deleted once it returns
+			::DeleteTimerQueueTimer(m_hQueryTimers, running->second.timer, NULL);
+			m_queries.erase(running);
+		}
+	}
+
+	for (std::vector<QueryResult>::const_iterator ii = finished.begin(); ii != finished.end(); ++ii)
+	{
+		notify(std::string(), IServiceDelegate::EVENT_QUERY, [&](IServiceDelegate* delegate)
+		{
+			delegate->onQueryFinished(*ii);
+		});
+	}
+}
+
+void Service::expireQuery(unsigned int queryId)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		TQueries::iterator ii = m_queries.find(queryId);
+		if (ii == m_queries.end())
+			return;
+
+		ii->second.query->expire();
+	}
+
+	finishQueries();
+}
+
+VOID CALLBACK Service::queryTimerProc(PVOID param, BOOLEAN fired)
+{
+	// Timers are deleted before the service is gone
+	unsigned int queryId = static_cast<unsigned int>(reinterpret_cast<UINT_PTR>(param));
+	s_instance->expireQuery(queryId);
+}
+
+SessionParams Service::sessionParams(const std::string& endpointId)
+{
+	TEndpointRegistry::TRecordPtr record = m_registry.find(findStream(endpointId));
+	return record ? record->state : SessionParams();
+}
+
+void Service::setSendRate(const std::string& endpointId, double bytesPerSecond)
+{
+	::net::IStream::TId streamId = findStream(endpointId);
+	net::StreamListener::instance().sendScheduler().setStreamRate(streamId, bytesPerSecond);
+}
+
+net::SendStats Service::sendStats(const std::string& endpointId)
+{
+	::net::IStream::TId streamId = findStream(endpointId);
+	return net::StreamListener::instance().sendScheduler().stats(streamId);
+}
+
+TransferManager& Service::transfers()
+{
+	return *m_transfers;
+}
+
+void Service::transferQueued(const TransferInfo& info)
+{
+	notify(info.m_endpointId, IServiceDelegate::EVENT_TRANSFER, [&](IServiceDelegate* delegate)
+	{
+		delegate->onTransferQueued(info);
+	});
+}
+
+void Service::transferProgress(const TransferInfo& info)
+{
+	notify(info.m_endpointId, IServiceDelegate::EVENT_TRANSFER, [&](IServiceDelegate* delegate)
+	{
+		delegate->onTransferProgress(info);
+	});
+}
+
+void Service::transferFinished(const TransferInfo& info)
+{
+	notify(info.m_endpointId, IServiceDelegate::EVENT_TRANSFER, [&](IServiceDelegate* delegate)
+	{
+		delegate->onTransferFinished(info);
+	});
 }
 
 
@@ -295,17 +942,8 @@ DWORD WINAPI listenerWorkerProc(LPVOID param)
 ::net::IStream::TId Service::findStream(const std::string& endpointId)
 {
 	// Lookup corresponding stream ID
-	::net::IStream::TId streamId = 0;
-	for (TEndpoints::const_iterator ii = m_endpoints.begin(); ii != m_endpoints.end(); ++ii)
-	{
-		if (ii->second == endpointId)
-		{
-			streamId = ii->first;
-			break;
-		}
-	}
-
-	if (0 == streamId)
+	::net::IStream::TId streamId = m_registry.findStream(endpointId);
+	if (!streamId)
 		throw util::Error("Invalid endpoint name: " + endpointId);
 	return streamId;
 }
@@ -1,15 +1,87 @@
 #pragma once
 
+#include <deque>
+#include <unordered_map>
+
 #include <QSharedPointer>
 #include <msg/Messenger.hpp>
 #include <net/BindingFactory.hpp>
+#include <net/EndpointRegistry.hpp>
+#include <util/ChunkManifest.hpp>
 #include <protocol/DataTypes.hpp>
+#include <protocol/MessageIdentity.hpp>
+
+#include "FanOutQuery.hpp"
 
 class SvcMsgFactory;
+class TransferManager;
+
+/// Download or upload of a file scheduled by TransferManager
+struct TransferInfo
+{
+	enum Direction
+	{
+		DOWNLOAD,
+		UPLOAD
+	};
+
+	enum State
+	{
+		QUEUED,
+		ACTIVE,
+		FINISHED
+	};
+
+	TransferInfo()
+		: m_id(0)
+		, m_direction(DOWNLOAD)
+		, m_state(QUEUED)
+		, m_fileSize(-1)
+		, m_position(0)
+		, m_ok(false)
+	{}
+
+	unsigned int m_id;
+	std::string m_endpointId;
+	Direction m_direction;
+	State m_state;
+	std::wstring m_remoteFileName;
+	std::wstring m_localFileName;
+
+	/// Size is -1 while it is unknown, a download learns it from its first chunk
+	__int64 m_fileSize;
+	__int64 m_position;
+
+	/// Result of a finished transfer
+	bool m_ok;
+	std::string m_error;
+};
 
 /// Base interface for service events handler
 struct IServiceDelegate
 {
+	/// Events a delegate may subscribe to, see Service::subscribe()
+	enum Event
+	{
+		/// Endpoint connected, disconnected or closed a data connection
+		EVENT_CONNECTION	= 0x0001,
+		EVENT_DIR			= 0x0002,
+
+		/// File responses and their chunk sinks
+		EVENT_FILE			= 0x0004,
+		EVENT_SYSINFO		= 0x0008,
+
+		/// Upload replies and signatures of uploaded files
+		EVENT_UPLOAD		= 0x0010,
+		EVENT_MANIFEST		= 0x0020,
+		EVENT_TREE			= 0x0040,
+		EVENT_TRANSFER		= 0x0080,
+
+		/// Finished queries, they are not events of a single endpoint
+		EVENT_QUERY			= 0x0100,
+		EVENT_ALL			= 0xFFFF
+	};
+
 	virtual ~IServiceDelegate() {}
 
 	/// Fires when a new endpoint is connected and sent its identity
@@ -18,6 +90,9 @@ struct IServiceDelegate
 	/// Fires when an endpoint is disconnected
 	virtual void onEndpointDisconnected(const std::string& endpointId) {}
 
+	/// Fires when a data connection of an endpoint is closed, requests sent over it are not answered
+	virtual void onDataConnectionClosed(const std::string& endpointId, net::IStream::TId connection) {}
+
 	/// Fires when directory content reponse is received
 	virtual void onResponseDir(const std::string& endpointId, const TDirItems& content) {}
 
@@ -27,8 +102,32 @@ struct IServiceDelegate
 	/// Fires when sysinfo reponse is received
 	virtual void onResponseSysInfo(const std::string& endpointId, const std::vector<std::string>& sysinfo) {}
 
-	/// Fires when upload file result is received
-	virtual void onUploadFileReply(const std::string& endpointId, bool ok) {}
+	/// Fires when upload file result is received, older endpoints do not name the file
+	virtual void onUploadFileReply(const std::string& endpointId, const std::wstring& fileName, bool ok) {}
+
+	/// Fires when signature of a file to be uploaded is received, it is NULL if the endpoint has no copy of the file
+	virtual void onResponseSignature(const std::string& endpointId, const std::wstring& fileName, const util::TDeltaSignaturePtr& signature) {}
+
+	/// Fires when manifest of a file to be downloaded is received, it is NULL if the endpoint could not chunk the file
+	virtual void onResponseManifest(const std::string& endpointId, const std::wstring& fileName, const util::TChunkManifestPtr& manifest) {}
+
+	/// Fires when a batch of a directory tree is received, see requestTree()
+	virtual void onTreeBatch(const std::string& endpointId, const TreeBatch& batch) {}
+
+	/// Is asked for a receiver of file data before a file chunk is received, return NULL to get data in onResponseFile()
+	virtual IFileChunkSink* fileChunkSink(const std::string& endpointId) { return 0; }
+
+	/// Fires when a transfer is queued by TransferManager
+	virtual void onTransferQueued(const TransferInfo& info) {}
+
+	/// Fires when a transfer starts and as its data are transferred
+	virtual void onTransferProgress(const TransferInfo& info) {}
+
+	/// Fires when a transfer is complete, failed or was cancelled
+	virtual void onTransferFinished(const TransferInfo& info) {}
+
+	/// Fires once every endpoint of a query answered or its deadline passed, see Service::querySysInfo()
+	virtual void onQueryFinished(const QueryResult& result) {}
 };
 
 /// Service sending/receiving messages
@@ -41,24 +140,96 @@ public:
 		IServiceDelegate* delegate_);
 	~Service();
 
+	/// Delegate gets all events of all endpoints
 	void addDelegate(IServiceDelegate* delegate_);
+
+	/**
+	 * Removes all subscriptions of the delegate, it is not called once this returns.
+	 * Waits for calls of delegates made by other threads meanwhile, so the caller must not hold locks the delegates take.
+	 */
 	void deleteDelegate(IServiceDelegate* delegate_);
 
+	/**
+	 * Sets events (IServiceDelegate::Event flags) the delegate gets from the endpoint, or from all endpoints if the ID is empty.
+	 * Events 0 remove the subscription. Events of no endpoint go to subscriptions to all endpoints only.
+	 */
+	void subscribe(IServiceDelegate* delegate_, const std::string& endpointId, unsigned int events);
+
 	/// Sends dir content request to the specified endpoint
 	void requestDir(const std::string& endpointId, const std::wstring& dir);
 
 	/// Sends file request to the specified endpoint
 	void requestFile(const std::string& endpointId, const FileRequest& request);
 
+	/// Sends file request over a data connection of the endpoint, or over its first connection if it is 0
+	void requestFile(const std::string& endpointId, const FileRequest& request, net::IStream::TId connection);
+
+	/// Asks the endpoint to keep count data connections besides the first one, the number only grows
+	void openDataConnections(const std::string& endpointId, size_t count);
+
+	/// Returns open data connections of the endpoint
+	std::vector<net::IStream::TId> dataConnections(const std::string& endpointId);
+
 	/// Send chunk of file to upload
 	void uploadFile(const std::string& endpointId, const FileChunk& chunk);
 
+	/// Send chunk of file to upload, it was saved once for all the endpoints it is sent to
+	void uploadFile(const std::string& endpointId, const msg::TSerializedMessagePtr& chunk);
+
+	/// Requests signature of the endpoint's copy of a file, so that the file is uploaded as differences to it
+	void requestSignature(const std::string& endpointId, const std::wstring& fileName);
+
+	/// Requests manifest of a file, so that only chunks which are not in the chunk store are downloaded
+	void requestManifest(const std::string& endpointId, const std::wstring& fileName);
+
+	/// Requests a whole directory tree, the endpoint streams it in batches which are acknowledged by ackTreeBatch()
+	void requestTree(const std::string& endpointId, const std::wstring& dir);
+	void ackTreeBatch(const std::string& endpointId, util::T_UI4 sequence);
+
+	/// Requests files of a directory by names, or by a wildcard pattern if there are no names.
+	///	Files are streamed in batches like a tree, which are acknowledged by ackTreeBatch()
+	void requestFiles(const std::string& endpointId, const std::wstring& dir, const std::vector<std::wstring>& names, const std::wstring& pattern);
+
 	/// Requests the execution of a remote file
 	void executeFile(const std::string& endpointId, const std::wstring& remoteFile);
 
 	/// Sends sys info request to the specified endpoint
 	void requestSysInfo(const std::string& endpointId);
 
+	/// Deadline of a query unless it is given
+	static const unsigned int kDefaultQueryTimeoutMs = 5000;
+
+	/**
+	 * Sends a request to each of the endpoints at once, or to all connected endpoints if none are given, returns the query ID.
+	 * Responses are collected as they arrive, until every endpoint answered or the deadline passed.
+	 *	IServiceDelegate::onQueryFinished() fires then with the answers collected. Responses are passed to the delegates as usual too.
+	 */
+	unsigned int querySysInfo(const std::vector<std::string>& endpointIds, unsigned int timeoutMs = kDefaultQueryTimeoutMs);
+	unsigned int queryDir(const std::vector<std::string>& endpointIds, const std::wstring& dir, unsigned int timeoutMs = kDefaultQueryTimeoutMs);
+
+	/// Returns answers collected so far by a running query, a result with ID 0 if the query is finished
+	QueryResult queryResult(unsigned int queryId);
+
+	/// Returns IDs of connected endpoints
+	std::vector<std::string> endpoints();
+
+	/// Returns the mode agreed with the specified endpoint
+	SessionParams sessionParams(const std::string& endpointId);
+
+	/// Limits the rate messages are sent to the specified endpoint at, 0 removes the limit
+	void setSendRate(const std::string& endpointId, double bytesPerSecond);
+
+	/// Returns throughput and queueing delay of messages sent to the specified endpoint
+	net::SendStats sendStats(const std::string& endpointId);
+
+	/// Schedules downloads and uploads of all endpoints
+	TransferManager& transfers();
+
+	/// Pass events of transfers of TransferManager to the delegates
+	void transferQueued(const TransferInfo& info);
+	void transferProgress(const TransferInfo& info);
+	void transferFinished(const TransferInfo& info);
+
 
 	//
 	// msg::IBindingDelegate
@@ -72,25 +243,148 @@ public:
 	virtual void onMessageReceived(
 		::net::IStream::TId streamId,
 		::msg::TMessagePtr message);
+	virtual void onMessageStarted(
+		::net::IStream::TId streamId,
+		::msg::TMessagePtr message);
 
 private:
 	::net::IStream::TId findStream(const std::string& endpointId);
 
+	/// Calls the delegates subscribed to the event of the endpoint, without the lock (see deleteDelegate())
+	template<class F>
+	void notify(const std::string& endpointId, unsigned int event, F call);
+
+	/// Counts a dispatch of the calling thread while it lives, dispatches nested in it are counted with it
+	class Dispatch
+	{
+	public:
+		explicit Dispatch(Service& service);
+		~Dispatch();
+
+	private:
+		Dispatch(const Dispatch&);
+		Dispatch& operator =(const Dispatch&);
+
+		Service& m_service;
+	};
+
+	/// Sends the request of a query to the endpoints
+	unsigned int startQuery(QueryResult::Kind kind, std::vector<std::string> endpointIds, const std::wstring& dir, unsigned int timeoutMs);
+
+	/**
+	 * Passes a response to the query of its request, responses to single requests are only passed to the delegates.
+	 * Response without request ID answers the oldest request to the endpoint.
+	 */
+	void answerQuery(const std::string& endpointId, const std::vector<std::string>* sysinfo, const TDirItems* content, unsigned int requestId);
+
+	/// Reports queries which are complete or past their deadlines
+	void finishQueries();
+
+	/// Is run by the deadline timer of a query
+	void expireQuery(unsigned int queryId);
+
+	static VOID CALLBACK queryTimerProc(PVOID param, BOOLEAN fired);
+
 private:
 	static util::ThreadMutex s_sync;
 	static Service* s_instance;
 
 	mutable util::ThreadMutex m_sync;
 	std::auto_ptr<SvcMsgFactory> m_msgFactory;
-	std::vector<IServiceDelegate*> m_delegate;
+
+	struct Subscription
+	{
+		IServiceDelegate* delegate;
+		unsigned int events;
+	};
+
+	typedef std::vector<Subscription> TSubscriptionList;
+
+	typedef std::unordered_map<
+		std::string,		// endpoint ID
+		TSubscriptionList	// delegates subscribed to the endpoint
+	> TEndpointSubscriptions;
+
+	struct Subscriptions
+	{
+		/// Delegates subscribed to all endpoints, in order of subscription
+		TSubscriptionList all;
+		TEndpointSubscriptions endpoints;
+	};
+
+	typedef std::shared_ptr<const Subscriptions> TSubscriptionsPtr;
+
+	/// Is copied and replaced under the lock, messages are dispatched to a snapshot taken by std::atomic_load()
+	TSubscriptionsPtr m_subscriptions;
+
+	/// Dispatches running, by the epoch they started in. Removal of a delegate flips the epoch,
+	///	then waits for the dispatches of the previous one, which may still call the delegate.
+	volatile LONG m_dispatches[2];
+	volatile LONG m_epoch;
+
+	/// Serializes removals of delegates, dispatches never take it
+	util::ThreadMutex m_removeSync;
+
+	static bool hasEvent(const TSubscriptionList& list, IServiceDelegate* delegate_, unsigned int event);
+	static bool isSubscribed(const Subscriptions& subscriptions, IServiceDelegate* delegate_, const std::string& endpointId, unsigned int event);
+	static void unsubscribe(TSubscriptionList& list, IServiceDelegate* delegate_);
+
+	/// Is a delegate as well, responses to transfers are routed to it
+	std::auto_ptr<TransferManager> m_transfers;
 	HANDLE m_hWorker;
 	net::TBindingPtr m_binding;
 
+	/// Streams of endpoints with the mode agreed with each of them, extra connections carry chunks of striped downloads.
+	/// Is locked by itself, so received messages find their endpoints and messages are sent without m_sync.
+	typedef net::EndpointRegistry<SessionParams> TEndpointRegistry;
+	TEndpointRegistry m_registry;
+
+	typedef std::map<
+		std::string,	// endpoint ID
+		size_t			// data connections the endpoint was asked for
+	> TDataConnectionCounts;
+	TDataConnectionCounts m_dataConnectionCounts;
+
+	/// Timers of query deadlines
+	HANDLE m_hQueryTimers;
+	unsigned int m_lastQueryId;
+
+	struct RunningQuery
+	{
+		std::shared_ptr<FanOutQuery> query;
+		HANDLE timer;
+	};
+
 	typedef std::map<
-		::net::IStream::TId,	// stream ID
-		std::string				// endpoint ID
-	> TEndpoints;
-	TEndpoints m_endpoints;
+		unsigned int,	// query ID
+		RunningQuery
+	> TQueries;
+	TQueries m_queries;
+
+	struct PendingRequest
+	{
+		/// Is sent with requests which carry it, unique among the requests of the service
+		unsigned int requestId;
+
+		/// Query the response answers, 0 stands for a single request
+		unsigned int queryId;
+	};
+
+	typedef std::map<
+		std::string,					// endpoint ID
+		std::deque<PendingRequest>		// requests in order they were sent
+	> TPendingQueries;
+
+	/// Requests of each kind waiting for responses of endpoints
+	TPendingQueries m_pendingSysInfo;
+	TPendingQueries m_pendingDirs;
+	unsigned int m_lastRequestId;
+
+	/// Registers a request before it is sent, so its response is expected once it arrives. Returns ID of the request.
+	unsigned int expectResponse(TPendingQueries& pending, const std::string& endpointId, unsigned int queryId);
+
+	/// Drops a pending request whose sending failed
+	void dropPending(TPendingQueries& pending, const std::string& endpointId, unsigned int requestId);
 };
 
 typedef QSharedPointer<Service> ServicePtr;
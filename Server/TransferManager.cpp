@@ -0,0 +1,536 @@
+#include "TransferManager.hpp"
+
+#include <util/AsyncFileIo.hpp>
+#include <util/Error.hpp>
+#include <util/ScopedLock.hpp>
+#include <protocol/MessageIdentity.hpp>
+
+namespace {
+
+/// Downloads of unknown size are weighted as files of this size
+const double kUnknownSizeCost = 1024.0 * 1024.0;
+
+} // namespace
+
+TransferManager::TransferManager(Service& service)
+	: m_service(service)
+	, m_maxActive(kDefaultMaxActive)
+	, m_maxActivePerEndpoint(kDefaultMaxActivePerEndpoint)
+	, m_policy(POLICY_SHORTEST_REMAINING_FIRST)
+	, m_lastId(0)
+	, m_stopped(false)
+	, m_virtualTime(0)
+{
+}
+
+TransferManager::~TransferManager()
+{
+	std::vector<TFileTransferPtr> active;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		m_stopped = true;
+		m_queued.clear();
+
+		for (TJobs::const_iterator ii = m_active.begin(); ii != m_active.end(); ++ii)
+			active.push_back(ii->second.transfer);
+	}
+
+	for (std::vector<TFileTransferPtr>::const_iterator ii = active.begin(); ii != active.end(); ++ii)
+		(*ii)->cancel("Service stopped");
+
+	// Transfer reports itself finished once its messages are sent, which another thread may be doing yet.
+	//	Finished transfers are reaped by jobs referring to the manager.
+	for (;;)
+	{
+		util::AsyncFileIo::instance().drain(this);
+
+		{
+			util::ScopedLock lock(&m_sync);
+			if (m_active.empty())
+				break;
+		}
+
+		::Sleep(1);
+	}
+}
+
+void TransferManager::setChunkStore(const util::TChunkStorePtr& chunkStore)
+{
+	util::ScopedLock lock(&m_sync);
+	m_chunkStore = chunkStore;
+}
+
+void TransferManager::setLimits(size_t maxActive, size_t maxActivePerEndpoint)
+{
+	std::vector<TFileTransferPtr> picked;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		m_maxActive = maxActive;
+		m_maxActivePerEndpoint = maxActivePerEndpoint;
+		pickTransfers(picked);
+	}
+
+	startTransfers(picked);
+}
+
+void TransferManager::setPolicy(Policy policy)
+{
+	util::ScopedLock lock(&m_sync);
+	m_policy = policy;
+}
+
+void TransferManager::setWeight(const std::string& endpointId, unsigned int weight)
+{
+	util::ScopedLock lock(&m_sync);
+	m_weights[endpointId] = weight ? weight : 1;
+}
+
+unsigned int TransferManager::download(const std::string& endpointId, const std::wstring& remoteFileName, const std::wstring& localFileName, __int64 fileSize)
+{
+	TransferInfo info;
+	info.m_endpointId = endpointId;
+	info.m_direction = TransferInfo::DOWNLOAD;
+	info.m_remoteFileName = remoteFileName;
+	info.m_localFileName = localFileName;
+	info.m_fileSize = fileSize;
+	return enqueue(info);
+}
+
+unsigned int TransferManager::upload(const std::string& endpointId, const std::wstring& localFileName, const std::wstring& remoteFileName)
+{
+	TransferInfo info;
+	info.m_endpointId = endpointId;
+	info.m_direction = TransferInfo::UPLOAD;
+	info.m_remoteFileName = remoteFileName;
+	info.m_localFileName = localFileName;
+
+	// A file which could not be read fails once it starts
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (::GetFileAttributesExW(localFileName.c_str(), GetFileExInfoStandard, &attributes))
+		info.m_fileSize = (static_cast<__int64>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+
+	return enqueue(info);
+}
+
+std::vector<unsigned int> TransferManager::broadcast(const std::vector<std::string>& endpointIds, const std::wstring& localFileName, const std::wstring& remoteFileName)
+{
+	// Chunks are saved once, so they fit the chunk size of every endpoint
+	size_t chunkSize = 0;
+	for (std::vector<std::string>::const_iterator ii = endpointIds.begin(); ii != endpointIds.end(); ++ii)
+	{
+		SessionParams session = m_service.sessionParams(*ii);
+		if (0 == chunkSize || session.m_chunkSize < chunkSize)
+			chunkSize = session.m_chunkSize;
+	}
+
+	TUploadBroadcastPtr broadcast = std::make_shared<UploadBroadcast>(localFileName, remoteFileName, chunkSize);
+	if (!broadcast->open())
+		throw util::Error("Failed to open file");
+
+	std::vector<TransferInfo> infos;
+	for (std::vector<std::string>::const_iterator ii = endpointIds.begin(); ii != endpointIds.end(); ++ii)
+	{
+		TransferInfo info;
+		info.m_endpointId = *ii;
+		info.m_direction = TransferInfo::UPLOAD;
+		info.m_remoteFileName = remoteFileName;
+		info.m_localFileName = localFileName;
+		info.m_fileSize = broadcast->fileSize();
+		infos.push_back(info);
+	}
+
+	return enqueue(infos, broadcast);
+}
+
+void TransferManager::cancel(unsigned int id)
+{
+	TFileTransferPtr transfer;
+	TransferInfo dropped;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		TJobs::iterator ii = m_queued.find(id);
+		if (ii != m_queued.end())
+		{
+			dropped = ii->second.info;
+			m_queued.erase(ii);
+		}
+		else
+		{
+			ii = m_active.find(id);
+			if (ii != m_active.end())
+				transfer = ii->second.transfer;
+		}
+	}
+
+	// Active transfer is reaped once it reports itself finished
+	if (transfer)
+		transfer->cancel("Transfer cancelled");
+	else if (0 != dropped.m_id)
+		reportDropped(dropped, "Transfer cancelled");
+}
+
+std::vector<TransferInfo> TransferManager::transfers() const
+{
+	util::ScopedLock lock(&m_sync);
+
+	TJobs jobs = m_active;
+	jobs.insert(m_queued.begin(), m_queued.end());
+
+	std::vector<TransferInfo> result;
+	for (TJobs::const_iterator ii = jobs.begin(); ii != jobs.end(); ++ii)
+		result.push_back(ii->second.info);
+	return result;
+}
+
+void TransferManager::onEndpointDisconnected(const std::string& endpointId)
+{
+	std::vector<TransferInfo> dropped;
+	std::vector<TFileTransferPtr> active;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		for (TJobs::iterator ii = m_queued.begin(); ii != m_queued.end();)
+		{
+			TJobs::iterator job = ii++;
+			if (job->second.info.m_endpointId == endpointId)
+			{
+				dropped.push_back(job->second.info);
+				m_queued.erase(job);
+			}
+		}
+
+		for (TJobs::const_iterator ii = m_active.begin(); ii != m_active.end(); ++ii)
+		{
+			if (ii->second.info.m_endpointId == endpointId)
+				active.push_back(ii->second.transfer);
+		}
+
+		m_finishTags.erase(endpointId);
+	}
+
+	for (std::vector<TFileTransferPtr>::const_iterator ii = active.begin(); ii != active.end(); ++ii)
+		(*ii)->cancel("Endpoint disconnected");
+
+	for (std::vector<TransferInfo>::const_iterator ii = dropped.begin(); ii != dropped.end(); ++ii)
+		reportDropped(*ii, "Endpoint disconnected");
+}
+
+void TransferManager::onDataConnectionClosed(const std::string& endpointId, net::IStream::TId connection)
+{
+	std::vector<TFileTransferPtr> active;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		for (TJobs::const_iterator ii = m_active.begin(); ii != m_active.end(); ++ii)
+		{
+			if (ii->second.info.m_endpointId == endpointId && TransferInfo::DOWNLOAD == ii->second.info.m_direction)
+				active.push_back(ii->second.transfer);
+		}
+	}
+
+	for (std::vector<TFileTransferPtr>::const_iterator ii = active.begin(); ii != active.end(); ++ii)
+		(*ii)->onConnectionClosed(connection);
+}
+
+void TransferManager::onResponseFile(const std::string& endpointId, const FileChunk& chunk)
+{
+	if (TFileTransferPtr transfer = findActive(endpointId, TransferInfo::DOWNLOAD, chunk.m_fileName))
+		transfer->onResponseFile(chunk);
+}
+
+void TransferManager::onUploadFileReply(const std::string& endpointId, const std::wstring& fileName, bool ok)
+{
+	if (TFileTransferPtr transfer = findActive(endpointId, TransferInfo::UPLOAD, fileName))
+		transfer->onUploadFileReply(ok);
+}
+
+void TransferManager::onResponseSignature(const std::string& endpointId, const std::wstring& fileName, const util::TDeltaSignaturePtr& signature)
+{
+	if (TFileTransferPtr transfer = findActive(endpointId, TransferInfo::UPLOAD, fileName))
+		transfer->onResponseSignature(signature);
+}
+
+void TransferManager::onResponseManifest(const std::string& endpointId, const std::wstring& fileName, const util::TChunkManifestPtr& manifest)
+{
+	if (TFileTransferPtr transfer = findActive(endpointId, TransferInfo::DOWNLOAD, fileName))
+		transfer->onResponseManifest(manifest);
+}
+
+IFileChunkSink* TransferManager::fileChunkSink(const std::string& endpointId)
+{
+	util::ScopedLock lock(&m_sync);
+
+	// File of the chunk is only known once its header is received, the sink finds its transfer then
+	bool downloading = false;
+	for (TJobs::const_iterator ii = m_active.begin(); ii != m_active.end() && !downloading; ++ii)
+		downloading = ii->second.info.m_endpointId == endpointId && TransferInfo::DOWNLOAD == ii->second.info.m_direction;
+
+	if (!downloading)
+		return 0;
+
+	std::shared_ptr<ChunkSink>& sink = m_sinks[endpointId];
+	if (!sink)
+		sink = std::make_shared<ChunkSink>(*this, endpointId);
+
+	return sink.get();
+}
+
+void TransferManager::onTransferProgress(const TransferInfo& info)
+{
+	{
+		util::ScopedLock lock(&m_sync);
+
+		TJobs::iterator ii = m_active.find(info.m_id);
+		if (ii != m_active.end())
+			ii->second.info = info;
+	}
+
+	m_service.transferProgress(info);
+}
+
+void TransferManager::onTransferFinished(const TransferInfo& info)
+{
+	// Next transfers are started by a job, the thread reporting may have more messages of the transfer to send
+	util::AsyncFileIo::instance().submit(this, [this, info]()
+	{
+		reap(info);
+	});
+}
+
+unsigned int TransferManager::enqueue(const TransferInfo& info)
+{
+	return enqueue(std::vector<TransferInfo>(1, info), TUploadBroadcastPtr()).front();
+}
+
+std::vector<unsigned int> TransferManager::enqueue(std::vector<TransferInfo> infos, const TUploadBroadcastPtr& broadcast)
+{
+	// Throws if an endpoint is not connected
+	std::vector<SessionParams> sessions;
+	for (std::vector<TransferInfo>::const_iterator ii = infos.begin(); ii != infos.end(); ++ii)
+		sessions.push_back(m_service.sessionParams(ii->m_endpointId));
+
+	std::vector<TFileTransferPtr> picked;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		// All the transfers are checked before any of them is queued, a file is transferred once at a time
+		for (std::vector<TransferInfo>::const_iterator ii = infos.begin(); ii != infos.end(); ++ii)
+		{
+			for (int i = 0; i < 2; ++i)
+			{
+				const TJobs& jobs = i ? m_active : m_queued;
+				for (TJobs::const_iterator jj = jobs.begin(); jj != jobs.end(); ++jj)
+				{
+					if (isSameTransfer(jj->second.info, *ii))
+						throw util::Error("File is being transferred already");
+				}
+			}
+
+			for (std::vector<TransferInfo>::const_iterator other = infos.begin(); other != ii; ++other)
+			{
+				if (isSameTransfer(*other, *ii))
+					throw util::Error("File is being transferred already");
+			}
+		}
+
+		for (size_t i = 0; i < infos.size(); ++i)
+			queue(infos[i], sessions[i], broadcast);
+
+		pickTransfers(picked);
+	}
+
+	std::vector<unsigned int> ids;
+	for (std::vector<TransferInfo>::const_iterator ii = infos.begin(); ii != infos.end(); ++ii)
+	{
+		m_service.transferQueued(*ii);
+		ids.push_back(ii->m_id);
+	}
+
+	startTransfers(picked);
+	return ids;
+}
+
+bool TransferManager::isSameTransfer(const TransferInfo& info, const TransferInfo& other)
+{
+	return other.m_endpointId == info.m_endpointId && other.m_direction == info.m_direction && other.m_remoteFileName == info.m_remoteFileName;
+}
+
+void TransferManager::queue(TransferInfo& info, const SessionParams& session, const TUploadBroadcastPtr& broadcast)
+{
+	info.m_id = ++m_lastId;
+
+	// Transfers report to the manager, though the manager does not expose itself as their listener
+	FileTransfer::IListener& listener = *this;
+
+	Job job;
+	job.transfer = std::make_shared<FileTransfer>(m_service, listener, info, m_chunkStore);
+	job.info = info;
+	job.namedReplies = 0 != (session.m_features & MessageIdentity::FEATURE_NAMED_REPLIES);
+
+	if (broadcast)
+	{
+		job.transfer->setBroadcast(broadcast);
+		job.broadcast = true;
+	}
+
+	// Transfer starts once the previous transfers of the endpoint are served, or at once if the endpoint was idle
+	std::map<std::string, unsigned int>::const_iterator weight = m_weights.find(info.m_endpointId);
+	double cost = 0 < info.m_fileSize ? static_cast<double>(info.m_fileSize) : kUnknownSizeCost;
+
+	double& finishTag = m_finishTags[info.m_endpointId];
+	job.startTag = finishTag > m_virtualTime ? finishTag : m_virtualTime;
+	finishTag = job.startTag + cost / (weight == m_weights.end() ? 1 : weight->second);
+
+	m_queued[info.m_id] = job;
+}
+
+void TransferManager::pickTransfers(std::vector<TFileTransferPtr>& picked)
+{
+	while (!m_stopped)
+	{
+		// Uploads of a broadcast are not held back by the total limit, a slow endpoint only holds its own upload
+		bool isFull = activeCount() >= m_maxActive;
+
+		TJobs::iterator best = m_queued.end();
+		for (TJobs::iterator ii = m_queued.begin(); ii != m_queued.end(); ++ii)
+		{
+			if (isFull && !ii->second.broadcast)
+				continue;
+
+			// Transfers are in order of IDs, so the earlier one wins a tie
+			if (isStartable(ii->second) && (best == m_queued.end() || precedes(ii->second, best->second)))
+				best = ii;
+		}
+
+		if (best == m_queued.end())
+			break;
+
+		if (best->second.startTag > m_virtualTime)
+			m_virtualTime = best->second.startTag;
+
+		best->second.info.m_state = TransferInfo::ACTIVE;
+		picked.push_back(best->second.transfer);
+
+		m_active.insert(*best);
+		m_queued.erase(best);
+	}
+}
+
+void TransferManager::startTransfers(const std::vector<TFileTransferPtr>& picked)
+{
+	for (std::vector<TFileTransferPtr>::const_iterator ii = picked.begin(); ii != picked.end(); ++ii)
+		(*ii)->start();
+}
+
+size_t TransferManager::activeCount() const
+{
+	size_t count = 0;
+	for (TJobs::const_iterator ii = m_active.begin(); ii != m_active.end(); ++ii)
+	{
+		if (!ii->second.broadcast)
+			++count;
+	}
+	return count;
+}
+
+bool TransferManager::isStartable(const Job& job) const
+{
+	size_t endpointActive = 0;
+	bool uploading = false;
+	for (TJobs::const_iterator ii = m_active.begin(); ii != m_active.end(); ++ii)
+	{
+		if (ii->second.info.m_endpointId == job.info.m_endpointId)
+		{
+			++endpointActive;
+			uploading = uploading || TransferInfo::UPLOAD == ii->second.info.m_direction;
+		}
+	}
+
+	// Replies of older endpoints do not tell which upload they are for
+	if (TransferInfo::UPLOAD == job.info.m_direction && !job.namedReplies && uploading)
+		return false;
+
+	return endpointActive < m_maxActivePerEndpoint;
+}
+
+bool TransferManager::precedes(const Job& job, const Job& other) const
+{
+	if (POLICY_WEIGHTED_FAIR == m_policy)
+		return job.startTag < other.startTag;
+
+	// Queued transfers have transferred nothing yet, so the remaining size is the file size
+	if (job.info.m_fileSize < 0 || other.info.m_fileSize < 0)
+		return 0 <= job.info.m_fileSize && other.info.m_fileSize < 0;
+	return job.info.m_fileSize < other.info.m_fileSize;
+}
+
+void TransferManager::reap(const TransferInfo& info)
+{
+	std::vector<TFileTransferPtr> picked;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		m_active.erase(info.m_id);
+		pickTransfers(picked);
+	}
+
+	m_service.transferFinished(info);
+	startTransfers(picked);
+}
+
+TFileTransferPtr TransferManager::findActive(const std::string& endpointId, TransferInfo::Direction direction, const std::wstring& remoteFileName) const
+{
+	util::ScopedLock lock(&m_sync);
+
+	TFileTransferPtr found;
+	for (TJobs::const_iterator ii = m_active.begin(); ii != m_active.end(); ++ii)
+	{
+		const TransferInfo& info = ii->second.info;
+		if (info.m_endpointId != endpointId || info.m_direction != direction)
+			continue;
+
+		if (info.m_remoteFileName == remoteFileName)
+			return ii->second.transfer;
+
+		// Older endpoints do not name files of upload replies, they only have one upload at a time
+		if (remoteFileName.empty() && TransferInfo::UPLOAD == direction)
+			found = ii->second.transfer;
+	}
+
+	return found;
+}
+
+void TransferManager::reportDropped(TransferInfo info, const std::string& error)
+{
+	info.m_state = TransferInfo::FINISHED;
+	info.m_ok = false;
+	info.m_error = error;
+	m_service.transferFinished(info);
+}
+
+TransferManager::ChunkSink::ChunkSink(TransferManager& manager, const std::string& endpointId)
+	: m_manager(manager)
+	, m_endpointId(endpointId)
+{
+}
+
+bool TransferManager::ChunkSink::beginChunkData(const FileChunk& chunk)
+{
+	TFileTransferPtr transfer = m_manager.findActive(m_endpointId, TransferInfo::DOWNLOAD, chunk.m_fileName);
+	return transfer && transfer->beginChunkData(chunk);
+}
+
+bool TransferManager::ChunkSink::writeChunkData(const FileChunk& chunk, const char* buf, size_t bufSize)
+{
+	return writeChunkData(chunk, util::BufferChain::copy(buf, bufSize));
+}
+
+bool TransferManager::ChunkSink::writeChunkData(const FileChunk& chunk, const util::BufferChain& data)
+{
+	// Transfer may have failed since its chunk began, the chunk is ignored then
+	TFileTransferPtr transfer = m_manager.findActive(m_endpointId, TransferInfo::DOWNLOAD, chunk.m_fileName);
+	return transfer && transfer->writeChunkData(chunk, data);
+}
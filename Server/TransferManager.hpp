@@ -0,0 +1,194 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <util/ChunkStore.hpp>
+#include <util/ThreadMutex.hpp>
+#include <protocol/DataTypes.hpp>
+
+#include "FileTransfer.hpp"
+#include "Service.hpp"
+
+/**
+ * Queue of downloads and uploads of all endpoints, several of them run at once.
+ * Active transfers are limited in total and per endpoint, uploads of a broadcast are only limited per endpoint. The next queued transfer is the one with the least data
+ *	to transfer, or the one picked fairly among endpoints by their weights (start-time fair queuing).
+ * Is a delegate of the service, responses of endpoints are routed to the transfers by file names.
+ * Progress of the transfers is passed to the delegates of the service.
+ */
+class TransferManager : public IServiceDelegate, private FileTransfer::IListener
+{
+public:
+	enum Policy
+	{
+		/// Transfer of the smallest file goes first, downloads of unknown size go last in order
+		POLICY_SHORTEST_REMAINING_FIRST,
+
+		/// Endpoints share active transfers by their weights, transfers of an endpoint go in order
+		POLICY_WEIGHTED_FAIR
+	};
+
+	static const size_t kDefaultMaxActive = 4;
+	static const size_t kDefaultMaxActivePerEndpoint = 2;
+
+	explicit TransferManager(Service& service);
+
+	/// Cancels the transfers and waits for them to be reported
+	~TransferManager();
+
+	/// Chunks of downloaded files are deduplicated if the store is set
+	void setChunkStore(const util::TChunkStorePtr& chunkStore);
+
+	/// Limits active transfers, queued transfers are started at once if the limits grow
+	void setLimits(size_t maxActive, size_t maxActivePerEndpoint);
+	void setPolicy(Policy policy);
+
+	/// Weight of an endpoint for POLICY_WEIGHTED_FAIR is 1 unless it is set, it applies to transfers queued later
+	void setWeight(const std::string& endpointId, unsigned int weight);
+
+	/**
+	 * Queue a transfer and return its ID. Size of a downloaded file is only known once it starts, unless it is given.
+	 * Throws if the endpoint is not connected or the file is being transferred to or from the endpoint already.
+	 */
+	unsigned int download(const std::string& endpointId, const std::wstring& remoteFileName, const std::wstring& localFileName, __int64 fileSize = -1);
+	unsigned int upload(const std::string& endpointId, const std::wstring& localFileName, const std::wstring& remoteFileName);
+
+	/**
+	 * Queues uploads of a file to many endpoints, the file is read once for all of them (see UploadBroadcast).
+	 * Returns IDs of the uploads in order of the endpoints. Throws if the file could not be opened, an endpoint is not connected
+	 *	or it is uploaded the file already, none of the uploads is queued then.
+	 */
+	std::vector<unsigned int> broadcast(const std::vector<std::string>& endpointIds, const std::wstring& localFileName, const std::wstring& remoteFileName);
+
+	/// Cancels a queued or active transfer, it is reported as failed
+	void cancel(unsigned int id);
+
+	/// Returns queued and active transfers in the order they were queued
+	std::vector<TransferInfo> transfers() const;
+
+	//
+	// IServiceDelegate
+	//
+	virtual void onEndpointDisconnected(const std::string& endpointId);
+	virtual void onDataConnectionClosed(const std::string& endpointId, net::IStream::TId connection);
+	virtual void onResponseFile(const std::string& endpointId, const FileChunk& chunk);
+	virtual void onUploadFileReply(const std::string& endpointId, const std::wstring& fileName, bool ok);
+	virtual void onResponseSignature(const std::string& endpointId, const std::wstring& fileName, const util::TDeltaSignaturePtr& signature);
+	virtual void onResponseManifest(const std::string& endpointId, const std::wstring& fileName, const util::TChunkManifestPtr& manifest);
+	virtual IFileChunkSink* fileChunkSink(const std::string& endpointId);
+
+private:
+	TransferManager(const TransferManager&);
+	TransferManager& operator =(const TransferManager&);
+
+	/// Passes data downloaded from an endpoint to the transfer of the chunk, so that they are written as they arrive
+	class ChunkSink : public IFileChunkSink
+	{
+	public:
+		ChunkSink(TransferManager& manager, const std::string& endpointId);
+
+		virtual bool beginChunkData(const FileChunk& chunk);
+		virtual bool writeChunkData(const FileChunk& chunk, const char* buf, size_t bufSize);
+		virtual bool writeChunkData(const FileChunk& chunk, const util::BufferChain& data);
+
+	private:
+		TransferManager& m_manager;
+		std::string m_endpointId;
+	};
+
+	/// Transfer with what the scheduler needs to know of it, so that the manager never locks a transfer
+	struct Job
+	{
+		Job()
+			: namedReplies(false)
+			, broadcast(false)
+			, startTag(0)
+		{
+		}
+
+		TFileTransferPtr transfer;
+		TransferInfo info;
+
+		/// Endpoint names files of upload replies, so several files are uploaded to it at once
+		bool namedReplies;
+
+		/// Upload of a broadcast, uploads of a broadcast start together so that they share the chunks read
+		bool broadcast;
+
+		/// Virtual time the transfer may start at under POLICY_WEIGHTED_FAIR
+		double startTag;
+	};
+
+	typedef std::map<
+		unsigned int,	// transfer ID
+		Job				// transfer in order of IDs
+	> TJobs;
+
+	//
+	// FileTransfer::IListener
+	//
+	virtual void onTransferProgress(const TransferInfo& info);
+	virtual void onTransferFinished(const TransferInfo& info);
+
+	unsigned int enqueue(const TransferInfo& info);
+
+	/// Queues all of the transfers or, if any of them can't be queued, none of them
+	std::vector<unsigned int> enqueue(std::vector<TransferInfo> infos, const TUploadBroadcastPtr& broadcast);
+
+	/// Must be executed under the lock. Queues a transfer which was checked, assigns its ID.
+	void queue(TransferInfo& info, const SessionParams& session, const TUploadBroadcastPtr& broadcast);
+
+	/// Returns true if both transfers move the same file in the same direction
+	static bool isSameTransfer(const TransferInfo& info, const TransferInfo& other);
+
+	/// Number of active transfers which count against the total limit
+	size_t activeCount() const;
+
+	/// Moves queued transfers which may start within the limits to the active ones, they are started without the manager locked
+	void pickTransfers(std::vector<TFileTransferPtr>& picked);
+	void startTransfers(const std::vector<TFileTransferPtr>& picked);
+
+	/// Returns true if a queued transfer may start now
+	bool isStartable(const Job& job) const;
+
+	/// Returns true if a queued transfer goes before another one
+	bool precedes(const Job& job, const Job& other) const;
+
+	/// Is run by the disk I/O threads, drops a finished transfer and starts the next ones
+	void reap(const TransferInfo& info);
+
+	/// Returns an active transfer of a file, or the only active upload to the endpoint if the file name is empty
+	TFileTransferPtr findActive(const std::string& endpointId, TransferInfo::Direction direction, const std::wstring& remoteFileName) const;
+
+	/// Reports a transfer which was dropped from the queue
+	void reportDropped(TransferInfo info, const std::string& error);
+
+private:
+	mutable util::ThreadMutex m_sync;
+	Service& m_service;
+	util::TChunkStorePtr m_chunkStore;
+
+	size_t m_maxActive;
+	size_t m_maxActivePerEndpoint;
+	Policy m_policy;
+
+	unsigned int m_lastId;
+	TJobs m_queued;
+	TJobs m_active;
+
+	/// Is set once the manager is being destroyed, queued transfers are not started then
+	bool m_stopped;
+
+	/// Virtual time of the weighted fair queue, it is the start tag of the last started transfer
+	double m_virtualTime;
+	std::map<std::string, unsigned int> m_weights;
+
+	/// Virtual time the last queued transfer of an endpoint ends at, the next one of the endpoint starts there
+	std::map<std::string, double> m_finishTags;
+
+	/// Sinks are kept while the manager lives, since received messages refer to them
+	std::map<std::string, std::shared_ptr<ChunkSink> > m_sinks;
+};
@@ -0,0 +1,266 @@
+#include "TreeReceiver.hpp"
+
+#include <util/AsyncFileIo.hpp>
+#include <util/ScopedLock.hpp>
+
+namespace {
+
+/// Creates a directory and its parents, existing ones are kept
+bool createDirectory(const std::wstring& dir)
+{
+	for (size_t pos = dir.find_first_of(L"\\/"); ; pos = dir.find_first_of(L"\\/", pos + 1))
+	{
+		// Drive and server names fail to be created, which is harmless
+		std::wstring part = dir.substr(0, pos);
+		if (!part.empty() && L':' != part[part.size() - 1])
+			::CreateDirectoryW(part.c_str(), NULL);
+
+		if (std::wstring::npos == pos)
+			break;
+	}
+
+	DWORD attributes = ::GetFileAttributesW(dir.c_str());
+	return INVALID_FILE_ATTRIBUTES != attributes && 0 != (attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+std::wstring parentOf(const std::wstring& path)
+{
+	size_t pos = path.find_last_of(L"\\/");
+	return std::wstring::npos == pos ? std::wstring() : path.substr(0, pos);
+}
+
+} // namespace
+
+TreeReceiver::TreeReceiver(const std::wstring& localDir, const TAck& ack, const TFinished& finished)
+	: m_localDir(localDir)
+	, m_ack(ack)
+	, m_finished(finished)
+	, m_lanes(kLaneCount)
+	, m_pendingJobs(0)
+	, m_done(false)
+	, m_valid(true)
+	, m_fileCount(0)
+	, m_failedCount(0)
+{
+}
+
+TreeReceiver::~TreeReceiver()
+{
+	// Queued writes refer to the receiver
+	util::AsyncFileIo& fileIo = util::AsyncFileIo::instance();
+	for (std::vector<Lane>::iterator ii = m_lanes.begin(); ii != m_lanes.end(); ++ii)
+		fileIo.drain(&*ii);
+}
+
+void TreeReceiver::receive(const TreeBatch& batch)
+{
+	// Entries are grouped by lanes, a file always falls on the same lane, so its pieces are written in order
+	std::vector<TTreeEntries> laneEntries(kLaneCount);
+
+	// The local directory is created even if the tree is empty
+	if (0 == batch.m_sequence)
+	{
+		TreeEntry root;
+		root.m_isDir = true;
+		laneEntries[0].push_back(root);
+	}
+
+	std::hash<std::wstring> hashPath;
+	for (TTreeEntries::const_iterator ii = batch.m_entries.begin(); ii != batch.m_entries.end(); ++ii)
+		laneEntries[hashPath(ii->m_path) % kLaneCount].push_back(*ii);
+
+	size_t jobs = 0;
+	for (size_t i = 0; i < kLaneCount; ++i)
+	{
+		if (!laneEntries[i].empty())
+			++jobs;
+	}
+
+	bool finished = false;
+	bool ok = false;
+	size_t fileCount = 0;
+	size_t failedCount = 0;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		if (m_done)
+			return;
+
+		m_done = batch.m_done || !batch.m_valid;
+		if (!batch.m_valid)
+			m_valid = false;
+
+		m_pendingJobs += jobs;
+		if (0 < jobs)
+			m_batchJobs[batch.m_sequence] = jobs;
+
+		finished = m_done && 0 == m_pendingJobs;
+		ok = m_valid && 0 == m_failedCount;
+		fileCount = m_fileCount;
+		failedCount = m_failedCount;
+	}
+
+	// A batch without entries makes room for the next one at once
+	if (0 == jobs)
+		m_ack(batch.m_sequence);
+	if (finished)
+		m_finished(ok, fileCount, failedCount);
+
+	util::AsyncFileIo& fileIo = util::AsyncFileIo::instance();
+	for (size_t i = 0; i < kLaneCount; ++i)
+	{
+		if (laneEntries[i].empty())
+			continue;
+
+		Lane& lane = m_lanes[i];
+		util::T_UI4 sequence = batch.m_sequence;
+		TTreeEntries entries;
+		entries.swap(laneEntries[i]);
+
+		fileIo.submit(&lane, [this, &lane, sequence, entries]()
+		{
+			writeEntries(lane, sequence, entries);
+		});
+	}
+}
+
+void TreeReceiver::writeEntries(Lane& lane, util::T_UI4 sequence, const TTreeEntries& entries)
+{
+	size_t fileCount = 0;
+	size_t failedCount = 0;
+
+	for (TTreeEntries::const_iterator ii = entries.begin(); ii != entries.end(); ++ii)
+	{
+		if (ii->m_isDir)
+		{
+			// An empty path stands for the local directory itself
+			std::wstring dir;
+			if (!localPath(ii->m_path, dir) || !createDirectory(dir))
+				++failedCount;
+			continue;
+		}
+
+		bool ok = true;
+		if (!writeFile(lane, *ii, ok))
+			continue;
+
+		if (ok)
+			++fileCount;
+		else
+			++failedCount;
+	}
+
+	jobDone(sequence, fileCount, failedCount);
+}
+
+bool TreeReceiver::writeFile(Lane& lane, const TreeEntry& entry, bool& ok)
+{
+	std::shared_ptr<OpenFile>& file = lane.files[entry.m_path];
+
+	// The first piece creates the file, a piece without its beginning fails the file
+	if (0 == entry.m_offset || !file)
+	{
+		file = std::make_shared<OpenFile>();
+
+		// Small files are not forced to the disk one by one, a tree of them would be written at the pace of the disk flushes
+		util::FileWriter& writer = file->writer;
+		writer.setDurability(entry.m_fileSize < util::FileWriter::kMinMappedSize ?
+			util::FileWriter::DURABILITY_NONE :
+			util::FileWriter::DURABILITY_AT_CLOSE);
+
+		std::wstring path;
+		file->failed = !entry.m_valid
+			|| 0 != entry.m_offset
+			|| !localPath(entry.m_path, path)
+			|| !createDirectory(parentOf(path))
+			|| !writer.open(path);
+
+		if (!file->failed)
+			writer.reserve(entry.m_fileSize);
+	}
+
+	util::FileWriter& writer = file->writer;
+	if (!file->failed)
+		file->failed = !entry.m_valid || entry.m_offset != writer.size() || !writer.write(entry.m_data);
+
+	if (!entry.m_last)
+		return false;
+
+	// Verify the whole file, a corrupted file is left under its temporary name
+	util::T_UI8 hash = 0;
+	ok = !file->failed
+		&& writer.isComplete(entry.m_fileSize)
+		&& writer.hash(hash)
+		&& entry.m_fileHash == hash;
+
+	if (ok)
+		ok = writer.finish();
+	else
+		writer.close();
+
+	lane.files.erase(entry.m_path);
+	return true;
+}
+
+void TreeReceiver::jobDone(util::T_UI4 sequence, size_t fileCount, size_t failedCount)
+{
+	bool acked = false;
+	bool finished = false;
+	bool ok = false;
+	size_t totalFiles = 0;
+	size_t totalFailed = 0;
+	{
+		util::ScopedLock lock(&m_sync);
+
+		m_fileCount += fileCount;
+		m_failedCount += failedCount;
+
+		std::map<util::T_UI4, size_t>::iterator ii = m_batchJobs.find(sequence);
+		if (ii != m_batchJobs.end() && 0 == --ii->second)
+		{
+			m_batchJobs.erase(ii);
+			acked = true;
+		}
+
+		--m_pendingJobs;
+		finished = m_done && 0 == m_pendingJobs;
+
+		ok = m_valid && 0 == m_failedCount;
+		totalFiles = m_fileCount;
+		totalFailed = m_failedCount;
+	}
+
+	if (acked)
+		m_ack(sequence);
+	if (finished)
+		m_finished(ok, totalFiles, totalFailed);
+}
+
+bool TreeReceiver::localPath(const std::wstring& path, std::wstring& result) const
+{
+	if (path.empty())
+	{
+		result = m_localDir;
+		return true;
+	}
+
+	// Paths are relative and stay within the local directory, streams and drives are rejected
+	if (L'\\' == path[0] || L'/' == path[0] || std::wstring::npos != path.find(L':'))
+		return false;
+
+	for (size_t begin = 0; begin <= path.size();)
+	{
+		size_t end = path.find_first_of(L"\\/", begin);
+		if (std::wstring::npos == end)
+			end = path.size();
+
+		std::wstring part = path.substr(begin, end - begin);
+		if (part.empty() || L"." == part || L".." == part)
+			return false;
+
+		begin = end + 1;
+	}
+
+	result = m_localDir + L"\\" + path;
+	return true;
+}
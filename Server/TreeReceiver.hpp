@@ -0,0 +1,87 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <util/FileWriter.hpp>
+#include <util/ThreadMutex.hpp>
+#include <protocol/DataTypes.hpp>
+
+/**
+ * Recreates a directory tree streamed by the endpoint (see MessageRequestTree) under a local directory.
+ * Files are spread over several writer lanes by their paths, lanes are util::AsyncFileIo strands,
+ *	so files are written in parallel while pieces of each file are written in order.
+ * A batch is acknowledged once all its entries are written, so the endpoint keeps a window of batches in flight.
+ */
+class TreeReceiver
+{
+public:
+	/// Are called by the disk I/O threads without the receiver locked
+	typedef std::function<void (util::T_UI4 sequence)> TAck;
+	typedef std::function<void (bool ok, size_t fileCount, size_t failedCount)> TFinished;
+
+	static const size_t kLaneCount = 4;
+
+	TreeReceiver(const std::wstring& localDir, const TAck& ack, const TFinished& finished);
+
+	/// Waits for queued writes, unfinished files are left under their temporary names
+	~TreeReceiver();
+
+	/// Queues writes of a batch, batches are received in the order they were sent
+	void receive(const TreeBatch& batch);
+
+private:
+	TreeReceiver(const TreeReceiver&);
+	TreeReceiver& operator =(const TreeReceiver&);
+
+	/// File being written, a large file is received in pieces by consecutive batches
+	struct OpenFile
+	{
+		OpenFile()
+			: failed(false)
+		{
+		}
+
+		util::FileWriter writer;
+		bool failed;
+	};
+
+	/// Files of a lane are only used by the jobs of the lane
+	struct Lane
+	{
+		std::map<std::wstring, std::shared_ptr<OpenFile> > files;
+	};
+
+	/// Is run by the disk I/O threads, writes entries of a batch which fall on a lane
+	void writeEntries(Lane& lane, util::T_UI4 sequence, const TTreeEntries& entries);
+
+	/// Writes a piece of a file, returns true once a file is complete
+	bool writeFile(Lane& lane, const TreeEntry& entry, bool& ok);
+
+	/// Counts a finished job, acknowledges its batch once all jobs of the batch are done
+	void jobDone(util::T_UI4 sequence, size_t fileCount, size_t failedCount);
+
+	/// Returns local path of an entry, false if the path leads out of the local directory
+	bool localPath(const std::wstring& path, std::wstring& result) const;
+
+private:
+	util::ThreadMutex m_sync;
+	std::wstring m_localDir;
+	TAck m_ack;
+	TFinished m_finished;
+	std::vector<Lane> m_lanes;
+
+	/// Jobs of batches which are not acknowledged yet
+	std::map<util::T_UI4, size_t> m_batchJobs;
+	size_t m_pendingJobs;
+
+	/// Is set once the last batch is received
+	bool m_done;
+	bool m_valid;
+
+	size_t m_fileCount;
+	size_t m_failedCount;
+};
@@ -0,0 +1,151 @@
+#include "UploadBroadcast.hpp"
+
+#include <util/ScopedLock.hpp>
+#include <protocol/MessageUploadFile.hpp>
+
+UploadBroadcast::UploadBroadcast(const std::wstring& localFileName, const std::wstring& remoteFileName, size_t chunkSize)
+	: m_localFileName(localFileName)
+	, m_remoteFileName(remoteFileName)
+	, m_chunkSize(chunkSize)
+	, m_memoryCap(kDefaultMemoryCap)
+	, m_hashedSize(0)
+	, m_keptSize(0)
+	, m_readEnd(0)
+	, m_readCount(0)
+	, m_rereadCount(0)
+{
+}
+
+bool UploadBroadcast::open()
+{
+	util::ScopedLock lock(&m_sync);
+	return m_reader.open(m_localFileName);
+}
+
+void UploadBroadcast::setMemoryCap(size_t memoryCap)
+{
+	util::ScopedLock lock(&m_sync);
+
+	m_memoryCap = memoryCap;
+	dropChunks();
+}
+
+__int64 UploadBroadcast::fileSize() const
+{
+	util::ScopedLock lock(&m_sync);
+	return m_reader.size();
+}
+
+void UploadBroadcast::join(unsigned int transferId)
+{
+	util::ScopedLock lock(&m_sync);
+	m_positions[transferId] = 0;
+}
+
+void UploadBroadcast::leave(unsigned int transferId)
+{
+	util::ScopedLock lock(&m_sync);
+
+	m_positions.erase(transferId);
+	dropChunks();
+}
+
+msg::TSerializedMessagePtr UploadBroadcast::chunk(unsigned int transferId, __int64 position, __int64& size)
+{
+	util::ScopedLock lock(&m_sync);
+
+	__int64 fileSize = m_reader.size();
+	size = fileSize - position;
+	if (size > static_cast<__int64>(m_chunkSize))
+		size = m_chunkSize;
+
+	m_positions[transferId] = position + size;
+
+	msg::TSerializedMessagePtr message;
+	TChunks::const_iterator ii = m_chunks.find(position);
+	if (ii != m_chunks.end())
+	{
+		message = ii->second;
+	}
+	else
+	{
+		// Data are read to memory rather than referred to, so they are hashed. The first chunk is sent even for an empty file.
+		util::BufferChain data;
+		if (0 < size && !m_reader.readAt(data, position, static_cast<int>(size)))
+			return msg::TSerializedMessagePtr();
+
+		if (position < m_readEnd)
+		{
+			++m_rereadCount;
+		}
+		else
+		{
+			++m_readCount;
+			m_readEnd = position + size;
+		}
+
+		if (position == m_hashedSize)
+		{
+			for (size_t i = 0; i < data.segmentCount(); ++i)
+				m_hash.update(data.segment(i).data(), data.segment(i).size);
+			m_hashedSize += size;
+		}
+
+		std::shared_ptr<MessageUploadFile> msgUpload = std::make_shared<MessageUploadFile>();
+		FileChunk& chunk = msgUpload->m_chunk;
+		chunk.m_fileName = m_remoteFileName;
+		chunk.m_fileSize = fileSize;
+		chunk.m_positionFrom = position;
+		chunk.m_valid = true;
+		chunk.m_fileData = data;
+
+		// The last chunk carries hash of the whole file
+		if (position + size == fileSize && m_hashedSize == fileSize)
+		{
+			chunk.m_hasFileHash = true;
+			chunk.m_fileHash = m_hash.digest();
+		}
+
+		// Frames of all the endpoints refer to the blocks of the chunk data
+		message = msg::Messenger::instance().serializeMessage(msgUpload);
+		m_chunks[position] = message;
+		m_keptSize += static_cast<size_t>(size);
+	}
+
+	dropChunks();
+	return message;
+}
+
+size_t UploadBroadcast::readCount() const
+{
+	util::ScopedLock lock(&m_sync);
+	return m_readCount;
+}
+
+size_t UploadBroadcast::rereadCount() const
+{
+	util::ScopedLock lock(&m_sync);
+	return m_rereadCount;
+}
+
+void UploadBroadcast::dropChunks()
+{
+	__int64 slowest = m_readEnd;
+	for (TPositions::const_iterator ii = m_positions.begin(); ii != m_positions.end(); ++ii)
+	{
+		if (ii->second < slowest)
+			slowest = ii->second;
+	}
+
+	// The slowest transfer reads the oldest chunks again rather than holds back the others
+	__int64 fileSize = m_reader.size();
+	while (!m_chunks.empty() && (m_chunks.begin()->first < slowest || m_keptSize > m_memoryCap))
+	{
+		__int64 size = fileSize - m_chunks.begin()->first;
+		if (size > static_cast<__int64>(m_chunkSize))
+			size = m_chunkSize;
+
+		m_keptSize -= static_cast<size_t>(size);
+		m_chunks.erase(m_chunks.begin());
+	}
+}
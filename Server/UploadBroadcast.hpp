@@ -0,0 +1,87 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include <msg/Messenger.hpp>
+#include <util/FileReader.hpp>
+#include <util/ThreadMutex.hpp>
+#include <util/XxHash64.hpp>
+
+/**
+ * Upload of one file to many endpoints, each endpoint is uploaded to by its own FileTransfer.
+ * Each chunk is read once and saved once as an upload message, the transfers send the same payload.
+ * Transfers keep their own windows, so a fast endpoint runs ahead of slow ones rather than waits for them.
+ *	Chunks are kept until every transfer sent them or until they take more than the memory cap,
+ *	a transfer which fell behind the kept chunks reads its chunk again.
+ */
+class UploadBroadcast
+{
+public:
+	static const size_t kDefaultMemoryCap = 64 * 1024 * 1024;
+
+	UploadBroadcast(const std::wstring& localFileName, const std::wstring& remoteFileName, size_t chunkSize);
+
+	/// Opens the file, returns false if it could not be read
+	bool open();
+
+	void setMemoryCap(size_t memoryCap);
+
+	__int64 fileSize() const;
+
+	/// Transfer sends chunks from the beginning of the file, chunks are kept for it until it leaves
+	void join(unsigned int transferId);
+	void leave(unsigned int transferId);
+
+	/**
+	 * Returns the upload message of the chunk at position and the size of the chunk, NULL if the file could not be read.
+	 * The transfer is done with the chunks before the returned one.
+	 */
+	msg::TSerializedMessagePtr chunk(unsigned int transferId, __int64 position, __int64& size);
+
+	/// Chunks read for the first time and chunks read again for transfers behind the kept ones
+	size_t readCount() const;
+	size_t rereadCount() const;
+
+private:
+	UploadBroadcast(const UploadBroadcast&);
+	UploadBroadcast& operator =(const UploadBroadcast&);
+
+	/// Must be executed under a lock. Drops chunks every transfer sent, then the oldest ones over the cap.
+	void dropChunks();
+
+private:
+	mutable util::ThreadMutex m_sync;
+
+	std::wstring m_localFileName;
+	std::wstring m_remoteFileName;
+	size_t m_chunkSize;
+	size_t m_memoryCap;
+
+	util::FileReader m_reader;
+
+	/// File is hashed as chunks are read for the first time, they are read in order by the leading transfer
+	util::XxHash64 m_hash;
+	__int64 m_hashedSize;
+
+	typedef std::map<
+		__int64,						// position of a chunk
+		msg::TSerializedMessagePtr		// upload message of the chunk
+	> TChunks;
+	TChunks m_chunks;
+	size_t m_keptSize;
+
+	typedef std::map<
+		unsigned int,	// transfer ID
+		__int64			// position the transfer sends next
+	> TPositions;
+	TPositions m_positions;
+
+	/// End of the chunks read so far, a chunk before it is read again
+	__int64 m_readEnd;
+	size_t m_readCount;
+	size_t m_rereadCount;
+};
+
+typedef std::shared_ptr<UploadBroadcast> TUploadBroadcastPtr;
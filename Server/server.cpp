@@ -1,5 +1,8 @@
 #include "Server.h"
 
+#include <QDir>
+#include <QStandardPaths>
+
 #pragma comment(lib, "Ws2_32.lib")
 #pragma comment(lib, "NetComm.lib")
 
@@ -9,6 +12,12 @@ Server::Server(QWidget *parent)
 	ui.setupUi(this);
 	ui.leListen->setText("127.0.0.1:7777");
 
+	// Downloads work without the chunk store, they just receive every chunk then
+	QString chunkDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/chunks";
+	m_chunkStore = std::make_shared<util::ChunkStore>();
+	if (QDir().mkpath(chunkDir))
+		m_chunkStore->open(QDir::toNativeSeparators(chunkDir).toStdWString());
+
 	connect(ui.btnListen, SIGNAL(clicked()), this, SLOT(onListenClicked()));
 	connect(ui.btnRequestSysInfo, SIGNAL(clicked()), this, SLOT(onRequestSysInfoClicked()));
 	connect(ui.lstEndpoints, SIGNAL(itemSelectionChanged()), this, SLOT(onEndpointsSelectionChanged()));
@@ -50,6 +59,21 @@ void Server::onResponseSysInfo(const std::string& endpointId, const std::vector<
 	QMetaObject::invokeMethod(this, "updateSysinfo", Qt::QueuedConnection);
 }
 
+void Server::onQueryFinished(const QueryResult& result)
+{
+	QString summary = QString("%1 of %2 endpoints answered, latency p50 %3 ms, p90 %4 ms, p99 %5 ms")
+		.arg(result.m_endpointCount - result.m_unanswered.size())
+		.arg(result.m_endpointCount)
+		.arg(result.latencyPercentile(0.5) * 1000, 0, 'f', 1)
+		.arg(result.latencyPercentile(0.9) * 1000, 0, 'f', 1)
+		.arg(result.latencyPercentile(0.99) * 1000, 0, 'f', 1);
+	if (result.m_timedOut)
+		summary += ", timed out";
+
+	// main thread UI Update call
+	QMetaObject::invokeMethod(this, "showQueryResult", Qt::QueuedConnection, Q_ARG(QString, summary));
+}
+
 
 /// *********************************************************
 ///  QT Component Signals / Slots
@@ -69,6 +93,10 @@ void Server::onListenClicked()
 			// Important !!! First delete previous, then create another one.
 			m_service.reset();
 			m_service.reset(new Service(net::BindingFactory::BINDING_TCP_SERVER, address.toStdString(), this));
+			m_service->transfers().setChunkStore(m_chunkStore);
+
+			// File chunks and transfers of the endpoints go to their windows only
+			m_service->subscribe(this, std::string(), IServiceDelegate::EVENT_CONNECTION | IServiceDelegate::EVENT_SYSINFO | IServiceDelegate::EVENT_QUERY);
 
 			ui.btnListen->setText(_T("Stop"));
 			ui.lstEndpoints->setEnabled(true);
@@ -92,10 +120,13 @@ void Server::onListenClicked()
 void Server::onRequestSysInfoClicked()
 {
 	if (m_service) {
-		if(ui.lstEndpoints->selectedItems().size() >= 1) {
-			QString sId = ui.lstEndpoints->currentItem()->text();
-			m_service->requestSysInfo(sId.toStdString());
-		}
+		// All endpoints are asked at once unless some are selected
+		std::vector<std::string> endpointIds;
+		for (QListWidgetItem* item : ui.lstEndpoints->selectedItems())
+			endpointIds.push_back(item->text().toStdString());
+
+		m_service->querySysInfo(endpointIds);
+		ui.statusBar->showMessage(QString("Requesting sysinfo of %1 endpoints").arg(endpointIds.empty() ? m_service->endpoints().size() : endpointIds.size()));
 	}
 }
 
@@ -115,7 +146,7 @@ void Server::ShowContextMenu(const QPoint& pos)
 			QString sId = ui.lstEndpoints->currentItem()->text();
 			FileTransferWindow *fwin;
 			fwin = new FileTransferWindow(m_service, sId.toStdString());
-			m_service->addDelegate(fwin);
+			m_service->subscribe(fwin, sId.toStdString(), IServiceDelegate::EVENT_CONNECTION | IServiceDelegate::EVENT_DIR | IServiceDelegate::EVENT_TREE | IServiceDelegate::EVENT_TRANSFER);
 			fwin->setWindowTitle(QString::fromStdString("File Transfer [") + sId + QString::fromStdString("]"));
 			fwin->show();
 		}
@@ -182,3 +213,8 @@ void Server::updateDisconnectedEndpoints()
 	}
 	m_disconnectedEndpoints.clear();
 }
+
+void Server::showQueryResult(const QString& summary)
+{
+	ui.statusBar->showMessage(summary);
+}
@@ -524,6 +524,1440 @@ testMessenger2()
 	}
 }
 
+void
+testStreamingMessenger()
+{
+	// Payload is larger than the messenger's initial buffer, so it must arrive in several fragments
+	static const size_t kPayloadSize = 1024 * 1024 * 64;
+
+	struct BlobMessage : msg::IMessage, msg::IStreamingMessage
+	{
+		BlobMessage() : loaded(0), fragments(0), checksum(0), completed(false) {}
+
+		enum {
+			TYPE_ID = 8
+		};
+
+		size_t loaded;
+		size_t fragments;
+		unsigned int checksum;
+		bool completed;
+
+		virtual util::T_UI4 typeId() const
+		{
+			return TYPE_ID;
+		}
+
+		virtual void save(TOStream& out)
+		{
+			std::vector<unsigned char> blob(kPayloadSize);
+			for (size_t i = 0; i < blob.size(); ++i)
+				blob[i] = static_cast<unsigned char>(i);
+
+			out.write(&blob[0], blob.size());
+		}
+
+		virtual void load(TIStream& in)
+		{
+			assert(!"Streaming message must not be loaded at once");
+		}
+
+		virtual void beginLoad(util::T_UI4 payloadSize)
+		{
+			assert(kPayloadSize == payloadSize);
+		}
+
+		virtual void loadFragment(const unsigned char* buf, size_t bufSize)
+		{
+			for (size_t i = 0; i < bufSize; ++i)
+			{
+				assert(static_cast<unsigned char>(loaded + i) == buf[i]);
+				checksum += buf[i];
+			}
+
+			loaded += bufSize;
+			++fragments;
+		}
+
+		virtual void endLoad()
+		{
+			completed = true;
+		}
+	};
+
+	struct MsgFactory : msg::IMessageFactory
+	{
+		virtual msg::TMessagePtr createMessage(util::T_UI4 messageType)
+		{
+			if (BlobMessage::TYPE_ID != messageType)
+				throw std::logic_error("Unknown message type");
+
+			return std::make_shared<BlobMessage>();
+		}
+	} msgFactory;
+
+	struct MsgBindingDelegate : msg::IBindingDelegate, msg::IMessengerDelegate
+	{
+		MsgBindingDelegate() : streams(0), started(0) {}
+
+		int streams;
+		int started;
+
+		virtual void onStreamCreated(net::IStream::TId streamId)
+		{
+			msg::Messenger& messenger = msg::Messenger::instance();
+			messenger.addDelegate(streamId, this);
+
+			// Only one side sends the blob
+			if (0 == streams++)
+				messenger.sendMessage(streamId, std::make_shared<BlobMessage>());
+		}
+
+		virtual void onMessageStarted(
+			::net::IStream::TId streamId,
+			::msg::TMessagePtr message)
+		{
+			BlobMessage* blob = dynamic_cast<BlobMessage*>(message.get());
+			assert(blob && 0 == blob->loaded);
+			++started;
+		}
+
+		virtual void onMessageReceived(
+			::net::IStream::TId streamId,
+			::msg::TMessagePtr message)
+		{
+			BlobMessage* blob = dynamic_cast<BlobMessage*>(message.get());
+			assert(blob);
+			assert(blob->completed);
+			assert(kPayloadSize == blob->loaded);
+			assert(1 < blob->fragments);
+			assert(1 == started);
+
+			LOGLOG("Blob received in " << blob->fragments << " fragments");
+			net::StreamListener::instance().cancelRun();
+		}
+
+		virtual void onStreamDied(::net::IStream::TId streamId)
+		{
+			// It's ok, we're forcing a stream to close
+		}
+
+	} bindingDelegate;
+
+	msg::Messenger& messenger = msg::Messenger::instance();
+	messenger.setMessageFactory(&msgFactory);
+	messenger.setBindingDelegate(&bindingDelegate);
+
+	net::TBindingPtr server = net::BindingFactory::createBinding(net::BindingFactory::BINDING_TCP_SERVER);
+	net::TBindingPtr client = net::BindingFactory::createBinding(net::BindingFactory::BINDING_TCP_CLIENT);
+
+	const char* address = "127.0.0.1:7777";
+
+	server->bind(address, &messenger);
+	client->bind(address, &messenger);
+
+	net::StreamListener::instance().run();
+
+	messenger.setMessageFactory(0);
+	messenger.setBindingDelegate(0);
+}
+
+void
+testSerializedMessage()
+{
+	struct TextMessage : msg::IMessage
+	{
+		enum {
+			TYPE_ID = 9
+		};
+
+		std::string text;
+
+		virtual util::T_UI4 typeId() const
+		{
+			return TYPE_ID;
+		}
+
+		virtual void save(TOStream& out)
+		{
+			out.write(reinterpret_cast<const unsigned char*>(text.data()), text.size());
+		}
+
+		virtual void load(TIStream& in)
+		{
+		}
+	};
+
+	std::shared_ptr<TextMessage> message = std::make_shared<TextMessage>();
+	message->text = "The same frame goes to every stream";
+
+	// Message is saved once, its checksum is ready for streams which need it
+	msg::TSerializedMessagePtr serialized = msg::Messenger::instance().serializeMessage(message);
+	assert(TextMessage::TYPE_ID == serialized->typeId);
+	assert(message->text.size() == serialized->payload.size());
+
+	util::BufferChain payload = serialized->payload;
+	assert(0 == memcmp(payload.coalesce(), message->text.data(), message->text.size()));
+	assert(util::Crc32c::compute(message->text.data(), message->text.size()) == serialized->checksum);
+}
+
+void
+testChecksums()
+{
+	// Check values of the algorithms
+	assert(0xE3069283 == util::Crc32c::compute("123456789", 9));
+	assert(0xEF46DB3751D8E999ULL == util::XxHash64::compute("", 0));
+	assert(0x44BC2CF5AD770999ULL == util::XxHash64::compute("abc", 3));
+
+	static const size_t kDataSize = 1024 * 1024 * 256;
+	static const size_t kFragmentSize = 1024 * 100;
+
+	std::vector<unsigned char> data(kDataSize);
+	std::vector<unsigned char> copy(kDataSize);
+	for (size_t i = 0; i < kDataSize; ++i)
+		data[i] = static_cast<unsigned char>(i * 31 + (i >> 11));
+
+	// Incremental results must match one-shot results
+	util::Crc32c crc;
+	util::XxHash64 hash;
+	for (size_t i = 0; i < kDataSize; i += kFragmentSize)
+	{
+		size_t cb = std::min(kFragmentSize, kDataSize - i);
+		crc.update(&data[i], cb);
+		hash.update(&data[i], cb);
+	}
+	assert(crc.value() == util::Crc32c::compute(&data[0], kDataSize));
+	assert(hash.digest() == util::XxHash64::compute(&data[0], kDataSize));
+
+	// Throughput is compared to copying the same data, which is the least a transfer does with them
+	LARGE_INTEGER freq;
+	LARGE_INTEGER t0, t1, t2, t3;
+	::QueryPerformanceFrequency(&freq);
+
+	::QueryPerformanceCounter(&t0);
+	memcpy(&copy[0], &data[0], kDataSize);
+	::QueryPerformanceCounter(&t1);
+	util::T_UI4 crcValue = util::Crc32c::compute(&data[0], kDataSize);
+	::QueryPerformanceCounter(&t2);
+	util::T_UI8 hashValue = util::XxHash64::compute(&data[0], kDataSize);
+	::QueryPerformanceCounter(&t3);
+
+	double mb = kDataSize / (1024.0 * 1024.0);
+	double copyTime = double(t1.QuadPart - t0.QuadPart) / freq.QuadPart;
+	double crcTime = double(t2.QuadPart - t1.QuadPart) / freq.QuadPart;
+	double hashTime = double(t3.QuadPart - t2.QuadPart) / freq.QuadPart;
+
+	std::cout << "memcpy: " << mb / copyTime << " MB/s" << std::endl;
+	std::cout << "CRC32C" << (util::Crc32c::hardwareSupported() ? " (SSE4.2): " : " (table): ")
+		<< mb / crcTime << " MB/s, " << crcValue << std::endl;
+	std::cout << "XXH64: " << mb / hashTime << " MB/s, " << hashValue << std::endl;
+}
+
+void
+testCompression()
+{
+	static const size_t kDataSize = 1024 * 1024 * 64;
+
+	// Text-like data compress well, random data don't
+	std::vector<unsigned char> text(kDataSize);
+	std::vector<unsigned char> noise(kDataSize);
+	const char* words[] = { "chunk ", "stream ", "message ", "file ", "endpoint ", "\r\n" };
+	for (size_t i = 0; i < kDataSize; )
+	{
+		const char* word = words[rand() % (sizeof(words) / sizeof(words[0]))];
+		for (; *word && i < kDataSize; ++word)
+			text[i++] = *word;
+	}
+	for (size_t i = 0; i < kDataSize; ++i)
+		noise[i] = static_cast<unsigned char>(rand());
+
+	std::vector<unsigned char> compressed(util::Lz4::compressBound(kDataSize));
+	std::vector<unsigned char> restored(kDataSize);
+
+	for (int acceleration = 1; acceleration <= util::Lz4::kMaxAcceleration; acceleration *= 4)
+	{
+		util::Stopwatch stopwatch;
+		size_t size = util::Lz4::compress(&text[0], kDataSize, &compressed[0], compressed.size(), acceleration);
+		double compressTime = stopwatch.seconds();
+
+		stopwatch.restart();
+		util::Lz4::decompress(&compressed[0], size, &restored[0], kDataSize);
+		double decompressTime = stopwatch.seconds();
+
+		assert(restored == text);
+
+		double mb = kDataSize / (1024.0 * 1024.0);
+		std::cout << "LZ4 acceleration " << acceleration << ": ratio " << double(size) / kDataSize
+			<< ", " << mb / compressTime << " MB/s compress, " << mb / decompressTime << " MB/s decompress" << std::endl;
+	}
+
+	// Incompressible frames are detected by their first block and sent as is
+	msg::FrameCompressor compressor;
+	std::vector<unsigned char> frame;
+
+	bool isCompressed = compressor.compress(&noise[0], 1024 * 100, frame);
+	assert(!isCompressed);
+
+	isCompressed = compressor.compress(&text[0], 1024 * 100, frame);
+	assert(isCompressed);
+
+	compressor.decompress(&frame[0], frame.size(), restored);
+	assert(1024 * 100 == restored.size() && std::equal(restored.begin(), restored.end(), text.begin()));
+
+	msg::CompressionStats stats = compressor.stats();
+	assert(1 == stats.framesCompressed && 1 == stats.framesSkipped);
+	std::cout << "Frame compression ratio " << stats.sendRatio()
+		<< ", " << stats.compressThroughput() / (1024 * 1024) << " MB/s" << std::endl;
+}
+
+void
+testBufferChain()
+{
+	const char text[] = "0123456789abcdef";
+
+	// Two blocks, the second one is filled by two commits like a socket fills it
+	util::BufferChain chain = util::BufferChain::copy(text, 6);
+
+	util::TBufferBlockPtr block = std::make_shared<util::BufferBlock>(64);
+	memcpy(block->tail(), text + 6, 4);
+	block->commit(4);
+	chain.append(block, 0, 4);
+	memcpy(block->tail(), text + 10, 6);
+	block->commit(6);
+	chain.append(block, 4, 6);
+
+	// Adjacent slices of a block are merged
+	assert(16 == chain.size() && 2 == chain.segmentCount());
+
+	// Slices share blocks
+	util::BufferChain middle = chain.slice(4, 8);
+	assert(8 == middle.size() && 2 == middle.segmentCount());
+	assert(middle.segment(1).block == block);
+
+	char buf[16];
+	middle.copyTo(buf, 0, middle.size());
+	assert(0 == memcmp(buf, text + 4, 8));
+
+	middle.trimFront(3);
+	assert(5 == middle.size() && 1 == middle.segmentCount());
+	middle.copyTo(buf, 0, middle.size());
+	assert(0 == memcmp(buf, text + 7, 5));
+
+	// Coalescing merges segments into a new block, the original chain is intact
+	util::BufferChain merged(chain);
+	const unsigned char* p = merged.coalesce();
+	assert(1 == merged.segmentCount() && 0 == memcmp(p, text, 16));
+	assert(2 == chain.segmentCount());
+}
+
+void
+testReceiveToFile()
+{
+	static const size_t kFileSize = 1024 * 1024 * 256;
+	static const size_t kBlockSize = 1024 * 1024;
+
+	// Received data arrive as chains of socket blocks, a frame header is cut off each of them
+	std::vector<util::BufferChain> received;
+	for (size_t i = 0; i < kFileSize; i += kBlockSize)
+	{
+		util::TBufferBlockPtr block = std::make_shared<util::BufferBlock>(kBlockSize + 8);
+		for (size_t j = 0; j < kBlockSize + 8; ++j)
+			block->tail()[j] = static_cast<unsigned char>(rand());
+		block->commit(kBlockSize + 8);
+
+		received.push_back(util::BufferChain(block, 8, kBlockSize));
+	}
+
+	wchar_t path[MAX_PATH];
+	::GetTempPathW(MAX_PATH, path);
+	std::wstring fileName = std::wstring(path) + L"netcomm_receive.bin";
+
+	util::T_UI8 hashes[2] = { 0, 0 };
+	for (int mapped = 0; mapped < 2; ++mapped)
+	{
+		util::FileWriter writer;
+		util::Stopwatch stopwatch;
+
+		bool ok = writer.open(fileName);
+		assert(ok);
+
+		if (mapped)
+		{
+			ok = writer.reserve(kFileSize);
+			assert(ok);
+		}
+
+		for (size_t i = 0; i < received.size(); ++i)
+		{
+			ok = writer.write(received[i]);
+			assert(ok);
+		}
+		assert(kFileSize == writer.size());
+
+		ok = writer.hash(hashes[mapped]);
+		assert(ok);
+		ok = writer.finish();
+		assert(ok);
+		double time = stopwatch.seconds();
+
+		std::cout << (mapped ? "Mapped" : "Buffered") << " receive to file: "
+			<< kFileSize / (1024.0 * 1024.0) / time << " MB/s" << std::endl;
+	}
+	assert(hashes[0] == hashes[1]);
+
+	// An interrupted transfer leaves only the data written under the temporary name, the previous file is intact
+	{
+		util::FileWriter writer;
+		writer.open(fileName);
+		writer.reserve(kFileSize);
+		writer.write(received[0]);
+		writer.close();
+
+		std::wstring tempName = fileName + util::FileWriter::kTempSuffix;
+		WIN32_FILE_ATTRIBUTE_DATA attributes;
+		::GetFileAttributesExW(tempName.c_str(), GetFileExInfoStandard, &attributes);
+		assert(0 == attributes.nFileSizeHigh && kBlockSize == attributes.nFileSizeLow);
+
+		::GetFileAttributesExW(fileName.c_str(), GetFileExInfoStandard, &attributes);
+		assert(0 == attributes.nFileSizeHigh && kFileSize == attributes.nFileSizeLow);
+
+		::DeleteFileW(tempName.c_str());
+	}
+
+	// Small writes are coalesced into aligned ones, group commits don't change the data
+	{
+		static const size_t kSize = kBlockSize * 3 + 7;
+
+		util::BufferChain data;
+		for (size_t i = 0; i < 4; ++i)
+			data.append(received[i]);
+		const char* p = reinterpret_cast<const char*>(data.coalesce());
+
+		util::FileWriter writer;
+		writer.setDurability(util::FileWriter::DURABILITY_GROUP_COMMIT);
+		writer.open(fileName);
+		writer.reserve(kSize);
+
+		for (size_t i = 0; i < kSize; i += 3)
+		{
+			bool ok = writer.write(p + i, kSize - i < 3 ? kSize - i : 3);
+			assert(ok);
+		}
+		assert(writer.isComplete(kSize));
+
+		bool ok = writer.finish();
+		assert(ok);
+
+		util::FileReader reader;
+		reader.open(fileName);
+
+		util::BufferChain chunk;
+		ok = reader.readAt(chunk, kBlockSize * 2 - 5, kBlockSize + 12);
+		assert(ok && 0 == memcmp(chunk.coalesce(), p + kBlockSize * 2 - 5, kBlockSize + 12));
+	}
+
+	// Chunks written out of order complete the file, yet can't be hashed as they arrive, they are read back for the hash
+	{
+		util::FileWriter writer;
+		writer.open(fileName);
+		for (size_t i = received.size(); 0 < i; --i)
+		{
+			bool ok = writer.writeAt(received[i - 1], (i - 1) * kBlockSize);
+			assert(ok && (1 == i) == writer.isComplete(kFileSize));
+		}
+
+		util::T_UI8 hash = 0;
+		bool ok = writer.hash(hash);
+		assert(kFileSize == writer.size() && !ok);
+		ok = writer.readHash(hash);
+		assert(ok && hashes[0] == hash);
+		ok = writer.finish();
+		assert(ok);
+
+		util::FileReader reader;
+		reader.open(fileName);
+
+		util::BufferChain chunk;
+		ok = reader.readAt(chunk, kBlockSize * 3, kBlockSize);
+		assert(ok && 0 == memcmp(chunk.coalesce(), received[3].coalesce(), kBlockSize));
+
+		// Reader which read a range only hashes the file by reading it again
+		hash = 0;
+		ok = reader.hash(hash);
+		assert(!ok);
+		ok = reader.readHash(hash);
+		assert(ok && hashes[0] == hash);
+	}
+
+	::DeleteFileW(fileName.c_str());
+}
+
+void
+testRangeSet()
+{
+	util::RangeSet ranges;
+	assert(ranges.empty() && 0 == ranges.prefix() && ranges.isComplete(0));
+
+	__int64 first = ranges.add(20, 10);
+	__int64 second = ranges.add(40, 10);
+	assert(10 == first && 10 == second);
+	assert(2 == ranges.rangeCount() && 0 == ranges.prefix() && 50 == ranges.end());
+
+	// Overlapping and adjacent ranges are merged, only new bytes are counted
+	first = ranges.add(25, 10);
+	second = ranges.add(35, 5);
+	assert(5 == first && 5 == second);
+	assert(1 == ranges.rangeCount() && 30 == ranges.covered());
+	assert(ranges.contains(20, 30) && !ranges.contains(19, 2));
+	assert(0 == ranges.nextGap(0) && 50 == ranges.nextGap(20) && 50 == ranges.nextGap(49));
+
+	first = ranges.add(0, 20);
+	assert(20 == first);
+	assert(50 == ranges.prefix() && ranges.isComplete(50) && !ranges.isComplete(51));
+
+	// A range covering several ones absorbs them
+	ranges.add(60, 5);
+	ranges.add(70, 5);
+	assert(3 == ranges.rangeCount());
+	first = ranges.add(55, 30);
+	assert(20 == first);
+	assert(2 == ranges.rangeCount() && 85 == ranges.end() && 80 == ranges.covered());
+}
+
+void
+testMappedFileReader()
+{
+	static const size_t kFileSize = 1024 * 1024 * 256 + 12345;
+	static const int kChunkSize = 1024 * 1024;
+
+	wchar_t path[MAX_PATH];
+	::GetTempPathW(MAX_PATH, path);
+	std::wstring fileName = std::wstring(path) + L"netcomm_mapped.bin";
+
+	{
+		std::vector<char> data(kFileSize);
+		for (size_t i = 0; i < kFileSize; ++i)
+			data[i] = static_cast<char>(rand());
+
+		util::FileWriter writer;
+		writer.open(fileName);
+		writer.write(&data[0], kFileSize);
+		writer.finish();
+	}
+
+	// Both modes read the same data, the file is hashed as it is read
+	util::T_UI8 hashes[2] = { 0, 0 };
+	for (int mapped = 0; mapped < 2; ++mapped)
+	{
+		util::FileReader reader;
+		reader.setMapped(1 == mapped);
+
+		util::Stopwatch stopwatch;
+
+		bool ok = reader.open(fileName);
+		assert(ok && kFileSize == reader.size());
+
+		size_t segments = 0;
+		for (__int64 position = 0; position < static_cast<__int64>(kFileSize); position += kChunkSize)
+		{
+			int size = static_cast<int>((std::min)(static_cast<__int64>(kChunkSize), static_cast<__int64>(kFileSize) - position));
+
+			util::BufferChain chunk;
+			ok = reader.read(chunk, position, size);
+			assert(ok && size == chunk.size());
+			segments += chunk.segmentCount();
+		}
+
+		ok = reader.hash(hashes[mapped]);
+		assert(ok);
+		double time = stopwatch.seconds();
+
+		std::cout << (mapped ? "Mapped" : "Stdio") << " file reader: "
+			<< kFileSize / (1024.0 * 1024.0) / time << " MB/s, " << segments << " segments" << std::endl;
+	}
+	assert(hashes[0] == hashes[1]);
+
+	// A chunk crossing a window refers to two windows, random reads remap
+	{
+		util::FileReader reader;
+		reader.setMapped(true);
+		reader.open(fileName);
+
+		util::BufferChain tail;
+		bool ok = reader.read(tail, util::FileReader::kWindowSize - 100, 200);
+		assert(ok && 2 == tail.segmentCount());
+
+		util::BufferChain head;
+		ok = reader.read(head, 0, 100);
+		assert(ok && 1 == head.segmentCount());
+
+		// Windows outlive the reader
+		reader.close();
+		std::vector<unsigned char> bytes;
+		tail.copyTo(bytes);
+		head.copyTo(bytes);
+		assert(300 == bytes.size());
+	}
+
+	::DeleteFileW(fileName.c_str());
+}
+
+void
+testAsyncFileIo()
+{
+	static const int kJobCount = 1000;
+
+	util::AsyncFileIo fileIo(4, 16);
+
+	// Jobs of a strand run in order, one at a time
+	std::vector<int> order;
+	int strand = 0;
+	for (int i = 0; i < kJobCount; ++i)
+		fileIo.submit(&strand, [&order, i]() { order.push_back(i); });
+
+	// Jobs without a strand run in parallel
+	volatile LONG count = 0;
+	for (int i = 0; i < kJobCount; ++i)
+		fileIo.submit(0, [&count]() { ::InterlockedIncrement(&count); });
+
+	fileIo.drain(&strand);
+	assert(kJobCount == order.size());
+	for (int i = 0; i < kJobCount; ++i)
+		assert(i == order[i]);
+
+	// Positional reads and writes complete on the pool threads
+	wchar_t path[MAX_PATH];
+	::GetTempPathW(MAX_PATH, path);
+	std::wstring fileName = std::wstring(path) + L"netcomm_async.bin";
+
+	util::BufferChain data = util::BufferChain::copy("0123456789abcdef", 16);
+	{
+		util::FileWriter writer;
+		writer.open(fileName);
+
+		volatile LONG written = 0;
+		fileIo.write(writer, data.slice(8, 8), 8, [&written](bool ok) { if (ok) ::InterlockedIncrement(&written); });
+		fileIo.write(writer, data.slice(0, 8), 0, [&written](bool ok) { if (ok) ::InterlockedIncrement(&written); });
+		fileIo.drain();
+
+		assert(2 == written && writer.isComplete(16));
+		writer.finish();
+	}
+	{
+		util::FileReader reader;
+		reader.open(fileName);
+
+		std::vector<unsigned char> bytes;
+		fileIo.read(reader, 4, 8, [&bytes](bool ok, const util::BufferChain& chunk) { if (ok) chunk.copyTo(bytes); });
+		fileIo.drain();
+
+		assert(8 == bytes.size() && 0 == memcmp(&bytes[0], "456789ab", 8));
+	}
+
+	fileIo.drain();
+	assert(kJobCount == count);
+
+	::DeleteFileW(fileName.c_str());
+}
+
+void
+testReadAheadPrefetcher()
+{
+	static const size_t kFileSize = 1024 * 1024 * 32 + 777;
+	static const int kChunkSize = 1024 * 1024;
+
+	wchar_t path[MAX_PATH];
+	::GetTempPathW(MAX_PATH, path);
+	std::wstring fileName = std::wstring(path) + L"netcomm_readahead.bin";
+
+	std::vector<char> content(kFileSize);
+	for (size_t i = 0; i < kFileSize; ++i)
+		content[i] = static_cast<char>(rand());
+	{
+		util::FileWriter writer;
+		writer.open(fileName);
+		writer.write(&content[0], kFileSize);
+		writer.finish();
+	}
+
+	// Sending a chunk takes a while, the next chunks are read meanwhile
+	for (size_t depth = 0; depth <= 4; depth += 4)
+	{
+		util::FileReader reader;
+		reader.open(fileName);
+		util::ReadAheadPrefetcher prefetcher(reader, depth, kChunkSize * 3);
+
+		util::Stopwatch stopwatch;
+		for (__int64 position = 0; position < static_cast<__int64>(kFileSize); position += kChunkSize)
+		{
+			int size = static_cast<int>((std::min)(static_cast<__int64>(kChunkSize), static_cast<__int64>(kFileSize) - position));
+
+			util::BufferChain chunk;
+			bool ok = prefetcher.take(chunk, position, size);
+			assert(ok && size == chunk.size());
+			assert(0 == memcmp(chunk.coalesce(), &content[static_cast<size_t>(position)], size));
+
+			::Sleep(2);
+		}
+
+		util::T_UI8 hash = 0;
+		bool ok = prefetcher.hash(hash);
+		assert(ok && util::XxHash64::compute(&content[0], kFileSize) == hash);
+
+		std::cout << "Read-ahead depth " << depth << ": " << kFileSize / (1024.0 * 1024.0) / stopwatch.seconds() << " MB/s" << std::endl;
+	}
+
+	// A chunk out of order restarts the read-ahead, the file can't be hashed then
+	{
+		util::FileReader reader;
+		reader.open(fileName);
+		util::ReadAheadPrefetcher prefetcher(reader);
+
+		util::BufferChain chunk;
+		bool ok = prefetcher.take(chunk, 0, kChunkSize);
+		ok = ok && prefetcher.take(chunk, kChunkSize * 5, kChunkSize);
+		assert(ok && 0 == memcmp(chunk.coalesce(), &content[kChunkSize * 5], kChunkSize));
+
+		util::T_UI8 hash = 0;
+		ok = prefetcher.hash(hash);
+		assert(!ok);
+	}
+
+	// Chunks of a mapped file refer to its windows, the file is still hashed
+	{
+		util::FileReader reader;
+		reader.setMapped(true);
+		reader.open(fileName);
+		util::ReadAheadPrefetcher prefetcher(reader);
+
+		for (__int64 position = 0; position < static_cast<__int64>(kFileSize); position += kChunkSize)
+		{
+			int size = static_cast<int>((std::min)(static_cast<__int64>(kChunkSize), static_cast<__int64>(kFileSize) - position));
+
+			util::BufferChain chunk;
+			bool ok = prefetcher.take(chunk, position, size);
+			assert(ok && size == chunk.size());
+			assert(0 == memcmp(chunk.coalesce(), &content[static_cast<size_t>(position)], size));
+		}
+
+		util::T_UI8 hash = 0;
+		bool ok = prefetcher.hash(hash);
+		assert(ok && util::XxHash64::compute(&content[0], kFileSize) == hash);
+	}
+
+	// Pooled blocks return to the pool once chains release them
+	{
+		util::BufferPool pool(16, 2);
+		util::TBufferBlockPtr first = pool.acquire();
+		util::TBufferBlockPtr second = pool.acquire();
+		util::TBufferBlockPtr third = pool.acquire();
+		assert(first && second && !third && 2 == pool.blocksInUse());
+
+		second.reset();
+		first.reset();
+		assert(0 == pool.blocksInUse());
+		third = pool.acquire();
+		assert(third);
+	}
+
+	::DeleteFileW(fileName.c_str());
+}
+
+void
+testSparseFile()
+{
+	static const size_t kBlockSize = 1024 * 1024;
+	static const __int64 kHoleSize = 1024 * 1024 * 64;
+
+	wchar_t path[MAX_PATH];
+	::GetTempPathW(MAX_PATH, path);
+	std::wstring fileName = std::wstring(path) + L"netcomm_sparse.bin";
+
+	std::vector<char> data(kBlockSize);
+	for (size_t i = 0; i < kBlockSize; ++i)
+		data[i] = static_cast<char>(rand());
+
+	// Data, a hole, data and a trailing hole, the hash covers zeros of the holes
+	util::T_UI8 written = 0;
+	{
+		util::FileWriter writer;
+		writer.open(fileName);
+
+		bool ok = writer.write(&data[0], kBlockSize)
+			&& writer.writeHole(kBlockSize, kHoleSize)
+			&& writer.write(&data[0], kBlockSize)
+			&& writer.writeHole(kBlockSize * 2 + kHoleSize, kHoleSize);
+		assert(ok && writer.isComplete(kBlockSize * 2 + kHoleSize * 2));
+
+		ok = writer.hash(written) && writer.finish();
+		assert(ok);
+	}
+
+	util::XxHash64 dense;
+	dense.update(&data[0], kBlockSize);
+	dense.updateZeros(kHoleSize);
+	dense.update(&data[0], kBlockSize);
+	dense.updateZeros(kHoleSize);
+	assert(dense.digest() == written);
+
+	// Sender describes holes rather than sends them
+	{
+		util::FileReader reader;
+		bool ok = reader.open(fileName);
+		assert(ok && kBlockSize * 2 + kHoleSize * 2 == reader.size());
+
+		assert(kBlockSize == reader.dataSize(0, kBlockSize * 4));
+		assert(kHoleSize == reader.holeSize(kBlockSize));
+		assert(0 == reader.dataSize(kBlockSize * 4, kBlockSize));
+		assert(0 == reader.holeSize(kBlockSize + kHoleSize));
+		assert(kHoleSize == reader.holeSize(kBlockSize * 2 + kHoleSize));
+	}
+
+	// Holes take no disk space
+	DWORD high = 0;
+	DWORD low = ::GetCompressedFileSizeW(fileName.c_str(), &high);
+	assert(0 == high && low < kBlockSize * 4);
+
+	// Hole which would extend the file is rejected by the receiver
+	{
+		FileChunk chunk;
+		chunk.m_fileSize = kBlockSize * 2 + kHoleSize - 1;
+		chunk.m_positionFrom = kBlockSize + kHoleSize;
+		chunk.m_fileData = util::BufferChain::copy(&data[0], kBlockSize);
+		chunk.m_valid = true;
+		chunk.m_holeSize = kHoleSize;
+
+		util::MemoryStream out;
+		chunk.save(out);
+		std::basic_string<unsigned char> buf = out.str();
+
+		bool rejected = false;
+		try
+		{
+			util::MemoryStream in(buf.data(), buf.data() + buf.size());
+			FileChunk received;
+			received.load(in);
+		}
+		catch (const util::Error&)
+		{
+			rejected = true;
+		}
+		assert(rejected);
+	}
+
+	::DeleteFileW(fileName.c_str());
+}
+
+namespace
+{
+
+/// Counts open files
+struct CountedFile
+{
+	CountedFile() { ++s_open; }
+	~CountedFile() { --s_open; }
+
+	static int s_open;
+};
+
+int CountedFile::s_open = 0;
+
+} // namespace
+
+void
+testFileHandleCache()
+{
+	int streams[2];
+	util::FileHandleCache<CountedFile> cache(3, 60000);
+
+	// Interleaved chunks of transfers get the files they opened before
+	std::shared_ptr<CountedFile> a = cache.get(L"a", &streams[0]);
+	std::shared_ptr<CountedFile> b = cache.get(L"a", &streams[1]);
+	std::shared_ptr<CountedFile> again = cache.get(L"a", &streams[0]);
+	assert(a != b && a == again);
+	again = cache.get(L"a", &streams[1]);
+	assert(b == again);
+	assert(2 == CountedFile::s_open && 2 == cache.size());
+
+	// The least recently used file is dropped, it is closed once it is released
+	cache.get(L"b", &streams[0]);
+	cache.get(L"a", &streams[0]);
+	cache.get(L"c", &streams[0]);
+	assert(3 == cache.size() && !cache.find(L"a", &streams[1]) && cache.find(L"b", &streams[0]));
+	assert(4 == CountedFile::s_open);
+	b.reset();
+	assert(3 == CountedFile::s_open);
+
+	// Files of a transfer are dropped together, e.g. when its stream dies
+	a.reset();
+	cache.removeTransfer(&streams[0]);
+	assert(0 == cache.size() && 0 == CountedFile::s_open);
+
+	// Idle files are dropped
+	cache.setLimits(3, 0);
+	cache.get(L"a", &streams[0]);
+	cache.evictIdle();
+	assert(0 == cache.size() && 0 == CountedFile::s_open);
+}
+
+void
+testDeltaSync()
+{
+	static const size_t kFileSize = 8 * 1024 * 1024 + 1000;
+	static const size_t kChunkSize = 1024 * 1024;
+
+	std::vector<char> basis(kFileSize);
+	for (size_t i = 0; i < kFileSize; ++i)
+		basis[i] = static_cast<char>(rand());
+
+	// Rolled checksum equals the checksum of the block it was rolled to
+	{
+		const size_t kWindow = 1000;
+		util::RollingChecksum checksum;
+		checksum.reset(&basis[0], kWindow);
+		for (size_t i = 0; i < 5000; ++i)
+			checksum.roll(basis[i], basis[i + kWindow]);
+		assert(checksum.value() == util::RollingChecksum::compute(&basis[5000], kWindow));
+	}
+
+	wchar_t path[MAX_PATH];
+	::GetTempPathW(MAX_PATH, path);
+	std::wstring basisName = std::wstring(path) + L"netcomm_basis.bin";
+	std::wstring fileName = std::wstring(path) + L"netcomm_delta.bin";
+
+	{
+		util::FileWriter writer;
+		bool ok = writer.open(basisName) && writer.write(&basis[0], kFileSize) && writer.finish();
+		assert(ok);
+	}
+
+	// New version of the file has bytes inserted, removed and changed
+	std::vector<char> file(basis);
+	file.insert(file.begin() + 100000, 777, 'x');
+	file.erase(file.begin() + 3000000, file.begin() + 3010000);
+	file[6000000] ^= 1;
+
+	// Receiver signs its copy, the signature is sent to the sender
+	util::FileHandle basisFile;
+	std::shared_ptr<util::DeltaSignature> signature = std::make_shared<util::DeltaSignature>();
+	bool ok = basisFile.openRead(basisName) && signature->compute(basisFile);
+	assert(ok && kFileSize / signature->blockSize() == signature->blockCount());
+
+	util::MemoryStream out;
+	signature->save(out);
+	std::basic_string<unsigned char> buf = out.str();
+	util::MemoryStream in(buf.data(), buf.data() + buf.size());
+	std::shared_ptr<util::DeltaSignature> received = std::make_shared<util::DeltaSignature>();
+	ok = received->load(in);
+	assert(ok && received->blockCount() == signature->blockCount());
+
+	// Sender encodes the file in windows, the receiver applies chunks in order
+	util::DeltaEncoder encoder(received);
+	util::FileWriter writer;
+	ok = writer.open(fileName);
+	assert(ok);
+
+	size_t window = received->windowSize(kChunkSize);
+	size_t literalSize = 0;
+	for (size_t position = 0; position < file.size(); position += window)
+	{
+		size_t size = (std::min)(window, file.size() - position);
+		bool last = position + size == file.size();
+
+		util::TDeltaOps ops;
+		util::BufferChain literals;
+		__int64 positionFrom = encoder.position();
+		encoder.encode(util::BufferChain::copy(&file[position], size), last, ops, literals);
+		assert(literals.size() <= kChunkSize);
+		assert(positionFrom + util::DeltaEncoder::targetSize(ops) == encoder.position());
+
+		ok = positionFrom == writer.size() && util::DeltaEncoder::apply(ops, literals, basisFile, writer);
+		assert(ok);
+
+		literalSize += literals.size();
+	}
+
+	// Only changed blocks and the unsigned tail are sent
+	assert(literalSize < 8 * signature->blockSize() + kFileSize % signature->blockSize());
+
+	util::T_UI8 hash = 0;
+	ok = writer.isComplete(file.size()) && writer.hash(hash) && writer.finish();
+	assert(ok && util::XxHash64::compute(&file[0], file.size()) == hash);
+
+	basisFile.close();
+	::DeleteFileW(basisName.c_str());
+	::DeleteFileW(fileName.c_str());
+}
+
+void
+testContentChunking()
+{
+	static const size_t kFileSize = 8 * 1024 * 1024 + 1000;
+
+	std::vector<unsigned char> data(kFileSize);
+	for (size_t i = 0; i < kFileSize; ++i)
+		data[i] = static_cast<unsigned char>(rand());
+
+	// Vectorized scan cuts where the scalar one does
+	std::vector<size_t> sizes;
+	for (size_t offset = 0; offset < data.size(); offset += sizes.back())
+	{
+		size_t size = util::ContentChunker::cut(&data[offset], data.size() - offset);
+		assert(size == util::ContentChunker::cutScalar(&data[offset], data.size() - offset));
+		assert(0 < size && size <= util::ContentChunker::kMaxSize);
+		sizes.push_back(size);
+	}
+
+	wchar_t path[MAX_PATH];
+	::GetTempPathW(MAX_PATH, path);
+	std::wstring fileName = std::wstring(path) + L"netcomm_chunked.bin";
+	std::wstring storeDir = std::wstring(path) + L"netcomm_chunks";
+	::CreateDirectoryW(storeDir.c_str(), NULL);
+
+	// Chunks of a file are stored as they are received
+	util::ChunkStore store;
+	bool ok = store.open(storeDir, 4 * kFileSize);
+	assert(ok);
+
+	for (size_t offset = 0, i = 0; i < sizes.size(); offset += sizes[i++])
+	{
+		util::BufferChain chunk = util::BufferChain::copy(&data[offset], sizes[i]);
+		ok = store.put(util::ChunkId::compute(chunk), chunk);
+		assert(ok);
+	}
+
+	// Edited version of the file shares all chunks but the ones around the edits
+	data.insert(data.begin() + 100000, 777, 'x');
+	data[6000000] ^= 1;
+
+	{
+		util::FileWriter writer;
+		ok = writer.open(fileName) && writer.write(reinterpret_cast<const char*>(&data[0]), data.size()) && writer.finish();
+		assert(ok);
+	}
+
+	util::FileHandle file;
+	util::ChunkManifest manifest;
+	ok = file.openRead(fileName) && manifest.compute(file);
+	assert(ok && data.size() == manifest.fileSize());
+	assert(util::XxHash64::compute(&data[0], data.size()) == manifest.fileHash());
+	file.close();
+
+	util::MemoryStream out;
+	manifest.save(out);
+	std::basic_string<unsigned char> buf = out.str();
+	util::MemoryStream in(buf.data(), buf.data() + buf.size());
+	util::ChunkManifest received;
+	ok = received.load(in);
+	assert(ok && received.entryCount() == manifest.entryCount());
+
+	size_t missing = 0;
+	for (size_t i = 0; i < received.entryCount(); ++i)
+	{
+		if (!store.contains(received.entry(i).id))
+			++missing;
+	}
+	assert(0 < missing && missing <= 4);
+
+	// Stored chunks are read back verified
+	util::BufferChain chunk;
+	ok = store.get(received.entry(received.entryCount() - 1).id, chunk);
+	assert(ok && chunk.size() == received.entry(received.entryCount() - 1).size);
+
+	// The least recently used chunks are evicted once the store shrinks, the recently used ones stay
+	store.setCapacity(util::ContentChunker::kMaxSize);
+	assert(store.size() <= util::ContentChunker::kMaxSize && store.contains(received.entry(received.entryCount() - 1).id));
+
+	// Chunks survive the store
+	size_t count = store.count();
+	ok = store.open(storeDir, util::ContentChunker::kMaxSize);
+	assert(ok && count == store.count());
+
+	store.setCapacity(0);
+	store.close();
+	::RemoveDirectoryW(storeDir.c_str());
+	::DeleteFileW(fileName.c_str());
+}
+
+void
+testTreeWalker()
+{
+	wchar_t path[MAX_PATH];
+	::GetTempPathW(MAX_PATH, path);
+	std::wstring root = std::wstring(path) + L"netcomm_tree";
+
+	// a\b\c.txt, a\d.txt, e\ (empty) and f.txt
+	::CreateDirectoryW(root.c_str(), NULL);
+	::CreateDirectoryW((root + L"\\a").c_str(), NULL);
+	::CreateDirectoryW((root + L"\\a\\b").c_str(), NULL);
+	::CreateDirectoryW((root + L"\\e").c_str(), NULL);
+
+	const wchar_t* files[] = { L"a\\b\\c.txt", L"a\\d.txt", L"f.txt" };
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i)
+	{
+		util::FileWriter writer;
+		bool ok = writer.open(root + L"\\" + files[i]) && writer.write("data", i + 1) && writer.finish();
+		assert(ok);
+	}
+
+	util::TreeWalker walker;
+	bool ok = walker.open(root + L"\\");
+	assert(ok && root == walker.root());
+
+	std::map<std::wstring, util::TreeWalker::Entry> entries;
+	std::vector<std::wstring> order;
+
+	util::TreeWalker::Entry entry;
+	while (walker.next(entry))
+	{
+		assert(0 == entries.count(entry.path));
+		entries[entry.path] = entry;
+		order.push_back(entry.path);
+	}
+
+	assert(6 == entries.size());
+	assert(entries[L"a"].isDir && entries[L"a\\b"].isDir && entries[L"e"].isDir);
+	assert(!entries[L"a\\b\\c.txt"].isDir && 1 == entries[L"a\\b\\c.txt"].size);
+	assert(2 == entries[L"a\\d.txt"].size && 3 == entries[L"f.txt"].size);
+
+	// Directory precedes its content
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		size_t pos = order[i].find_last_of(L'\\');
+		if (std::wstring::npos != pos)
+			assert(std::find(order.begin(), order.begin() + i, order[i].substr(0, pos)) != order.begin() + i);
+	}
+
+	walker.close();
+
+	// A missing directory is not walked
+	ok = walker.open(root + L"\\missing");
+	bool walked = walker.next(entry);
+	assert(!ok && !walked);
+
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i)
+		::DeleteFileW((root + L"\\" + files[i]).c_str());
+	::RemoveDirectoryW((root + L"\\a\\b").c_str());
+	::RemoveDirectoryW((root + L"\\a").c_str());
+	::RemoveDirectoryW((root + L"\\e").c_str());
+	::RemoveDirectoryW(root.c_str());
+}
+
+void
+testRequestFiles()
+{
+	MessageRequestFiles msg;
+	msg.m_dir = L"C:\\data";
+	msg.m_names.push_back(L"a.txt");
+	msg.m_names.push_back(L"b.txt");
+	msg.m_pattern = L"*.log";
+
+	util::MemoryStream out;
+	msg.save(out);
+	std::basic_string<unsigned char> buf = out.str();
+	util::MemoryStream in(buf.data(), buf.data() + buf.size());
+	MessageRequestFiles received;
+	received.load(in);
+	assert(msg.m_dir == received.m_dir && msg.m_names == received.m_names && msg.m_pattern == received.m_pattern);
+
+	// A truncated request names no files and does not fall back to the pattern
+	util::MemoryStream truncated(buf.data(), buf.data() + buf.size() - 1);
+	MessageRequestFiles malformed;
+	malformed.load(truncated);
+	assert(malformed.m_names.empty() && malformed.m_pattern.empty());
+
+	// a.txt, b.txt, c.log and d.txt\ (directory)
+	wchar_t path[MAX_PATH];
+	::GetTempPathW(MAX_PATH, path);
+	std::wstring root = std::wstring(path) + L"netcomm_files";
+
+	::CreateDirectoryW(root.c_str(), NULL);
+	::CreateDirectoryW((root + L"\\d.txt").c_str(), NULL);
+
+	const wchar_t* files[] = { L"a.txt", L"b.txt", L"c.log" };
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i)
+	{
+		util::FileWriter writer;
+		bool ok = writer.open(root + L"\\" + files[i]) && writer.write("data", 4) && writer.finish();
+		assert(ok);
+	}
+
+	// Names are taken as they are, the pattern is not used
+	std::vector<std::wstring> names = received.files(root);
+	assert(msg.m_names == names);
+
+	// The pattern lists the matching files but not the directory
+	received.m_names.clear();
+	received.m_pattern = L"*.txt";
+	names = received.files(root);
+	std::sort(names.begin(), names.end());
+	assert(2 == names.size() && L"a.txt" == names[0] && L"b.txt" == names[1]);
+
+	received.m_pattern = L"*.bin";
+	assert(received.files(root).empty());
+
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i)
+		::DeleteFileW((root + L"\\" + files[i]).c_str());
+	::RemoveDirectoryW((root + L"\\d.txt").c_str());
+	::RemoveDirectoryW(root.c_str());
+}
+
+void
+testSendScheduler()
+{
+	static const size_t kQuantum = 64 * 1024;
+
+	net::IStream::TId bulk = reinterpret_cast<net::IStream::TId>(1);
+	net::IStream::TId interactive = reinterpret_cast<net::IStream::TId>(2);
+
+	// Small frames are not held up by large frames queued before them
+	{
+		net::SendScheduler scheduler;
+		scheduler.setQuantum(kQuantum);
+		scheduler.setMaxSending(1);
+
+		std::vector<net::SendScheduler::TTicket> bulkFrames;
+		std::vector<net::SendScheduler::TTicket> interactiveFrames;
+		for (int i = 0; i < 4; ++i)
+			bulkFrames.push_back(scheduler.enqueue(bulk, 4 * kQuantum, 0));
+		for (int i = 0; i < 4; ++i)
+			interactiveFrames.push_back(scheduler.enqueue(interactive, 1000, 0));
+
+		std::vector<net::IStream::TId> order;
+		while (order.size() < 8)
+		{
+			double wait = scheduler.dispatch(0);
+			assert(0 > wait);
+
+			net::SendScheduler::TTicket granted = 0;
+			for (net::SendScheduler::TTicket ticket = 1; ticket <= 8; ++ticket)
+			{
+				if (scheduler.isGranted(ticket))
+					granted = ticket;
+			}
+			assert(0 != granted);
+
+			order.push_back(granted <= 4 ? bulk : interactive);
+			scheduler.complete(granted, 0);
+		}
+
+		// Interactive stream sends its frames in one turn, while the bulk stream saves turns for its first frame
+		assert(std::find(order.begin(), order.end(), bulk) - order.begin() == 4);
+		assert(4 == scheduler.stats(bulk).framesSent && 4 * 4 * kQuantum == scheduler.stats(bulk).bytesSent);
+		assert(4000 == scheduler.stats(interactive).bytesSent);
+	}
+
+	// Streams of different frame sizes send the same number of bytes
+	{
+		net::SendScheduler scheduler;
+		scheduler.setQuantum(kQuantum);
+		scheduler.setMaxSending(1);
+
+		std::map<net::SendScheduler::TTicket, net::IStream::TId> frames;
+		for (int i = 0; i < 100; ++i)
+			frames[scheduler.enqueue(bulk, kQuantum, 0)] = bulk;
+		for (int i = 0; i < 1000; ++i)
+			frames[scheduler.enqueue(interactive, kQuantum / 10, 0)] = interactive;
+
+		for (int i = 0; i < 200; ++i)
+		{
+			scheduler.dispatch(0);
+			for (std::map<net::SendScheduler::TTicket, net::IStream::TId>::iterator ii = frames.begin(); ii != frames.end(); ++ii)
+			{
+				if (scheduler.isGranted(ii->first))
+				{
+					scheduler.complete(ii->first, 0);
+					frames.erase(ii);
+					break;
+				}
+			}
+		}
+
+		double ratio = static_cast<double>(scheduler.stats(bulk).bytesSent) / scheduler.stats(interactive).bytesSent;
+		assert(0.8 < ratio && ratio < 1.25);
+
+		// Queued frames are left to the writers of a removed stream
+		scheduler.removeStream(bulk);
+		scheduler.removeStream(interactive);
+		while (!frames.empty())
+		{
+			scheduler.dispatch(0);
+			for (std::map<net::SendScheduler::TTicket, net::IStream::TId>::iterator ii = frames.begin(); ii != frames.end(); ++ii)
+			{
+				if (scheduler.isGranted(ii->first))
+				{
+					scheduler.complete(ii->first, 0);
+					frames.erase(ii);
+					break;
+				}
+			}
+		}
+		assert(0 == scheduler.stats(bulk).framesSent);
+	}
+
+	// Rate limits of a stream and of all streams pace the frames
+	{
+		net::SendScheduler scheduler;
+		scheduler.setStreamRate(bulk, 1024 * 1024, kQuantum);
+		scheduler.setGlobalRate(1536 * 1024, kQuantum);
+
+		std::vector<net::SendScheduler::TTicket> tickets;
+		for (int i = 0; i < 16; ++i)
+		{
+			tickets.push_back(scheduler.enqueue(bulk, kQuantum, 0));
+			tickets.push_back(scheduler.enqueue(interactive, kQuantum, 0));
+		}
+
+		// Time passes only while the limits hold the frames
+		double now = 0;
+		for (size_t sent = 0; sent < tickets.size(); )
+		{
+			double wait = scheduler.dispatch(now);
+
+			bool progress = false;
+			for (size_t i = 0; i < tickets.size(); ++i)
+			{
+				if (tickets[i] && scheduler.isGranted(tickets[i]))
+				{
+					scheduler.complete(tickets[i], now);
+					tickets[i] = 0;
+					progress = true;
+					++sent;
+				}
+			}
+
+			if (!progress)
+			{
+				assert(0 < wait);
+				now += wait;
+			}
+		}
+
+		// 2MB at 1.5MB/s, the bulk stream got no more than 1MB/s
+		assert(1.2 < now && now < 1.5);
+		net::SendStats stats = scheduler.stats(bulk);
+		assert(stats.throughput() < 1.05 * 1024 * 1024 && stats.throughput() > 0.6 * 1024 * 1024);
+		assert(0 < stats.maxQueuedSeconds && stats.averageQueuedSeconds() <= stats.maxQueuedSeconds);
+	}
+
+	// Streams whose writes do not complete hold up only their own frames
+	{
+		net::SendScheduler scheduler;
+
+		std::vector<net::SendScheduler::TTicket> stalled;
+		for (int i = 1; i <= 8; ++i)
+			stalled.push_back(scheduler.enqueue(reinterpret_cast<net::IStream::TId>(i), kQuantum, 0));
+		net::SendScheduler::TTicket next = scheduler.enqueue(bulk, kQuantum, 0);
+		scheduler.dispatch(0);
+
+		// Next frame of the first stream waits for the stream's previous one
+
+		size_t granted = 0;
+		for (size_t i = 0; i < stalled.size(); ++i)
+		{
+			if (scheduler.isGranted(stalled[i]))
+				++granted;
+		}
+		assert(stalled.size() == granted && !scheduler.isGranted(next));
+
+		for (size_t i = 0; i < stalled.size(); ++i)
+			scheduler.complete(stalled[i], 0);
+		scheduler.dispatch(0);
+		granted = scheduler.isGranted(next) ? 1 : 0;
+		scheduler.complete(next, 0);
+		assert(1 == granted);
+	}
+}
+
+void
+testEndpointRegistry()
+{
+	typedef net::EndpointRegistry<int> TRegistry;
+
+	net::IStream::TId first = reinterpret_cast<net::IStream::TId>(1);
+	net::IStream::TId second = reinterpret_cast<net::IStream::TId>(2);
+	net::IStream::TId extra = reinterpret_cast<net::IStream::TId>(3);
+
+	// Endpoint which reconnected keeps its new stream when the old one dies
+	{
+		TRegistry registry;
+		registry.add(first, "alpha", 1);
+		registry.addConnection(extra, "alpha", 3);
+		registry.add(second, "alpha", 2);
+		assert(second == registry.findStream("alpha") && 1 == registry.connections("alpha").size());
+
+		TRegistry::TRecordPtr record = registry.remove(first);
+		assert(record && record->isMain && "alpha" == record->endpointId && 1 == record->state);
+		assert(second == registry.findStream("alpha") && 1 == registry.endpoints().size());
+
+		// Found record stays valid after its state is replaced
+		record = registry.find(extra);
+		bool updated = registry.update(extra, 4);
+		assert(updated);
+		assert(3 == record->state && 4 == registry.find(extra)->state && !registry.find(extra)->isMain);
+
+		registry.remove(second);
+		assert(!registry.findStream("alpha") && registry.endpoints().empty() && 1 == registry.connections("alpha").size());
+
+		registry.remove(extra);
+		TRegistry::TRecordPtr removed = registry.remove(extra);
+		assert(0 == registry.size() && !registry.find(extra) && !removed);
+	}
+
+	// Lookups of many endpoints don't grow with their number, unlike a scan of the streams
+	{
+		static const size_t kEndpoints = 10000;
+		static const size_t kLookups = 1000000;
+
+		TRegistry registry;
+		std::map<net::IStream::TId, std::string> streams;
+		std::vector<std::string> endpointIds;
+		for (size_t i = 0; i < kEndpoints; ++i)
+		{
+			std::ostringstream endpointId;
+			endpointId << "endpoint-" << i;
+			net::IStream::TId streamId = reinterpret_cast<net::IStream::TId>(i + 1);
+
+			registry.add(streamId, endpointId.str(), static_cast<int>(i));
+			streams[streamId] = endpointId.str();
+			endpointIds.push_back(endpointId.str());
+		}
+		assert(kEndpoints == registry.endpoints().size());
+
+		util::Stopwatch stopwatch;
+		size_t found = 0;
+		for (size_t i = 0; i < kLookups; ++i)
+		{
+			const std::string& endpointId = endpointIds[(i * 7919) % kEndpoints];
+			net::IStream::TId streamId = registry.findStream(endpointId);
+			found += registry.find(streamId)->endpointId == endpointId;
+		}
+		assert(kLookups == found);
+		double registrySeconds = stopwatch.seconds();
+
+		// Stream of an endpoint looked up by a scan
+		stopwatch.restart();
+		found = 0;
+		for (size_t i = 0; i < kLookups / 100; ++i)
+		{
+			const std::string& endpointId = endpointIds[(i * 7919) % kEndpoints];
+			for (std::map<net::IStream::TId, std::string>::const_iterator ii = streams.begin(); ii != streams.end(); ++ii)
+			{
+				if (ii->second == endpointId)
+				{
+					++found;
+					break;
+				}
+			}
+		}
+		assert(kLookups / 100 == found);
+		double scanSeconds = stopwatch.seconds() * 100;
+
+		std::cout << "Endpoint lookups of " << kEndpoints << " endpoints: registry " << kLookups / registrySeconds
+			<< " /s, scan " << kLookups / scanSeconds << " /s" << std::endl;
+	}
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -556,6 +1990,24 @@ main(int argc, char* argv[])
 		testSimpleClientServerCommunication();
 		testMessenger();
 //		testMessenger2();
+		testStreamingMessenger();
+		testSerializedMessage();
+		testChecksums();
+		testCompression();
+		testBufferChain();
+		testReceiveToFile();
+		testMappedFileReader();
+		testRangeSet();
+		testAsyncFileIo();
+		testReadAheadPrefetcher();
+		testFileHandleCache();
+		testSparseFile();
+		testDeltaSync();
+		testContentChunking();
+		testTreeWalker();
+		testRequestFiles();
+		testSendScheduler();
+		testEndpointRegistry();
 #endif
 
 		std::cout << "OK!" << std::endl;
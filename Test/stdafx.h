@@ -11,14 +11,39 @@
 #include <limits>
 #include <cassert>
 #include <ctime>
+#include <algorithm>
+#include <map>
 
 #include <util/SharedPtr.hpp>
+#include <util/AsyncFileIo.hpp>
+#include <util/BufferChain.hpp>
+#include <util/ChunkManifest.hpp>
+#include <util/ChunkStore.hpp>
+#include <util/ContentChunker.hpp>
+#include <util/Crc32c.hpp>
+#include <util/DeltaEncoder.hpp>
+#include <util/DeltaSignature.hpp>
+#include <util/Lz4.hpp>
+#include <util/Stopwatch.hpp>
+#include <util/TreeWalker.hpp>
+#include <util/XxHash64.hpp>
 #include <util/Error.hpp>
+#include <util/FileHandleCache.hpp>
+#include <util/FileReader.hpp>
+#include <util/FileWriter.hpp>
 #include <util/GetOpt.hpp>
 #include <util/MemoryStream.hpp>
+#include <util/RangeSet.hpp>
+#include <util/ReadAheadPrefetcher.hpp>
+#include <util/RollingChecksum.hpp>
 #include <util/ScopedArray.hpp>
 
 #include <net/BindingFactory.hpp>
+#include <net/EndpointRegistry.hpp>
+#include <net/SendScheduler.hpp>
 #include <net/StreamListener.hpp>
 
 #include <msg/Messenger.hpp>
+
+#include <protocol/DataTypes.hpp>
+#include <protocol/MessageRequestFiles.hpp>